@@ -5,6 +5,8 @@
 #include "arch/x86_64/asm.h"
 #include "arch/x86_64/idt.h"
 #include "arch/x86_64/msr.h"
+#include "arch/x86_64/paging.h"
+#include "arch/x86_64/smp.h"
 #include "arch/registers.h"
 #include "kernel/main.h"
 #include "kernel/string.h"
@@ -49,6 +51,7 @@
 #define APIC_INTERRUPT_REQUEST 0x200
 #define APIC_ERROR_STATUS 0x280
 #define APIC_INTERRUPT_COMMAND 0x300
+#define APIC_INTERRUPT_COMMAND_HIGH 0x310
 #define APIC_LVT_TIMER 0x320
 #define APIC_LVT_THERMAL_SENSOR 0x330
 #define APIC_LVT_PERF_MONITOR_COUNTERS 0x340
@@ -60,7 +63,24 @@
 #define APIC_TIMER_DIVIDE 0x3E0
 
 #define APIC_LVT_INT_MASK (1 << 16)
+#define APIC_TIMER_MODE_ONESHOT (0 << 17)
 #define APIC_TIMER_MODE_PERIODIC (1 << 17)
+#define APIC_TIMER_MODE_TSC_DEADLINE (2 << 17)
+
+#define CPUID_FEATURE_LEAF 1
+#define CPUID_ECX_TSC_DEADLINE (1 << 24)
+#define CPUID_ADVANCED_POWER_LEAF 0x80000007
+#define CPUID_EDX_INVARIANT_TSC (1 << 8)
+
+/// Longest one-shot delay to program at once. Longer waits fire early and reprogram the timer,
+/// which keeps the tick conversion from overflowing
+#define TIMER_MAX_DELAY_MICROSECONDS 1000000
+
+// Interrupt command register fields
+#define APIC_IPI_DELIVERY_INIT (5 << 8)
+#define APIC_IPI_DELIVERY_STARTUP (6 << 8)
+#define APIC_IPI_DELIVERY_PENDING (1 << 12)
+#define APIC_IPI_LEVEL_ASSERT (1 << 14)
 
 #define IO_APIC_VERSION_REGISTER 1
 #define IO_APIC_REDIRECTION_TABLE_BASE 0x10
@@ -71,6 +91,7 @@
 #define HPET_MAIN_COUNTER 0xF0
 
 #define SECOND_IN_FEMTOSECONDS 0x38D7EA4C68000
+#define MICROSECOND_IN_FEMTOSECONDS 1000000000
 
 const struct acpi_rsdp_v2 *rsdp = NULL;
 const struct acpi_madt *madt = NULL;
@@ -85,6 +106,22 @@ static vm_object *local_apic_mmio_vm_object;
 static uintptr_t hpet_mmio_base;
 static vm_object *hpet_mmio_vm_object;
 
+/// Counters that can be read for the time since boot
+enum time_source {
+    TIME_SOURCE_NONE, // Before the timer is calibrated
+    TIME_SOURCE_TSC,
+    TIME_SOURCE_HPET,
+};
+static enum time_source time_source = TIME_SOURCE_NONE;
+/// Microseconds per time source tick, as 32.32 fixed point
+static uint64_t time_source_scale;
+/// Value of the time stamp counter when it was calibrated, which is time 0
+static uint64_t tsc_at_boot;
+/// Time stamp counter ticks per microsecond, as 32.32 fixed point
+static uint64_t tsc_ticks_per_microsecond;
+/// Whether local apic timers are programmed with time stamp counter deadlines rather than tick counts
+static bool use_tsc_deadline = false;
+
 struct io_apic_info {
     uintptr_t address;
     uint base;
@@ -99,6 +136,9 @@ static int io_apic_count;
 
 volatile bool oneshot_triggered = false; // Used during timer calibration
 
+/// Set by each application processor once it no longer needs its startup state
+static volatile bool ap_started = false;
+
 static void record_acpi_table_address(const struct acpi_header* table) {
     if (strncmp(table->signature, "APIC", 4) == 0) {
         madt = (struct acpi_madt*)table;
@@ -246,6 +286,91 @@ void apic_send_eoi() {
     apic_io_output(APIC_EOI, 0);
 }
 
+/// @brief Send an inter-processor interrupt
+/// @param apic_id Local apic id of the target cpu
+/// @param command Delivery mode, level and vector for the interrupt command register
+static void apic_send_ipi(uint8_t apic_id, uint32_t command) {
+    apic_io_output(APIC_INTERRUPT_COMMAND_HIGH, apic_id << 24);
+    // Writing the low half sends the interrupt
+    apic_io_output(APIC_INTERRUPT_COMMAND, command);
+    while (apic_io_input(APIC_INTERRUPT_COMMAND) & APIC_IPI_DELIVERY_PENDING) {
+        arch_cpu_relax();
+    }
+}
+
+/// @brief Read the time since boot from the calibrated time source
+/// @return Microseconds since the timer was calibrated, or 0 before then
+uint64_t arch_time_microseconds() {
+    switch (time_source) {
+        case TIME_SOURCE_TSC:
+            return ((unsigned __int128)(rdtsc() - tsc_at_boot) * time_source_scale) >> 32;
+        case TIME_SOURCE_HPET:
+            return ((unsigned __int128)*(uint64_t volatile*)(hpet_mmio_base + HPET_MAIN_COUNTER) * time_source_scale) >> 32;
+        default:
+            return 0;
+    }
+}
+
+/// @brief Busy wait with interrupts disabled
+/// @param microseconds Minimum time to wait
+static void timer_delay_microseconds(uint64_t microseconds) {
+    uint64_t end = arch_time_microseconds() + microseconds;
+    while (arch_time_microseconds() < end) {
+        arch_cpu_relax();
+    }
+}
+
+/// @brief Convert a rate to 32.32 fixed point without overflowing
+static uint64_t fixed_point_ratio(uint64_t numerator, uint64_t denominator) {
+    return ((numerator / denominator) << 32) + (((numerator % denominator) << 32) / denominator);
+}
+
+/// @brief Program this cpu's timer to interrupt once at a point in time
+///
+/// Replaces any deadline set earlier. Deadlines that have already passed fire immediately.
+/// @param deadline Time in microseconds since boot, or `UINT64_MAX` to stop the timer
+void arch_timer_set_deadline(uint64_t deadline) {
+    if (deadline == UINT64_MAX) {
+        if (use_tsc_deadline) wrmsr(MSR_TSC_DEADLINE, 0);
+        else apic_io_output(APIC_TIMER_INITIAL_COUNT, 0);
+        return;
+    }
+
+    if (use_tsc_deadline) {
+        uint64_t tsc = tsc_at_boot + (((unsigned __int128)deadline * tsc_ticks_per_microsecond) >> 32);
+        // 0 would disarm the timer instead
+        wrmsr(MSR_TSC_DEADLINE, tsc ? tsc : 1);
+        return;
+    }
+
+    uint64_t now = arch_time_microseconds();
+    uint64_t delay = deadline > now ? deadline - now : 0;
+    if (delay > TIMER_MAX_DELAY_MICROSECONDS) delay = TIMER_MAX_DELAY_MICROSECONDS;
+
+    uint64_t ticks = delay * this_cpu->arch.apic_timer_ticks / 10000;
+    if (ticks == 0) ticks = 1; // Writing 0 stops the timer
+    if (ticks > 0xffffffff) ticks = 0xffffffff;
+    apic_io_output(APIC_TIMER_INITIAL_COUNT, ticks);
+}
+
+/// @brief Interrupt another cpu so it runs the scheduler
+///
+/// Used to hand work to idle cpus, which have no timer running
+/// @param cpu Index of the cpu in `processor_local_data`
+void arch_cpu_wake(int cpu) {
+    if (cpu == this_cpu->core_id) {
+        // Takes effect as soon as interrupts are enabled again
+        arch_timer_set_deadline(0);
+    } else {
+        apic_send_ipi(processor_local_data[cpu].arch.local_apic_id, 32);
+    }
+}
+
+/// @brief Interrupt another cpu to carry out the TLB shootdowns queued for it
+void apic_send_tlb_shootdown(int cpu) {
+    apic_send_ipi(processor_local_data[cpu].arch.local_apic_id, INTERRUPT_TLB_SHOOTDOWN);
+}
+
 /// Enabled the APIC interrupt controller
 void apic_init() {
     // TODO: Map mmio as strong uncachable?
@@ -260,6 +385,21 @@ void apic_init() {
     apic_io_output(APIC_SPURIOUS_INT_VECTOR, apic_io_input(APIC_SPURIOUS_INT_VECTOR) | 0x1ff);
 }
 
+/// @brief Switch the local apic timer to one-shot deadlines on interrupt 32
+/// Nothing fires until the scheduler sets a deadline
+static void apic_timer_start() {
+    if (use_tsc_deadline) {
+        apic_io_output(APIC_LVT_TIMER, 32 | APIC_TIMER_MODE_TSC_DEADLINE);
+        // Orders the mode switch before any writes to the deadline msr
+        asm volatile ("mfence" ::: "memory");
+        wrmsr(MSR_TSC_DEADLINE, 0);
+    } else {
+        apic_io_output(APIC_LVT_TIMER, 32 | APIC_TIMER_MODE_ONESHOT);
+        apic_io_output(APIC_TIMER_DIVIDE, 3);
+        apic_io_output(APIC_TIMER_INITIAL_COUNT, 0);
+    }
+}
+
 /// Initialize the cpu's local apic timer
 void timer_init(int pit_irq) {
 
@@ -302,6 +442,8 @@ void timer_init(int pit_irq) {
         uint64_t period = (*(uint64_t volatile*)(hpet_mmio_base) >> 32) & 0xffffffff;
         uint64_t ticks_per_second = SECOND_IN_FEMTOSECONDS / period;
         uint64_t ticks_in_10_ms = ticks_per_second / 100;
+        // Only used if the time stamp counter turns out to be unreliable
+        time_source_scale = fixed_point_ratio(period, MICROSECOND_IN_FEMTOSECONDS);
 
         *(uint64_t volatile*)(hpet_mmio_base + 0x108) = ticks_in_10_ms; // Dont need to take existing counter value into account because we cleared it
         *(uint64_t volatile*)(hpet_mmio_base + 0x100) = (hpet_irq << 9) | (1 << 2); // Setup comparator interrupts for the desired IRQ line
@@ -325,6 +467,7 @@ void timer_init(int pit_irq) {
     // Set timer divier to 16 and count down from max value
     apic_io_output(APIC_TIMER_DIVIDE, 3);
     apic_io_output(APIC_TIMER_INITIAL_COUNT, 0xffffffff);
+    uint64_t tsc_start = rdtsc();
 
     oneshot_triggered = false;
     arch_exit_critical();
@@ -335,23 +478,62 @@ void timer_init(int pit_irq) {
     arch_enter_critical();
 
     // Measure how many ticks passed during that sleep
+    uint64_t tsc_end = rdtsc();
     apic_io_output(APIC_LVT_TIMER, APIC_LVT_INT_MASK);
     unsigned long elapsed_ticks = 0xffffffff - apic_io_input(APIC_TIMER_CURRENT_COUNT);
     debug_printf("APIC timer has %lu ticks in 10ms\n", elapsed_ticks);
     framebuffer_printf("APIC timer has %lu ticks in 10ms\n", elapsed_ticks);
 
-    // Start the timer to fire every 10ms on interrupt 32
-    // Now that we know how many ticks occur in 10ms
-    apic_io_output(APIC_LVT_TIMER, 32 | APIC_TIMER_MODE_PERIODIC);
-    apic_io_output(APIC_TIMER_DIVIDE, 3);
-    apic_io_output(APIC_TIMER_INITIAL_COUNT, elapsed_ticks);
+    // The time stamp counter is the cheapest clock to read, but is only
+    // usable if it keeps a constant rate through power state changes
+    uint32_t eax, ebx, ecx, edx;
+    bool invariant_tsc = false;
+    if (__get_cpuid(CPUID_ADVANCED_POWER_LEAF, &eax, &ebx, &ecx, &edx)) {
+        invariant_tsc = edx & CPUID_EDX_INVARIANT_TSC;
+    }
+    __get_cpuid(CPUID_FEATURE_LEAF, &eax, &ebx, &ecx, &edx);
+    bool tsc_deadline_supported = ecx & CPUID_ECX_TSC_DEADLINE;
+
+    uint64_t tsc_per_second = (tsc_end - tsc_start) * 100;
+    tsc_ticks_per_microsecond = fixed_point_ratio(tsc_per_second, 1000000);
+    tsc_at_boot = tsc_end;
+    if (invariant_tsc || !hpet) {
+        time_source_scale = fixed_point_ratio(1000000, tsc_per_second);
+        time_source = TIME_SOURCE_TSC;
+        // Deadlines are in time stamp counter ticks, so only use them when that's the time source
+        use_tsc_deadline = tsc_deadline_supported;
+    } else {
+        time_source = TIME_SOURCE_HPET;
+    }
+    debug_printf("Time source is the %s (%lu TSC ticks per second), timer uses %s\n",
+        time_source == TIME_SOURCE_TSC ? "TSC" : "HPET", tsc_per_second,
+        use_tsc_deadline ? "TSC deadlines" : "one-shot counts");
+
+    // Used to convert one-shot delays into timer ticks
+    this_cpu->arch.apic_timer_ticks = elapsed_ticks;
+    apic_timer_start();
 }
 
-void timer_fired(struct registers* context) {
-    // Fires every 10 milliseconds
+/// @brief Calibrate and start an application processor's local apic timer
+///
+/// The bootstrap processor's calibration interrupt is not available once the
+/// system is running, so this polls the time source instead.
+void timer_init_ap() {
+    apic_io_output(APIC_LVT_TIMER, APIC_LVT_INT_MASK);
+    apic_io_output(APIC_TIMER_DIVIDE, 3);
+    apic_io_output(APIC_TIMER_INITIAL_COUNT, 0xffffffff);
 
-    microseconds_since_boot += 10000;
+    timer_delay_microseconds(10000);
 
+    unsigned long elapsed_ticks = 0xffffffff - apic_io_input(APIC_TIMER_CURRENT_COUNT);
+    debug_printf("CPU %d APIC timer has %lu ticks in 10ms\n", this_cpu->core_id, elapsed_ticks);
+
+    this_cpu->arch.apic_timer_ticks = elapsed_ticks;
+    apic_timer_start();
+}
+
+/// @brief Handler for this cpu's one-shot timer and wake up interrupts
+void timer_fired(struct registers* context) {
     struct thread *thread = this_cpu->current_thread;
     // When the task resumes, return directly into the interrupted context rather than unwinding the stack
     memcpy(&thread->context, context, sizeof(struct registers) - 16);
@@ -389,6 +571,7 @@ void acpi_init(v_addr_t rsdp_addr) {
 
     // Setup the interrupt controller
     apic_init();
+    paging_shootdown_init();
 
     framebuffer_print("Interrupt controller setup\n");
 
@@ -410,6 +593,10 @@ void acpi_init(v_addr_t rsdp_addr) {
         entry = (void*)((uintptr_t)entry + entry->length);
     }
 
+    if (count > MAX_CPUS_COUNT) {
+        debug_printf("Only %d of %d CPUs can be used\n", MAX_CPUS_COUNT, count);
+        count = MAX_CPUS_COUNT;
+    }
     cpu_count = count;
     debug_printf("Computer has %d CPUs\n", count);
 
@@ -420,14 +607,15 @@ void acpi_init(v_addr_t rsdp_addr) {
 
     paging_print_tables(get_kernel_address_space()->table_base, 0xffff800000000000);
 
-    // Get this core's apic id from the mmio registers
-    uint8_t bsp_apic_id = *((uint32_t*)(local_apic_mmio_base + 0x20));
+    // Get this core's apic id from the mmio registers, which is kept in the top byte
+    uint8_t bsp_apic_id = apic_io_input(APIC_LAPIC_ID) >> 24;
 
     io_apics = calloc(io_apic_count, sizeof(struct io_apic_info));
 
     // Save data about each CPU's local APIC
     // And record io apic information
-    int cpu = 0;
+    // The bootstrap processor is always cpu 0, so application processors are numbered after it
+    int cpu = 1;
     int io_apic_count = 0;
     int pit_entry_number = 0; // The io apic entry that the legacy pit maps to
     entry = (void*)&madt[1];
@@ -435,14 +623,12 @@ void acpi_init(v_addr_t rsdp_addr) {
     while ((uintptr_t)entry < end) {
         if (entry->type == ACPI_MADT_ENTRY_PROCESSOR_LOCAL_APIC) {
             struct processor_local_apic *lapic = (void*)entry;
-            processor_local_data[cpu].core_id = cpu;
-            processor_local_data[cpu].arch.local_apic_id = lapic->apic_id;
-
-            if (lapic->apic_id == bsp_apic_id && cpu != 0) {
-                debug_print("BSP lapic not first in list!\n");
-                framebuffer_print("BSP lapic not first in list!\n");
-            }
-            if (lapic->flags != 0) {
+            if (lapic->apic_id == bsp_apic_id) {
+                processor_local_data[0].core_id = 0;
+                processor_local_data[0].arch.local_apic_id = lapic->apic_id;
+            } else if (lapic->flags != 0 && cpu < cpu_count) {
+                processor_local_data[cpu].core_id = cpu;
+                processor_local_data[cpu].arch.local_apic_id = lapic->apic_id;
                 cpu++;
             }
         }
@@ -451,8 +637,8 @@ void acpi_init(v_addr_t rsdp_addr) {
             // The MADT contains a 32 bit physical address
             if (!io_apic_mmio_v_addr_region) {
                 struct vm_object *mmio_vm;
-                vm_object_create_physical(io_apic->address, PAGE_SIZE, VM_WRITABLE | VM_WRITABLE | VM_DISABLE_CACHING, &mmio_vm);
-                v_addr_region_map_vm_object(kernel_region, V_ADDR_REGION_WRITABLE | V_ADDR_REGION_READABLE, mmio_vm, &io_apic_mmio_v_addr_region, 0, &io_apic_mmio_address);
+                vm_object_create_physical(io_apic->address, PAGE_SIZE, VM_MMIO_FLAGS, &mmio_vm);
+                v_addr_region_map_vm_object(kernel_region, V_ADDR_REGION_WRITABLE | V_ADDR_REGION_READABLE | V_ADDR_REGION_DISABLE_CACHE, mmio_vm, &io_apic_mmio_v_addr_region, 0, &io_apic_mmio_address);
             }
             io_apics[io_apic_count].address = io_apic_mmio_address;
             io_apics[io_apic_count].base = io_apic->global_interrupt_base;
@@ -502,13 +688,59 @@ void acpi_init(v_addr_t rsdp_addr) {
 }
 
 
-void smp_init(void) {
-    // Send initialization interupts to each AP
-    for (int i = 0; i < cpu_count; i++) {
-        // But not to the one we're already running on
-        if (processor_local_data[i].core_id != this_cpu->core_id) {
-            // Start up the core
+/// @brief Called by an application processor once it is done with its startup state
+void smp_ap_started() {
+    ap_started = true;
+}
+
+/// @brief Start every application processor listed in the MADT
+///
+/// APs are started one at a time, since they share the trampoline's data block
+void smp_init() {
+    if (cpu_count <= 1) return;
+
+    // Copy the startup code somewhere real mode can reach
+    struct smp_trampoline_data *data = (void*)p_addr_to_physical_map(SMP_TRAMPOLINE_ADDRESS + (smp_trampoline_data - smp_trampoline_start));
+    memcpy((void*)p_addr_to_physical_map(SMP_TRAMPOLINE_ADDRESS), smp_trampoline_start, smp_trampoline_end - smp_trampoline_start);
+    data->kernel_cr3 = (uintptr_t)&kernel_pml4[0] - KERNEL_VIRTUAL_ADDRESS;
+
+    int started = 1;
+    for (int i = 1; i < cpu_count; i++) {
+        struct per_cpu_data *cpu = &processor_local_data[i];
+
+        // Each AP boots on its own kernel stack, which becomes its TSS stack until it runs a thread
+        vm_object *stack_vm;
+        v_addr_t stack_base;
+        ir_status_t status = vm_object_create(PER_THREAD_KERNEL_STACK_SIZE, VM_READABLE | VM_WRITABLE, &stack_vm);
+        if (status != IR_OK) { panic(NULL, status, "Error allocating an application processor stack\n"); }
+        status = v_addr_region_map_vm_object(kernel_region, V_ADDR_REGION_READABLE | V_ADDR_REGION_WRITABLE, stack_vm, NULL, 0, &stack_base);
+        if (status != IR_OK) { panic(NULL, status, "Error mapping an application processor stack\n"); }
+
+        data->stack_top = stack_base + PER_THREAD_KERNEL_STACK_SIZE - 16;
+        data->cpu = (uintptr_t)cpu;
+        ap_started = false;
+
+        // INIT-SIPI-SIPI sequence. The startup vector is the page number of the trampoline
+        apic_send_ipi(cpu->arch.local_apic_id, APIC_IPI_DELIVERY_INIT | APIC_IPI_LEVEL_ASSERT);
+        timer_delay_microseconds(10000);
+        apic_send_ipi(cpu->arch.local_apic_id, APIC_IPI_DELIVERY_STARTUP | (SMP_TRAMPOLINE_ADDRESS >> 12));
+        timer_delay_microseconds(200);
+        if (!ap_started) {
+            apic_send_ipi(cpu->arch.local_apic_id, APIC_IPI_DELIVERY_STARTUP | (SMP_TRAMPOLINE_ADDRESS >> 12));
+        }
 
+        // Wait up to a second for the AP to reach the scheduler
+        for (int waited = 0; !ap_started && waited < 1000; waited++) {
+            timer_delay_microseconds(1000);
+        }
+
+        if (ap_started) {
+            started++;
+        } else {
+            debug_printf("CPU %d (apic id %d) did not start\n", i, cpu->arch.local_apic_id);
         }
     }
+
+    debug_printf("%d of %d CPUs started\n", started, cpu_count);
+    framebuffer_printf("%d of %d CPUs started\n", started, cpu_count);
 }
@@ -8,6 +8,7 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 
 
 #define SERIAL_BASE_PORT 0x3f8
@@ -61,16 +62,26 @@ void debug_print_hex(uint64_t value) {
 }
 
 static char buffer[1024];
+/// Keeps lines from different cpus from interleaving. Not a `lock_t`,
+/// since spinlocks print through here when they are contended
+static atomic_flag print_lock = ATOMIC_FLAG_INIT;
 
 /// @brief Printf for the serial line for debugging purposes.
 ///
 /// Supports a large but incomplete subset of the standard printf specifiers and behavior
 void debug_printf(const char * restrict format, ...) {
+    // An interrupt printing on this cpu while the lock is held would never get it
+    uint64_t rflags;
+    asm volatile ("pushfq; pop %0; cli" : "=r"(rflags) :: "memory");
+    while (atomic_flag_test_and_set_explicit(&print_lock, memory_order_acquire));
+
     va_list args;
     va_start(args, format);
     vsprintf(buffer, format, args);
     va_end(args);
 
-    // TODO: Does not support multithreading
     debug_print(buffer);
+
+    atomic_flag_clear_explicit(&print_lock, memory_order_release);
+    asm volatile ("push %0; popfq" :: "r"(rflags) : "memory", "cc");
 }
@@ -0,0 +1,243 @@
+/// @file kernel/arch/x86_64/fpu.c
+/// @brief Lazy switching of the x87, SSE and AVX registers
+///
+/// The registers are left holding the state of whichever thread used them last on each cpu,
+/// and CR0.TS is set whenever a different thread runs, so its first use raises #NM and loads
+/// its own state. Threads that never touch the registers never have them saved or restored.
+/// A thread leaving a cpu with the registers in use saves them, so it can pick them up on any cpu.
+
+#include "arch/x86_64/fpu.h"
+#include "arch/x86_64/msr.h"
+#include "kernel/arch/arch.h"
+#include "kernel/cpu_locals.h"
+#include "kernel/process.h"
+#include "kernel/string.h"
+#include "kernel/memory/pmm.h"
+#include "kernel/memory/physical_map.h"
+#include "iridium/errors.h"
+#include <cpuid.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "arch/debug.h"
+
+#define CR0_MONITOR_COPROCESSOR (1 << 1)
+#define CR0_EMULATION (1 << 2)
+/// Makes the next use of the extended registers raise #NM
+#define CR0_TASK_SWITCHED (1 << 3)
+
+#define CR4_OSFXSR (1 << 9)
+#define CR4_OSXMMEXCPT (1 << 10)
+#define CR4_OSXSAVE (1 << 18)
+
+#define CPUID_FEATURE_LEAF 1
+#define CPUID_ECX_XSAVE (1 << 26)
+#define CPUID_XSAVE_LEAF 0xd
+#define CPUID_XSAVE_EAX_XSAVEOPT (1 << 0)
+#define CPUID_XSAVE_EAX_XSAVES (1 << 3)
+
+// State components, enabled in XCR0
+#define XSTATE_X87 (1 << 0)
+#define XSTATE_SSE (1 << 1)
+#define XSTATE_AVX (1 << 2)
+/// Opmask registers, and the upper halves of ZMM0-15 and all of ZMM16-31, which can only be enabled together
+#define XSTATE_AVX512 (0x7 << 5)
+/// Components saved for threads. Together they fit in a page
+#define XSTATE_SUPPORTED (XSTATE_X87 | XSTATE_SSE | XSTATE_AVX | XSTATE_AVX512)
+
+// Offsets in the legacy region of the save area, shared by every format
+#define FXSAVE_FCW 0
+#define FXSAVE_MXCSR 24
+/// XCOMP_BV in the XSAVE header, which XRSTORS needs to find the compacted components
+#define XSAVE_HEADER_XCOMP_BV (512 + 8)
+#define XCOMP_BV_COMPACTED (1ul << 63)
+
+// Control register values after FNINIT and at reset, with every exception masked
+#define FCW_DEFAULT 0x37f
+#define MXCSR_DEFAULT 0x1f80
+
+/// Instructions used to save and restore the registers, from most to least preferred
+enum extended_state_format {
+    /// Compacted areas, skipping components in their initial state or unmodified since they were restored
+    EXTENDED_STATE_XSAVES,
+    /// Skips components unmodified since they were restored
+    EXTENDED_STATE_XSAVEOPT,
+    EXTENDED_STATE_XSAVE,
+    /// x87 and SSE only, on cpus without XSAVE
+    EXTENDED_STATE_FXSAVE,
+};
+
+static enum extended_state_format format;
+/// Components enabled in XCR0
+static uint64_t xstate_components;
+/// Size of a thread's save area, in bytes
+static size_t extended_state_size;
+
+static inline uint64_t read_cr0() {
+    uint64_t cr0;
+    asm volatile ("mov %%cr0, %0" : "=r" (cr0));
+    return cr0;
+}
+
+static inline void write_cr0(uint64_t cr0) {
+    asm volatile ("mov %0, %%cr0" :: "r" (cr0) : "memory");
+}
+
+static inline void xsetbv(uint32_t index, uint64_t value) {
+    asm volatile ("xsetbv" :: "c" (index), "d" (value >> 32), "a" (value));
+}
+
+/// @brief Enable the x87, SSE and AVX registers for user code on this cpu, trapping their first use.
+/// Needs to run on every cpu
+void fpu_init() {
+    unsigned int eax, ebx, ecx, edx;
+    __get_cpuid(CPUID_FEATURE_LEAF, &eax, &ebx, &ecx, &edx);
+    bool xsave_supported = ecx & CPUID_ECX_XSAVE;
+
+    uint64_t cr4;
+    asm volatile ("mov %%cr4, %0" : "=r" (cr4));
+    cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if (xsave_supported) cr4 |= CR4_OSXSAVE;
+    asm volatile ("mov %0, %%cr4" :: "r" (cr4) : "memory");
+
+    // No thread's registers are loaded yet
+    write_cr0((read_cr0() & ~CR0_EMULATION) | CR0_MONITOR_COPROCESSOR | CR0_TASK_SWITCHED);
+    this_cpu->arch.extended_state_owner = NULL;
+
+    if (!xsave_supported) {
+        format = EXTENDED_STATE_FXSAVE;
+        extended_state_size = 512;
+        return;
+    }
+
+    __cpuid_count(CPUID_XSAVE_LEAF, 0, eax, ebx, ecx, edx);
+    uint64_t components = ((uint64_t)edx << 32 | eax) & XSTATE_SUPPORTED;
+    if ((components & XSTATE_AVX512) != XSTATE_AVX512 || !(components & XSTATE_AVX)) {
+        components &= ~XSTATE_AVX512;
+    }
+    xsetbv(0, components);
+    xstate_components = components;
+
+    // The sizes reported depend on what was just enabled
+    __cpuid_count(CPUID_XSAVE_LEAF, 1, eax, ebx, ecx, edx);
+    if (eax & CPUID_XSAVE_EAX_XSAVES) {
+        // Only user components are saved, so no supervisor ones are enabled
+        wrmsr(MSR_XSS, 0);
+        format = EXTENDED_STATE_XSAVES;
+        extended_state_size = ebx;
+    } else {
+        format = eax & CPUID_XSAVE_EAX_XSAVEOPT ? EXTENDED_STATE_XSAVEOPT : EXTENDED_STATE_XSAVE;
+        __cpuid_count(CPUID_XSAVE_LEAF, 0, eax, ebx, ecx, edx);
+        extended_state_size = ebx;
+    }
+
+    if (this_cpu->core_id == 0) {
+        debug_printf("Extended state components %#lx, %zu bytes per thread\n", components, extended_state_size);
+    }
+}
+
+/// @brief Save this cpu's extended registers
+/// @param area 64 byte aligned area of `extended_state_size` bytes
+static void extended_state_save(void *area) {
+    switch (format) {
+        case EXTENDED_STATE_XSAVES:
+            asm volatile ("xsaves64 (%0)" :: "r" (area), "a" (UINT32_MAX), "d" (UINT32_MAX) : "memory");
+            break;
+        case EXTENDED_STATE_XSAVEOPT:
+            asm volatile ("xsaveopt64 (%0)" :: "r" (area), "a" (UINT32_MAX), "d" (UINT32_MAX) : "memory");
+            break;
+        case EXTENDED_STATE_XSAVE:
+            asm volatile ("xsave64 (%0)" :: "r" (area), "a" (UINT32_MAX), "d" (UINT32_MAX) : "memory");
+            break;
+        case EXTENDED_STATE_FXSAVE:
+            asm volatile ("fxsave64 (%0)" :: "r" (area) : "memory");
+            break;
+    }
+}
+
+/// @brief Load this cpu's extended registers from an area saved by `extended_state_save`
+static void extended_state_restore(void *area) {
+    switch (format) {
+        case EXTENDED_STATE_XSAVES:
+            asm volatile ("xrstors64 (%0)" :: "r" (area), "a" (UINT32_MAX), "d" (UINT32_MAX) : "memory");
+            break;
+        case EXTENDED_STATE_XSAVEOPT:
+        case EXTENDED_STATE_XSAVE:
+            asm volatile ("xrstor64 (%0)" :: "r" (area), "a" (UINT32_MAX), "d" (UINT32_MAX) : "memory");
+            break;
+        case EXTENDED_STATE_FXSAVE:
+            asm volatile ("fxrstor64 (%0)" :: "r" (area) : "memory");
+            break;
+    }
+}
+
+/// @brief Allocate a save area holding the registers' initial state
+/// Areas take a page, which keeps them aligned and fits every supported component
+/// @return The area, or NULL if out of memory
+static void *extended_state_allocate() {
+    physical_page_info *page;
+    if (pmm_allocate_page(&page) != IR_OK) return NULL;
+
+    uint8_t *area = (uint8_t*)p_addr_to_physical_map(page->address);
+    memset(area, 0, PAGE_SIZE);
+    // Components missing from the header start out in their initial state,
+    // but the legacy control registers are always loaded from the area
+    *(uint16_t*)(area + FXSAVE_FCW) = FCW_DEFAULT;
+    *(uint32_t*)(area + FXSAVE_MXCSR) = MXCSR_DEFAULT;
+    if (format == EXTENDED_STATE_XSAVES) {
+        *(uint64_t*)(area + XSAVE_HEADER_XCOMP_BV) = XCOMP_BV_COMPACTED | xstate_components;
+    }
+    return area;
+}
+
+/// @brief Load a thread's extended registers after its first use of them trapped
+///
+/// The thread's save area is allocated the first time it ever uses them.
+/// @param thread The thread running on this cpu
+/// @return `IR_OK`, or `IR_ERROR_NO_MEMORY` if the thread has no save area and one can't be allocated
+ir_status_t fpu_load(struct thread *thread) {
+    if (!thread->arch.extended_state) {
+        thread->arch.extended_state = extended_state_allocate();
+        if (!thread->arch.extended_state) return IR_ERROR_NO_MEMORY;
+    }
+
+    asm volatile ("clts" ::: "memory");
+
+    struct per_cpu_data *cpu = &processor_local_data[this_cpu->core_id];
+    if (this_cpu->arch.extended_state_owner != thread || thread->arch.extended_state_cpu != cpu) {
+        extended_state_restore(thread->arch.extended_state);
+        this_cpu->arch.extended_state_owner = thread;
+        thread->arch.extended_state_cpu = cpu;
+    }
+    return IR_OK;
+}
+
+/// @brief Get the extended registers ready for another thread to run on this cpu
+///
+/// Saves them if the thread leaving used them, and leaves them enabled
+/// for the next thread only if they still hold its state.
+/// @note Called before the previous thread can be picked up by another cpu
+void arch_switch_extended_state(struct thread *next) {
+    uint64_t cr0 = read_cr0();
+    struct thread *owner = this_cpu->arch.extended_state_owner;
+
+    // The registers are only enabled while their owner runs, and could have changed since they were loaded
+    if (!(cr0 & CR0_TASK_SWITCHED) && owner != next) {
+        extended_state_save(owner->arch.extended_state);
+    }
+
+    uint64_t next_cr0 = cr0 | CR0_TASK_SWITCHED;
+    if (owner == next && next->arch.extended_state_cpu == &processor_local_data[this_cpu->core_id]) {
+        next_cr0 &= ~CR0_TASK_SWITCHED;
+    }
+    // Writing cr0 serializes the cpu, so it is skipped when nothing changes
+    if (next_cr0 != cr0) write_cr0(next_cr0);
+}
+
+/// @brief Free a thread's extended register save area, if it ever used the registers
+void arch_free_extended_state(struct thread *thread) {
+    if (!thread->arch.extended_state) return;
+
+    pmm_free_page(pmm_page_from_p_addr(physical_map_to_p_addr(thread->arch.extended_state)));
+    thread->arch.extended_state = NULL;
+}
@@ -2,6 +2,7 @@
 #include <kernel/stack.h>
 #include <kernel/arch/arch.h>
 #include <arch/x86_64/gdt.h>
+#include <kernel/cpu_locals.h>
 #include <stdint.h>
 
 typedef struct gdt_entry {
@@ -41,12 +42,31 @@ typedef struct tss {
 // Tbe gdt defined in gdt.S
 extern gdt_entry gdt[];
 
-tss boot_cpu_tss;
+/// Index of the first tss descriptor in the gdt. Each cpu's descriptor takes up 2 entries
+#define GDT_TSS_BASE_INDEX 5
+#define GDT_TSS_INDEX(cpu) (GDT_TSS_BASE_INDEX + (cpu) * 2)
 
-void init_tss() {
+/// Size of each interrupt stack table stack
+#define IST_STACK_SIZE 4096
 
-    gdt_tss_entry *tss_entry = (gdt_tss_entry*)&gdt[5];
-    uintptr_t base = (uintptr_t)&boot_cpu_tss;
+// Each cpu has its own tss, which tells it which stacks to use when entering the kernel
+tss cpu_tss[MAX_CPUS_COUNT];
+
+// Stacks for exceptions that can arrive while the current stack is unusable.
+// Can't share the kernel stack, since a double fault is often caused by overflowing it
+__attribute__((aligned(16)))
+static uint8_t double_fault_stacks[MAX_CPUS_COUNT][IST_STACK_SIZE];
+__attribute__((aligned(16)))
+static uint8_t nmi_stacks[MAX_CPUS_COUNT][IST_STACK_SIZE];
+
+/// @brief Set up and load a cpu's task state segment
+/// @param cpu Index of the cpu in `processor_local_data`
+/// @param kernel_stack_top Stack to use when interrupts arrive from user mode,
+///                         until the scheduler provides a thread's stack
+void init_tss(int cpu, uintptr_t kernel_stack_top) {
+
+    gdt_tss_entry *tss_entry = (gdt_tss_entry*)&gdt[GDT_TSS_INDEX(cpu)];
+    uintptr_t base = (uintptr_t)&cpu_tss[cpu];
     tss_entry->base_low = base & 0xffff; // Low 16 bits
     tss_entry->base_mid = (base >> 16) & 0xff; // Next 8 bits
     tss_entry->base_high = (base >> 24) & 0xff; // Next 8 bits
@@ -57,13 +77,15 @@ void init_tss() {
 
     tss_entry->granularity |= 0b00010000;
 
-    extern uint8_t stack;
-    boot_cpu_tss.rsp[0] = ((uintptr_t)&stack) + BOOT_STACK_SIZE - 16;
+    cpu_tss[cpu].rsp[0] = kernel_stack_top;
+    cpu_tss[cpu].ist[IST_DOUBLE_FAULT - 1] = (uintptr_t)&double_fault_stacks[cpu][IST_STACK_SIZE - 16];
+    cpu_tss[cpu].ist[IST_NMI - 1] = (uintptr_t)&nmi_stacks[cpu][IST_STACK_SIZE - 16];
 
     // Load the tss
-    asm volatile ("mov $0x2b, %rax; ltr %ax");
+    uint16_t selector = GDT_TSS_INDEX(cpu) * sizeof(gdt_entry);
+    asm volatile ("ltr %0" : : "r" (selector));
 }
 
 void arch_set_interrupt_stack(uintptr_t stack_top) {
-    boot_cpu_tss.rsp[0] = stack_top;
+    cpu_tss[this_cpu->core_id].rsp[0] = stack_top;
 }
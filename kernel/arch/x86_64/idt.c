@@ -1,16 +1,20 @@
 
 #include "arch/x86_64/idt.h"
+#include "arch/x86_64/gdt.h"
 #include "arch/x86_64/paging.h"
 #include "arch/x86_64/acpi.h"
+#include "arch/x86_64/fpu.h"
 #include "arch/registers.h"
 #include "kernel/arch/arch.h"
 #include "kernel/interrupt.h"
 #include "kernel/process.h"
 #include "kernel/memory/physical_map.h"
 #include "kernel/memory/vmem.h"
+#include "kernel/memory/v_addr_region.h"
 #include "kernel/main.h"
 #include "kernel/scheduler.h"
 #include "kernel/string.h"
+#include "iridium/errors.h"
 #include <stdbool.h>
 
 #include <arch/debug.h>
@@ -69,6 +73,13 @@ void idt_set_entry(uint8_t index, uint16_t segment,
     entry->ist_index = 0;
 }
 
+/// @brief Run an interrupt on one of the stacks in the interrupt stack table
+/// @param index The interrupt vector
+/// @param ist The 1-based IST slot, or 0 to use the normal stack
+void idt_set_ist(uint8_t index, uint8_t ist) {
+    _idt.entries[index].ist_index = ist;
+}
+
 /// @brief Generic exception handler
 void exception(registers *context, char *name) {
     debug_printf("\n----------------\nException %#x!\n", context->interrupt_number);
@@ -144,6 +155,22 @@ void general_protection_fault(registers *context) {
 
 static bool is_in_page_fault = false;
 
+/// @brief Load the extended registers for a thread using them for the first time since it was switched to
+void device_not_available(registers *context) {
+    // The kernel is built without SSE, so only user code should ever reach this
+    if (context->cs == 0x8 || this_cpu->current_thread == NULL) {
+        exception(context, "Device Not Available");
+        return;
+    }
+
+    if (fpu_load(this_cpu->current_thread) != IR_OK) {
+        debug_printf("No memory to save thread %d's extended registers\n", this_cpu->current_thread->thread_id);
+        this_cpu->current_thread->state = TERMINATING;
+        this_cpu->current_thread->exit_code = -1;
+        switch_task(true);
+    }
+}
+
 void page_fault(registers *context) {
     bool present = context->error_code & 0x1;
     bool write = context->error_code & (0x1 << 1);
@@ -151,6 +178,20 @@ void page_fault(registers *context) {
     bool reserved_bits = context->error_code & (0x1 << 3);
     bool instruction = context->error_code & (0x1 << 4);
 
+    uint64_t accessed_address;
+    asm volatile ("mov %%cr2, %%rax; mov %%rax, %0;" : "=m" (accessed_address) :: "rax");
+
+    // Memory objects are only backed once they're touched, so first accesses to user memory fault,
+    // as do writes to pages shared copy-on-write.
+    // That includes the kernel reading and writing user buffers during syscalls
+    if ((!present || (write && !instruction)) && !reserved_bits && this_cpu->current_thread && accessed_address < USER_MEMORY_LENGTH) {
+        struct process *process = (struct process*)this_cpu->current_thread->object.parent;
+        if (process->root_v_addr_region
+                && v_addr_region_handle_fault(process->root_v_addr_region, accessed_address, write, instruction) == IR_OK) {
+            return;
+        }
+    }
+
     char *access_string = "read from";
     if (write) { access_string = "write to"; }
     if (instruction) { access_string = "run code at"; }
@@ -163,9 +204,6 @@ void page_fault(registers *context) {
     char *ring = "Kernel";
     if (user) { ring = "User"; }
 
-    uint64_t accessed_address;
-    asm volatile ("mov %%cr2, %%rax; mov %%rax, %0;" : "=m" (accessed_address) :: "rax");
-
     debug_print("\n----------------\nPage Fault!\n");
     debug_printf("A paging related error was encountered at %#p, with error code %#x.\n", context->rip, (uint64_t)context->error_code);
     debug_printf("%s-space tried to %s %#p in %s.\n", ring, access_string, accessed_address, page);
@@ -238,7 +276,7 @@ void interrupt_handler(registers context) {
             exception(&context, "Invalid Opcode");
             break;
         case 0x7:
-            exception(&context, "Device Not Available");
+            device_not_available(&context);
             break;
         case 0x8:
             double_fault(&context);
@@ -261,6 +299,9 @@ void interrupt_handler(registers context) {
         case 32:
             timer_fired(&context);
             break;
+        case INTERRUPT_TLB_SHOOTDOWN:
+            paging_handle_shootdowns();
+            break;
         default:
             exception(&context, "Unknown exeption!!");
             break;
@@ -286,6 +327,7 @@ extern void _isr13();
 extern void _isr14();
 
 extern void _isr32();
+extern void _isr254();
 
 extern void _irq34();
 extern void _irq35();
@@ -325,18 +367,30 @@ void idt_init() {
     for (int i = 34; i < 255; i++) {
         idt_set_entry(i, 0x8, irq_pointers[i], IDT_GATE_INTERRUPT, 0);
     }
+    idt_set_entry(INTERRUPT_TLB_SHOOTDOWN, 0x8, (uintptr_t)&_isr254, IDT_GATE_INTERRUPT, 0);
 
 
     // Spurious interrupt vector
     idt_set_entry(0xff, 0x8, (uintptr_t)&isr_spurious, IDT_GATE_INTERRUPT, 0);
 
+    // These can arrive with a broken kernel stack, or right after entering from a syscall before stacks are switched
+    idt_set_ist(2, IST_NMI);
+    idt_set_ist(8, IST_DOUBLE_FAULT);
+
+    idt_load();
+
+    // Don't let users try to override the spurios interrupt vector
+    interrupt_reserve(0xff);
+    interrupt_reserve(INTERRUPT_TLB_SHOOTDOWN);
+}
+
+/// @brief Load the interrupt table on the current cpu
+/// Every cpu shares the same table
+void idt_load() {
     idt_pointer idt_pointer = {
         .limit = sizeof(_idt) - 1,
         .base = &(_idt.entries[0])
     };
 
     asm volatile ("lidt (%0)" : : "r" (&idt_pointer));
-
-    // Don't let users try to override the spurios interrupt vector
-    interrupt_reserve(0xff);
 }
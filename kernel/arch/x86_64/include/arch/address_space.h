@@ -3,7 +3,23 @@
 #define ARCH_X86_64_ADDRESS_SPACE_H_
 
 #include "arch/x86_64/paging.h"
+#include "arch/defines.h"
 #include "kernel/spinlock.h"
+#include <stddef.h>
+#include <stdint.h>
+
+struct physical_page_info; // #include "kernel/memory/pmm.h"
+
+/// @brief An address space's process context identifier on one cpu
+/// Translations tagged with the PCID stay in the cpu's TLB while other address spaces run
+struct address_space_context {
+    /// PCID tagging the address space's translations, or 0 if it hasn't been given one yet
+    uint16_t pcid;
+    /// The cpu's `pcid_generation` when the PCID was handed out. It has since gone to someone else if they differ
+    uint32_t generation;
+    /// The address space's `tlb_generation` the last time its translations were flushed on the cpu
+    size_t tlb_generation;
+};
 
 /// @brief Address space data structure
 typedef struct address_space {
@@ -11,6 +27,50 @@ typedef struct address_space {
     page_table_entry *table_base; // PPointer to the pml4 in the physical memory map
     lock_t lock;
 
+    /// Pages of memory objects mapped into the address space, whether or not they have been touched
+    _Atomic size_t committed_pages;
+    /// Pages present in the page tables, protected by `lock`
+    size_t resident_pages;
+
+    /// Incremented whenever mappings are changed or removed, so cpus that ran the address space
+    /// know to flush what they cached before loading it again
+    _Atomic size_t tlb_generation;
+    /// PCID for each cpu
+    struct address_space_context contexts[MAX_CPUS_COUNT];
+    /// Bit mask of the cpus with the address space loaded, which TLB shootdowns are sent to
+    _Atomic uint64_t active_cpus;
+
 } address_space;
 
+/// Ranges a TLB gather tracks before it falls back to flushing everything
+#define TLB_GATHER_RANGES 8
+
+/// @brief TLB invalidations queued while changing an address space's mappings
+///
+/// Every cpu that could have cached the old mappings is sent them at once by `arch_mmu_gather_flush`,
+/// so a batch of changes costs one shootdown. Usually lives on the stack of whoever made the changes.
+struct tlb_gather {
+    struct address_space *addr_space;
+    /// Ranges of pages to invalidate
+    struct {
+        v_addr_t address;
+        size_t count;
+    } ranges[TLB_GATHER_RANGES];
+    size_t range_count;
+    /// Total pages queued, including any that didn't fit in `ranges`
+    size_t page_count;
+    /// Whether the ranges are kernel memory, which is mapped in every address space
+    bool kernel;
+    /// Too much was queued to invalidate page by page, so the whole address space is flushed
+    bool flush_all;
+    /// Kernel page tables were freed, which can be cached under any PCID
+    bool flush_global;
+    /// Page tables to free once no cpu can be using them, linked through `next`
+    struct physical_page_info *freed_tables;
+    /// The address space's `tlb_generation` once the changes were made
+    size_t tlb_generation;
+    /// Number of cpus yet to carry out the shootdown
+    _Atomic unsigned int remaining;
+};
+
 #endif // ARCH_X86_64_ADDRESS_SPACE_H_
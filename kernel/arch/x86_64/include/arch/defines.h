@@ -20,8 +20,35 @@
 
 #ifndef __ASSEMBLER__
 
+struct address_space; // #include "arch/address_space.h"
+struct tlb_gather; // #include "arch/address_space.h"
+struct thread; // #include "kernel/process.h"
+struct per_cpu_data; // #include "kernel/cpu_locals.h"
+
 struct arch_per_cpu_data {
     int local_apic_id;
+    /// Local apic timer ticks in 10ms, measured when the cpu started
+    unsigned long apic_timer_ticks;
+    /// Address space loaded in cr3
+    struct address_space *address_space;
+    /// Next PCID to hand out. Once they run out they are all taken back and handed out again
+    unsigned short next_pcid;
+    /// Number of times this cpu's PCIDs have been handed out
+    unsigned int pcid_generation;
+    /// Bit mask of the cpus waiting on this one to carry out a TLB shootdown
+    _Atomic unsigned long pending_shootdowns;
+    /// The shootdown each of those cpus sent, indexed by its core id
+    struct tlb_gather *shootdowns[MAX_CPUS_COUNT];
+    /// Thread whose x87/SSE/AVX state is in this cpu's registers
+    struct thread *extended_state_owner;
+};
+
+struct arch_thread_data {
+    /// Save area for the thread's x87/SSE/AVX registers, allocated the first time it uses them
+    void *extended_state;
+    /// The cpu whose registers were last loaded with the thread's state. They are only
+    /// still its own if it is also that cpu's `extended_state_owner`
+    struct per_cpu_data *extended_state_cpu;
 };
 
 #endif
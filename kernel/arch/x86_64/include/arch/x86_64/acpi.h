@@ -191,12 +191,13 @@ static inline bool acpi_checksum(const struct acpi_header *header) {
 
 void apic_init();
 void apic_send_eoi();
+void apic_send_tlb_shootdown(int cpu);
 
 struct registers;
 void timer_fired(struct registers* context);
+void timer_init_ap();
 
 void acpi_init(v_addr_t rsdp_addr);
 int get_cpu_count();
-void smp_init();
 
 #endif // ! ARCH_X86_64_ACPI_H_
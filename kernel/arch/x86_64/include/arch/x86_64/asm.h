@@ -1,6 +1,8 @@
 #ifndef ARCH_X86_64_ASM_H_
 #define ARCH_X86_64_ASM_H_
 
+#include <stdint.h>
+
 static inline char in_port_b(int port) {
     char input;
     asm volatile ("inb %%dx, %%al" : "=a"(input) : "d"(port));
@@ -31,6 +33,13 @@ static inline void out_port_l(int port, int value) {
     asm volatile ("outb %%eax, %%dx" : : "d"(port), "a"(value));
 }
 
+/// Read the cpu's time stamp counter
+static inline uint64_t rdtsc() {
+    uint32_t high, low;
+    asm volatile ("rdtsc" : "=d"(high), "=a"(low));
+    return (uint64_t)high << 32 | low;
+}
+
 static inline void hlt() {
     asm volatile ("hlt");
 }
@@ -0,0 +1,14 @@
+#ifndef ARCH_X86_64_FPU_H_
+#define ARCH_X86_64_FPU_H_
+
+#include "iridium/types.h"
+
+struct thread; // #include "kernel/process.h"
+
+// Enable the x87, SSE and AVX registers for user code on this cpu, trapping their first use
+void fpu_init();
+
+// Load a thread's extended registers after its first use of them trapped
+ir_status_t fpu_load(struct thread *thread);
+
+#endif // ARCH_X86_64_FPU_H_
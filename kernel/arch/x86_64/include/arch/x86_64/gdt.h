@@ -1,6 +1,12 @@
 #ifndef ARCH_X86_64_GDT_H_
 #define ARCH_X86_64_GDT_H_
 
-void init_tss();
+#include <stdint.h>
+
+// Interrupt stack table slots, used by idt entries
+#define IST_DOUBLE_FAULT 1
+#define IST_NMI 2
+
+void init_tss(int cpu, uintptr_t kernel_stack_top);
 
 #endif // ARCH_X86_64_GDT_H_
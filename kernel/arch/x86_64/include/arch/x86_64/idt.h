@@ -6,6 +6,9 @@
 
 #define INTERRUPT_PRESENT (0x1 << 7)
 
+/// Vector other cpus send to have this one flush its TLB
+#define INTERRUPT_TLB_SHOOTDOWN 0xfe
+
 typedef enum idt_gate_type {
     IDT_GATE_INTERRUPT = 0xe, // For hardware interrupts
     IDT_GATE_TRAP = 0xf // For cpu exceptions
@@ -40,6 +43,9 @@ struct idt {
 void idt_set_entry(uint8_t index, uint16_t segment, 
     uintptr_t entry_offset, idt_gate_type gate_type, idt_dpl dpl);
 
+void idt_set_ist(uint8_t index, uint8_t ist);
+
 void idt_init();
+void idt_load();
 
 #endif // ARCH_X86_64_IDT_H_
\ No newline at end of file
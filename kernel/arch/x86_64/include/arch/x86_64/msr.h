@@ -25,6 +25,15 @@
                                  // Every cpu has its own local apic mapped to the same address
 #define MSR_APIC_BASE_ENABLE 0x800
 
+// Local apic timer deadline, in time stamp counter ticks. Writing 0 disarms the timer
+#define MSR_TSC_DEADLINE    0x6E0
+
+// Memory types
+#define MSR_PAT             0x277 // Page attribute table, selects the memory type for each PAT/PCD/PWT page flag combination
+
+// Supervisor state components saved by XSAVES
+#define MSR_XSS             0xDA0
+
 #ifndef __ASSEMBLER__
 
 #include <stdint.h>
@@ -11,15 +11,26 @@
 typedef uint64_t page_table_entry;
 
 extern bool no_execute_supported;
+extern bool gigabyte_pages_supported;
+extern bool pcid_supported;
 
 struct physical_region; // Defined in kernel/memory/pmm.h
 
+// Load the kernel's memory type layout into the page attribute table
+void paging_pat_init();
+
+// Tag TLB entries with the address space they came from, so they survive switching address spaces
+void paging_pcid_init();
+
+// Let other cpus interrupt this one to flush its TLB
+void paging_shootdown_init();
+
+// Flush whatever other cpus asked this one to drop from its TLB
+void paging_handle_shootdowns();
+
 // Setup the physical map and kernel mappings
 void paging_init(struct physical_region *memory_regions, size_t count);
 
-ir_status_t paging_map_page(page_table_entry *table, v_addr_t virtual_address, p_addr_t physical_address, uint64_t protection_flags, bool paging_map_page);
-ir_status_t paging_protect_page(page_table_entry *table, v_addr_t virtual_address, uint64_t protection_flags);
-ir_status_t paging_unmap_page(page_table_entry *table, v_addr_t virtual_address);
 
 void paging_print_tables(page_table_entry *table_root, v_addr_t target);
 
@@ -1,6 +1,44 @@
+// Warning: Included from assembly code
+
 #ifndef ARCH_X86_64_SMP_H_
 #define ARCH_X86_64_SMP_H_
 
+/// Physical address the application processor startup code is copied to.
+/// Must be page aligned and below 1MB, since APs start in real mode
+#define SMP_TRAMPOLINE_ADDRESS 0x8000
+
+#ifndef __ASSEMBLER__
+
+#include <stdint.h>
+#include <stdnoreturn.h>
+
+struct per_cpu_data;
+
+/// @brief Values handed from the bootstrap processor to an AP through the trampoline
+/// @note Layout matches `smp_trampoline_data` in smp_trampoline.S
+struct smp_trampoline_data {
+    /// Physical address of the kernel's pml4
+    uint64_t kernel_cr3;
+    /// Kernel stack for the AP to run `ap_main` on
+    uint64_t stack_top;
+    /// The AP's `per_cpu_data`
+    uint64_t cpu;
+};
+
+/// Start of the trampoline code and data to copy to `SMP_TRAMPOLINE_ADDRESS`
+extern char smp_trampoline_start[];
+extern char smp_trampoline_data[];
+extern char smp_trampoline_end[];
+
+/// @brief Enable the cpu features the kernel relies on. Run on every cpu as it starts
+void cpu_init();
+
+/// @brief Entry point for application processors once they reach 64 bit mode
+noreturn void ap_main(struct per_cpu_data *cpu, uintptr_t stack_top);
+
+void smp_init();
+void smp_ap_started();
 
+#endif // ! __ASSEMBLER__
 
 #endif // ! ARCH_X86_64_SMP_H_
@@ -4,17 +4,21 @@
 #include "kernel/arch/arch.h"
 #include "kernel/main.h"
 #include "kernel/process.h"
+#include "kernel/scheduler.h"
 #include "kernel/memory/init.h"
 #include "kernel/memory/pmm.h"
 #include "kernel/memory/physical_map.h"
 #include "kernel/string.h"
 #include "kernel/devices/framebuffer.h"
+#include "kernel/stack.h"
 #include "multiboot/multiboot2.h"
 #include "arch/defines.h"
 #include "arch/x86_64/idt.h"
 #include "arch/x86_64/gdt.h"
 #include "arch/x86_64/msr.h"
 #include "arch/x86_64/acpi.h"
+#include "arch/x86_64/fpu.h"
+#include "arch/x86_64/smp.h"
 #include "arch/debug.h"
 #include "align.h"
 #include <cpuid.h>
@@ -55,6 +59,11 @@ struct efi_mmap_entry {
 #define CPUID_EDX_PGE (1 << 13)
 #define CPUID_EDX_PAT (1 << 16)
 #define CPUID_EDX_NX (1 << 20)
+#define CPUID_ECX_PCID (1 << 17)
+
+#define CPUID_STRUCTURED_FEATURE_LEAF 7
+#define CPUID_STRUCTURED_EBX_ERMS (1 << 9)
+#define CPUID_STRUCTURED_EDX_FSRM (1 << 4)
 
 #define CPUID_EXTENTED_FEATURE_LEAF 0x80000001
 #define CPUID_EXTENDED_EDX_1G (1 << 26)
@@ -66,7 +75,7 @@ struct efi_mmap_entry {
 #define MAX_MEMORY_REGIONS 128
 struct physical_region physical_memory_regions[MAX_MEMORY_REGIONS];
 
-struct arch_reserved_range reserved_memory_regions[1];
+struct arch_reserved_range reserved_memory_regions[2];
 
 // Points to the array of memory ranges arch code wants reserved
 extern struct arch_reserved_range *reserved_ranges;
@@ -78,6 +87,9 @@ bool found_memory = false;
 bool found_efi_memory = false;
 bool found_rsdp = false;
 
+// Whether the cpu supports the page attribute table, for choosing memory types
+static bool pat_supported = false;
+
 p_addr_t init_module_start;
 p_addr_t init_module_end;
 
@@ -177,7 +189,8 @@ void arch_main(p_addr_t multiboot_physical_addr) {
 
     // Set up exception handlers
     idt_init();
-    init_tss();
+    extern uint8_t stack;
+    init_tss(0, ((uintptr_t)&stack) + BOOT_STACK_SIZE - 16);
 
     unsigned int eax=0, ebx=0, ecx=0, edx=0;
     __get_cpuid(CPUID_FEATURE_LEAF, &eax, &ebx, &ecx, &edx);
@@ -187,6 +200,7 @@ void arch_main(p_addr_t multiboot_physical_addr) {
     }
     if (edx & CPUID_EDX_PAT) {
         debug_print("Has PAT\n");
+        pat_supported = true;
     }
     if (edx & CPUID_EDX_PSE) {
         debug_print("Has PSE\n");
@@ -199,13 +213,31 @@ void arch_main(p_addr_t multiboot_physical_addr) {
         // Tell the paging system its allowed to use the feature
         no_execute_supported = true;
     }
+    if (ecx & CPUID_ECX_PCID) {
+        debug_print("Has PCID\n");
+        pcid_supported = true;
+    }
+
+    if (__get_cpuid_count(CPUID_STRUCTURED_FEATURE_LEAF, 0, &eax, &ebx, &ecx, &edx)) {
+        if (ebx & CPUID_STRUCTURED_EBX_ERMS) {
+            debug_print("Has enhanced rep movsb\n");
+            string_fast_rep = true;
+        }
+        if (edx & CPUID_STRUCTURED_EDX_FSRM) {
+            debug_print("Has fast short rep movsb\n");
+            string_fast_short_rep = true;
+        }
+    }
 
     __get_cpuid(CPUID_EXTENTED_FEATURE_LEAF, &eax, &ebx, &ecx, &edx);
     debug_printf("CPUID extended feature leaf is %#lx\n", (uint64_t)(ecx) << 32 | edx);
     if (edx & CPUID_EXTENDED_EDX_1G) {
         debug_print("1G pages supported\n");
+        gigabyte_pages_supported = true;
     }
 
+    cpu_init();
+
     p_addr_t framebuffer_addr = 0;
     int framebuffer_width = 0;
     int framebuffer_height = 0;
@@ -309,8 +341,12 @@ void arch_main(p_addr_t multiboot_physical_addr) {
     reserved_memory_regions[0].base = init_module_start;
     reserved_memory_regions[0].length = init_module_length;
 
+    // Application processors start up in real mode, in the first megabyte
+    reserved_memory_regions[1].base = SMP_TRAMPOLINE_ADDRESS;
+    reserved_memory_regions[1].length = PAGE_SIZE;
+
     reserved_ranges = reserved_memory_regions;
-    reserved_ranges_count = 1;
+    reserved_ranges_count = 2;
 
     // Generic startup tasks
     // After this we can use heap methods and memory mapping
@@ -340,6 +376,68 @@ void arch_main(p_addr_t multiboot_physical_addr) {
     kernel_main(init_module_start + physical_map_base);
 }
 
+/// @brief Enable the cpu features the kernel relies on. Run on every cpu as it starts
+void cpu_init() {
+    // Enable syscall instructions and no-execute pages
+    uint64_t efer = rdmsr(MSR_EFER) | MSR_EFER_SYSCALL;
+    if (no_execute_supported) efer |= MSR_EFER_EXECUTE_DISABLE;
+    wrmsr(MSR_EFER, efer);
+
+    // On Syscall, CS  will be set to 32:47,
+    // and SS will be set to 32:47 + 8
+    // On sysret,  SS will be set to 63:48 + 8,
+    // and CS will be set to 64:47 + 16
+    // No 32 bit entry point
+    wrmsr(MSR_STAR, 0x0013000800000000ul);
+
+    // Set 64 bit entry point
+    extern char syscall_entry;
+    wrmsr(MSR_LSTAR, (uintptr_t)&syscall_entry);
+
+    // Disable interrupts momentarily when entering a syscall,
+    // so we don't get interrupted while switching gs and end up in a bad state
+    wrmsr(MSR_SFMASK, 1 << 9);
+
+    if (pat_supported) {
+        // Make write-combining available before anything gets mapped with it
+        paging_pat_init();
+    }
+    if (pcid_supported) {
+        paging_pcid_init();
+    }
+
+    fpu_init();
+}
+
+/// @brief Finish starting up an application processor and join the scheduler
+/// @param cpu This cpu's local data, assigned by the bootstrap processor
+/// @param stack_top The stack the AP was started on
+noreturn void ap_main(struct per_cpu_data *cpu, uintptr_t stack_top) {
+    arch_set_cpu_local_pointer(cpu);
+
+    idt_load();
+    init_tss(cpu->core_id, stack_top);
+    cpu_init();
+
+    apic_init();
+    paging_shootdown_init();
+    timer_init_ap();
+
+    scheduler_init_cpu();
+
+    debug_printf("CPU %d started\n", cpu->core_id);
+    // Let the bootstrap processor move on to the next cpu
+    smp_ap_started();
+
+    // Pick up a thread, or idle until one is available
+    switch_task(false);
+
+    panic(NULL, -1, "Application processor returned from the scheduler\n");
+    for (;;) {
+        asm volatile ("cli; hlt");
+    }
+}
+
 void arch_set_cpu_local_pointer(struct per_cpu_data* cpu_local_data) {
     wrmsr(MSR_GS_BASE, (uint64_t)cpu_local_data);
 }
@@ -349,6 +447,12 @@ void arch_pause() {
     asm volatile ("hlt");
 }
 
+/// @brief Spin loop hint. The kernel spins with interrupts off, so TLB shootdowns are answered here instead
+void arch_cpu_relax() {
+    paging_handle_shootdowns();
+    asm volatile ("pause");
+}
+
 /// Prevent interrupts from firing while running important code
 void arch_enter_critical() {
     asm volatile("cli");
@@ -2,14 +2,18 @@
 /// @brief Memory mapping and page table manipulation
 
 #include "arch/x86_64/paging.h"
+#include "arch/x86_64/acpi.h"
+#include "arch/x86_64/msr.h"
 #include "arch/address_space.h"
 #include "kernel/arch/arch.h"
 #include "kernel/arch/mmu.h"
+#include "kernel/cpu_locals.h"
 #include "kernel/main.h"
 #include "kernel/string.h"
 #include "align.h"
 #include "kernel/memory/pmm.h"
 #include "kernel/memory/physical_map.h"
+#include "kernel/memory/vmem.h"
 #include "iridium/errors.h"
 #include "iridium/types.h"
 #include "types.h"
@@ -43,6 +47,37 @@
 #define PAGE_GLOBAL (0x1 << 8)
 #define PAGE_NO_EXECUTE  (0x1ul << 63)
 
+/// Control register 4 flag enabling global pages, which stay in the TLB when cr3 is reloaded
+#define CR4_GLOBAL_PAGES (0x1 << 7)
+/// Control register 4 flag enabling process context identifiers in the low bits of cr3
+#define CR4_PCID (0x1 << 17)
+/// Set when writing cr3 to keep the translations already cached for the new PCID
+#define CR3_NO_FLUSH (0x1ul << 63)
+/// PCIDs are 12 bits. 0 is left for the kernel address space, which only has global pages cached
+#define PCID_COUNT 4096
+
+// Memory type selection through the PCD and PWT flags, using the layout programmed into the PAT
+#define PAGE_MEMORY_WRITE_BACK 0
+#define PAGE_MEMORY_WRITE_COMBINING PAGE_WRITE_THROUGH
+#define PAGE_MEMORY_UNCACHEABLE (PAGE_CACHE_DISABLE | PAGE_WRITE_THROUGH)
+
+// Memory type encodings for PAT entries
+#define PAT_UNCACHEABLE 0x0
+#define PAT_WRITE_COMBINING 0x1
+#define PAT_WRITE_THROUGH 0x4
+#define PAT_WRITE_PROTECTED 0x5
+#define PAT_WRITE_BACK 0x6
+#define PAT_UNCACHED 0x7 // UC-, may be overridden to write-combining by MTRRs
+#define PAT_ENTRY(index, type) ((uint64_t)(type) << ((index) * 8))
+
+// Identical to the power-on default, except entry 1 (PWT only) is write-combining instead of write-through.
+// Keeping the other entries lets tables built before the PAT is programmed keep their meaning,
+// and keeps the PAT bit itself unused so 4KB and large pages select memory types the same way
+#define PAT_LAYOUT (PAT_ENTRY(0, PAT_WRITE_BACK) | PAT_ENTRY(1, PAT_WRITE_COMBINING) \
+                  | PAT_ENTRY(2, PAT_UNCACHED) | PAT_ENTRY(3, PAT_UNCACHEABLE) \
+                  | PAT_ENTRY(4, PAT_WRITE_BACK) | PAT_ENTRY(5, PAT_WRITE_THROUGH) \
+                  | PAT_ENTRY(6, PAT_UNCACHED) | PAT_ENTRY(7, PAT_UNCACHEABLE))
+
 #define IS_PRESENT(entry) ((entry) & PAGE_PRESENT)
 #define IS_LARGE_PAGE(entry) ((entry) & PAGE_LARGE_PAGE)
 
@@ -60,6 +95,9 @@
 
 #define INDEX_AT_LEVEL(virtual_address, table_level) (((virtual_address) >> (12 + ((table_level) * 9))) & PAGE_INDEX_MASK)
 
+/// Ranges of more pages than this are dropped from the TLB by reloading cr3 instead of page by page
+#define PAGING_INVLPG_LIMIT 32
+
 // Kernel page tables, initialized on entry
 // Instead of pml4, pdp, pd, and pt we refer to the levels as pml(#)
 page_table_entry kernel_pml4[512] PAGE_ALIGNED;
@@ -77,18 +115,80 @@ extern uintptr_t _start_physical;
 
 // Whether the cpu supports NX (no execute) pages. If it doesn't, we'll silently ignore the no execute flag
 bool no_execute_supported = false;
+// Whether the cpu supports 1GB pages. If it doesn't, large mappings stop at 2MB pages
+bool gigabyte_pages_supported = false;
+// Whether the cpu can tag TLB entries with a PCID. If it can't, every address space switch flushes the TLB
+bool pcid_supported = false;
+// Cpus that can be interrupted for TLB shootdowns. Kernel memory changes have to reach all of them
+static _Atomic uint64_t shootdown_cpus = 0;
 
 // Private functions
 // Internal to this file only
 
 static size_t page_size(uint table_level);
+static uint64_t page_flags_from_region_flags(v_addr_t address, uint64_t flags);
 static uint64_t intermediate_page_flags(uint64_t leaf_flags);
 static uint64_t leaf_page_flags(uint64_t flags);
-static bool maybe_release_frame(page_table_entry *page_frame);
+static bool maybe_release_frame(page_table_entry *page_frame, struct tlb_gather *gather);
 /// Split an entry in a table into a full, lower level table mapping the same memory
 static ir_status_t paging_split_page(page_table_entry *table_entry, uint table_level);
 static page_table_entry *paging_allocate_table();
+static ir_status_t paging_walk(page_table_entry *table, v_addr_t virtual_address, v_addr_t end, uint64_t intermediate_flags, bool create, page_table_entry *levels[4], uint *level_out);
+static bool paging_release_tables(page_table_entry *levels[4], uint level, v_addr_t virtual_address, struct tlb_gather *gather);
+static void paging_flush_range(v_addr_t address, size_t count);
+static void paging_flush_global();
+static void paging_flush_all(bool kernel);
+static void paging_gather_range(struct tlb_gather *gather, v_addr_t address, size_t count);
+static void paging_flush_gather(struct tlb_gather *gather);
+static void paging_allocate_pcid(struct address_space_context *context);
+
+
+/// @brief Program the page attribute table with the memory types used by the kernel.
+/// Needs to run on every cpu, since each has its own copy of the MSR.
+void paging_pat_init() {
+    // Flush anything cached under the old memory types before changing them
+    asm volatile ("wbinvd" ::: "memory");
+    wrmsr(MSR_PAT, PAT_LAYOUT);
+    asm volatile ("wbinvd" ::: "memory");
+
+    // Reloading cr3 drops any (non-global) translations cached with the old types
+    uint64_t cr3;
+    asm volatile ("mov %%cr3, %0" : "=r" (cr3));
+    asm volatile ("mov %0, %%cr3" :: "r" (cr3) : "memory");
+}
+
+/// @brief Turn on PCIDs. Needs to run on every cpu, with PCID 0 loaded in cr3
+void paging_pcid_init() {
+    uint64_t cr4;
+    asm volatile ("mov %%cr4, %0" : "=r" (cr4));
+    asm volatile ("mov %0, %%cr4" :: "r" (cr4 | CR4_PCID) : "memory");
+}
 
+/// @brief Let other cpus send this one TLB shootdowns. Needs to run on every cpu, once its interrupts are set up
+void paging_shootdown_init() {
+    atomic_fetch_or(&shootdown_cpus, 1ul << this_cpu->core_id);
+    // Kernel memory changed before now was never shot down here
+    paging_flush_global();
+}
+
+/// @brief Carry out the TLB shootdowns other cpus have sent this one
+///
+/// Called from the shootdown interrupt, and from spin loops, since the kernel runs with
+/// interrupts off and a cpu waiting on a lock could otherwise hold up the cpu holding it.
+void paging_handle_shootdowns() {
+    if (atomic_load_explicit(&this_cpu->arch.pending_shootdowns, memory_order_relaxed) == 0) return;
+
+    uint64_t pending = atomic_exchange(&this_cpu->arch.pending_shootdowns, 0);
+    while (pending) {
+        int sender = __builtin_ctzl(pending);
+        pending &= pending - 1;
+
+        struct tlb_gather *gather = this_cpu->arch.shootdowns[sender];
+        paging_flush_gather(gather);
+        // The sender is waiting on this, and the gather is gone once it stops
+        atomic_fetch_sub(&gather->remaining, 1);
+    }
+}
 
 /// Create a new address space for the kernel to reside in,
 /// and map all of physical memory into kernel space
@@ -107,7 +207,7 @@ void paging_init(struct physical_region *memory_regions, size_t count) {
     kernel_pml4[ADDRESS_PML4_INDEX((uintptr_t)&_start_physical + KERNEL_VIRTUAL_ADDRESS)] = physical_address | PAGE_PRESENT | PAGE_WRITABLE | PAGE_GLOBAL;
 
     physical_address = (uintptr_t)&kernel_pml2 - KERNEL_VIRTUAL_ADDRESS;
-    kernel_pml3[ADDRESS_PML3_INDEX((uintptr_t)&_start_physical + KERNEL_VIRTUAL_ADDRESS)] = physical_address | PAGE_PRESENT | PAGE_CACHE_DISABLE | PAGE_WRITABLE | PAGE_GLOBAL;
+    kernel_pml3[ADDRESS_PML3_INDEX((uintptr_t)&_start_physical + KERNEL_VIRTUAL_ADDRESS)] = physical_address | PAGE_PRESENT | PAGE_WRITABLE | PAGE_GLOBAL;
 
     extern uintptr_t _end_physical;
     uint large_page_count = ROUND_UP((uint64_t)&_end_physical, LARGE_PAGE_SIZE) / LARGE_PAGE_SIZE;
@@ -152,39 +252,50 @@ void paging_init(struct physical_region *memory_regions, size_t count) {
     // Each PML2 holds 512 2MB pages, and rounding up a GB makes sure every entry in the PML2 is used to simplify mapping creation
     size_t required_pml2s = ROUND_UP(highest_physical_address, GIGABYTE_PAGE_SIZE) / LARGE_PAGE_SIZE / 512;
 
-    debug_printf("Removing %ld pages off end of region %#p-%#p for creating physical map\n", required_pml2s, largest_region->base, largest_region->base + largest_region->length);
-    largest_region->length -= required_pml2s * PAGE_SIZE;
-
     // Physical mapping to kernel space
-
-
-    kernel_pml3s[1][0] = ((uintptr_t)bootstrap_window_pml2 - KERNEL_VIRTUAL_ADDRESS) | PAGE_PRESENT | PAGE_WRITABLE | PAGE_GLOBAL;
-    page_table_entry *physical_map_pml3 = &kernel_pml3s[0][0];
-    p_addr_t pml2_address = largest_region->base + largest_region->length;
-    physical_address = 0;
-    for (uint i = 0; i < required_pml2s; i++) {
-        physical_map_pml3[i] = pml2_address | PAGE_PRESENT | PAGE_WRITABLE | PAGE_GLOBAL;
-        // Provide a temporary window to access the pml2, since the physical map isn't finished yet
-        size_t offset_in_window = pml2_address % LARGE_PAGE_SIZE;
-        bootstrap_window_pml2[0] = (pml2_address & PAGE_2MB_ADDRESS_MASK) | PAGE_PRESENT | PAGE_LARGE_PAGE | PAGE_WRITABLE | PAGE_GLOBAL;
-        //debug_printf("Mapping window to %#p -> %#.16p | %#.16p\n", bootstrap_window_pml2[0], pml2_address, PAGE_PRESENT | PAGE_LARGE_PAGE | PAGE_WRITABLE | PAGE_GLOBAL);
-        asm volatile ("invlpg (%0)" : : "r" (WINDOW_VIRTUAL_ADDRESS) : "memory");
-
-        // Fill out the pml2 with 2MB pages
-        for (uint p = 0; p < 512; p++) {
-            //debug_printf("%d: %#p -> %#.16p | %#.16p\n", p, &((page_table_entry*)WINDOW_VIRTUAL_ADDRESS)[p], physical_address & PAGE_ADDRESS_MASK, PAGE_PRESENT | PAGE_LARGE_PAGE | PAGE_CACHE_DISABLE | PAGE_WRITABLE | PAGE_GLOBAL);
-            ((page_table_entry*)(WINDOW_VIRTUAL_ADDRESS + offset_in_window))[p] = physical_address | PAGE_PRESENT | PAGE_LARGE_PAGE | PAGE_CACHE_DISABLE | PAGE_WRITABLE | PAGE_GLOBAL;
-            physical_address += LARGE_PAGE_SIZE;
+    // Everything is mapped write-back. Device memory that falls inside the map is still kept uncached
+    // by the firmware's MTRRs, and drivers map it through a v_addr_region with its proper memory type.
+
+    // With 1GB pages the whole map fits in the kernel pml3, so no pml2s need to be carved out
+    if (gigabyte_pages_supported) {
+        page_table_entry *physical_map_pml3 = &kernel_pml3s[0][0];
+        physical_address = 0;
+        for (uint i = 0; i < required_pml2s; i++) {
+            physical_map_pml3[i] = physical_address | PAGE_PRESENT | PAGE_LARGE_PAGE | PAGE_WRITABLE | PAGE_GLOBAL;
+            physical_address += GIGABYTE_PAGE_SIZE;
         }
+    } else {
+        debug_printf("Removing %ld pages off end of region %#p-%#p for creating physical map\n", required_pml2s, largest_region->base, largest_region->base + largest_region->length);
+        largest_region->length -= required_pml2s * PAGE_SIZE;
+
+        kernel_pml3s[1][0] = ((uintptr_t)bootstrap_window_pml2 - KERNEL_VIRTUAL_ADDRESS) | PAGE_PRESENT | PAGE_WRITABLE | PAGE_GLOBAL;
+        page_table_entry *physical_map_pml3 = &kernel_pml3s[0][0];
+        p_addr_t pml2_address = largest_region->base + largest_region->length;
+        physical_address = 0;
+        for (uint i = 0; i < required_pml2s; i++) {
+            physical_map_pml3[i] = pml2_address | PAGE_PRESENT | PAGE_WRITABLE | PAGE_GLOBAL;
+            // Provide a temporary window to access the pml2, since the physical map isn't finished yet
+            size_t offset_in_window = pml2_address % LARGE_PAGE_SIZE;
+            bootstrap_window_pml2[0] = (pml2_address & PAGE_2MB_ADDRESS_MASK) | PAGE_PRESENT | PAGE_LARGE_PAGE | PAGE_WRITABLE | PAGE_GLOBAL;
+            //debug_printf("Mapping window to %#p -> %#.16p | %#.16p\n", bootstrap_window_pml2[0], pml2_address, PAGE_PRESENT | PAGE_LARGE_PAGE | PAGE_WRITABLE | PAGE_GLOBAL);
+            asm volatile ("invlpg (%0)" : : "r" (WINDOW_VIRTUAL_ADDRESS) : "memory");
+
+            // Fill out the pml2 with 2MB pages
+            for (uint p = 0; p < 512; p++) {
+                //debug_printf("%d: %#p -> %#.16p | %#.16p\n", p, &((page_table_entry*)WINDOW_VIRTUAL_ADDRESS)[p], physical_address & PAGE_ADDRESS_MASK, PAGE_PRESENT | PAGE_LARGE_PAGE | PAGE_WRITABLE | PAGE_GLOBAL);
+                ((page_table_entry*)(WINDOW_VIRTUAL_ADDRESS + offset_in_window))[p] = physical_address | PAGE_PRESENT | PAGE_LARGE_PAGE | PAGE_WRITABLE | PAGE_GLOBAL;
+                physical_address += LARGE_PAGE_SIZE;
+            }
 
-        pml2_address += PAGE_SIZE;
+            pml2_address += PAGE_SIZE;
+        }
     }
 
     // Try clearing the TLB again to invalidate the entire physical memory map cache
     asm volatile ("mov %0, %%cr3" :: "r"(((uintptr_t)&kernel_pml4[0]) - KERNEL_VIRTUAL_ADDRESS) : );
 
     // Pass on the table to the virtual memory manager, so kernel memory can be mapped at runtime
-    address_space kernel_address_space;
+    address_space kernel_address_space = {0};
     kernel_address_space.table_base = kernel_pml4;
     init_kernel_address_space(&kernel_address_space);
 }
@@ -198,11 +309,57 @@ ir_status_t arch_mmu_create_address_space(address_space *addr_space) {
 }
 
 void arch_mmu_enter_kernel_address_space() {
-    asm volatile ("mov %0, %%cr3" : : "r" ((uint64_t)kernel_pml4 - KERNEL_VIRTUAL_ADDRESS): "memory");
+    address_space *kernel_address_space = get_kernel_address_space();
+    address_space *previous = this_cpu->arch.address_space;
+    if (previous == kernel_address_space) return;
+    this_cpu->arch.address_space = kernel_address_space;
+
+    // Only global pages are ever cached under PCID 0, so there is nothing to flush
+    uint64_t cr3 = (uint64_t)kernel_pml4 - KERNEL_VIRTUAL_ADDRESS;
+    if (pcid_supported) cr3 |= CR3_NO_FLUSH;
+    asm volatile ("mov %0, %%cr3" : : "r" (cr3): "memory");
+
+    // Shootdowns for the address space left behind no longer need to reach this cpu
+    if (previous) atomic_fetch_and(&previous->active_cpus, ~(1ul << this_cpu->core_id));
 }
 
+/// @brief Load an address space on this cpu
+///
+/// Switching to the address space that is already loaded, like between threads of the same process, does nothing.
+/// With PCIDs, translations cached the last time the address space ran on this cpu are kept,
+/// unless its mappings have changed since.
 void arch_mmu_set_address_space(address_space *address_space) {
-    asm volatile ("mov %0, %%cr3" : : "r" (physical_map_to_p_addr(address_space->table_base)): "memory");
+    struct address_space_context *context = &address_space->contexts[this_cpu->core_id];
+    struct address_space *previous = this_cpu->arch.address_space;
+    uint64_t cpu_bit = 1ul << this_cpu->core_id;
+    // Joined before reading the generation, so a shootdown racing with this either reaches
+    // this cpu or leaves a generation it hasn't flushed yet
+    if (previous != address_space) atomic_fetch_or(&address_space->active_cpus, cpu_bit);
+    size_t tlb_generation = address_space->tlb_generation;
+    bool context_valid = context->pcid != 0 && context->generation == this_cpu->arch.pcid_generation;
+
+    if (this_cpu->arch.address_space == address_space && context_valid && context->tlb_generation == tlb_generation) {
+        return;
+    }
+
+    uint64_t cr3 = physical_map_to_p_addr(address_space->table_base);
+    if (!context_valid) {
+        // Loading a PCID without CR3_NO_FLUSH drops whatever its previous owner left cached
+        paging_allocate_pcid(context);
+    } else if (context->tlb_generation == tlb_generation) {
+        cr3 |= CR3_NO_FLUSH;
+    }
+    context->tlb_generation = tlb_generation;
+    this_cpu->arch.address_space = address_space;
+
+    if (pcid_supported) {
+        cr3 |= context->pcid;
+    } else {
+        cr3 &= ~CR3_NO_FLUSH;
+    }
+    asm volatile ("mov %0, %%cr3" : : "r" (cr3): "memory");
+
+    if (previous && previous != address_space) atomic_fetch_and(&previous->active_cpus, ~cpu_bit);
 }
 
 /// @brief Map a set of pages into an address space
@@ -214,68 +371,109 @@ void arch_mmu_set_address_space(address_space *address_space) {
 /// @return `IR_OK` on successful mapping, or an error code
 ir_status_t arch_mmu_map(address_space *addr_space, v_addr_t address, size_t count, p_addr_t *p_addr_list, uint64_t flags) {
     // TODO: Check that pointers are in kernel space and that flags are valid
-    // TODO: Get necessary address space locks
-
-    uint64_t page_flags = PAGE_PRESENT;
-    if (flags & V_ADDR_REGION_WRITABLE) page_flags |= PAGE_WRITABLE;
-    if (~flags & V_ADDR_REGION_EXECUTABLE) page_flags |= PAGE_NO_EXECUTE;
-    if (flags & V_ADDR_REGION_DISABLE_CACHE) page_flags |= PAGE_CACHE_DISABLE | PAGE_WRITE_THROUGH;
 
-    if (arch_is_kernel_pointer((void*)address)) page_flags |= PAGE_GLOBAL;
-    else page_flags |= PAGE_USER;
-
-    // Map the pages
-    page_table_entry *table = addr_space->table_base;
-    for (size_t i = 0; i < count; i++) {
-        // Map each page individually
-        // TODO: Not an efficient way to do this, but its simpler in the short term.
-        // Crawls each level from scratch every time
-        ir_status_t status = paging_map_page(table, address, *p_addr_list, page_flags, false);
-        if (status != IR_OK ) {
-            debug_printf("Paging: Error %d while mapping\n", status);
-            return status; // Pass on any errors encountered whhile mapping
+    uint64_t page_flags = leaf_page_flags(page_flags_from_region_flags(address, flags));
+    uint64_t intermediate_flags = intermediate_page_flags(page_flags);
+    v_addr_t start = address;
+    bool flush = false;
+    ir_status_t status = IR_OK;
+
+    spinlock_aquire(addr_space->lock);
+    size_t i = 0;
+    while (i < count) {
+        // Tables are only walked (and allocated) once for each run of pages they hold
+        page_table_entry *levels[4];
+        uint level;
+        status = paging_walk(addr_space->table_base, address, address + PAGE_SIZE, intermediate_flags, true, levels, &level);
+        if (status != IR_OK) break;
+
+        page_table_entry *table = levels[0];
+        for (uint index = ADDRESS_PML1_INDEX(address); index < 512 && i < count; index++, i++) {
+            // Only replaced translations can be cached, new ones don't need invalidating
+            if (IS_PRESENT(table[index])) flush = true;
+            else addr_space->resident_pages++;
+
+            table[index] = p_addr_list[i] | page_flags;
+            address += PAGE_SIZE;
         }
-
-        address += PAGE_SIZE;
-        p_addr_list++; // Move to the next physiclal page
     }
 
-    return IR_OK;
+    struct tlb_gather gather;
+    arch_mmu_gather_init(&gather, addr_space);
+    if (flush) paging_gather_range(&gather, start, i);
+    spinlock_release(addr_space->lock);
+    // Other cpus are waited on after the lock is released, so it is only held while the tables change
+    arch_mmu_gather_flush(&gather);
+
+    if (status != IR_OK) {
+        debug_printf("Paging: Error %d while mapping\n", status);
+    }
+    return status; // Pass on any errors encountered whhile mapping
 }
 
-// Map a contigous range of physical memory into the address space
+/// @brief Map a contigous range of physical memory into the address space
+///
+/// Wherever the virtual and physical addresses are both aligned to a large page,
+/// and the rest of the range covers it, the memory is mapped with 2MB or 1GB pages.
+/// @param count The number of (4KB) pages to map
+/// @param physical_address Physical address of the first page
+/// @see `arch_mmu_map`
 ir_status_t arch_mmu_map_contiguous(address_space *addr_space, v_addr_t address, size_t count, p_addr_t physical_address, uint64_t flags) {
-    uint64_t page_flags = PAGE_PRESENT;
-    if (flags & V_ADDR_REGION_WRITABLE) page_flags |= PAGE_WRITABLE;
-    if (~flags & V_ADDR_REGION_EXECUTABLE) page_flags |= PAGE_NO_EXECUTE;
-
-    // Map the pages
-     page_table_entry *table = addr_space->table_base;
-    for (size_t i = 0; i < count; i++) {
-        if (address % LARGE_PAGE_SIZE == 0 && i - count >= LARGE_PAGE_SIZE / PAGE_SIZE) {
-            // Map a 2MB chunk all at once using a large page
-            ir_status_t status = paging_map_page(table, address, physical_address, page_flags, false);
-            if (status != IR_OK ) {
-                return status; // Pass on any errors encountered whhile mapping
+    uint64_t page_flags = leaf_page_flags(page_flags_from_region_flags(address, flags));
+    uint64_t intermediate_flags = intermediate_page_flags(page_flags);
+    v_addr_t start = address;
+    bool flush = false;
+    ir_status_t status = IR_OK;
+
+    spinlock_aquire(addr_space->lock);
+    size_t i = 0;
+    while (i < count) {
+        // Aim for the largest page both addresses line up with
+        uint level = 0;
+        for (uint candidate = gigabyte_pages_supported ? 2 : 1; candidate > 0; candidate--) {
+            size_t size = page_size(candidate);
+            if (address % size == 0 && physical_address % size == 0 && (count - i) * PAGE_SIZE >= size) {
+                level = candidate;
+                break;
             }
-            address += LARGE_PAGE_SIZE;
-            physical_address += LARGE_PAGE_SIZE;
-            i += LARGE_PAGE_SIZE / PAGE_SIZE;
         }
-        else {
-            // Map each page individually
-            // TODO: Not an efficient way to do this, but its simpler in the short term.
-            ir_status_t status = paging_map_page(table, address, physical_address, page_flags, false);
-            if (status != IR_OK ) {
-                return status; // Pass on any errors encountered whhile mapping
-            }
 
+        // The walk stops short of that at tables already holding smaller pages
+        page_table_entry *levels[4];
+        status = paging_walk(addr_space->table_base, address, address + page_size(level), intermediate_flags, true, levels, &level);
+        if (status != IR_OK) break;
+
+        if (level > 0) {
+            page_table_entry *entry = &levels[level][INDEX_AT_LEVEL(address, level)];
+            size_t size = page_size(level);
+            if (IS_PRESENT(*entry)) flush = true;
+            else addr_space->resident_pages += size / PAGE_SIZE;
+
+            *entry = physical_address | page_flags | PAGE_LARGE_PAGE;
+            address += size;
+            physical_address += size;
+            i += size / PAGE_SIZE;
+            continue;
+        }
+
+        page_table_entry *table = levels[0];
+        for (uint index = ADDRESS_PML1_INDEX(address); index < 512 && i < count; index++, i++) {
+            if (IS_PRESENT(table[index])) flush = true;
+            else addr_space->resident_pages++;
+
+            table[index] = physical_address | page_flags;
             address += PAGE_SIZE;
             physical_address += PAGE_SIZE;
         }
     }
 
-    return IR_OK;
+    struct tlb_gather gather;
+    arch_mmu_gather_init(&gather, addr_space);
+    if (flush) paging_gather_range(&gather, start, i);
+    spinlock_release(addr_space->lock);
+    arch_mmu_gather_flush(&gather);
+
+    return status; // Pass on any errors encountered whhile mapping
 }
 
 // Change the access flags for an existing mapping
@@ -287,180 +485,375 @@ ir_status_t arch_mmu_protect(address_space *addr_space, v_addr_t address, size_t
     if (count == 0) { return IR_OK; }
     // TODO: Check page flags using arch-defined method
 
-    uint64_t page_flags = PAGE_PRESENT;
-    if (flags & V_ADDR_REGION_WRITABLE) page_flags |= PAGE_WRITABLE;
-    if (~flags & V_ADDR_REGION_EXECUTABLE) page_flags |= PAGE_NO_EXECUTE;
-    if (flags & V_ADDR_REGION_DISABLE_CACHE) page_flags |= PAGE_CACHE_DISABLE;
-
-    if (arch_is_kernel_pointer((void*)address)) page_flags |= PAGE_GLOBAL;
-    else page_flags |= PAGE_USER;
+    uint64_t page_flags = leaf_page_flags(page_flags_from_region_flags(address, flags));
+    uint64_t intermediate_flags = intermediate_page_flags(page_flags);
+    v_addr_t start = address;
+    v_addr_t end = address + count * PAGE_SIZE;
+    bool flush = false;
+    ir_status_t status = IR_OK;
+
+    spinlock_aquire(addr_space->lock);
+    while (address < end) {
+        // Large pages are only split if part of them is left with the old flags
+        page_table_entry *levels[4];
+        uint level;
+        status = paging_walk(addr_space->table_base, address, end, intermediate_flags, false, levels, &level);
+        if (status != IR_OK) break;
+
+        if (level > 0) {
+            // Either a large page inside the range, or a missing table with nothing mapped under it
+            page_table_entry *entry = &levels[level][INDEX_AT_LEVEL(address, level)];
+            if (IS_PRESENT(*entry)) {
+                *entry = (*entry & PAGE_ADDRESS_MASK) | page_flags | PAGE_LARGE_PAGE;
+                flush = true;
+            }
 
-    page_table_entry *table = addr_space->table_base;
+            v_addr_t next = ROUND_DOWN(address, page_size(level)) + page_size(level);
+            if (next <= address) break; // Wrapped around the top of the address space
+            address = next;
+            continue;
+        }
 
-    for (size_t i = 0; i < count; i++) {
-        paging_protect_page(table, address, flags);
-        address += PAGE_SIZE;
+        page_table_entry *table = levels[0];
+        for (uint index = ADDRESS_PML1_INDEX(address); index < 512 && address < end; index++) {
+            // Unmapped pages are left alone, they get their flags when they are mapped
+            if (IS_PRESENT(table[index])) {
+                table[index] = (table[index] & PAGE_ADDRESS_MASK) | page_flags;
+                flush = true;
+            }
+            address += PAGE_SIZE;
+        }
     }
 
-    return IR_OK;
+    struct tlb_gather gather;
+    arch_mmu_gather_init(&gather, addr_space);
+    if (flush) paging_gather_range(&gather, start, count);
+    spinlock_release(addr_space->lock);
+    arch_mmu_gather_flush(&gather);
+
+    return status;
 }
 
-// Remove a range of mappings from an address space
+/// @brief Remove a range of mappings from an address space
+/// @param count Size of the range in bytes
+/// @see `arch_mmu_unmap_gather`
 ir_status_t arch_mmu_unmap(address_space *addr_space, v_addr_t address, size_t count) {
+    struct tlb_gather gather;
+    arch_mmu_gather_init(&gather, addr_space);
+    ir_status_t status = arch_mmu_unmap_gather(&gather, address, count);
+    arch_mmu_gather_flush(&gather);
+    return status;
+}
+
+/// @brief Remove a range of mappings, leaving the TLB invalidations queued in a gather
+///
+/// Page tables left empty are freed too, but not until the gather is flushed.
+/// @param gather Gather set up for the address space being unmapped from
+/// @param count Size of the range in bytes
+ir_status_t arch_mmu_unmap_gather(struct tlb_gather *gather, v_addr_t address, size_t count) {
+    address_space *addr_space = gather->addr_space;
     if (!addr_space) {
         debug_printf("Null address space\n");
         return IR_ERROR_INVALID_ARGUMENTS;
     }
 
-    int pages = count / PAGE_SIZE;
-
-    for (int i = 0; i < pages; i++) {
-        paging_unmap_page(addr_space->table_base, address);
-        address += PAGE_SIZE;
-    }
-
-    return IR_OK;
-}
-
-
-// Update the access flags of an existing page
-ir_status_t paging_protect_page(page_table_entry *table, v_addr_t virtual_address, uint64_t new_flags) {
-    uint64_t intermediate_flags = intermediate_page_flags(new_flags);
-
-    // Work down from the PML4 (top of tables) down to the relevant leaf, updating permissions along the way
-    for (uint level = 3; level > 0; level--) {
-        uint index = INDEX_AT_LEVEL(virtual_address, level);
+    size_t pages = count / PAGE_SIZE;
+    v_addr_t start = address;
+    v_addr_t end = address + pages * PAGE_SIZE;
+    bool flush = false;
+    bool released_tables = false;
+    ir_status_t status = IR_OK;
+
+    spinlock_aquire(addr_space->lock);
+    while (address < end) {
+        // Large pages are only split if part of them stays mapped
+        page_table_entry *levels[4];
+        uint level;
+        status = paging_walk(addr_space->table_base, address, end, 0, false, levels, &level);
+        if (status != IR_OK) break;
+
+        if (level > 0) {
+            // Either a large page inside the range, or a missing table with nothing mapped under it
+            page_table_entry *entry = &levels[level][INDEX_AT_LEVEL(address, level)];
+            if (IS_PRESENT(*entry)) {
+                *entry = 0;
+                addr_space->resident_pages -= page_size(level) / PAGE_SIZE;
+                flush = true;
+                if (paging_release_tables(levels, level, address, gather)) released_tables = true;
+            }
 
-        // Break up any large pages in the way
-        if (IS_LARGE_PAGE(table[index])) {
-            ir_status_t status = paging_split_page(&table[index], level);
-            if (status != IR_OK) { return status; } // Bubble any errors up to the caller
+            v_addr_t next = ROUND_DOWN(address, page_size(level)) + page_size(level);
+            if (next <= address) break; // Wrapped around the top of the address space
+            address = next;
+            continue;
         }
 
-        // Abort if the page is not mapped
-        if (!IS_PRESENT(table[index])) {
-            return IR_ERROR_NOT_FOUND;
+        page_table_entry *table = levels[0];
+        v_addr_t table_address = address;
+        for (uint index = ADDRESS_PML1_INDEX(address); index < 512 && address < end; index++) {
+            if (IS_PRESENT(table[index])) {
+                addr_space->resident_pages--;
+                flush = true;
+            }
+            table[index] = 0;
+            address += PAGE_SIZE;
         }
 
-        // Update permissions
-        table[index] = (table[index] & PAGE_ADDRESS_MASK) | intermediate_flags;
-        // Get the next level of the table
-        table = (page_table_entry*)((table[index] & PAGE_ADDRESS_MASK) | HIGHER_HALF_BITS);
+        // Freed tables can still be held in the paging structure caches, so they need a flush too
+        if (paging_release_tables(levels, 0, table_address, gather)) released_tables = true;
     }
 
-    // Replace the permissions
-    uint index = INDEX_AT_LEVEL(virtual_address, 0);
-    p_addr_t physical_address = table[index] & PAGE_ADDRESS_MASK;
-    table[index] = physical_address | leaf_page_flags(new_flags);
-
-    asm volatile ("invlpg (%0)" : : "r" (virtual_address) : "memory");
+    if (released_tables && arch_is_kernel_pointer((void*)start) && pcid_supported) {
+        gather->kernel = true;
+        gather->flush_global = true;
+    } else if (flush || released_tables) {
+        paging_gather_range(gather, start, pages);
+    }
+    spinlock_release(addr_space->lock);
 
-    return IR_OK;
+    return status;
 }
 
-// Map a single physical page to a virtual address space
-ir_status_t paging_map_page(page_table_entry *table, v_addr_t virtual_address, p_addr_t physical_address, uint64_t protection_flags, bool use_2mb) {
-    uint64_t intermediate_flags = intermediate_page_flags(protection_flags);
+/// @brief Start gathering TLB invalidations for changes to an address space
+void arch_mmu_gather_init(struct tlb_gather *gather, address_space *addr_space) {
+    gather->addr_space = addr_space;
+    gather->range_count = 0;
+    gather->page_count = 0;
+    gather->kernel = false;
+    gather->flush_all = false;
+    gather->flush_global = false;
+    gather->freed_tables = NULL;
+    gather->tlb_generation = 0;
+    gather->remaining = 0;
+}
 
-    // Work down from the PML4 (top of tables) down to the relevant leaf, updating permissions along the way
-    for (uint level = 3; level > 0; level--) {
-        uint index = INDEX_AT_LEVEL(virtual_address, level);
+/// @brief Carry out the TLB invalidations queued in a gather on every cpu that could have cached the old mappings
+///
+/// This cpu flushes straight away. The other cpus running the address space, or every cpu for kernel memory,
+/// are sent a shootdown and waited on. Cpus that ran it before flush when they next load it.
+/// Afterwards the gather is empty and can be used again.
+void arch_mmu_gather_flush(struct tlb_gather *gather) {
+    if (gather->range_count > 0 || gather->flush_all || gather->flush_global) {
+        uint64_t targets;
+        if (gather->kernel) {
+            targets = shootdown_cpus;
+        } else {
+            // The generation goes up before looking for the cpus running the address space, so a cpu
+            // loading it at the same time is either found or sees the new generation
+            gather->tlb_generation = atomic_fetch_add(&gather->addr_space->tlb_generation, 1) + 1;
+            targets = gather->addr_space->active_cpus;
+        }
 
-        if(use_2mb && index == 1) {
-            if (IS_PRESENT(table[index]) && !IS_LARGE_PAGE(table[index])) {
-                // Release the page backing the existing mapping and overwrite it
-                page_table_entry *lower_table = (page_table_entry*)(table[index] & PAGE_ADDRESS_MASK);
-                pmm_free_page(pmm_page_from_p_addr((p_addr_t)lower_table));
-                // TODO: Do i need to invlpg the whole 2MB?
-                asm volatile ("invlpg (%0)" : : "r" (virtual_address) : "memory");
+        int core_id = this_cpu->core_id;
+        targets &= ~(1ul << core_id);
+        paging_flush_gather(gather);
+
+        if (targets) {
+            for (uint64_t pending = targets; pending; pending &= pending - 1) {
+                int cpu = __builtin_ctzl(pending);
+                // Counted before the cpu can see the shootdown and answer it
+                gather->remaining++;
+                // Each cpu only has one shootdown in flight, so it gets a slot of its own on every other cpu
+                processor_local_data[cpu].arch.shootdowns[core_id] = gather;
+                atomic_fetch_or(&processor_local_data[cpu].arch.pending_shootdowns, 1ul << core_id);
+                apic_send_tlb_shootdown(cpu);
             }
 
-            table[index] = physical_address | leaf_page_flags(protection_flags) | PAGE_LARGE_PAGE;
-            asm volatile ("invlpg (%0)" : : "r" (virtual_address) : "memory");
-            return IR_OK;
+            // Shootdowns sent to this cpu in the meantime are answered while spinning
+            while (gather->remaining) {
+                arch_cpu_relax();
+            }
         }
+    }
 
-        // Break up any large pages in the way
-        if (IS_LARGE_PAGE(table[index])) {
-            ir_status_t status = paging_split_page(&table[index], level);
-            if (status != IR_OK) { return status; } // Bubble any errors up to the caller
-        }
+    while (gather->freed_tables) {
+        physical_page_info *page = gather->freed_tables;
+        gather->freed_tables = page->next;
+        pmm_free_page(page);
+    }
 
-        // Create new page tables where there aren't any yet
-        if (!IS_PRESENT(table[index])) {
-            p_addr_t new_table = (uint64_t)paging_allocate_table() - physical_map_base;
+    arch_mmu_gather_init(gather, gather->addr_space);
+}
+
+/// @brief Find the page size to align a range of contiguous physical memory's virtual address to
+/// @param length Size of the range in bytes
+/// @return The largest page size that fits inside the range
+size_t arch_mmu_contiguous_alignment(size_t length) {
+    if (gigabyte_pages_supported && length >= GIGABYTE_PAGE_SIZE) return GIGABYTE_PAGE_SIZE;
+    if (length >= LARGE_PAGE_SIZE) return LARGE_PAGE_SIZE;
+    return PAGE_SIZE;
+}
+
+/// @brief Walk down the tables to the entry mapping an address
+///
+/// Stops early at an entry that doesn't point to a lower table if the page it covers lies wholly
+/// inside `[virtual_address, end)`, which is either a large page or an empty entry, and otherwise
+/// goes all the way to the pml1. Large pages sticking out of the range are split on the way,
+/// and missing tables are allocated if `create` is set, or end the walk if it isn't.
+/// Entries passed through gain `intermediate_flags`, only ever adding permissions
+/// since other pages under the same entries may still need theirs.
+/// @param table Top level of the page tables
+/// @param end End of the range being worked on. `virtual_address + PAGE_SIZE` always reaches the pml1
+/// @param intermediate_flags Flags needed by every level above the leaf, or 0 to leave them as they are
+/// @param create Whether to allocate missing tables
+/// @param levels Set to the table at each level the walk went through, from the pml1 in `levels[0]` up to the pml4 in `levels[3]`
+/// @param level_out Set to the level of the table holding the entry the walk stopped at
+/// @return `IR_OK` on success, or `IR_ERROR_NO_MEMORY`
+static ir_status_t paging_walk(page_table_entry *table, v_addr_t virtual_address, v_addr_t end, uint64_t intermediate_flags, bool create, page_table_entry *levels[4], uint *level_out) {
+    levels[3] = table;
+
+    uint level;
+    for (level = 3; level > 0; level--) {
+        page_table_entry *entry = &table[INDEX_AT_LEVEL(virtual_address, level)];
+        size_t size = page_size(level);
+        bool covered = virtual_address % size == 0 && end > virtual_address && end - virtual_address >= size;
+
+        if (!IS_PRESENT(*entry)) {
+            if (covered || !create) break;
+
+            // Create new page tables where there aren't any yet
+            page_table_entry *new_table = paging_allocate_table();
             if (!new_table) { return IR_ERROR_NO_MEMORY; } // If an intermediate table could not be allocated
-            table[index] = new_table & PAGE_ADDRESS_MASK;
+            *entry = physical_map_to_p_addr(new_table) & PAGE_ADDRESS_MASK;
+        } else if (IS_LARGE_PAGE(*entry)) {
+            if (covered) break;
+
+            // Break up any large pages in the way
+            ir_status_t status = paging_split_page(entry, level);
+            if (status != IR_OK) { return status; } // Bubble any errors up to the caller
         }
 
-        // Update permissions
-        table[index] = (table[index] & PAGE_ADDRESS_MASK) | intermediate_flags;
+        *entry |= intermediate_flags;
 
         // Get the next level of the table
-        table = (page_table_entry*)((table[index] & PAGE_ADDRESS_MASK) + physical_map_base);
+        table = (page_table_entry*)((*entry & PAGE_ADDRESS_MASK) + physical_map_base);
+        levels[level - 1] = table;
     }
 
-    // Map the physical page to the requested address
-    uint index = ADDRESS_PML1_INDEX(virtual_address);
-    table[index] = physical_address | leaf_page_flags(protection_flags);
-
-    asm volatile ("invlpg (%0)" : : "r" (virtual_address) : "memory");
+    *level_out = level;
     return IR_OK;
 }
 
-/// @brief Remove a page from the memory maps
-/// @param table PML4 of the address space being unmapped from
-/// @param virtual_address The address to unmap
-/// @return `IR_OK` on success, or a negative error code
-ir_status_t paging_unmap_page(page_table_entry *table, v_addr_t virtual_address) {
+/// @brief Free the tables holding an entry that was just cleared, if they no longer map anything
+/// @param levels Tables leading to the entry, as filled in by `paging_walk`
+/// @param level Level of the table holding the entry
+/// @param virtual_address Any address the entry covered
+/// @param gather Gather the tables are freed through, once no cpu can have them cached
+/// @return Whether any table was freed
+static bool paging_release_tables(page_table_entry *levels[4], uint level, v_addr_t virtual_address, struct tlb_gather *gather) {
+    bool released = false;
 
-    page_table_entry *levels[4]; // Save pointers to each frame for when we check for empty frames
+    for (; level < 3; level++) {
+        // Can't free kernel pml3s since the change won't propogate to different processes
+        if (level >= 2 && arch_is_kernel_pointer((void*)virtual_address)) { break; }
 
-    // Work down from the PML4 (top of tables) down to the relevant leaf, updating permissions along the way
-    for (uint level = 3; level > 0; level--) {
-        uint index = INDEX_AT_LEVEL(virtual_address, level);
+        // If we can't free this level we certainly can't free the next one
+        if (!maybe_release_frame(levels[level], gather)) { break; }
 
-        // Break up any large pages in the way
-        if (IS_LARGE_PAGE(table[index])) {
-            ir_status_t status = paging_split_page(&table[index], level);
-            if (status != IR_OK) { return status; } // Bubble any errors up to the caller
-        }
+        levels[level + 1][INDEX_AT_LEVEL(virtual_address, level + 1)] = 0;
+        released = true;
+    }
 
-        // If there isn't a table there then there is nothing for us to do
-        if (table[index] == 0) {
-            return IR_OK;
-        }
+    return released;
+}
 
-        // Save a pointer for when we want to potentially free higher levels
-        levels[level] = table;
+/// @brief Invalidate the TLB entries for a range of pages in the current address space
+///
+/// Small ranges are invalidated page by page. Past `PAGING_INVLPG_LIMIT` pages it is cheaper to
+/// flush everything with `paging_flush_all`.
+static void paging_flush_range(v_addr_t address, size_t count) {
+    if (count > PAGING_INVLPG_LIMIT) {
+        paging_flush_all(arch_is_kernel_pointer((void*)address));
+        return;
+    }
 
-        // Get the next level of the table
-        table = (page_table_entry*)((table[index] & PAGE_ADDRESS_MASK) + physical_map_base);
+    for (size_t i = 0; i < count; i++) {
+        asm volatile ("invlpg (%0)" : : "r" (address) : "memory");
+        address += PAGE_SIZE;
+    }
+}
+
+/// @brief Flush the current address space's translations from the TLB
+/// @param kernel Whether kernel memory changed. Global kernel pages survive reloading cr3, so that toggles CR4.PGE instead
+static void paging_flush_all(bool kernel) {
+    if (kernel) {
+        paging_flush_global();
+    } else {
+        uint64_t cr3;
+        asm volatile ("mov %%cr3, %0" : "=r" (cr3));
+        asm volatile ("mov %0, %%cr3" :: "r" (cr3) : "memory");
     }
+}
 
-    levels[0] = table;
-    uint index = INDEX_AT_LEVEL(virtual_address, 0);
-    table[index] = 0;
+/// @brief Flush every TLB entry on this cpu, including global pages and those of every PCID
+static void paging_flush_global() {
+    uint64_t cr4;
+    asm volatile ("mov %%cr4, %0" : "=r" (cr4));
+    asm volatile ("mov %0, %%cr4" :: "r" (cr4 & ~CR4_GLOBAL_PAGES) : "memory");
+    asm volatile ("mov %0, %%cr4" :: "r" (cr4) : "memory");
+}
 
-    // Check if there are any unused page frames now
-    for (int i = 0; i < 3; i++) {
+/// @brief Queue the invalidation of a range of pages whose mappings changed
+///
+/// Once the gather runs out of ranges, or holds more than `PAGING_INVLPG_LIMIT` pages,
+/// it gives up on tracking them and flushes everything instead.
+static void paging_gather_range(struct tlb_gather *gather, v_addr_t address, size_t count) {
+    if (count == 0) return;
+
+    gather->kernel = arch_is_kernel_pointer((void*)address);
+    gather->page_count += count;
+    if (gather->flush_all || gather->range_count == TLB_GATHER_RANGES || gather->page_count > PAGING_INVLPG_LIMIT) {
+        gather->flush_all = true;
+        return;
+    }
 
-        // Can't free kernel pml3s since the change won't propogate to different processes
-        if (i >= 2 && arch_is_kernel_pointer((void*)virtual_address)) { break; }
+    gather->ranges[gather->range_count].address = address;
+    gather->ranges[gather->range_count].count = count;
+    gather->range_count++;
+}
 
-        if (maybe_release_frame(table)) {
-            levels[i+1][INDEX_AT_LEVEL(virtual_address, i+1)] = 0;
-            // Release the page backing the table
-            pmm_free_page(pmm_page_from_p_addr(physical_map_to_p_addr(table)));
+/// @brief Carry out a gather's invalidations on this cpu
+///
+/// Kernel memory is flushed everywhere. An address space's translations are only flushed if it is loaded,
+/// otherwise whatever this cpu cached of it is flushed the next time it is loaded.
+static void paging_flush_gather(struct tlb_gather *gather) {
+    if (!gather->kernel) {
+        struct address_space_context *context = &gather->addr_space->contexts[this_cpu->core_id];
+        if (this_cpu->arch.address_space != gather->addr_space) {
+            // A later shootdown could have marked the context up to date while this one was on its way
+            context->tlb_generation = SIZE_MAX;
+            return;
+        }
+        if (context->tlb_generation < gather->tlb_generation) {
+            context->tlb_generation = gather->tlb_generation;
         }
-        // If we can't free this level we certainly can't free the next one
-        else { break; }
     }
 
-    // Previously used &virtual_address, accidentally invalidating cache for the stack instead of target memory
-    asm volatile ("invlpg (%0)" : : "r" (virtual_address) : "memory");
+    if (gather->flush_global) {
+        // Kernel tables can be cached under any PCID, and invlpg only reaches the current one
+        paging_flush_global();
+    } else if (gather->flush_all) {
+        paging_flush_all(gather->kernel);
+    } else {
+        for (size_t i = 0; i < gather->range_count; i++) {
+            paging_flush_range(gather->ranges[i].address, gather->ranges[i].count);
+        }
+    }
+}
 
-    return IR_OK;
+/// @brief Give an address space a PCID on this cpu
+///
+/// PCIDs are handed out in order. Once they run out every cached translation is flushed,
+/// and a new generation starts, taking them all back from the address spaces holding them.
+static void paging_allocate_pcid(struct address_space_context *context) {
+    if (this_cpu->arch.next_pcid == 0 || this_cpu->arch.next_pcid >= PCID_COUNT) {
+        this_cpu->arch.pcid_generation++;
+        this_cpu->arch.next_pcid = 1;
+        if (pcid_supported) paging_flush_global();
+    }
+
+    context->pcid = this_cpu->arch.next_pcid++;
+    context->generation = this_cpu->arch.pcid_generation;
 }
 
 // Split an entry in a table into a full, lower level table mapping the same memory
@@ -532,6 +925,23 @@ static uint64_t intermediate_page_flags(uint64_t leaf_flags) {
     return leaf_flags & ~(PAGE_NO_EXECUTE | PAGE_CACHE_DISABLE | PAGE_WRITE_THROUGH);
 }
 
+/// Translate `V_ADDR_REGION_*` flags into page table entry flags for a mapping at `address`
+static uint64_t page_flags_from_region_flags(v_addr_t address, uint64_t flags) {
+    uint64_t page_flags = PAGE_PRESENT;
+    if (flags & V_ADDR_REGION_WRITABLE) page_flags |= PAGE_WRITABLE;
+    if (~flags & V_ADDR_REGION_EXECUTABLE) page_flags |= PAGE_NO_EXECUTE;
+
+    // Normal memory is write-back, only device memory should ask for anything else
+    if (flags & V_ADDR_REGION_DISABLE_CACHE) page_flags |= PAGE_MEMORY_UNCACHEABLE;
+    else if (flags & V_ADDR_REGION_WRITE_COMBINE) page_flags |= PAGE_MEMORY_WRITE_COMBINING;
+    else page_flags |= PAGE_MEMORY_WRITE_BACK;
+
+    if (arch_is_kernel_pointer((void*)address)) page_flags |= PAGE_GLOBAL;
+    else page_flags |= PAGE_USER;
+
+    return page_flags;
+}
+
 static uint64_t leaf_page_flags(uint64_t flags) {
     if (no_execute_supported) {
         return flags;
@@ -560,7 +970,7 @@ static size_t page_size(uint table_level) {
 /// @brief Free a page frame if all the entries inside are empty
 /// @param page_frame Pointer to a page frame that might need to be freed
 /// @return Whether the page frame was freed
-static bool maybe_release_frame(page_table_entry *page_frame) {
+static bool maybe_release_frame(page_table_entry *page_frame, struct tlb_gather *gather) {
     // If there is even a single page still mapped in here we can't remove it
     for (int i = 0; i < 512; i++) {
         // Checking the entry as a whole, not the present flag, so swapped
@@ -568,8 +978,10 @@ static bool maybe_release_frame(page_table_entry *page_frame) {
         if (page_frame[i] != 0) return false;
     }
 
+    // Other cpus can still be walking the table through their paging structure caches until the gather is flushed
     physical_page_info *page = pmm_page_from_p_addr(physical_map_to_p_addr(page_frame));
-    pmm_free_page(page);
+    page->next = gather->freed_tables;
+    gather->freed_tables = page;
     debug_printf("Released page table @ %#p\n", page_frame);
     return true; // The caller should remove pointers to the frame
 }
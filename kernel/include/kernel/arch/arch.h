@@ -10,6 +10,7 @@
 struct registers; // Defined in arch/registers.h
 struct per_cpu_data; // Defined in kernel/cpu_locals.h
 struct physical_region; // Defined in kernel/memory/pmm.h
+struct thread; // Defined in kernel/process.h
 
 /// @brief Set data accessible through `this_cpu` in kernel/process.h
 /// @param cpu_local_data This cpu's local data struct
@@ -26,11 +27,27 @@ bool arch_is_kernel_pointer(void *pointer);
 /// Pause execution on the cpu
 void arch_pause();
 
+/// Hint to the cpu that it is spinning while waiting on another cpu
+void arch_cpu_relax();
+
 /// Prevent interrupts from firing while running important code
 void arch_enter_critical();
 /// Allow interrupts to fire again
 void arch_exit_critical();
 
+/// @brief Read the time since boot from a clock that runs independently of timer interrupts
+/// @return Time in microseconds
+uint64_t arch_time_microseconds();
+
+/// @brief Program this cpu's timer to interrupt once at a point in time,
+/// replacing any earlier deadline. Deadlines that have passed fire immediately.
+/// @param deadline Time in microseconds since boot, or `UINT64_MAX` to stop the timer
+void arch_timer_set_deadline(uint64_t deadline);
+
+/// @brief Interrupt a cpu so that it runs the scheduler
+/// @param cpu Index of the cpu in `processor_local_data`
+void arch_cpu_wake(int cpu);
+
 /// Add an interrupt handler to the platform's interrupt table
 void arch_interrupt_set(int vector, int irq);
 /// Remove an interrupt from the interrupt table
@@ -64,13 +81,25 @@ long arch_io_input(int port, int word_size);
 ///
 /// Assumeing the thread's address space is already loaded,
 /// load its register values and enter usermode.
+/// @param context The register values to resume execution with
+/// @param release If not NULL, moves off of the current stack and clears this
+///                flag once the stack is no longer in use
 /// @note Does not return - executes a user process
-noreturn void arch_enter_context(struct registers *context);
+noreturn void arch_enter_context(struct registers *context, bool volatile *release);
 
 /// @brief Save cpu context to be resumed later
 /// @param context The space to save register values to
 void arch_save_context(struct registers *context);
 
+/// @brief Get registers kept outside of `struct registers` ready for switching threads
+///
+/// Called while switching away from the current thread, before any other cpu can run it
+/// @param next The thread about to run on this cpu
+void arch_switch_extended_state(struct thread *next);
+
+/// @brief Free whatever the architecture allocated for a thread's extra registers
+void arch_free_extended_state(struct thread *thread);
+
 /// @brief Task switching utility that unwinds a level of the stack before returning
 void arch_leave_function(void);
 
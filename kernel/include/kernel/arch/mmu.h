@@ -45,7 +45,24 @@ void arch_mmu_enter_kernel_address_space();
 /// @return `IR_OK` on success, or a negative error code
 ir_status_t arch_mmu_map(address_space *addr_space, v_addr_t address, size_t count, p_addr_t *p_addr_list, uint64_t flags);
 ir_status_t arch_mmu_map_contiguous(address_space *addr_space, v_addr_t address, size_t count, p_addr_t physical_address, uint64_t flags);
+/// @brief Find the boundary a virtual range mapping `length` bytes of contiguous physical memory
+///        should line up with the same way the memory does, so it can be mapped with large pages
+size_t arch_mmu_contiguous_alignment(size_t length);
 ir_status_t arch_mmu_unmap(address_space *addr_space, v_addr_t address, size_t count); // Remove a range of mappings
 ir_status_t arch_mmu_protect(address_space *addr_space, v_addr_t address, size_t count, uint flags); // Change the access flags for an existing mapping
 
+/// @brief Start gathering TLB invalidations for changes to an address space
+/// @param gather The arch-defined `struct tlb_gather` to set up, usually on the caller's stack
+void arch_mmu_gather_init(struct tlb_gather *gather, address_space *addr_space);
+
+/// @brief Remove a range of mappings without waiting for other cpus to drop them from their TLBs
+/// @param gather Gather for the address space, which queues the invalidations
+/// @param count Size of the range in bytes
+/// @note The memory that was mapped can't be reused until the gather is flushed
+ir_status_t arch_mmu_unmap_gather(struct tlb_gather *gather, v_addr_t address, size_t count);
+
+/// @brief Invalidate everything queued in a gather, on every cpu that could have it cached
+/// Waits for the other cpus, so is best called without locks held. The gather can be used again afterwards.
+void arch_mmu_gather_flush(struct tlb_gather *gather);
+
 #endif // KERNEL_ARCH_MMU_H_
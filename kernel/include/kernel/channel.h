@@ -1,8 +1,11 @@
 #ifndef KERNEL_CHANNEL_H_
 #define KERNEL_CHANNEL_H_
 
+#include "arch/defines.h"
 #include "kernel/object.h"
-#include "kernel/linked_list.h"
+#include "kernel/memory/slab.h"
+#include "kernel/rcu.h"
+#include <stdbool.h>
 
 /// @see kernel/handle.h
 struct handle;
@@ -10,18 +13,64 @@ struct handle;
 struct process;
 /// Internal message storage
 struct channel_message;
+/// Caller waiting in `SYSCALL_CHANNEL_CALL`
+struct channel_call;
+
+/// Number of messages a new channel can queue
+#define CHANNEL_DEFAULT_QUEUE_DEPTH 16
+/// Largest queue depth `SYSCALL_CHANNEL_SET_QUEUE_DEPTH` accepts
+#define CHANNEL_MAX_QUEUE_DEPTH 1024
+/// Bytes each message takes in its channel's queue ring. Messages are stored in their slot when
+/// their handle pointers and bytes fit in the rest of it, otherwise they overflow into pages
+/// allocated for the message
+#define CHANNEL_MESSAGE_SLOT_SIZE 128
+/// Page aligned messages of at least this many bytes written with `SYSCALL_CHANNEL_WRITE_MOVE` have
+/// their whole pages moved between address spaces instead of copied. Below it, remapping costs more than copying does
+#define CHANNEL_ZERO_COPY_THRESHOLD (4 * PAGE_SIZE)
+/// Largest message that can be written, in bytes
+#define CHANNEL_MAX_MESSAGE_LENGTH (256 * PAGE_SIZE)
+/// Most handles that can be sent in a single message
+#define CHANNEL_MAX_MESSAGE_HANDLES 64
 
 /// @brief IPC object for transmitting data and object handles between processes.
 ///
+/// Messages written to a channel are queued in its peer, and read from there.
+/// Each channel's queue is a ring of `queue_depth` message slots, allocated separately
+/// when the channel is created, so queueing a small message doesn't allocate any memory.
+/// Large page aligned messages written with `SYSCALL_CHANNEL_WRITE_MOVE` are moved from the
+/// writer's address space to the reader's by exchanging pages, instead of being copied in and
+/// out of the kernel.
+///
+/// Replies to `SYSCALL_CHANNEL_CALL` are matched to their caller by transaction id
+/// and handed to it directly, instead of being queued.
+///
 /// NOTE: Channels do not keep their peers alive. If one end closes communication will fail
 struct channel {
     object object;
 
-    /// This channel's other end where data is sent
-    struct channel *peer;
-    linked_list message_queue;
+    /// This channel's other end where data is sent.
+    /// Read without a lock by writers, and cleared when the peer is released
+    struct channel *volatile peer;
+
+    /// Ring of message slots, protected by `object.lock`
+    struct channel_message *queue;
+    size_t queue_depth;
+    /// Slot holding the oldest message
+    size_t queue_head;
+    size_t queue_count;
+
+    /// Callers waiting for replies to be written to this channel, protected by `object.lock`
+    struct channel_call *calls;
+
+    /// Set once the channel is being released, after which nothing can be written to it
+    bool closed;
+    /// Defers freeing the channel until writers that found it through its peer are done
+    struct rcu_head rcu;
 };
 
+/// Every `struct channel` is allocated from here
+extern struct kmem_cache channel_cache;
+
 /// @brief Create a linked pair of channels for IPC
 /// One of the 2 generated channels is intended to be passed to another process =
 /// @param channel_out
@@ -29,13 +78,9 @@ struct channel {
 /// @return `IR_OK` on success or `IR_ERROR_NO_MEMORY`
 ir_status_t channel_create(struct channel **channel_out, struct channel **peer_out);
 
-/// @brief Read the next message in a channel's queue
-/// @param channel
-/// @param process
-/// @param message_out Buffer for the data component of the message
-/// @param handles Array of handles
-/// @return `IR_OK` on success
-ir_status_t channel_read(struct channel *channel, struct process *process, char *message_out, struct handle *handles);
+/// @brief Free a pair of channels from `channel_create` that were never handed out
+/// Neither channel can have any messages queued yet.
+void channel_destroy_unused(struct channel *channel, struct channel *peer);
 
 /// @brief Write a message to a channel
 /// @param destination The channel the sent message is to be read from
@@ -45,7 +90,9 @@ ir_status_t channel_read(struct channel *channel, struct process *process, char
 ///                handles' IDs will ignored and reassigned upon reading
 ///                the message
 /// @param handles_count Number of handle pointers in `handles`
-/// @return
+/// @return `IR_OK` on success, in which case the message owns the handles. Otherwise returns
+///         `IR_ERROR_SHOULD_WAIT` if the queue is full, `IR_ERROR_PEER_CLOSED` if `destination`
+///         is being released, or `IR_ERROR_NO_MEMORY`, and the caller keeps the handles
 ir_status_t channel_write(struct channel *destination, char *message, size_t message_length, struct handle **handles, size_t handles_count);
 
 /// Channel garbage collection handler
@@ -68,7 +115,36 @@ ir_status_t sys_channel_create(ir_handle_t *channel_out, ir_handle_t *peer_out);
 ir_status_t sys_channel_read(ir_handle_t channel, char *buffer, size_t buffer_length, size_t *handles_count, size_t *message_length);
 
 /// @brief SYSCALL_CHANNEL_WRITE
+/// Copies the message, leaving the caller's buffer untouched.
 /// Handles must have `IR_RIGHT_TRANSFER` and are removed from the process's handle table.
 ir_status_t sys_channel_write(ir_handle_t channel, char *message, size_t message_length, ir_handle_t **handles, size_t handles_count);
 
+/// @brief SYSCALL_CHANNEL_WRITE_MOVE
+/// Like `SYSCALL_CHANNEL_WRITE`, but if the message is page aligned and at least
+/// `CHANNEL_ZERO_COPY_THRESHOLD` bytes its whole pages are moved to the reader instead of copied.
+/// Once the write succeeds the moved part of the caller's buffer reads as zeroes.
+/// Messages that can't be moved are copied as usual.
+ir_status_t sys_channel_write_move(ir_handle_t channel, char *message, size_t message_length, ir_handle_t **handles, size_t handles_count);
+
+/// @brief SYSCALL_CHANNEL_SET_QUEUE_DEPTH
+/// Change how many messages can be queued for a channel to read
+/// @param channel A handle to the channel whose queue is resized
+/// @param queue_depth Number of messages, from 1 to `CHANNEL_MAX_QUEUE_DEPTH`
+/// @return `IR_OK` on success, or `IR_ERROR_BAD_STATE` if more messages than that are already queued
+ir_status_t sys_channel_set_queue_depth(ir_handle_t channel, size_t queue_depth);
+
+/// @brief SYSCALL_CHANNEL_CALL
+/// Write a request to a channel, then wait for the reply carrying the request's transaction id
+/// and read it into the caller's buffer
+/// @param channel A handle to the channel the request is written to and the reply read from
+/// @param args The request, and the buffer for the reply. The request's first bytes are
+///             replaced with the transaction id the kernel picks
+/// @param timeout_microseconds How long to wait for the reply, or -1 to never time out
+/// @param handles_count Output parameter containing the number of handles in the reply
+/// @param message_length Output parameter containing the length of the reply
+/// @return `IR_OK` on success, `IR_ERROR_TIMED_OUT` if no reply arrived in time, or an error code.
+///         `handles_count` and `message_length` are still written in the event of an
+///         `IR_ERROR_BUFFER_TOO_SMALL` error, though the reply is lost
+ir_status_t sys_channel_call(ir_handle_t channel, ir_channel_call_args_t *args, size_t timeout_microseconds, size_t *handles_count, size_t *message_length);
+
 #endif // KERNEL_CHANNEL_H_
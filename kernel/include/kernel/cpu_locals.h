@@ -2,14 +2,50 @@
 #define KERNEL_CPU_LOCALS_H_
 
 #include "arch/defines.h"
+#include "kernel/spinlock.h"
+#include "kernel/timer.h"
+#include "kernel/memory/pmm.h"
+#include "kernel/rcu.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 struct thread; // #include "kernel/process.h"
 
+/// @brief Threads waiting to run on a cpu
+/// Linked through `thread->run_queue_next`, so queueing never has to allocate
+struct run_queue {
+    struct thread *head;
+    struct thread *tail;
+    /// Read without holding the lock by other cpus looking for work to take
+    size_t volatile count;
+    lock_t lock;
+};
+
 struct per_cpu_data {
     // Note: Be take care to update the offset in the x86_64 syscall entry point if current_thread moves or is changed
     struct thread *volatile current_thread;
     struct thread *idle_thread;
+    /// Stack used while switching away from a thread, so the thread's own
+    /// kernel stack is free for another cpu as soon as it is requeued
+    /// Note: The x86_64 arch_enter_context expects this at offset 0x10
+    uintptr_t switch_stack_top;
     int core_id;
+
+    struct run_queue run_queue;
+    /// Time since boot in microseconds when the load balancer next runs on this cpu
+    size_t next_balance;
+    /// Timers armed on this cpu
+    struct timer_heap timers;
+    /// Free pages kept for this cpu's allocations
+    struct pmm_page_cache page_cache;
+    /// Grace period tracking and callbacks waiting for one
+    struct rcu_cpu_data rcu;
+    /// Set while the running thread wakes a thread it is about to block on
+    bool direct_handoff;
+    /// Thread woken during a direct handoff, which runs next instead of waiting in a run queue
+    struct thread *handoff_thread;
+
     struct arch_per_cpu_data arch;
 };
 
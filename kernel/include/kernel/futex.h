@@ -0,0 +1,55 @@
+
+#ifndef KERNEL_FUTEX_H_
+#define KERNEL_FUTEX_H_
+
+#include "kernel/memory/vm_object.h"
+#include "kernel/object.h"
+#include "iridium/types.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/// Number of wait queues futexes are hashed into
+#define FUTEX_HASH_BUCKETS 256
+
+/// @brief A thread blocked in `SYSCALL_FUTEX_WAIT`, on its kernel stack
+///
+/// Futexes are identified by the vm_object holding them and their offset in it,
+/// so processes sharing memory find the same waiters whatever address they map it at.
+struct futex_waiter {
+    vm_object *vm;
+    size_t offset;
+    /// Wakes the thread when the futex is woken or the wait times out
+    struct signal_listener listener;
+    /// `IR_OK` once woken by `SYSCALL_FUTEX_WAKE`
+    ir_status_t status;
+    /// Links in the bucket's wait queue, protected by the bucket's lock
+    struct futex_waiter *prev;
+    struct futex_waiter *next;
+    bool queued;
+};
+
+/// @brief Threads waiting on every futex whose key hashes to the bucket, oldest first
+struct futex_bucket {
+    struct futex_waiter *head;
+    struct futex_waiter *tail;
+    lock_t lock;
+};
+
+/// @brief SYSCALL_FUTEX_WAIT
+/// Block until the futex is woken, if it still holds the expected value
+/// @param address 4 byte aligned address of the futex, in memory mapped from a vm_object
+/// @param expected Value the futex must have for the thread to block
+/// @param timeout_microseconds How long to wait, or -1 to never time out
+/// @return `IR_OK` once woken, `IR_ERROR_BAD_STATE` if the futex didn't hold `expected`,
+///         or `IR_ERROR_TIMED_OUT`
+ir_status_t sys_futex_wait(uint32_t *address, uint32_t expected, size_t timeout_microseconds);
+
+/// @brief SYSCALL_FUTEX_WAKE
+/// Wake threads waiting on a futex, in the order they started waiting
+/// @param address Address of the futex
+/// @param count Most threads to wake
+/// @param woken_out If not NULL, set to the number of threads woken
+/// @return `IR_OK` on success
+ir_status_t sys_futex_wake(uint32_t *address, size_t count, size_t *woken_out);
+
+#endif // KERNEL_FUTEX_H_
@@ -4,6 +4,9 @@
 
 #include "types.h"
 #include "kernel/object.h"
+#include "kernel/memory/slab.h"
+#include "kernel/rcu.h"
+#include "kernel/spinlock.h"
 #include "iridium/types.h"
 
 /// @brief Kernel object handle
@@ -15,17 +18,58 @@ struct handle {
     // Pointer to the object this is a handle for
     // Verify the type is correct before accessing!
     object *object;
+    /// Defers releasing the handle until lockless lookups can't be using it
+    struct rcu_head rcu;
+};
+
+/// Number of handles in each second level table
+#define HANDLE_TABLE_LEAF_SIZE 512
+/// Number of second level tables in a handle table
+#define HANDLE_TABLE_LEAVES 256
+/// Handle ids are always less than this
+#define HANDLE_TABLE_MAX_ID (HANDLE_TABLE_LEAF_SIZE * HANDLE_TABLE_LEAVES)
+
+/// @brief Second level of a handle table, covering `HANDLE_TABLE_LEAF_SIZE` consecutive ids
+struct handle_table_leaf {
+    /// Read without a lock, so only changed with atomic stores
+    struct handle *volatile handles[HANDLE_TABLE_LEAF_SIZE];
+    /// Bitmap of ids in use, or reserved in the case of `IR_HANDLE_INVALID`
+    uint64_t used[HANDLE_TABLE_LEAF_SIZE / 64];
+    /// Defers freeing the leaf when its table is destroyed
+    struct rcu_head rcu;
+};
+
+/// @brief A process's handles, indexed by id
+///
+/// Lookups take no lock. Adding and removing handles takes `lock`, and removed
+/// handles are released with `handle_release` so that any lookup still using
+/// them finishes first. Leaves are allocated when first needed, and a zeroed
+/// table is empty.
+struct handle_table {
+    /// Read without a lock, so only changed with atomic stores
+    struct handle_table_leaf *volatile leaves[HANDLE_TABLE_LEAVES];
+    /// Bitmap of leaves with no free ids, so the lowest free id is found without searching every leaf
+    uint64_t full_leaves[HANDLE_TABLE_LEAVES / 64];
+    size_t count;
+    lock_t lock;
 };
 
 struct process;
 
-// Linked list search function for using handle IDs
-int handle_by_id(void *data, void *target);
+/// Every `struct handle` is allocated from here
+extern struct kmem_cache handle_cache;
 
-ir_status_t handle_create(struct process *process, object *object, ir_rights_t rights, struct handle **handle);
-ir_status_t handle_copy(struct handle *original, ir_rights_t new_rights, uint new_id, struct handle **out);
+ir_status_t handle_create(object *object, ir_rights_t rights, struct handle **handle);
+ir_status_t handle_copy(struct handle *original, ir_rights_t new_rights, struct handle **out);
+void handle_release(struct handle *handle);
 
-ir_handle_t handle_get_next_id(struct process *process);
+struct handle *handle_table_get(struct handle_table *table, ir_handle_t id);
+ir_status_t handle_table_add(struct handle_table *table, struct handle *handle);
+ir_status_t handle_table_add_locked(struct handle_table *table, struct handle *handle);
+ir_status_t handle_table_restore_locked(struct handle_table *table, struct handle *handle);
+ir_status_t handle_table_remove(struct handle_table *table, ir_handle_t id, struct handle **out);
+ir_status_t handle_table_remove_locked(struct handle_table *table, ir_handle_t id, struct handle **out);
+void handle_table_destroy(struct handle_table *table);
 
 /// @brief SYSCALL_HANDLE_DUPLICATE
 ///
@@ -27,8 +27,36 @@ typedef struct physical_page_info {
     struct physical_page_info* next;
     p_addr_t address; // Used when allocating from the linked list
     char state; // Whether the page is free or in use
+    /// For the first page of a free block, log2 of the block's page count.
+    /// `PAGE_ORDER_NONE` for every other page
+    uint8_t order;
+    /// Number of `vm_object`s the page backs. Set to 1 when a page is put in an object,
+    /// and only above 1 for pages shared copy-on-write between clones
+    _Atomic uint32_t references;
 } physical_page_info;
 
+/// Largest free block the physical memory manager keeps, 2^10 pages (4MB)
+#define PMM_MAX_ORDER 10
+/// Order of pages that are not the start of a free block
+#define PAGE_ORDER_NONE 0xff
+
+/// Number of free pages each cpu can keep for itself
+#define PMM_CACHE_SIZE 64
+/// Number of pages moved between a cpu's cache and the free lists at once
+#define PMM_CACHE_BATCH 32
+
+/// @brief Free pages kept by one cpu, so most single page allocations and frees
+/// don't have to take the lock on the shared free lists
+///
+/// Only the cpu that owns a cache touches its pages. Kernel code isn't preempted,
+/// so that needs no lock or atomic operations.
+struct pmm_page_cache {
+    /// Used as a stack, so recently freed pages that may still be in the cpu's caches are reused first
+    physical_page_info *pages[PMM_CACHE_SIZE];
+    /// Read by other cpus when totalling memory statistics
+    volatile size_t count;
+};
+
 /// This region system needs a redesign but I'm hoping it works well enough for the time being.
 /// At least until I have to start writing drivers and may need to touch reserved memory
 typedef enum region_type {
@@ -0,0 +1,120 @@
+/// @brief Object caches for frequently allocated, fixed size kernel structures
+///
+/// A cache hands out objects of a single size from pages split into slabs,
+/// with a magazine of free objects on each cpu so that most allocations and
+/// frees don't take a lock or search for free space.
+
+#ifndef KERNEL_MEMORY_SLAB_H_
+#define KERNEL_MEMORY_SLAB_H_
+
+#include "arch/defines.h"
+#include "kernel/spinlock.h"
+#include <stddef.h>
+
+/// Number of free objects each cpu can keep for a cache
+#define KMEM_MAGAZINE_SIZE 16
+/// Number of objects moved between a magazine and the cache's slabs at once
+#define KMEM_MAGAZINE_BATCH 8
+
+/// Alignment of every object in a cache
+#define KMEM_ALIGNMENT 16ul
+
+/// @brief Prepares a new object when its slab is created
+///
+/// Objects are expected to be returned to their cache in the state the
+/// constructor left them in, so the work is only done once per object.
+typedef void (*kmem_constructor)(void *object);
+
+struct kmem_slab;
+
+/// @brief Free objects kept by one cpu for a cache
+/// Only the owning cpu uses a magazine. Kernel code isn't preempted, so that needs no lock.
+struct kmem_magazine {
+    /// Used as a stack, so the most recently freed objects are reused first
+    void *objects[KMEM_MAGAZINE_SIZE];
+    size_t count;
+    /// Allocations and frees made on this cpu, totalled by `kmem_cache_get_stats`
+    size_t allocations;
+    size_t frees;
+};
+
+/// @brief A source of equally sized objects
+/// Define caches with `KMEM_CACHE_INITIALIZER`, or `KMEM_CACHE_INITIALIZER_CONSTRUCTED` for caches with a constructor
+struct kmem_cache {
+    /// Name shown when debugging
+    const char *name;
+    /// Size of each object, rounded up to `KMEM_ALIGNMENT`
+    size_t object_size;
+    /// Called on each object when its slab is created, or NULL
+    kmem_constructor constructor;
+
+    /// Space taken by each object in a slab, including the link to the next free object
+    /// when it can't overlap the object. Set when the first slab is created
+    size_t slot_size;
+    /// Number of objects that fit in a slab
+    size_t objects_per_slab;
+    /// Next in the list of caches that have created a slab, printed by `kmem_dump_stats`
+    struct kmem_cache *next_cache;
+
+    /// Slabs with both free and allocated objects
+    struct kmem_slab *partial;
+    /// One slab with no allocated objects, kept so a single object
+    /// being allocated and freed over and over doesn't churn pages
+    struct kmem_slab *empty;
+    size_t slab_count;
+    /// Free objects in slabs, not counting magazines
+    size_t slab_free_objects;
+    /// Protects the slabs and the counters above
+    lock_t lock;
+
+    struct kmem_magazine magazines[MAX_CPUS_COUNT];
+};
+
+/// @brief Statistics for a cache, totalled across every cpu when requested
+struct kmem_cache_stats {
+    /// Pages used by the cache
+    size_t slabs;
+    /// Objects allocated and not yet freed
+    size_t objects_in_use;
+    /// Free objects in slabs and magazines
+    size_t objects_free;
+    size_t allocations;
+    size_t frees;
+};
+
+/// @brief Static initializer for a `struct kmem_cache`
+/// @param cache_name Name shown when debugging
+/// @param size Size of each object in bytes
+#define KMEM_CACHE_INITIALIZER(cache_name, size) KMEM_CACHE_INITIALIZER_CONSTRUCTED(cache_name, size, NULL)
+
+/// @brief Static initializer for a `struct kmem_cache` whose objects are prepared once, when their slab is created
+/// @param cache_name Name shown when debugging
+/// @param size Size of each object in bytes
+/// @param object_constructor A `kmem_constructor`
+#define KMEM_CACHE_INITIALIZER_CONSTRUCTED(cache_name, size, object_constructor) { \
+    .name = (cache_name), \
+    .object_size = ((size) + KMEM_ALIGNMENT - 1) & ~(KMEM_ALIGNMENT - 1), \
+    .constructor = (object_constructor), \
+}
+
+/// @brief Allocate an object from a cache
+/// @return The object, in the state its constructor left it or holding whatever it did
+///         when it was freed, or NULL if out of memory
+void *kmem_cache_alloc(struct kmem_cache *cache);
+
+/// @brief Allocate an object from a cache and zero it
+/// @note Only useful for caches without a constructor, since zeroing undoes its work
+/// @return The object, or NULL if out of memory
+void *kmem_cache_zalloc(struct kmem_cache *cache);
+
+/// @brief Return an object to the cache it was allocated from
+/// @param object The object, or NULL to do nothing
+void kmem_cache_free(struct kmem_cache *cache, void *object);
+
+/// @brief Total a cache's statistics across every cpu
+void kmem_cache_get_stats(struct kmem_cache *cache, struct kmem_cache_stats *stats_out);
+
+/// @brief Print the statistics of every cache that has been used over the debug output
+void kmem_dump_stats(void);
+
+#endif // ! KERNEL_MEMORY_SLAB_H_
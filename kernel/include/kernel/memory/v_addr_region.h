@@ -29,8 +29,21 @@ struct v_addr_region {
     /// Used if this region was created by mapping a vm_object into an address region, otherwise null.
     /// This object counts as a reference to prevents the `vm_object` from being freed.
     vm_object *vm_object;
+    /// Next region mapping the same `vm_object`, protected by the object's lock
+    struct v_addr_region *next_mapping;
 
-    // Use object's linked list for children
+    /// Root of an AVL tree of the child regions, ordered by base address. Protected by `object.lock`
+    struct v_addr_region *children;
+
+    /// Links in the parent's tree of children, protected by the parent's lock
+    struct v_addr_region *left;
+    struct v_addr_region *right;
+    int height;
+    /// Lowest address and highest end of the regions in the subtree rooted here
+    v_addr_t subtree_start;
+    v_addr_t subtree_end;
+    /// Largest gap between neighbouring regions in the subtree rooted here
+    size_t subtree_max_gap;
 };
 
 /// Creates the root of an address space. The returned object encompases the whole
@@ -47,6 +60,21 @@ ir_status_t v_addr_region_create_specific(struct v_addr_region *parent, v_addr_t
 /// Map a virtual memory object into the address space of virtual address region's host process
 ir_status_t v_addr_region_map_vm_object(struct v_addr_region *parent, uint64_t flags, vm_object *vm, struct v_addr_region **out, v_addr_t address, v_addr_t *address_out);
 
+/// Find the region mapping a vm_object that contains a range of addresses
+ir_status_t v_addr_region_find_mapping(struct v_addr_region *root, v_addr_t address, size_t length, struct v_addr_region **out);
+
+/// Swap pages into part of a region mapping a vm_object, remapping them in place
+ir_status_t v_addr_region_exchange_pages(struct v_addr_region *region, v_addr_t address, size_t count, physical_page_info **pages);
+
+/// Back a page of memory after an access to it faulted
+ir_status_t v_addr_region_handle_fault(struct v_addr_region *root, v_addr_t address, bool write, bool execute);
+
+/// Remap the pages of a region that are shared copy-on-write as read only
+void v_addr_region_protect_shared(struct v_addr_region *region);
+
+/// Remove a run of a vm_object's pages from every region mapping it
+void v_addr_region_unmap_object_pages(vm_object *vm, size_t first_page, size_t count);
+
 /// Remove a virtual address region
 /// Handles will continue to reference it but all operations on it afterwards will fail
 void v_addr_region_destroy(struct v_addr_region *region);
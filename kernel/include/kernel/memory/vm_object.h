@@ -9,20 +9,41 @@
 #include <stddef.h>
 #include <stdbool.h>
 
+struct v_addr_region; // #include "kernel/memory/v_addr_region.h"
+
+/// Bits of a page number each level of a vm_object's page tree is indexed by
+#define VM_PAGE_TREE_BITS 9
+/// Entries in each node of a page tree, so nodes take up a page
+#define VM_PAGE_TREE_SLOTS (1ul << VM_PAGE_TREE_BITS)
+#define VM_PAGE_TREE_MASK (VM_PAGE_TREE_SLOTS - 1)
+
 /// @brief Kernel object representing a piece of usable memory
 /// @see 'v_addr_region' for mapping memory into address spaces
 typedef struct vm_object {
     object object;
 
-    /// The list of pages backing this memory object.
-    /// @warning Index using `page->next` - NOT `page_list[i]`.
-    physical_page_info *page_list;
-    /// Number of pages in `page_list`
+    /// Radix tree of the pages backing this memory object, indexed by page number.
+    /// Ordinary memory is committed the first time each page is touched, so entries are NULL
+    /// and whole subtrees missing until then. Protected by `object.lock`
+    /// @see `vm_object_get_page`
+    void **page_tree;
+    /// Number of levels in `page_tree`. The bottom level holds `physical_page_info` pointers
+    uint page_tree_levels;
+    /// Number of pages in the object
     size_t page_count;
     /// Size in bytes
     size_t size;
 
     uint64_t access_flags; // Architecture-specific memory flags
+    /// Whether the object is backed by a single range of physical memory, in order, such as device memory.
+    /// These are mapped all at once, with large pages where the alignment allows
+    bool physically_contiguous;
+
+    /// Number of `v_addr_region`s mapping the object.
+    /// Pages can only be exchanged while a single region maps them
+    size_t mapping_count;
+    /// The regions mapping the object, linked through `next_mapping`. Protected by `object.lock`
+    struct v_addr_region *mappings;
 } vm_object;
 
 /// Sets `out` to a pointer to a new virtual memory object representing pages that can be mapped into address spaces
@@ -34,6 +55,24 @@ ir_status_t vm_object_create_physical(p_addr_t physical_address, size_t size, ui
 /// Wrap an existing physical memory allocation in a `vm_object`
 ir_status_t vm_object_from_page_list(physical_page_info *pages, uint64_t flags, vm_object **out);
 
+/// Look up the page backing part of an object, or NULL if it hasn't been committed
+physical_page_info *vm_object_get_page(vm_object *vm, size_t index);
+
+/// Find the first committed page of an object at or after a page number
+physical_page_info *vm_object_next_page(vm_object *vm, size_t *index);
+
+/// Create a copy-on-write clone of a memory object
+ir_status_t vm_object_create_clone(vm_object *parent, vm_object **out);
+
+/// Back a page of the object with memory, allocating a zeroed page if it hasn't been touched yet
+ir_status_t vm_object_commit_page(vm_object *vm, size_t index, bool write, physical_page_info **page_out);
+
+/// Back every page of the object with memory
+ir_status_t vm_object_commit(vm_object *vm);
+
+/// Swap a run of the object's pages for other pages, without copying their contents
+ir_status_t vm_object_exchange_pages(vm_object *vm, size_t first_page, size_t count, physical_page_info **pages);
+
 /// Free an unused vm_object, releasing the held memory
 void vm_object_cleanup(vm_object *vm);
 
@@ -43,4 +82,7 @@ ir_status_t sys_vm_object_create(size_t size, uint64_t flags, ir_handle_t *handl
 /// @brief SYSCALL_VM_OBJECT_CREATE_PHYSICAL
 ir_status_t sys_vm_object_create_physical(p_addr_t address, size_t size, ir_handle_t *handle_out);
 
+/// @brief SYSCALL_VM_OBJECT_CREATE_CLONE
+ir_status_t sys_vm_object_create_clone(ir_handle_t vm_object, ir_handle_t *clone_out);
+
 #endif // KERNEL_MEMORY_VM_OBJECT_H_
@@ -4,14 +4,30 @@
 #include "types.h"
 #include "kernel/linked_list.h"
 #include "kernel/spinlock.h"
+#include "kernel/timer.h"
+#include <stdatomic.h>
 
-/// Freed by the wait handler
+struct port; // #include "kernel/port.h"
+
+/// @brief Something waiting for an object's signals
+///
+/// Either a thread blocked until one of the signals is raised, which removes the listener,
+/// or a port binding, which stays attached and queues a packet each time one is raised.
+/// Owned by whoever attached it, usually on the waiting thread's stack.
 struct signal_listener {
     struct object *target; /// The object whose signals are being listened to
     struct thread *thread; /// Thread listening for signals
+    struct port *port; /// Port that packets are queued in, if this is a port binding
     ir_signal_t target_signals; // Bit mask of which signals should trigger the listener
     ir_signal_t observed_signals; // Bit map signals currently high when the signal is sent
-    unsigned long deadline; // TODO: Time type
+    struct timer timeout; // Armed if the wait has a deadline
+    /// Set by whichever of the signal, the timeout or process termination wakes the thread first
+    atomic_bool woken;
+
+    /// Links in the target's listeners, protected by the target's lock
+    struct signal_listener *prev;
+    struct signal_listener *next;
+    bool attached;
 };
 
 /// @brief Common component of all kernel objects
@@ -21,7 +37,7 @@ typedef struct object {
     struct object *parent;
     linked_list children;
     ir_signal_t signals;
-    linked_list signal_listeners; // Signal listeners attached to the object
+    struct signal_listener *signal_listeners; // Signal listeners attached to the object
 
     lock_t lock;
 } object;
@@ -32,6 +48,22 @@ typedef void (*object_cleanup)(object* obj); // Frees an object
 /// This should be used instead of directly setting the value of object->signals
 void object_set_signals(object *obj, ir_signal_t signals);
 
+/// @brief Attach a listener to an object
+/// @note Call with a lock on `obj`
+void object_add_listener(object *obj, struct signal_listener *listener);
+
+/// @brief Detach a listener from an object, if it is attached
+/// @note Call with a lock on `obj`
+void object_remove_listener(object *obj, struct signal_listener *listener);
+
+/// @brief Block the current thread until an object asserts one of the target signals
+/// @param obj Object whose signals will be listened to, which the caller keeps alive
+/// @param target_signals Bitmap of signals to wait for
+/// @param deadline Time since boot in microseconds to stop waiting at, or `SIZE_MAX` to never time out
+/// @param observed_signals Set to the object's signals when one was asserted
+/// @return `IR_OK` when a target signal is asserted, or `IR_ERROR_TIMED_OUT` if the deadline is reached first
+ir_status_t object_wait(object *obj, ir_signal_t target_signals, size_t deadline, ir_signal_t *observed_signals);
+
 /// @brief Blocking syscall that waits until an object asserts a signal
 /// @param object_handle Object whose signals will be listened to
 /// @param target_signals Bitmap of signals to wait for
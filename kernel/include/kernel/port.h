@@ -0,0 +1,96 @@
+
+#ifndef KERNEL_PORT_H_
+#define KERNEL_PORT_H_
+
+#include "kernel/object.h"
+#include "kernel/memory/slab.h"
+#include "kernel/spinlock.h"
+#include "iridium/types.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/// Most packets a single `SYSCALL_PORT_WAIT` returns
+#define PORT_MAX_WAIT_PACKETS 32
+
+/// @brief Persistent registration of an object's signals with a port
+///
+/// Stays attached to the object until it is unbound, or the port or the object is released.
+/// It doesn't keep the object alive. Each binding has at most one packet queued:
+/// signals raised while it is queued are added to the same packet.
+struct port_binding {
+    /// Attached to the bound object. Must be first, since the object only knows about the listener
+    struct signal_listener listener;
+    unsigned long key;
+    /// Next of the port's bindings, protected by the port's `bindings_lock`
+    struct port_binding *next;
+
+    /// The rest is protected by the port's lock
+    /// Next binding with a packet queued
+    struct port_binding *queue_next;
+    bool queued;
+    ir_signal_t trigger;
+    ir_signal_t signals;
+};
+
+/// @brief Object that collects signal packets from many objects, so one thread can wait on all of them
+///
+/// Objects are bound to the port once, and from then on queue a packet whenever a
+/// watched signal is raised, without the waiting thread re-arming anything.
+/// Packets are edge triggered: a signal that stays raised is only reported once.
+struct port {
+    object object;
+
+    /// Every binding, searched when unbinding. Held while a binding is attached or detached
+    struct port_binding *bindings;
+    lock_t bindings_lock;
+
+    /// Bindings with packets waiting to be read, oldest first. Protected by `object.lock`
+    struct port_binding *queue_head;
+    struct port_binding *queue_tail;
+
+    /// Set once the port is being released, after which no more packets are queued
+    bool closed;
+};
+
+/// Every `struct port` is allocated from here
+extern struct kmem_cache port_cache;
+
+ir_status_t port_create(struct port **out);
+void port_cleanup(struct port *port);
+
+/// @brief Detach every port binding from an object that is being released
+/// @note Call without a lock on `obj`, once nothing else has a reference to it
+void port_unbind_object(object *obj);
+
+/// @brief Queue a packet for a port binding whose watched signals were raised
+/// @note Called with a lock on the binding's target
+void port_queue_packet(struct signal_listener *listener, ir_signal_t trigger, ir_signal_t signals);
+
+/// @brief SYSCALL_PORT_CREATE
+ir_status_t sys_port_create(ir_handle_t *port_out);
+
+/// @brief SYSCALL_PORT_BIND
+/// Queue a packet in a port each time one of an object's signals is raised
+/// @param port A handle to the port, with `IR_RIGHT_WRITE`
+/// @param object A handle to the object being watched, which can't be a port
+/// @param signals Bitmap of the signals that queue packets
+/// @param key Value identifying the binding in its packets. Each object can only be bound once with a key
+/// @return `IR_OK` on success, or `IR_ERROR_ALREADY_EXISTS` if the object is already bound with the key
+ir_status_t sys_port_bind(ir_handle_t port, ir_handle_t object, ir_signal_t signals, unsigned long key);
+
+/// @brief SYSCALL_PORT_UNBIND
+/// Stop an object queueing packets in a port, and discard any packet it has queued
+/// @return `IR_OK` on success, or `IR_ERROR_NOT_FOUND` if the object isn't bound with the key
+ir_status_t sys_port_unbind(ir_handle_t port, ir_handle_t object, unsigned long key);
+
+/// @brief SYSCALL_PORT_WAIT
+/// Read queued packets from a port, waiting for one to be queued if there are none
+/// @param port A handle to the port, with `IR_RIGHT_READ`
+/// @param packets Buffer the packets are written to
+/// @param max_packets Size of `packets`, in packets
+/// @param timeout_microseconds How long to wait for packets. 0 returns immediately, and -1 never times out
+/// @param count_out Set to the number of packets read
+/// @return `IR_OK` on success, or `IR_ERROR_TIMED_OUT` if no packets were queued in time
+ir_status_t sys_port_wait(ir_handle_t port, ir_port_packet_t *packets, size_t max_packets, size_t timeout_microseconds, size_t *count_out);
+
+#endif // KERNEL_PORT_H_
@@ -2,6 +2,13 @@
 #ifndef KERNEL_PROCESS_H_
 #define KERNEL_PROCESS_H_
 
+// This file is included in an assembly file for the offsets below
+
+/// Offset of `kernel_stack_top` in `struct thread`, loaded by `syscall_entry`
+#define THREAD_KERNEL_STACK_TOP_OFFSET 0x58
+
+#ifndef __ASSEMBLER__
+
 #include "iridium/types.h"
 #include "arch/registers.h"
 #include "arch/defines.h"
@@ -10,8 +17,11 @@
 #include "kernel/linked_list.h"
 #include "kernel/object.h"
 #include "kernel/spinlock.h"
+#include "kernel/cpu_locals.h"
+#include "kernel/handle.h"
 
 #include <stdbool.h>
+#include <stddef.h>
 
 enum termination_state {
     /// The process is running as per usual
@@ -43,18 +53,7 @@ struct process {
     size_t exit_code;
 
     /// All open handles available to the process
-    linked_list handle_table;
-    /// New handles can use next_handle_id when free_handle_ids is empty
-    atomic_long next_handle_id;
-    /// The IDs are stored where the data pointer should go
-    /// Utility for quickly determining the next ID to assign a handle.
-    linked_list free_handle_ids;
-    lock_t handle_table_lock;
-
-    // Although the linked list struct has a lock already,
-    // the methods automatically try to obtain it themselves
-    // so its easier to add one we control outside the list.
-    // TODO: Can I write things such that this is unnessecary?
+    struct handle_table handle_table;
 };
 
 /// @brief Thread kernel object
@@ -70,9 +69,8 @@ struct thread {
     size_t exit_code;
 
     struct registers context;
-    /// If the thread is sleeping, this is the time since boot
-    /// in microseconds when it will wake up
-    size_t sleeping_until;
+    /// Armed while the thread is sleeping, and wakes it up
+    struct timer sleep_timer;
     /// Set when the thread is listening for signals in another object.
     struct signal_listener* blocking_listener;
 
@@ -80,8 +78,21 @@ struct thread {
     /// to avoid leaving the kernel in a bad state
     bool in_syscall;
     int thread_id;
+
+    /// Next thread in the run queue this thread is waiting in
+    struct thread *run_queue_next;
+    /// The cpu the thread last ran on, and whose run queue it joins when scheduled
+    int cpu;
+    /// Set while a cpu is using the thread's kernel stack. Another cpu
+    /// has to wait for this to clear before it can run the thread
+    bool volatile on_cpu;
+
+    struct arch_thread_data arch;
 };
 
+_Static_assert(offsetof(struct thread, kernel_stack_top) == THREAD_KERNEL_STACK_TOP_OFFSET,
+    "syscall_entry loads kernel_stack_top from THREAD_KERNEL_STACK_TOP_OFFSET");
+
 /// @see `kernel/channel.h`
 struct channel;
 
@@ -129,4 +140,6 @@ ir_status_t sys_process_exit(long exit_code);
 /// SYSCALL_THREAD_EXIT
 ir_status_t sys_thread_exit(long exit_code);
 
+#endif // ! __ASSEMBLER__
+
 #endif // ! KERNEL_PROCESS_H_
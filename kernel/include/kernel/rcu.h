@@ -0,0 +1,54 @@
+/// @brief Deferred freeing of data that is read without locks
+///
+/// Readers can use data reached through an rcu protected pointer without
+/// taking any lock, until they next pass through the scheduler. The kernel
+/// isn't preempted, so once every cpu has switched threads (or gone idle)
+/// after a pointer was unpublished, nothing can still be using what it
+/// pointed to. Writers unpublish the pointer and then use `rcu_call` to
+/// free the data once that has happened.
+
+#ifndef KERNEL_RCU_H_
+#define KERNEL_RCU_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct rcu_head;
+
+/// @brief Run once a grace period has passed, to free the data containing `head`
+typedef void (*rcu_callback)(struct rcu_head *head);
+
+/// @brief Embedded in data that is freed with `rcu_call`
+struct rcu_head {
+    struct rcu_head *next;
+    rcu_callback callback;
+    /// Every cpu must have passed this generation before the callback can run
+    size_t generation;
+};
+
+/// @brief A cpu's progress through grace periods
+struct rcu_cpu_data {
+    /// The latest generation this cpu has passed through the scheduler in,
+    /// or `SIZE_MAX` while it is idle and can't be holding any references
+    volatile size_t generation;
+    /// Callbacks queued on this cpu, in the order they were queued
+    struct rcu_head *head;
+    struct rcu_head *tail;
+};
+
+/// @brief Run a callback once no cpu can still be using data unpublished before this call
+/// @param head Embedded in the data to free, and valid until the callback runs
+/// @param callback Runs on this cpu from the scheduler, with interrupts disabled
+void rcu_call(struct rcu_head *head, rcu_callback callback);
+
+/// @brief Record that this cpu holds no rcu protected references, and run any callbacks that are ready
+/// @note Called by the scheduler, which is where readers' references end
+void rcu_quiescent_state(void);
+
+/// @brief Record that this cpu is going idle, so other cpus don't have to wait for it
+void rcu_enter_idle(void);
+
+/// @brief Whether this cpu has callbacks waiting for a grace period
+bool rcu_pending(void);
+
+#endif // ! KERNEL_RCU_H_
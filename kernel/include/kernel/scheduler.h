@@ -13,11 +13,16 @@ struct registers;
 ir_status_t sys_yield();
 ir_status_t sys_sleep_microseconds(size_t microseconds);
 
+/// @brief Create the current cpu's idle thread and get it ready to schedule threads
+void scheduler_init_cpu();
+
 void schedule_thread(struct thread *thread);
 void switch_task(bool reschedule);
 
 ir_status_t scheduler_block_listener_and_switch(struct signal_listener *listener);
 void scheduler_unblock_listener(struct signal_listener *listener);
+void scheduler_abort_listener(struct signal_listener *listener);
 void scheduler_sleep_microseconds(struct thread *thread, size_t microseconds);
+void scheduler_set_direct_handoff(bool enabled);
 
 #endif // KERNEL_SCHEDULER_H_
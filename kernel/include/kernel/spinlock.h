@@ -5,8 +5,8 @@
 #ifndef KERNEL_SPINLOCK_H_
 #define KERNEL_SPINLOCK_H_
 
-#include "kernel/cpu_locals.h"
 #include "arch/debug.h"
+#include "kernel/arch/arch.h"
 #include <stdatomic.h>
 #define __need_null
 #include <stddef.h>
@@ -19,10 +19,18 @@ typedef struct lock_t {
     const char *function;
 } lock_t;
 
-#define spinlock_aquire(x) \
-    if ((x).function) debug_printf("Tried getting lock in %s:%d, but it is currently held by %s\n", __FILE__, __LINE__, (x).function); \
-    do { \
-    while (atomic_flag_test_and_set_explicit(&(x).lock, memory_order_acquire)); \
+#ifdef DEBUG
+/// Reports contended locks over the serial output, which is far too slow to do
+/// on every acquire once several cpus share locks
+#define spinlock_report_contention(x) \
+    if ((x).function) debug_printf("Tried getting lock in %s:%d, but it is currently held by %s\n", __FILE__, __LINE__, (x).function)
+#else
+#define spinlock_report_contention(x)
+#endif
+
+#define spinlock_aquire(x) do { \
+    spinlock_report_contention(x); \
+    while (atomic_flag_test_and_set_explicit(&(x).lock, memory_order_acquire)) arch_cpu_relax(); \
     (x).function = __func__; \
     } while (0)
 
@@ -2,6 +2,7 @@
 #define __need_size_t
 #include <stddef.h>
 #include <stdarg.h>
+#include <stdbool.h>
 
 /// @brief Get the length of a null terminated string
 /// @param str A null terminated string
@@ -11,8 +12,19 @@ int strcmp(const char *str1, const char *str2);
 int strncmp(const char *str1, const char *str2, size_t n);
 /// Copy a section of memory from one location to another
 void *memcpy(void* dest, const void* src, size_t size);
+/// Copy a section of memory to a location that may overlap it
+void *memmove(void *dest, const void *src, size_t size);
 /// Fill a region of memory with a specific value
 void *memset(void *ptr, int value, size_t n);
+/// @brief Zero a page without pulling it into the cache
+/// For pages that won't be read again soon, so zeroing them doesn't evict anything that will be
+/// @param page Page aligned address of the page
+void zero_page_nontemporal(void *page);
+
+/// Set during boot if the cpu's string instructions are the fastest way to make long copies (x86_64 ERMS)
+extern bool string_fast_rep;
+/// Set during boot if they are also the fastest way to make short ones (x86_64 FSRM)
+extern bool string_fast_short_rep;
 /// Compare blocks of memory
 /// @return 0 when the blocks of memory are the same
 int memcmp(const void *str1, const void *str2, size_t n);
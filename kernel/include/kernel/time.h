@@ -2,9 +2,25 @@
 #define KERNEL_TIME_H_
 
 #include "iridium/types.h"
+#include "kernel/arch/arch.h"
 #include <stddef.h>
 
-extern size_t volatile microseconds_since_boot;
+/// @brief Microseconds since the kernel's time source was started
+static inline size_t time_microseconds() {
+    return arch_time_microseconds();
+}
+
+/// @brief Find when a wait with a timeout ends
+/// @param timeout_microseconds Length of the wait, or -1 to never time out
+/// @return Time since boot in microseconds to stop waiting at, or `SIZE_MAX` if the wait never ends
+static inline size_t time_deadline_after(size_t timeout_microseconds) {
+    size_t deadline = time_microseconds() + timeout_microseconds;
+    // -1 means never expire, as do deadlines too far away to represent
+    if (timeout_microseconds == -1ul || deadline < timeout_microseconds) {
+        return SIZE_MAX;
+    }
+    return deadline;
+}
 
 ir_status_t sys_time_microseconds(size_t *out);
 
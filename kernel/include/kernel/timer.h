@@ -0,0 +1,68 @@
+/// @brief Kernel timers
+///
+/// A timer runs a callback once after its deadline passes. Armed timers
+/// are kept in a min-heap on the cpu that armed them, so arming and
+/// cancelling are O(log n) and finding the next deadline is O(1).
+
+#ifndef KERNEL_TIMER_H_
+#define KERNEL_TIMER_H_
+
+#include "kernel/spinlock.h"
+#include "iridium/types.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+struct timer;
+
+/// @brief Run on the cpu that armed the timer, with interrupts disabled
+typedef void (*timer_callback)(struct timer *timer);
+
+struct timer {
+    /// Time since boot in microseconds when the callback runs
+    size_t deadline;
+    timer_callback callback;
+    /// Passed along for the callback to use
+    void *data;
+
+    /// Heap the timer is armed in, or NULL while it isn't armed
+    struct timer_heap *volatile heap;
+    /// Position in the heap's array
+    size_t heap_index;
+};
+
+/// @brief A cpu's armed timers, ordered by deadline
+struct timer_heap {
+    struct timer **timers;
+    size_t count;
+    size_t capacity;
+    /// The timer whose callback is currently running, so cancelling can wait for it
+    struct timer *volatile running;
+    /// Deadline the cpu's hardware timer is currently programmed for
+    size_t programmed_deadline;
+    lock_t lock;
+};
+
+/// @brief Arm a timer on the current cpu, replacing any deadline it was armed with
+/// @param timer The timer, which must stay valid until it fires or is cancelled
+/// @param deadline Time since boot in microseconds to run the callback at
+/// @param callback Function to run once the deadline passes
+/// @param data Value for the callback to find in `timer->data`
+/// @return `IR_OK`, or `IR_ERROR_NO_MEMORY` if the heap could not grow
+ir_status_t timer_set(struct timer *timer, size_t deadline, timer_callback callback, void *data);
+
+/// @brief Disarm a timer
+///
+/// If the callback is already running on another cpu this waits for it to finish,
+/// so the timer can be freed once this returns.
+/// @return `true` if the timer was disarmed before its callback ran
+bool timer_cancel(struct timer *timer);
+
+/// @brief Run the callbacks of every timer on this cpu whose deadline has passed
+/// @param now The current time since boot in microseconds
+void timer_run_expired(size_t now);
+
+/// @brief Program this cpu's hardware timer for the earlier of a deadline and its next kernel timer
+/// @param deadline Time since boot in microseconds, or `SIZE_MAX` for none
+void timer_program_cpu(size_t deadline);
+
+#endif // KERNEL_TIMER_H_
@@ -4,33 +4,262 @@
 #include "kernel/channel.h"
 #include "kernel/handle.h"
 #include "kernel/heap.h"
+#include "kernel/memory/physical_map.h"
+#include "kernel/memory/pmm.h"
+#include "kernel/memory/v_addr_region.h"
 #include "kernel/process.h"
+#include "kernel/scheduler.h"
 #include "kernel/spinlock.h"
 #include "kernel/string.h"
-
-/// @brief Dynamically sized container for channel messages.
+#include "kernel/time.h"
+#include "align.h"
+#include <stddef.h>
+
+/// Bytes of a message's slot before its inline data: its lengths and page lists
+#define CHANNEL_MESSAGE_HEADER_SIZE (3 * sizeof(size_t) + 2 * sizeof(physical_page_info*))
+/// Handle pointers and bytes a message can hold in its slot
+#define CHANNEL_INLINE_MESSAGE_SIZE (CHANNEL_MESSAGE_SLOT_SIZE - CHANNEL_MESSAGE_HEADER_SIZE)
+
+/// @brief A queued message
+///
+/// Large page aligned messages have their whole pages moved from the writer, and
+/// those hold the start of the message's bytes. The payload is the message's handle
+/// pointers followed by the rest of its bytes. It is stored in `data` when small
+/// enough, and otherwise in `pages`.
 struct channel_message {
     size_t message_length;
     size_t handle_count;
+    /// List of pages holding the payload, linked through `next`, or NULL if it is inline
+    physical_page_info *pages;
+    /// List of pages taken from the writer's address space, or NULL
+    physical_page_info *moved_pages;
+    size_t moved_page_count;
+    char data[CHANNEL_INLINE_MESSAGE_SIZE];
+};
 
-    /// @brief Block of data containing `hanle_count` handle pointers
-    /// followed by `message_length` bytes of data.
-    char data[];
+_Static_assert(offsetof(struct channel_message, data) == CHANNEL_MESSAGE_HEADER_SIZE,
+    "CHANNEL_MESSAGE_HEADER_SIZE must cover the fields before a message's inline data");
+_Static_assert(sizeof(struct channel_message) == CHANNEL_MESSAGE_SLOT_SIZE,
+    "Queued messages must fill exactly one CHANNEL_MESSAGE_SLOT_SIZE slot");
+
+/// @brief A caller blocked in `SYSCALL_CHANNEL_CALL`, waiting for its reply
+///
+/// Lives on the caller's kernel stack, and is linked into the calling channel's
+/// `calls` until the caller wakes up and takes it back out.
+struct channel_call {
+    struct channel_call *next;
+    ir_txid_t txid;
+    /// Wakes the caller when the reply arrives, the peer closes or the call times out
+    struct signal_listener listener;
+    /// `IR_OK` once `reply` holds the reply, or why the call ended without one
+    ir_status_t status;
+    struct channel_message reply;
 };
 
+struct kmem_cache channel_cache = KMEM_CACHE_INITIALIZER("channel", sizeof(struct channel));
+
+/// Transaction ids picked by the kernel have this bit set, so they can't collide with ids userspace picks
+#define CHANNEL_KERNEL_TXID 0x80000000u
+/// Shared by every channel, so calls made through both ends of a channel never use the same id
+static _Atomic ir_txid_t channel_next_txid;
+
+/// @brief Size of a message's handle pointers and the bytes that weren't moved, together
+static inline size_t channel_message_payload_size(struct channel_message *message) {
+    return message->handle_count * sizeof(struct handle*) + message->message_length - message->moved_page_count * PAGE_SIZE;
+}
+
+/// @brief Copy data into or out of a list of pages
+/// @param offset Byte offset into the pages
+/// @param to_pages Whether `buffer` is copied into the pages, rather than out of them
+static void channel_page_list_copy(physical_page_info *page, size_t offset, void *buffer, size_t length, bool to_pages) {
+    for (size_t i = 0; i < offset / PAGE_SIZE; i++) {
+        page = page->next;
+    }
+    offset %= PAGE_SIZE;
+
+    char *position = buffer;
+    while (length > 0) {
+        size_t chunk = PAGE_SIZE - offset;
+        if (chunk > length) chunk = length;
+
+        char *page_data = (char*)p_addr_to_physical_map(page->address) + offset;
+        if (to_pages) {
+            memcpy(page_data, position, chunk);
+        } else {
+            memcpy(position, page_data, chunk);
+        }
+
+        position += chunk;
+        length -= chunk;
+        offset = 0;
+        page = page->next;
+    }
+}
+
+/// @brief Free the first `count` pages of a list
+static void channel_page_list_free(physical_page_info *page, size_t count) {
+    for (size_t i = 0; i < count && page; i++) {
+        physical_page_info *next = page->next;
+        pmm_free_page(page);
+        page = next;
+    }
+}
+
+/// @brief Copy data into or out of a message's payload
+/// @param offset Byte offset into the payload
+/// @param to_message Whether `buffer` is copied into the payload, rather than out of it
+static void channel_message_copy(struct channel_message *message, size_t offset, void *buffer, size_t length, bool to_message) {
+    if (message->pages) {
+        channel_page_list_copy(message->pages, offset, buffer, length, to_message);
+    } else if (to_message) {
+        memcpy(&message->data[offset], buffer, length);
+    } else {
+        memcpy(buffer, &message->data[offset], length);
+    }
+}
+
+/// @brief Free the pages a message overflowed into or moved from its writer
+/// Does not release the message's handles
+static void channel_message_free_pages(struct channel_message *message) {
+    channel_page_list_free(message->pages, ROUND_UP_PAGE(channel_message_payload_size(message)) / PAGE_SIZE);
+    channel_page_list_free(message->moved_pages, message->moved_page_count);
+    message->pages = NULL;
+    message->moved_pages = NULL;
+}
+
+/// @brief Copy bytes into or out of the start of a message's data, skipping its handles
+/// @param length Number of bytes, which must not be more than the message's length or a page
+static void channel_message_copy_start(struct channel_message *message, void *buffer, size_t length, bool to_message) {
+    if (message->moved_pages) {
+        channel_page_list_copy(message->moved_pages, 0, buffer, length, to_message);
+    } else {
+        channel_message_copy(message, message->handle_count * sizeof(struct handle*), buffer, length, to_message);
+    }
+}
+
+/// @brief Release a message's handles and free its pages, for messages nobody will read
+static void channel_message_release(struct channel_message *message) {
+    for (size_t i = 0; i < message->handle_count; i++) {
+        struct handle *handle;
+        channel_message_copy(message, i * sizeof(struct handle*), &handle, sizeof(struct handle*), false);
+        handle_release(handle);
+    }
+    channel_message_free_pages(message);
+}
+
+/// @brief Build a message, allocating pages for it if it doesn't fit inline
+/// @return `IR_OK` on success, or `IR_ERROR_NO_MEMORY`
+static ir_status_t channel_message_create(struct channel_message *message, char *data, size_t message_length, struct handle **handles, size_t handles_count) {
+    message->message_length = message_length;
+    message->handle_count = handles_count;
+    message->pages = NULL;
+    message->moved_pages = NULL;
+    message->moved_page_count = 0;
+
+    size_t payload_size = channel_message_payload_size(message);
+    if (payload_size > CHANNEL_INLINE_MESSAGE_SIZE) {
+        ir_status_t status = pmm_allocate_pages(ROUND_UP_PAGE(payload_size) / PAGE_SIZE, &message->pages);
+        if (status != IR_OK) return status;
+    }
+
+    channel_message_copy(message, 0, handles, handles_count * sizeof(struct handle*), true);
+    channel_message_copy(message, handles_count * sizeof(struct handle*), data, message_length, true);
+    return IR_OK;
+}
+
+/// @brief Swap pages into part of a process's address space
+/// @param address Page aligned start of the range, which must be inside a single writable mapping of a vm_object
+/// @param count Number of pages to exchange
+/// @param pages List of `count` pages to put in the range. Set to the list of pages taken out of it
+/// @return `IR_OK` on success, or an error if the range can't be exchanged and must be copied instead
+static ir_status_t channel_exchange_user_pages(struct process *process, v_addr_t address, size_t count, physical_page_info **pages) {
+    struct v_addr_region *region;
+    ir_status_t status = v_addr_region_find_mapping(process->root_v_addr_region, address, count * PAGE_SIZE, &region);
+    if (status != IR_OK) return status;
+
+    status = v_addr_region_exchange_pages(region, address, count, pages);
+    object_decrement_references(&region->object);
+    return status;
+}
+
+/// @brief Build a message by moving its whole pages out of the writer's address space
+///
+/// The writer's pages are replaced with zeroed ones, and the rest of the message is copied.
+/// @param data Page aligned message in the writer's address space
+/// @return `IR_OK` on success, or an error if the message must be copied instead
+static ir_status_t channel_message_create_moved(struct channel_message *message, struct process *writer, char *data, size_t message_length, struct handle **handles, size_t handles_count) {
+    size_t count = message_length / PAGE_SIZE;
+
+    physical_page_info *pages;
+    ir_status_t status = pmm_allocate_pages(count, &pages);
+    if (status != IR_OK) return status;
+    physical_page_info *page = pages;
+    for (size_t i = 0; i < count; i++) {
+        // The pages replace the writer's buffer, which it likely won't read again before reusing
+        zero_page_nontemporal((void*)p_addr_to_physical_map(page->address));
+        page = page->next;
+    }
+
+    status = channel_exchange_user_pages(writer, (v_addr_t)data, count, &pages);
+    if (status != IR_OK) {
+        channel_page_list_free(pages, count);
+        return status;
+    }
+
+    status = channel_message_create(message, data + count * PAGE_SIZE, message_length - count * PAGE_SIZE, handles, handles_count);
+    if (status != IR_OK) {
+        // Give the writer its memory back
+        channel_exchange_user_pages(writer, (v_addr_t)data, count, &pages);
+        channel_page_list_free(pages, count);
+        return status;
+    }
+
+    message->message_length = message_length;
+    message->moved_pages = pages;
+    message->moved_page_count = count;
+    return IR_OK;
+}
+
+/// @brief Slot in a channel's ring for the message `index` places after the oldest
+static inline struct channel_message *channel_queue_slot(struct channel *channel, size_t index) {
+    return &channel->queue[(channel->queue_head + index) % channel->queue_depth];
+}
+
+/// @brief Update the signals describing a channel's queue
+/// @note Call with a lock on `channel`
+static void channel_update_queue_signals(struct channel *channel) {
+    ir_signal_t signals = channel->object.signals & ~(CHANNEL_SIGNAL_DATA_WAITING | CHANNEL_SIGNAL_HANDLE_WAITING | CHANNEL_SIGNAL_DATA_QUEUE_FULL);
+    if (channel->queue_count > 0) {
+        signals |= CHANNEL_SIGNAL_DATA_WAITING;
+        if (channel_queue_slot(channel, 0)->handle_count > 0) {
+            signals |= CHANNEL_SIGNAL_HANDLE_WAITING;
+        }
+    }
+    if (channel->queue_count == channel->queue_depth) {
+        signals |= CHANNEL_SIGNAL_DATA_QUEUE_FULL;
+    }
+    if (signals != channel->object.signals) {
+        object_set_signals(&channel->object, signals);
+    }
+}
+
 /// @brief Create a linked pair of channels for IPC
 /// One of the 2 generated channels is intended to be passed to another process.
 /// @param channel_out
 /// @param peer_out
 /// @return `IR_OK` on success or `IR_ERROR_NO_MEMORY`
 ir_status_t channel_create(struct channel **channel_out, struct channel **peer_out) {
-    struct channel *channel = calloc(1, sizeof(struct channel));
-    struct channel *peer = calloc(1, sizeof(struct channel));
+    struct channel *channel = kmem_cache_zalloc(&channel_cache);
+    struct channel *peer = kmem_cache_zalloc(&channel_cache);
+    struct channel_message *channel_queue = malloc(CHANNEL_DEFAULT_QUEUE_DEPTH * sizeof(struct channel_message));
+    struct channel_message *peer_queue = malloc(CHANNEL_DEFAULT_QUEUE_DEPTH * sizeof(struct channel_message));
 
-    if (!channel || !peer) {
+    if (!channel || !peer || !channel_queue || !peer_queue) {
         // Freeing null is a no-op
-        free(channel);
-        free(peer);
+        kmem_cache_free(&channel_cache, channel);
+        kmem_cache_free(&channel_cache, peer);
+        free(channel_queue);
+        free(peer_queue);
         return IR_ERROR_NO_MEMORY;
     }
 
@@ -38,12 +267,77 @@ ir_status_t channel_create(struct channel **channel_out, struct channel **peer_o
     peer->peer = channel;
     channel->object.type = OBJECT_TYPE_CHANNEL;
     peer->object.type = OBJECT_TYPE_CHANNEL;
+    channel->queue = channel_queue;
+    peer->queue = peer_queue;
+    channel->queue_depth = CHANNEL_DEFAULT_QUEUE_DEPTH;
+    peer->queue_depth = CHANNEL_DEFAULT_QUEUE_DEPTH;
 
     *channel_out = channel;
     *peer_out = peer;
     return IR_OK;
 }
 
+/// @brief Free a pair of channels from `channel_create` that were never handed out
+/// Neither channel can have any messages queued yet.
+void channel_destroy_unused(struct channel *channel, struct channel *peer) {
+    free(channel->queue);
+    free(peer->queue);
+    kmem_cache_free(&channel_cache, channel);
+    kmem_cache_free(&channel_cache, peer);
+}
+
+/// @brief Hand a message to the call waiting for it, if it is a reply
+/// @note Call with a lock on `destination`
+/// @return Whether the message was taken by a call
+static bool channel_deliver_reply(struct channel *destination, struct channel_message *message) {
+    if (!destination->calls || message->message_length < sizeof(ir_txid_t)) {
+        return false;
+    }
+
+    ir_txid_t txid;
+    channel_message_copy_start(message, &txid, sizeof(ir_txid_t), false);
+
+    struct channel_call **link = &destination->calls;
+    while (*link && (*link)->txid != txid) {
+        link = &(*link)->next;
+    }
+    struct channel_call *call = *link;
+    if (!call) return false;
+
+    *link = call->next;
+    call->reply = *message;
+    call->status = IR_OK;
+    scheduler_unblock_listener(&call->listener);
+    return true;
+}
+
+/// @brief Add a built message to the end of a channel's queue
+/// Replies to calls waiting on the channel skip the queue and go to their caller.
+/// @return `IR_OK` on success, `IR_ERROR_SHOULD_WAIT` if the queue is full, or
+///         `IR_ERROR_PEER_CLOSED` if the channel is being released
+static ir_status_t channel_enqueue(struct channel *destination, struct channel_message *message) {
+    spinlock_aquire(destination->object.lock);
+    if (destination->closed) {
+        spinlock_release(destination->object.lock);
+        return IR_ERROR_PEER_CLOSED;
+    }
+    if (channel_deliver_reply(destination, message)) {
+        spinlock_release(destination->object.lock);
+        return IR_OK;
+    }
+    if (destination->queue_count == destination->queue_depth) {
+        spinlock_release(destination->object.lock);
+        return IR_ERROR_SHOULD_WAIT;
+    }
+
+    *channel_queue_slot(destination, destination->queue_count) = *message;
+    destination->queue_count++;
+    channel_update_queue_signals(destination);
+
+    spinlock_release(destination->object.lock);
+    return IR_OK;
+}
+
 /// @brief Write a message to a channel
 /// @param destination The channel the sent message is to be read from
 /// @param message Data sent as part of the message
@@ -52,45 +346,60 @@ ir_status_t channel_create(struct channel **channel_out, struct channel **peer_o
 ///                handles' IDs will ignored and reassigned upon reading
 ///                the message
 /// @param handles_count Number of handle pointers in `handles`
-/// @return
+/// @return `IR_OK` on success, in which case the message owns the handles. Otherwise returns
+///         `IR_ERROR_SHOULD_WAIT` if the queue is full, `IR_ERROR_PEER_CLOSED` if `destination`
+///         is being released, or `IR_ERROR_NO_MEMORY`, and the caller keeps the handles
 ir_status_t channel_write(struct channel *destination, char *message, size_t message_length, struct handle **handles, size_t handles_count) {
+    struct channel_message item;
+    ir_status_t status = channel_message_create(&item, message, message_length, handles, handles_count);
+    if (status != IR_OK) return status;
 
-    struct channel_message *item = calloc(1, sizeof(size_t) * 2 + sizeof(uintptr_t) * handles_count + message_length);
-
-    item->message_length = message_length;
-    item->handle_count = handles_count;
-    memcpy(&item->data, handles, handles_count * sizeof(uintptr_t));
-    memcpy((void*)((uintptr_t)&item->data + sizeof(uintptr_t) * handles_count), message, message_length);
-
-    linked_list_add(&destination->message_queue, item);
+    status = channel_enqueue(destination, &item);
+    if (status != IR_OK) {
+        channel_message_free_pages(&item);
+    }
+    return status;
+}
 
-    return IR_OK;
+/// @brief rcu callback freeing a released channel
+static void channel_free(struct rcu_head *rcu) {
+    struct channel *channel = (struct channel*)((uintptr_t)rcu - offsetof(struct channel, rcu));
+    kmem_cache_free(&channel_cache, channel);
 }
 
 /// @brief Channel garbagee collection
 /// The channel's pair will still be able to read queued data,
 /// but attempts to send data or read past the end of the queue will return `IR_ERROR_PEER_CLOSED`
+/// @note Called with a lock on `channel`
 void channel_cleanup(struct channel *channel) {
-    if (channel->peer) {
-        spinlock_aquire(channel->peer->object.lock);
-        object_set_signals(&channel->peer->object, channel->peer->object.signals | CHANNEL_SIGNAL_PEER_DISCONNECTED);
-        spinlock_release(channel->peer->object.lock);
-        channel->peer = NULL;
-    }
-
-    struct channel_message *message;
-    while (linked_list_remove(&channel->message_queue, 0, (void**)&message) == IR_OK) {
-        // Start of data block is an array of handle pointers
-        struct handle **handles = (void*)&message->data;
-        for (uint i = 0; i < message->handle_count; i++) {
-            object_decrement_references(handles[i]->object);
-            free(handles[i]);
+    // Stop the peer writing any more messages. Nothing else can take the lock once it is released
+    channel->closed = true;
+    struct channel *peer = channel->peer;
+    channel->peer = NULL;
+    spinlock_release(channel->object.lock);
+
+    if (peer) {
+        // The peer may be being released too, but isn't freed until this has finished with it
+        spinlock_aquire(peer->object.lock);
+        peer->peer = NULL;
+        object_set_signals(&peer->object, peer->object.signals | CHANNEL_SIGNAL_PEER_DISCONNECTED);
+        // Calls waiting on the peer will never get their replies
+        while (peer->calls) {
+            struct channel_call *call = peer->calls;
+            peer->calls = call->next;
+            call->status = IR_ERROR_PEER_CLOSED;
+            scheduler_unblock_listener(&call->listener);
         }
+        spinlock_release(peer->object.lock);
+    }
 
-        free(message);
+    for (size_t i = 0; i < channel->queue_count; i++) {
+        channel_message_release(channel_queue_slot(channel, i));
     }
+    free(channel->queue);
 
-    free(channel);
+    // The peer may have loaded its pointer to this channel before it was cleared
+    rcu_call(&channel->rcu, channel_free);
 }
 
 /// @brief SYSCALL_CHANNEL_CREATE
@@ -107,11 +416,11 @@ ir_status_t sys_channel_create(ir_handle_t *channel_out, ir_handle_t *peer_out)
     struct process *process = (struct process*)this_cpu->current_thread->object.parent;
 
     struct handle *channel_handle, *peer_handle;
-    handle_create(process, &channel->object, IR_RIGHT_ALL, &channel_handle);
-    handle_create(process, &peer->object, IR_RIGHT_ALL, &peer_handle);
+    handle_create(&channel->object, IR_RIGHT_ALL, &channel_handle);
+    handle_create(&peer->object, IR_RIGHT_ALL, &peer_handle);
 
-    linked_list_add(&process->handle_table, channel_handle);
-    linked_list_add(&process->handle_table, peer_handle);
+    handle_table_add(&process->handle_table, channel_handle);
+    handle_table_add(&process->handle_table, peer_handle);
 
     *channel_out = channel_handle->handle_id;
     *peer_out = peer_handle->handle_id;
@@ -119,6 +428,43 @@ ir_status_t sys_channel_create(ir_handle_t *channel_out, ir_handle_t *peer_out)
     return IR_OK;
 }
 
+/// @brief Copy a message taken from a channel into a process, and give it the message's handles
+/// @param buffer The process's buffer, already checked to be large enough for the handle ids and bytes
+static void channel_message_receive(struct process *process, struct channel_message *message, char *buffer) {
+    // Copy just the byte data portion of the message
+    // The handles are stored as kernel pointers and must be transfered first
+    char *data = &buffer[sizeof(ir_handle_t) * message->handle_count];
+    size_t moved_length = message->moved_page_count * PAGE_SIZE;
+    if (message->moved_pages) {
+        // Moved pages go straight into the reader's address space if they line up with its buffer
+        // and it's writable.
+        // The pages they replace are freed along with the message
+        if ((uintptr_t)data % PAGE_SIZE != 0
+                || channel_exchange_user_pages(process, (v_addr_t)data, message->moved_page_count, &message->moved_pages) != IR_OK) {
+            channel_page_list_copy(message->moved_pages, 0, data, moved_length, false);
+        }
+    }
+    size_t handles_size = message->handle_count * sizeof(struct handle*);
+    channel_message_copy(message, handles_size, data + moved_length, message->message_length - moved_length, false);
+
+    // Handles being transfered to the process need new IDs valid in this context
+    spinlock_aquire(process->handle_table.lock);
+    for (uint i = 0; i < message->handle_count; i++) {
+        struct handle *handle;
+        channel_message_copy(message, i * sizeof(struct handle*), &handle, sizeof(struct handle*), false);
+        if (handle_table_add_locked(&process->handle_table, handle) != IR_OK) {
+            // The process is out of handle ids, so it loses this one
+            handle_release(handle);
+            ((ir_handle_t*)buffer)[i] = IR_HANDLE_INVALID;
+            continue;
+        }
+        ((ir_handle_t*)buffer)[i] = handle->handle_id;
+    }
+    spinlock_release(process->handle_table.lock);
+
+    channel_message_free_pages(message);
+}
+
 /// @brief SYSCALL_CHANNEL_READ
 /// NOTE: I'm not satisfied with how this uses a single buffer for both handles and the message,
 ///       but I ran out of argument registers and this method saves validating another pointer.
@@ -136,114 +482,331 @@ ir_status_t sys_channel_read(ir_handle_t channel, char *buffer, size_t buffer_le
     }
 
     struct process *process = (struct process*)this_cpu->current_thread->object.parent;
-    spinlock_aquire(process->handle_table_lock);
 
-    struct handle *channel_handle;
-    ir_status_t status = linked_list_find(&process->handle_table, (void*)channel, handle_by_id, NULL, (void**)&channel_handle);
-    if (status != IR_OK) {
-        spinlock_release(process->handle_table_lock);
+    struct handle *channel_handle = handle_table_get(&process->handle_table, channel);
+    if (!channel_handle) {
         return IR_ERROR_BAD_HANDLE;
     }
     if (channel_handle->object->type != OBJECT_TYPE_CHANNEL) {
-        spinlock_release(process->handle_table_lock);
         return IR_ERROR_WRONG_TYPE;
     }
 
     struct channel *channel_object = (struct channel*)channel_handle->object;
-    spinlock_aquire(channel_handle->object->lock);
-    spinlock_release(process->handle_table_lock);
+    spinlock_aquire(channel_object->object.lock);
 
-    struct channel_message *message;
-    if (linked_list_get(&channel_object->message_queue, 0, (void**)&message) != IR_OK) {
-        spinlock_release(channel_handle->object->lock);
-        spinlock_release(process->handle_table_lock);
+    if (channel_object->queue_count == 0) {
+        spinlock_release(channel_object->object.lock);
         return IR_ERROR_NOT_FOUND;
     }
 
-    if (message->message_length + message->handle_count * sizeof(ir_handle_t) > buffer_length) {
-        spinlock_release(channel_handle->object->lock);
-        spinlock_release(process->handle_table_lock);
+    struct channel_message message = *channel_queue_slot(channel_object, 0);
+    if (message.message_length + message.handle_count * sizeof(ir_handle_t) > buffer_length) {
+        spinlock_release(channel_object->object.lock);
+        *handles_count = message.handle_count;
+        *message_length = message.message_length;
         return IR_ERROR_BUFFER_TOO_SMALL;
     }
 
-    linked_list_remove(&channel_object->message_queue, 0, NULL);
+    // The message is ours now, so the rest can be done without holding up writers
+    channel_object->queue_head = (channel_object->queue_head + 1) % channel_object->queue_depth;
+    channel_object->queue_count--;
+    channel_update_queue_signals(channel_object);
+    spinlock_release(channel_object->object.lock);
 
-    // Copy just the byte data portion of the message
-    // The handles are stored as kernel pointers and must be transfered first
-    memcpy(&buffer[sizeof(ir_handle_t) * message->handle_count], &message->data[sizeof(ir_handle_t) * message->handle_count], message->message_length);
+    channel_message_receive(process, &message, buffer);
 
-    // Handles being transfered to the process need new IDs valid in this context
-    for (uint i = 0; i < message->handle_count; i++) {
-        // TODO: Does this work as intended
-        struct handle *handle = *(struct handle**)&message->data[sizeof(uintptr_t) * i];
-        handle->handle_id = handle_get_next_id(process);
-        linked_list_add(&process->handle_table, handle);
-        ((ir_handle_t*)buffer)[i] = handle->handle_id;
+    *handles_count = message.handle_count;
+    *message_length = message.message_length;
+    return IR_OK;
+}
+
+/// @brief Write a message from a process's memory, transferring its handles out of the process
+/// @param peer The channel the message is queued in
+/// @param handles Ids of the handles to transfer, which must have `IR_RIGHT_TRANSFER`
+/// @param txid If not NULL, the transaction id written over the start of the message
+/// @param move Whether the message's whole pages can be moved out of the process instead of copied,
+///             leaving them zeroed
+/// @return `IR_OK` on success, or an error code in which case the process keeps its handles
+static ir_status_t channel_write_user(struct process *process, struct channel *peer, char *message, size_t message_length, ir_handle_t *handles, size_t handles_count, ir_txid_t *txid, bool move) {
+    struct handle *handle_pointers[CHANNEL_MAX_MESSAGE_HANDLES];
+
+    // The table lock keeps the transferred handles from being closed between checking and removing them
+    spinlock_aquire(process->handle_table.lock);
+
+    // Verify all the handles exist and can be transfered
+    for (uint i = 0; i < handles_count; i++) {
+        handle_pointers[i] = handle_table_get(&process->handle_table, handles[i]);
+        if (!handle_pointers[i]) {
+            spinlock_release(process->handle_table.lock);
+            return IR_ERROR_BAD_HANDLE;
+        }
+        if (~handle_pointers[i]->rights & IR_RIGHT_TRANSFER) {
+            spinlock_release(process->handle_table.lock);
+            return IR_ERROR_ACCESS_DENIED;
+        }
+        // A handle can only be transferred once
+        for (uint j = 0; j < i; j++) {
+            if (handle_pointers[j] == handle_pointers[i]) {
+                spinlock_release(process->handle_table.lock);
+                return IR_ERROR_INVALID_ARGUMENTS;
+            }
+        }
     }
 
-    *handles_count = message->handle_count;
-    *message_length = message->message_length;
+    // Remove the handles from the caller before the message is built, so the table isn't locked
+    // while it is copied. The handles will continue to keep their referred objects alive.
+    for (uint i = 0; i < handles_count; i++) {
+        handle_table_remove_locked(&process->handle_table, handles[i], &handle_pointers[i]);
+    }
+    spinlock_release(process->handle_table.lock);
+
+    struct channel_message item;
+    ir_status_t status = IR_ERROR_UNSUPPORTED;
+    bool moved = move && message_length >= CHANNEL_ZERO_COPY_THRESHOLD && (uintptr_t)message % PAGE_SIZE == 0;
+    if (moved) {
+        status = channel_message_create_moved(&item, process, message, message_length, handle_pointers, handles_count);
+        // Buffers that aren't in a single unshared writable mapping are copied instead
+        moved = status == IR_OK;
+    }
+    if (!moved) {
+        status = channel_message_create(&item, message, message_length, handle_pointers, handles_count);
+    }
 
-    spinlock_release(channel_handle->object->lock);
-    return IR_OK;
+    if (status == IR_OK) {
+        if (txid) {
+            channel_message_copy_start(&item, txid, sizeof(ir_txid_t), true);
+        }
+        status = channel_enqueue(peer, &item);
+        if (status != IR_OK) {
+            if (moved) {
+                // Give the writer its memory back
+                channel_exchange_user_pages(process, (v_addr_t)message, item.moved_page_count, &item.moved_pages);
+            }
+            channel_message_free_pages(&item);
+        }
+    }
+
+    if (status != IR_OK) {
+        // Give the caller its handles back
+        spinlock_aquire(process->handle_table.lock);
+        for (uint i = 0; i < handles_count; i++) {
+            if (handle_table_restore_locked(&process->handle_table, handle_pointers[i]) != IR_OK) {
+                // The process is out of handle ids, so it loses this one
+                handle_release(handle_pointers[i]);
+            }
+        }
+        spinlock_release(process->handle_table.lock);
+    }
+
+    return status;
+}
+
+/// @brief Write a message from the current process to the channel one of its handles refers to
+/// @param move Whether the message's whole pages can be moved instead of copied
+static ir_status_t channel_write_from_handle(ir_handle_t channel, char *message, size_t message_length, ir_handle_t **handles, size_t handles_count, bool move) {
+    if (!arch_validate_user_pointer(message) || !arch_validate_user_pointer(handles)) {
+        return IR_ERROR_INVALID_ARGUMENTS;
+    }
+    if (message_length > CHANNEL_MAX_MESSAGE_LENGTH || handles_count > CHANNEL_MAX_MESSAGE_HANDLES) {
+        return IR_ERROR_INVALID_ARGUMENTS;
+    }
+
+    struct process *process = (struct process*)this_cpu->current_thread->object.parent;
+
+    struct handle *channel_handle = handle_table_get(&process->handle_table, channel);
+    if (!channel_handle) {
+        return IR_ERROR_BAD_HANDLE;
+    }
+    if (channel_handle->object->type != OBJECT_TYPE_CHANNEL) {
+        return IR_ERROR_WRONG_TYPE;
+    }
+
+    // Messages are queued in the other end of the channel, which may be released at any time
+    struct channel *peer = ((struct channel*)channel_handle->object)->peer;
+    if (!peer) {
+        return IR_ERROR_PEER_CLOSED;
+    }
+
+    return channel_write_user(process, peer, message, message_length, (ir_handle_t*)handles, handles_count, NULL, move);
 }
 
 /// @brief SYSCALL_CHANNEL_WRITE
+/// Copies the message, leaving the caller's buffer untouched.
 /// Handles must have `IR_RIGHT_TRANSFER` and are removed from the process's handle table.
 ir_status_t sys_channel_write(ir_handle_t channel, char *message, size_t message_length, ir_handle_t **handles, size_t handles_count) {
-    if (!arch_validate_user_pointer(message) || !arch_validate_user_pointer(handles)) {
+    return channel_write_from_handle(channel, message, message_length, handles, handles_count, false);
+}
+
+/// @brief SYSCALL_CHANNEL_WRITE_MOVE
+/// Like `SYSCALL_CHANNEL_WRITE`, but if the message is page aligned and at least
+/// `CHANNEL_ZERO_COPY_THRESHOLD` bytes its whole pages are moved to the reader instead of copied.
+/// Once the write succeeds the moved part of the caller's buffer reads as zeroes.
+/// Messages that can't be moved are copied as usual.
+/// Handles must have `IR_RIGHT_TRANSFER` and are removed from the process's handle table.
+ir_status_t sys_channel_write_move(ir_handle_t channel, char *message, size_t message_length, ir_handle_t **handles, size_t handles_count) {
+    return channel_write_from_handle(channel, message, message_length, handles, handles_count, true);
+}
+
+/// @brief SYSCALL_CHANNEL_SET_QUEUE_DEPTH
+/// Change how many messages can be queued for a channel to read
+/// @param channel A handle to the channel whose queue is resized
+/// @param queue_depth Number of messages, from 1 to `CHANNEL_MAX_QUEUE_DEPTH`
+/// @return `IR_OK` on success, or `IR_ERROR_BAD_STATE` if more messages than that are already queued
+ir_status_t sys_channel_set_queue_depth(ir_handle_t channel, size_t queue_depth) {
+    if (queue_depth == 0 || queue_depth > CHANNEL_MAX_QUEUE_DEPTH) {
         return IR_ERROR_INVALID_ARGUMENTS;
     }
 
     struct process *process = (struct process*)this_cpu->current_thread->object.parent;
-    spinlock_aquire(process->handle_table_lock);
 
-    struct handle *channel_handle;
-    ir_status_t status = linked_list_find(&process->handle_table, (void*)channel, handle_by_id, NULL, (void**)&channel_handle);
-    if (status != IR_OK) {
-        spinlock_release(process->handle_table_lock);
+    struct handle *channel_handle = handle_table_get(&process->handle_table, channel);
+    if (!channel_handle) {
         return IR_ERROR_BAD_HANDLE;
     }
     if (channel_handle->object->type != OBJECT_TYPE_CHANNEL) {
-        spinlock_release(process->handle_table_lock);
         return IR_ERROR_WRONG_TYPE;
     }
+    if (~channel_handle->rights & IR_RIGHT_WRITE) {
+        return IR_ERROR_ACCESS_DENIED;
+    }
 
-    spinlock_aquire(channel_handle->object->lock);
+    struct channel_message *queue = malloc(queue_depth * sizeof(struct channel_message));
+    if (!queue) return IR_ERROR_NO_MEMORY;
 
-    // `channel_write` will copy the pointers internally.
-    // The already allocated handles will be assigned new ids in the destination process
-    struct handle **handle_pointers = malloc(handles_count * sizeof(uintptr_t));
+    struct channel *channel_object = (struct channel*)channel_handle->object;
+    spinlock_aquire(channel_object->object.lock);
+    if (channel_object->queue_count > queue_depth) {
+        spinlock_release(channel_object->object.lock);
+        free(queue);
+        return IR_ERROR_BAD_STATE;
+    }
 
-    // Verify all the handles exist and can be transfered
-    for (uint i = 0; i < handles_count; i++) {
-        ir_status_t status = linked_list_find(&process->handle_table, handles[i], handle_by_id, NULL, (void**)&handle_pointers[i]);
-        if (status != IR_OK) {
-            spinlock_release(channel_handle->object->lock);
-            spinlock_release(process->handle_table_lock);
-            free(handle_pointers);
-            return status;
-        }
-        if (~handle_pointers[i]->rights & IR_RIGHT_TRANSFER) {
-            spinlock_release(channel_handle->object->lock);
-            spinlock_release(process->handle_table_lock);
-            free(handle_pointers);
-            return IR_ERROR_ACCESS_DENIED;
-        }
+    // Queued messages keep their order, starting from the beginning of the new ring
+    for (size_t i = 0; i < channel_object->queue_count; i++) {
+        queue[i] = *channel_queue_slot(channel_object, i);
+    }
+    struct channel_message *old_queue = channel_object->queue;
+    channel_object->queue = queue;
+    channel_object->queue_depth = queue_depth;
+    channel_object->queue_head = 0;
+    channel_update_queue_signals(channel_object);
+    spinlock_release(channel_object->object.lock);
+
+    free(old_queue);
+    return IR_OK;
+}
+
+/// @brief Timer callback for calls that reach their deadline without a reply
+static void channel_call_timed_out(struct timer *timer) {
+    scheduler_abort_listener(timer->data);
+}
+
+/// @brief SYSCALL_CHANNEL_CALL
+/// Write a request to a channel, then wait for the reply carrying the request's transaction id
+/// and read it into the caller's buffer
+///
+/// Saves a request/response round trip two kernel entries over writing, waiting and reading
+/// separately. If the request wakes a thread waiting on the other end of the channel, that
+/// thread is given this cpu right away instead of waiting for a turn.
+/// @param channel A handle to the channel the request is written to and the reply read from
+/// @param args The request, and the buffer for the reply. The request's first bytes are
+///             replaced with the transaction id the kernel picks
+/// @param timeout_microseconds How long to wait for the reply, or -1 to never time out
+/// @param handles_count Output parameter containing the number of handles in the reply
+/// @param message_length Output parameter containing the length of the reply
+/// @return `IR_OK` on success, `IR_ERROR_TIMED_OUT` if no reply arrived in time, or an error code.
+///         `handles_count` and `message_length` are still written in the event of an
+///         `IR_ERROR_BUFFER_TOO_SMALL` error, though the reply is lost
+ir_status_t sys_channel_call(ir_handle_t channel, ir_channel_call_args_t *args, size_t timeout_microseconds, size_t *handles_count, size_t *message_length) {
+    if (!arch_validate_user_pointer(args) || !arch_validate_user_pointer(handles_count) || !arch_validate_user_pointer(message_length)) {
+        return IR_ERROR_INVALID_ARGUMENTS;
     }
 
-    // Remove the handles from the caller
-    // The handles will continue to keep their referred objects alive.
-    for (uint i = 0; i < handles_count; i++) {
-        linked_list_find_and_remove(&process->handle_table, handle_pointers[i], NULL, NULL);
-        linked_list_add(&process->free_handle_ids, (void*)handle_pointers[i]->handle_id);
+    // Copied so the checked values can't be changed by another thread
+    ir_channel_call_args_t call_args = *args;
+    char *write_data = (char*)call_args.write_data;
+    if (!arch_validate_user_pointer(write_data) || !arch_validate_user_pointer(call_args.write_handles)
+            || !arch_validate_user_pointer(call_args.read_buffer)) {
+        return IR_ERROR_INVALID_ARGUMENTS;
+    }
+    if (call_args.write_length < sizeof(ir_txid_t) || call_args.write_length > CHANNEL_MAX_MESSAGE_LENGTH
+            || call_args.write_handles_count > CHANNEL_MAX_MESSAGE_HANDLES) {
+        return IR_ERROR_INVALID_ARGUMENTS;
+    }
+
+    struct process *process = (struct process*)this_cpu->current_thread->object.parent;
+
+    struct handle *channel_handle = handle_table_get(&process->handle_table, channel);
+    if (!channel_handle) {
+        return IR_ERROR_BAD_HANDLE;
+    }
+    if (channel_handle->object->type != OBJECT_TYPE_CHANNEL) {
+        return IR_ERROR_WRONG_TYPE;
+    }
+    struct channel *channel_object = (struct channel*)channel_handle->object;
+
+    struct channel_call call = {0};
+    call.txid = CHANNEL_KERNEL_TXID | atomic_fetch_add(&channel_next_txid, 1);
+    call.status = IR_ERROR_TIMED_OUT;
+    call.listener.thread = this_cpu->current_thread;
+    call.listener.target = &channel_object->object;
+
+    size_t deadline = time_deadline_after(timeout_microseconds);
+    if (deadline != SIZE_MAX) {
+        // Timers only fire when this cpu switches threads, which can't happen before the call blocks
+        ir_status_t status = timer_set(&call.listener.timeout, deadline, channel_call_timed_out, &call.listener);
+        if (status != IR_OK) return status;
+    }
+
+    // The call is waiting before the request is sent, since the reply can come from another cpu at any time
+    spinlock_aquire(channel_object->object.lock);
+    struct channel *peer = channel_object->peer;
+    if (!peer) {
+        spinlock_release(channel_object->object.lock);
+        timer_cancel(&call.listener.timeout);
+        return IR_ERROR_PEER_CLOSED;
+    }
+    call.next = channel_object->calls;
+    channel_object->calls = &call;
+    // Keep the channel alive while blocked, even if another thread closes the handle
+    channel_object->object.references++;
+    spinlock_release(channel_object->object.lock);
+
+    scheduler_set_direct_handoff(true);
+    ir_status_t status = channel_write_user(process, peer, write_data, call_args.write_length, call_args.write_handles, call_args.write_handles_count, &call.txid, false);
+    scheduler_set_direct_handoff(false);
+
+    if (status == IR_OK) {
+        // Not reached again until the reply arrives, the peer closes or the deadline is reached
+        scheduler_block_listener_and_switch(&call.listener);
+        this_cpu->current_thread->blocking_listener = NULL;
+    }
+
+    // The call is still waiting if the write failed or the wait ended without a reply
+    spinlock_aquire(channel_object->object.lock);
+    struct channel_call **link = &channel_object->calls;
+    while (*link && *link != &call) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = call.next;
     }
+    spinlock_release(channel_object->object.lock);
+
+    // The listener is on this stack, so wait for its timeout to be finished with it
+    timer_cancel(&call.listener.timeout);
+    object_decrement_references(&channel_object->object);
 
-    channel_write((struct channel*)channel_handle->object, message, message_length, handle_pointers, handles_count);
+    if (status != IR_OK) return status;
+    if (call.status != IR_OK) return call.status;
 
-    spinlock_release(channel_handle->object->lock);
-    spinlock_release(process->handle_table_lock);
-    free(handle_pointers);
+    *handles_count = call.reply.handle_count;
+    *message_length = call.reply.message_length;
+    if (call.reply.message_length + call.reply.handle_count * sizeof(ir_handle_t) > call_args.read_buffer_length) {
+        channel_message_release(&call.reply);
+        return IR_ERROR_BUFFER_TOO_SMALL;
+    }
 
+    channel_message_receive(process, &call.reply, call_args.read_buffer);
     return IR_OK;
 }
@@ -55,14 +55,14 @@ int max_y;
 /// @param bits_per_pixel
 void init_framebuffer(p_addr_t location, int width, int height, int pitch, int bits_per_pixel) {
     debug_printf("Allocating framebuffer\n");
-    ir_status_t status = vm_object_create_physical(location, pitch * height, VM_MMIO_FLAGS, &framebuffer_vm_object);
+    ir_status_t status = vm_object_create_physical(location, pitch * height, VM_FRAMEBUFFER_FLAGS, &framebuffer_vm_object);
     if (status != IR_OK) {
         debug_printf("Framebuffer reserving returned error %#d\n", status);
         return;
     }
 
     // Map into kernel space so we can render panics and display debugging information
-    status = v_addr_region_map_vm_object(kernel_region, V_ADDR_REGION_READABLE | V_ADDR_REGION_WRITABLE | V_ADDR_REGION_DISABLE_CACHE, framebuffer_vm_object, NULL, 0, &framebuffer);
+    status = v_addr_region_map_vm_object(kernel_region, V_ADDR_REGION_READABLE | V_ADDR_REGION_WRITABLE | V_ADDR_REGION_WRITE_COMBINE, framebuffer_vm_object, NULL, 0, &framebuffer);
     if (status != IR_OK) {
         debug_printf("Framebuffer mapping error %#d\n", status);
     }
@@ -226,10 +226,14 @@ ir_status_t sys_framebuffer_get(ir_handle_t *framebuffer, int *width, int *heigh
     if (!framebuffer_vm_object) return IR_ERROR_NOT_FOUND;
 
     struct process *process = (struct process*)this_cpu->current_thread->object.parent;
-    // Does not need to obtain handle table lock, because this does not access existing handles or remove any
     struct handle *handle;
-    handle_create(process, (object*)framebuffer_vm_object, IR_RIGHT_MAP | IR_RIGHT_WRITE | IR_RIGHT_READ, &handle);
-    linked_list_add(&process->handle_table, handle);
+    ir_status_t status = handle_create((object*)framebuffer_vm_object, IR_RIGHT_MAP | IR_RIGHT_WRITE | IR_RIGHT_READ, &handle);
+    if (status != IR_OK) return status;
+    status = handle_table_add(&process->handle_table, handle);
+    if (status != IR_OK) {
+        handle_release(handle);
+        return status;
+    }
 
     *framebuffer = handle->handle_id;
     *width = fb_width;
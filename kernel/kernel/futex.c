@@ -0,0 +1,188 @@
+/// @file kernel/futex.c
+/// @brief Wait queues keyed on user memory, for building locks in userspace
+///
+/// Userspace locks only enter the kernel when they are contended. A waiting thread
+/// checks the futex still holds the value it expects while holding its bucket's lock,
+/// and a waking thread changes the value before taking the same lock, so a wake can't
+/// be missed between the check and the thread blocking.
+
+#include "kernel/futex.h"
+#include "kernel/arch/arch.h"
+#include "kernel/memory/v_addr_region.h"
+#include "kernel/process.h"
+#include "kernel/scheduler.h"
+#include "kernel/time.h"
+#include "iridium/errors.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+
+static struct futex_bucket futex_buckets[FUTEX_HASH_BUCKETS];
+
+/// @brief Find the wait queue for a futex
+static struct futex_bucket *futex_bucket_of(vm_object *vm, size_t offset) {
+    uint64_t hash = ((uintptr_t)vm >> 4) ^ (offset / sizeof(uint32_t));
+    hash *= 0x9e3779b97f4a7c15ull;
+    return &futex_buckets[(hash >> 32) % FUTEX_HASH_BUCKETS];
+}
+
+/// @brief Find the vm_object and offset identifying a futex in the current process
+/// @param vm_out Set to the vm_object, which is given a reference the caller must drop
+/// @return `IR_OK` on success, or `IR_ERROR_INVALID_ARGUMENTS` if the address isn't in mapped memory
+static ir_status_t futex_key(uint32_t *address, vm_object **vm_out, size_t *offset_out) {
+    if (!arch_validate_user_pointer(address) || (uintptr_t)address % sizeof(uint32_t) != 0) {
+        return IR_ERROR_INVALID_ARGUMENTS;
+    }
+
+    struct process *process = (struct process*)this_cpu->current_thread->object.parent;
+    struct v_addr_region *region;
+    if (v_addr_region_find_mapping(process->root_v_addr_region, (v_addr_t)address, sizeof(uint32_t), &region) != IR_OK) {
+        return IR_ERROR_INVALID_ARGUMENTS;
+    }
+
+    // Destroying the region drops its reference to the vm_object only after unmapping it with
+    // the vm_object locked, so while locked and not destroyed the region still holds a reference
+    vm_object *vm = region->vm_object;
+    spinlock_aquire(vm->object.lock);
+    bool mapped = !region->destroyed;
+    if (mapped) {
+        atomic_fetch_add(&vm->object.references, 1);
+    }
+    spinlock_release(vm->object.lock);
+    *offset_out = (v_addr_t)address - region->base;
+    object_decrement_references(&region->object);
+    if (!mapped) {
+        return IR_ERROR_INVALID_ARGUMENTS;
+    }
+
+    *vm_out = vm;
+    return IR_OK;
+}
+
+/// @brief Take a waiter out of its bucket's queue
+/// @note Call with a lock on `bucket`
+static void futex_dequeue(struct futex_bucket *bucket, struct futex_waiter *waiter) {
+    if (waiter->prev) {
+        waiter->prev->next = waiter->next;
+    } else {
+        bucket->head = waiter->next;
+    }
+    if (waiter->next) {
+        waiter->next->prev = waiter->prev;
+    } else {
+        bucket->tail = waiter->prev;
+    }
+    waiter->prev = NULL;
+    waiter->next = NULL;
+    waiter->queued = false;
+}
+
+/// @brief Timer callback for futex waits that reach their deadline
+static void futex_wait_timed_out(struct timer *timer) {
+    scheduler_abort_listener(timer->data);
+}
+
+/// @brief SYSCALL_FUTEX_WAIT
+/// Block until the futex is woken, if it still holds the expected value
+/// @param address 4 byte aligned address of the futex, in memory mapped from a vm_object
+/// @param expected Value the futex must have for the thread to block
+/// @param timeout_microseconds How long to wait, or -1 to never time out
+/// @return `IR_OK` once woken, `IR_ERROR_BAD_STATE` if the futex didn't hold `expected`,
+///         or `IR_ERROR_TIMED_OUT`
+ir_status_t sys_futex_wait(uint32_t *address, uint32_t expected, size_t timeout_microseconds) {
+    struct futex_waiter waiter = {0};
+    ir_status_t status = futex_key(address, &waiter.vm, &waiter.offset);
+    if (status != IR_OK) return status;
+
+    waiter.status = IR_ERROR_TIMED_OUT;
+    waiter.listener.thread = this_cpu->current_thread;
+    // Never attached, but aborting the wait takes the target's lock
+    waiter.listener.target = &waiter.vm->object;
+
+    size_t deadline = time_deadline_after(timeout_microseconds);
+    if (deadline != SIZE_MAX) {
+        // Timers only fire when this cpu switches threads, which can't happen before the wait blocks
+        status = timer_set(&waiter.listener.timeout, deadline, futex_wait_timed_out, &waiter.listener);
+        if (status != IR_OK) {
+            object_decrement_references(&waiter.vm->object);
+            return status;
+        }
+    }
+
+    struct futex_bucket *bucket = futex_bucket_of(waiter.vm, waiter.offset);
+    spinlock_aquire(bucket->lock);
+
+    if (*(volatile uint32_t*)address != expected) {
+        spinlock_release(bucket->lock);
+        timer_cancel(&waiter.listener.timeout);
+        object_decrement_references(&waiter.vm->object);
+        return IR_ERROR_BAD_STATE;
+    }
+
+    waiter.prev = bucket->tail;
+    if (bucket->tail) {
+        bucket->tail->next = &waiter;
+    } else {
+        bucket->head = &waiter;
+    }
+    bucket->tail = &waiter;
+    waiter.queued = true;
+    spinlock_release(bucket->lock);
+
+    // Not reached again until the futex is woken or the deadline is reached
+    scheduler_block_listener_and_switch(&waiter.listener);
+    this_cpu->current_thread->blocking_listener = NULL;
+
+    spinlock_aquire(bucket->lock);
+    if (waiter.queued) {
+        futex_dequeue(bucket, &waiter);
+    }
+    status = waiter.status;
+    spinlock_release(bucket->lock);
+
+    // The listener is on this stack, so wait for its timeout to be finished with it
+    timer_cancel(&waiter.listener.timeout);
+    object_decrement_references(&waiter.vm->object);
+    return status;
+}
+
+/// @brief SYSCALL_FUTEX_WAKE
+/// Wake threads waiting on a futex, in the order they started waiting
+/// @param address Address of the futex
+/// @param count Most threads to wake
+/// @param woken_out If not NULL, set to the number of threads woken
+/// @return `IR_OK` on success
+ir_status_t sys_futex_wake(uint32_t *address, size_t count, size_t *woken_out) {
+    if (woken_out && !arch_validate_user_pointer(woken_out)) {
+        return IR_ERROR_INVALID_ARGUMENTS;
+    }
+
+    vm_object *vm;
+    size_t offset;
+    ir_status_t status = futex_key(address, &vm, &offset);
+    if (status != IR_OK) return status;
+
+    struct futex_bucket *bucket = futex_bucket_of(vm, offset);
+    size_t woken = 0;
+
+    spinlock_aquire(bucket->lock);
+    struct futex_waiter *waiter = bucket->head;
+    while (waiter && woken < count) {
+        struct futex_waiter *next = waiter->next;
+        if (waiter->vm == vm && waiter->offset == offset) {
+            futex_dequeue(bucket, waiter);
+            // Counts as woken even if its timeout is racing to wake it, so the wake isn't lost
+            waiter->status = IR_OK;
+            scheduler_unblock_listener(&waiter->listener);
+            woken++;
+        }
+        waiter = next;
+    }
+    spinlock_release(bucket->lock);
+
+    object_decrement_references(&vm->object);
+
+    if (woken_out) {
+        *woken_out = woken;
+    }
+    return IR_OK;
+}
@@ -8,9 +8,14 @@
 #include "iridium/errors.h"
 #include "kernel/object.h"
 #include "kernel/process.h"
+#include "kernel/string.h"
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include "arch/debug.h"
 
+struct kmem_cache handle_cache = KMEM_CACHE_INITIALIZER("handle", sizeof(struct handle));
+
 /// @brief Check that a set of rights does not have any permission another set does not
 /// @param rights Rights compared against
 /// @param requested Rights that should be equal or lesser
@@ -20,71 +25,208 @@ static inline bool handle_rights_are_subset(ir_rights_t rights, ir_rights_t requ
     return (rights | requested) == rights;
 }
 
-/// @brief `linked_list` search/compare to function for handle lists
-/// @param data Handle ID from a node in the list
-/// @param target Target handle ID as a long
-/// @return 0 if the IDs match, a negative value if data is lower, or positive if data is higher
-int handle_by_id(void *data, void *target) {
-    return ((struct handle*)data)->handle_id - (long)target;
-}
-
-/// @brief Determine and claim the next valid handle ID
-/// @param process Owner of the handle the id will be given to
-/// @return A valid handle id for the process
-ir_handle_t handle_get_next_id(struct process *process) {
-    ir_handle_t new_id = IR_HANDLE_INVALID;
-    ir_status_t result = linked_list_remove(&process->free_handle_ids, 0, (void**)&new_id);
-    if (result != IR_OK) {
-        atomic_fetch_add(&process->next_handle_id, 1);
-        new_id = process->next_handle_id;
-    }
-
-    return (ir_handle_t)new_id;
-}
-
-/// @brief Create a handle for a kernel object for a given process.
-/// NOTE: Does not add to the handle table. The caller must do that after calling.
-/// @param process Used to determine the next handle id and prevent the process
-///                from reusing it
+/// @brief Create a handle for a kernel object.
+/// NOTE: Does not add to a handle table, which assigns the id. The caller must do that after calling.
 /// @param object Object to be referenced by the handle.
 ///               This handle counts has a reference to the object, keeping it alive
 /// @param rights Access rights determining what holders of the handle can do with or to the object
 /// @param handle Output parameter set to the new handle
 /// @return `IR_OK` on success
-ir_status_t handle_create(struct process *process, object *object, ir_rights_t rights, struct handle **handle) {
-    object->references++;
+ir_status_t handle_create(object *object, ir_rights_t rights, struct handle **handle) {
+    struct handle *new_handle = kmem_cache_alloc(&handle_cache);
+    if (!new_handle) { return IR_ERROR_NO_MEMORY; }
 
-    struct handle *new_handle = malloc(sizeof(struct handle));
+    object->references++;
     new_handle->object = object;
     new_handle->rights = rights;
-    new_handle->handle_id = handle_get_next_id(process);
+    new_handle->handle_id = IR_HANDLE_INVALID;
     *handle = new_handle;
     return IR_OK;
 }
 
 /// @brief Create a copy of an existing handle
+/// NOTE: Does not add to a handle table, which assigns the id. The caller must do that after calling.
 /// @param original The handle being copied
 /// @param new_rights Rights used for the new handle.
 /// @see `handle_rights_are_subset` to validate new_rights
-/// @param new_id ID to assign the new handle
 /// @param out Output parameter set to the new handle
-/// @return
-ir_status_t handle_copy(struct handle *original, ir_rights_t new_rights, uint new_id, struct handle **out) {
-    struct handle *new_handle = malloc(sizeof(struct handle));
-    if (!new_handle) { return IR_ERROR_NO_MEMORY; }
+/// @return `IR_OK` on success
+ir_status_t handle_copy(struct handle *original, ir_rights_t new_rights, struct handle **out) {
+    return handle_create(original->object, new_rights, out);
+}
 
-    // The object has one more referrer keeping it in memory
-    object *object = original->object;
-    object->references++;
+/// @brief rcu callback for `handle_release`
+static void handle_release_callback(struct rcu_head *rcu) {
+    struct handle *handle = (struct handle*)((uintptr_t)rcu - offsetof(struct handle, rcu));
+    object_decrement_references(handle->object);
+    kmem_cache_free(&handle_cache, handle);
+}
 
-    new_handle->handle_id = new_id;
-    new_handle->rights = new_rights;
-    new_handle->object = object;
+/// @brief Drop a handle's reference to its object and free it
+///
+/// Both are deferred until lookups that may have found the handle before it
+/// was removed from its table have finished.
+/// @param handle A handle that is no longer in any handle table
+void handle_release(struct handle *handle) {
+    rcu_call(&handle->rcu, handle_release_callback);
+}
+
+/// @brief Find the handle with an id in a table
+///
+/// Takes no lock. The handle, and the object it refers to, remain valid until
+/// the calling thread next passes through the scheduler, even if the handle is
+/// removed from the table in the meantime. Callers that need the handle to
+/// stay in the table should hold `table->lock`.
+/// @return The handle, or NULL if the table has no handle with that id
+struct handle *handle_table_get(struct handle_table *table, ir_handle_t id) {
+    if (id >= HANDLE_TABLE_MAX_ID) return NULL;
+
+    struct handle_table_leaf *leaf = atomic_load((struct handle_table_leaf *_Atomic*)&table->leaves[id / HANDLE_TABLE_LEAF_SIZE]);
+    if (!leaf) return NULL;
+    return atomic_load((struct handle *_Atomic*)&leaf->handles[id % HANDLE_TABLE_LEAF_SIZE]);
+}
+
+/// @brief Find the lowest clear bit in a bitmap
+/// @return The bit's index, or `bits` if every bit is set
+static size_t handle_bitmap_find_clear(uint64_t *bitmap, size_t bits) {
+    for (size_t i = 0; i < bits / 64; i++) {
+        if (bitmap[i] != ~0ul) {
+            return i * 64 + __builtin_ctzl(~bitmap[i]);
+        }
+    }
+    return bits;
+}
+
+static inline void handle_bitmap_set(uint64_t *bitmap, size_t bit) {
+    bitmap[bit / 64] |= 1ul << (bit % 64);
+}
+
+static inline void handle_bitmap_clear(uint64_t *bitmap, size_t bit) {
+    bitmap[bit / 64] &= ~(1ul << (bit % 64));
+}
+
+/// @brief Add a handle to a table, assigning it the lowest free id
+/// @note Call with a lock on `table`
+/// @return `IR_OK` on success, or `IR_ERROR_NO_MEMORY` if the table is full or a leaf can't be allocated
+ir_status_t handle_table_add_locked(struct handle_table *table, struct handle *handle) {
+    size_t leaf_index = handle_bitmap_find_clear(table->full_leaves, HANDLE_TABLE_LEAVES);
+    if (leaf_index == HANDLE_TABLE_LEAVES) {
+        return IR_ERROR_NO_MEMORY;
+    }
+
+    struct handle_table_leaf *leaf = table->leaves[leaf_index];
+    if (!leaf) {
+        leaf = calloc(1, sizeof(struct handle_table_leaf));
+        if (!leaf) return IR_ERROR_NO_MEMORY;
+        if (leaf_index == 0) {
+            // Never hand out the invalid id
+            handle_bitmap_set(leaf->used, IR_HANDLE_INVALID);
+        }
+        atomic_store((struct handle_table_leaf *_Atomic*)&table->leaves[leaf_index], leaf);
+    }
+
+    size_t index = handle_bitmap_find_clear(leaf->used, HANDLE_TABLE_LEAF_SIZE);
+    handle_bitmap_set(leaf->used, index);
+    if (handle_bitmap_find_clear(leaf->used, HANDLE_TABLE_LEAF_SIZE) == HANDLE_TABLE_LEAF_SIZE) {
+        handle_bitmap_set(table->full_leaves, leaf_index);
+    }
 
-    *out = new_handle;
+    // The id must be visible before the handle can be found
+    handle->handle_id = leaf_index * HANDLE_TABLE_LEAF_SIZE + index;
+    atomic_store((struct handle *_Atomic*)&leaf->handles[index], handle);
+    table->count++;
     return IR_OK;
 }
 
+/// @brief Put a handle that was removed from a table back in it
+///
+/// The handle gets its old id back, unless another handle was given the id in the meantime
+/// and it has to take the lowest free id instead.
+/// @note Call with a lock on `table`
+/// @return `IR_OK` on success, or an error from `handle_table_add_locked`
+ir_status_t handle_table_restore_locked(struct handle_table *table, struct handle *handle) {
+    ir_handle_t id = handle->handle_id;
+    struct handle_table_leaf *leaf = table->leaves[id / HANDLE_TABLE_LEAF_SIZE];
+    size_t index = id % HANDLE_TABLE_LEAF_SIZE;
+    if (!leaf || (leaf->used[index / 64] & (1ul << (index % 64)))) {
+        return handle_table_add_locked(table, handle);
+    }
+
+    handle_bitmap_set(leaf->used, index);
+    if (handle_bitmap_find_clear(leaf->used, HANDLE_TABLE_LEAF_SIZE) == HANDLE_TABLE_LEAF_SIZE) {
+        handle_bitmap_set(table->full_leaves, id / HANDLE_TABLE_LEAF_SIZE);
+    }
+    atomic_store((struct handle *_Atomic*)&leaf->handles[index], handle);
+    table->count++;
+    return IR_OK;
+}
+
+/// @brief Add a handle to a table, assigning it the lowest free id
+/// @return `IR_OK` on success, or `IR_ERROR_NO_MEMORY` if the table is full or a leaf can't be allocated
+ir_status_t handle_table_add(struct handle_table *table, struct handle *handle) {
+    spinlock_aquire(table->lock);
+    ir_status_t status = handle_table_add_locked(table, handle);
+    spinlock_release(table->lock);
+    return status;
+}
+
+/// @brief Remove a handle from a table, freeing its id
+/// @note Call with a lock on `table`
+/// @param out Output parameter set to the removed handle. The caller owns it,
+///            and must release it with `handle_release` or move it elsewhere
+/// @return `IR_OK` on success, or `IR_ERROR_BAD_HANDLE` if the table has no handle with that id
+ir_status_t handle_table_remove_locked(struct handle_table *table, ir_handle_t id, struct handle **out) {
+    struct handle *handle = handle_table_get(table, id);
+    if (!handle) return IR_ERROR_BAD_HANDLE;
+
+    size_t leaf_index = id / HANDLE_TABLE_LEAF_SIZE;
+    struct handle_table_leaf *leaf = table->leaves[leaf_index];
+    atomic_store((struct handle *_Atomic*)&leaf->handles[id % HANDLE_TABLE_LEAF_SIZE], NULL);
+    handle_bitmap_clear(leaf->used, id % HANDLE_TABLE_LEAF_SIZE);
+    handle_bitmap_clear(table->full_leaves, leaf_index);
+    table->count--;
+
+    *out = handle;
+    return IR_OK;
+}
+
+/// @brief Remove a handle from a table, freeing its id
+/// @param out Output parameter set to the removed handle. The caller owns it,
+///            and must release it with `handle_release` or move it elsewhere
+/// @return `IR_OK` on success, or `IR_ERROR_BAD_HANDLE` if the table has no handle with that id
+ir_status_t handle_table_remove(struct handle_table *table, ir_handle_t id, struct handle **out) {
+    spinlock_aquire(table->lock);
+    ir_status_t status = handle_table_remove_locked(table, id, out);
+    spinlock_release(table->lock);
+    return status;
+}
+
+/// @brief rcu callback freeing a leaf of a destroyed table
+static void handle_table_leaf_free(struct rcu_head *rcu) {
+    free((void*)((uintptr_t)rcu - offsetof(struct handle_table_leaf, rcu)));
+}
+
+/// @brief Release every handle in a table, and the memory used by the table
+/// The table is left empty, and can be reused.
+void handle_table_destroy(struct handle_table *table) {
+    spinlock_aquire(table->lock);
+    for (size_t i = 0; i < HANDLE_TABLE_LEAVES; i++) {
+        struct handle_table_leaf *leaf = table->leaves[i];
+        if (!leaf) continue;
+
+        atomic_store((struct handle_table_leaf *_Atomic*)&table->leaves[i], NULL);
+        for (size_t j = 0; j < HANDLE_TABLE_LEAF_SIZE; j++) {
+            if (leaf->handles[j]) {
+                handle_release(leaf->handles[j]);
+            }
+        }
+        rcu_call(&leaf->rcu, handle_table_leaf_free);
+    }
+    memset(table->full_leaves, 0, sizeof(table->full_leaves));
+    table->count = 0;
+    spinlock_release(table->lock);
+}
+
 /// @brief SYSCALL_HANDLE_DUPLICATE
 ///
 /// Creates a new copy of a handle with the given rights, and returns the id in `id_out` (in user memory)
@@ -93,32 +235,27 @@ int64_t sys_handle_duplicate(long original_id, ir_rights_t new_rights, ir_handle
     // Anything else wrong is a logic error and can just crash that process
     if (!arch_validate_user_pointer(id_out)) return IR_ERROR_INVALID_ARGUMENTS;
 
-    // Obtain exclusive access over the process's handle table to avoid other
-    // threads deleting the handle out from under us
     struct process *process = (struct process*)this_cpu->current_thread->object.parent;
-    spinlock_aquire(process->handle_table_lock);
-
-    struct handle *handle_ptr;
-    ir_status_t result = linked_list_find(&process->handle_table, &original_id, handle_by_id, NULL, (void**)&handle_ptr);
-
-    if (result != IR_OK) {
-        spinlock_release(process->handle_table_lock);
+    struct handle *handle_ptr = handle_table_get(&process->handle_table, original_id);
+    if (!handle_ptr) {
         return IR_ERROR_BAD_HANDLE;
     }
     // Prevent the caller from gaining new rights
     if (!handle_rights_are_subset(handle_ptr->rights, new_rights)) {
-        spinlock_release(process->handle_table_lock);
         return IR_ERROR_BAD_HANDLE;
     }
 
-    ir_handle_t new_handle_id = handle_get_next_id(process);
-    handle_copy(handle_ptr, new_rights, new_handle_id, &handle_ptr);
-    // TODO: Unhandled path where malloc fails
-    linked_list_add(&process->handle_table, handle_ptr);
-    spinlock_release(process->handle_table_lock);
+    struct handle *new_handle;
+    ir_status_t status = handle_copy(handle_ptr, new_rights, &new_handle);
+    if (status != IR_OK) return status;
+    status = handle_table_add(&process->handle_table, new_handle);
+    if (status != IR_OK) {
+        handle_release(new_handle);
+        return status;
+    }
 
     // Give the id the userspace (If it faults accessing this, it is safe to kill the process now)
-    *id_out = new_handle_id;
+    *id_out = new_handle->handle_id;
     return IR_OK;
 }
 
@@ -135,23 +272,32 @@ ir_status_t sys_handle_replace(ir_handle_t handle, ir_rights_t new_rights, ir_ha
     // Obtain exclusive access over the process's handle table to avoid other
     // threads deleting the handle out from under us
     struct process *process = (struct process*)this_cpu->current_thread->object.parent;
-    spinlock_aquire(process->handle_table_lock);
+    spinlock_aquire(process->handle_table.lock);
 
-    struct handle *handle_ptr;
-    ir_status_t result = linked_list_find(&process->handle_table, &handle, handle_by_id, NULL, (void**)&handle_ptr);
-    if (result != IR_OK) {
-        spinlock_release(process->handle_table_lock);
+    struct handle *handle_ptr = handle_table_get(&process->handle_table, handle);
+    if (!handle_ptr) {
+        spinlock_release(process->handle_table.lock);
         return IR_ERROR_BAD_HANDLE;
     }
     if (!handle_rights_are_subset(handle_ptr->rights, new_rights)) {
-        spinlock_release(process->handle_table_lock);
+        spinlock_release(process->handle_table.lock);
         return IR_ERROR_INVALID_ARGUMENTS;
     }
 
-    struct handle *new = malloc(sizeof(struct handle));
-    handle_copy(handle_ptr, new_rights, handle_get_next_id(process), &new);
-    spinlock_release(process->handle_table_lock);
+    struct handle *new;
+    ir_status_t status = handle_copy(handle_ptr, new_rights, &new);
+    if (status != IR_OK) {
+        spinlock_release(process->handle_table.lock);
+        return status;
+    }
+
+    // Removing the original first lets the new handle take its id
+    handle_table_remove_locked(&process->handle_table, handle, &handle_ptr);
+    handle_table_add_locked(&process->handle_table, new);
+    spinlock_release(process->handle_table.lock);
 
+    handle_release(handle_ptr);
+    *new_handle = new->handle_id;
     return IR_OK;
 }
 
@@ -162,34 +308,31 @@ ir_status_t sys_handle_replace(ir_handle_t handle, ir_rights_t new_rights, ir_ha
 ///         does not have a handle with the given id
 ir_status_t sys_handle_close(ir_handle_t id) {
     struct process *process = (struct process*)this_cpu->current_thread->object.parent;
-    spinlock_aquire(process->handle_table_lock);
 
     struct handle *handle;
-    if (linked_list_find_and_remove(&process->handle_table, (void*)id, handle_by_id, (void**)&handle) == IR_OK) {
-        spinlock_release(process->handle_table_lock);
-
-        linked_list_add(&process->free_handle_ids, (void*)handle->handle_id);
-        object_decrement_references(handle->object);
-        free(handle);
+    if (handle_table_remove(&process->handle_table, id, &handle) == IR_OK) {
+        handle_release(handle);
         return IR_OK;
     }
 
-    spinlock_release(process->handle_table_lock);
     return IR_ERROR_BAD_HANDLE;
 }
 
+/// @brief SYSCALL_DEBUG_DUMP_HANDLES
+/// Print the calling process's handles, then the kernel's object cache statistics, over the debug output
 ir_status_t sys_handle_dump() {
     struct process *process = (struct process*)this_cpu->current_thread->object.parent;
-    spinlock_aquire(process->handle_table_lock);
+    spinlock_aquire(process->handle_table.lock);
 
-    struct handle *handle;
-    for (uint i = 0; i  < process->handle_table.count; i++) {
-        linked_list_get(&process->handle_table, i, (void**)&handle);
+    for (ir_handle_t id = 0; id < HANDLE_TABLE_MAX_ID; id++) {
+        struct handle *handle = handle_table_get(&process->handle_table, id);
+        if (!handle) continue;
         debug_printf("Handle %ld at %#p - object at %#p, rights %#lx\n", handle->handle_id, handle, handle->object, handle->rights);
         debug_printf("Object is type %u\n",  handle->object->type);
     }
 
-    spinlock_release(process->handle_table_lock);
-    return IR_OK;
+    spinlock_release(process->handle_table.lock);
 
+    kmem_dump_stats();
+    return IR_OK;
 }
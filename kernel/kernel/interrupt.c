@@ -25,7 +25,7 @@ void interrupt_dispatch(int number) {
     if (interrupt->armed) {
         if (!interrupt->thread) {
             debug_printf("WARNING: No thread listening for armed interrupt %d\n", number);
-            linked_list_add(&interrupt->queue, (void*)microseconds_since_boot);
+            linked_list_add(&interrupt->queue, (void*)time_microseconds());
             return;
         }
 
@@ -114,8 +114,14 @@ ir_status_t sys_interrupt_create(long vector, long irq, ir_handle_t *out) {
         return status;
 
     struct handle* handle;
-    handle_create(process, (struct object*)interrupt, IR_RIGHT_ALL, &handle);
-    linked_list_add_sorted(&process->handle_table, handle_by_id, handle);
+    status = handle_create((struct object*)interrupt, IR_RIGHT_ALL, &handle);
+    if (status != IR_OK)
+        return status;
+    status = handle_table_add(&process->handle_table, handle);
+    if (status != IR_OK) {
+        handle_release(handle);
+        return status;
+    }
 
     *out = handle->handle_id;
     return IR_OK;
@@ -124,14 +130,11 @@ ir_status_t sys_interrupt_create(long vector, long irq, ir_handle_t *out) {
 ir_status_t sys_interrupt_wait(ir_handle_t interrupt_handle) {
     struct process* process = (struct process*)this_cpu->current_thread->object.parent;
 
-    spinlock_aquire(process->handle_table_lock);
-    struct handle* handle;
-    ir_status_t status = linked_list_find(&process->handle_table, (void*)interrupt_handle, handle_by_id, NULL, (void**)&handle);
-    struct interrupt* interrupt = (struct interrupt*)handle->object;
-    spinlock_release(process->handle_table_lock);
-    if (status != IR_OK) {
+    struct handle* handle = handle_table_get(&process->handle_table, interrupt_handle);
+    if (!handle) {
         return IR_ERROR_BAD_HANDLE;
     }
+    struct interrupt* interrupt = (struct interrupt*)handle->object;
     if (interrupt->object.type != OBJECT_TYPE_INTERRUPT) {
         return IR_ERROR_WRONG_TYPE;
     }
@@ -147,14 +150,11 @@ ir_status_t sys_interrupt_wait(ir_handle_t interrupt_handle) {
 ir_status_t sys_interrupt_arm(ir_handle_t interrupt_handle) {
     struct process* process = (struct process*)this_cpu->current_thread->object.parent;
 
-    spinlock_aquire(process->handle_table_lock);
-    struct handle* handle;
-    ir_status_t status = linked_list_find(&process->handle_table, (void*)interrupt_handle, handle_by_id, NULL, (void**)&handle);
-    struct interrupt* interrupt = (struct interrupt*)handle->object;
-    spinlock_release(process->handle_table_lock);
-    if (status) {
+    struct handle* handle = handle_table_get(&process->handle_table, interrupt_handle);
+    if (!handle) {
         return IR_ERROR_BAD_HANDLE;
     }
+    struct interrupt* interrupt = (struct interrupt*)handle->object;
     if (interrupt->object.type != OBJECT_TYPE_INTERRUPT) {
         return IR_ERROR_WRONG_TYPE;
     }
@@ -167,14 +167,11 @@ ir_status_t sys_interrupt_arm(ir_handle_t interrupt_handle) {
 ir_status_t sys_interrupt_disarm(ir_handle_t interrupt_handle) {
     struct process* process = (struct process*)this_cpu->current_thread->object.parent;
 
-    spinlock_aquire(process->handle_table_lock);
-    struct handle* handle;
-    ir_status_t status = linked_list_find(&process->handle_table, (void*)interrupt_handle, handle_by_id, NULL, (void**)&handle);
-    struct interrupt* interrupt = (struct interrupt*)handle->object;
-    spinlock_release(process->handle_table_lock);
-    if (status) {
+    struct handle* handle = handle_table_get(&process->handle_table, interrupt_handle);
+    if (!handle) {
         return IR_ERROR_BAD_HANDLE;
     }
+    struct interrupt* interrupt = (struct interrupt*)handle->object;
     if (interrupt->object.type != OBJECT_TYPE_INTERRUPT) {
         return IR_ERROR_WRONG_TYPE;
     }
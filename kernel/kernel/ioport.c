@@ -70,11 +70,14 @@ ir_status_t sys_ioport_create(unsigned long vector, size_t count, ir_handle_t *o
 
     struct process *process = (struct process*)this_cpu->current_thread->object.parent;
     struct handle *handle;
-    status = handle_create(process, (object*)ports, IR_RIGHT_INFO | IR_RIGHT_TRANSFER | IR_RIGHT_DUPLICATE, &handle);
+    status = handle_create((object*)ports, IR_RIGHT_INFO | IR_RIGHT_TRANSFER | IR_RIGHT_DUPLICATE, &handle);
     if (status != IR_OK) return status;
 
-    linked_list_add(&process->handle_table, handle);
-    // Does not need the handle table lock, because this does not reference existing handles that must remain alive
+    status = handle_table_add(&process->handle_table, handle);
+    if (status != IR_OK) {
+        handle_release(handle);
+        return status;
+    }
 
     *out = handle->handle_id;
     return IR_OK;
@@ -88,21 +91,15 @@ ir_status_t sys_ioport_create(unsigned long vector, size_t count, ir_handle_t *o
 /// @return
 ir_status_t sys_ioport_send(ir_handle_t ioport, size_t offset, long value, long word_size) {
     struct process *process = (struct process*)this_cpu->current_thread->object.parent;
-    spinlock_aquire(process->handle_table_lock);
-
-    struct handle *handle;
-    ir_status_t status = linked_list_find(&process->handle_table, (void*)ioport, handle_by_id, NULL, (void**)&handle);
-    if (status != IR_OK) return status;
+    struct handle *handle = handle_table_get(&process->handle_table, ioport);
+    if (!handle) return IR_ERROR_BAD_HANDLE;
     struct ioport *ports = (struct ioport*)handle->object;
 
     if (offset >= ports->range_length) {
-        spinlock_release(process->handle_table_lock);
         return IR_ERROR_ACCESS_DENIED;
     }
 
     arch_io_output(ports->base_port + offset, value, word_size);
-
-    spinlock_release(process->handle_table_lock);
     return IR_OK;
 }
 
@@ -118,20 +115,14 @@ ir_status_t sys_ioport_receive(ir_handle_t ioport, size_t offset, long word_size
     }
 
     struct process *process = (struct process*)this_cpu->current_thread->object.parent;
-    spinlock_aquire(process->handle_table_lock);
-
-    struct handle *handle;
-    ir_status_t status = linked_list_find(&process->handle_table, (void*)ioport, handle_by_id, NULL, (void**)&handle);
-    if (status != IR_OK) return status;
+    struct handle *handle = handle_table_get(&process->handle_table, ioport);
+    if (!handle) return IR_ERROR_BAD_HANDLE;
     struct ioport *ports = (struct ioport*)handle->object;
 
     if (offset >= ports->range_length) {
-        spinlock_release(process->handle_table_lock);
         return IR_ERROR_ACCESS_DENIED;
     }
 
-    spinlock_release(process->handle_table_lock);
-
     *out = arch_io_input(ports->base_port + offset, word_size);
 
     return IR_OK;
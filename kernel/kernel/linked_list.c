@@ -7,7 +7,7 @@
 #include "iridium/types.h"
 #include "iridium/errors.h"
 #include <kernel/spinlock.h>
-#include "kernel/heap.h"
+#include "kernel/memory/slab.h"
 #include "kernel/string.h"
 
 #include <stdbool.h>
@@ -20,6 +20,8 @@ struct _node {
     void *data;
 };
 
+static struct kmem_cache node_cache = KMEM_CACHE_INITIALIZER("linked_list_node", sizeof(_node));
+
 /// @brief Default linked list searching function
 ///
 /// The search function used when given a null search function.
@@ -39,7 +41,11 @@ int default_search(void *data, void *target) {
 ir_status_t linked_list_add(linked_list* list, void *data) {
     spinlock_aquire(list->lock);
 
-    _node *new_node = malloc(sizeof(_node));
+    _node *new_node = kmem_cache_alloc(&node_cache);
+    if (!new_node) {
+        spinlock_release(list->lock);
+        return IR_ERROR_NO_MEMORY;
+    }
     new_node->data = data;
     new_node->next = NULL;
 
@@ -74,7 +80,11 @@ ir_status_t linked_list_add_sorted(linked_list *list, search_function function,
         first_larger = first_larger->next;
     }
 
-    _node *new_node = malloc(sizeof(_node));
+    _node *new_node = kmem_cache_alloc(&node_cache);
+    if (!new_node) {
+        spinlock_release(list->lock);
+        return IR_ERROR_NO_MEMORY;
+    }
     new_node->data = (void*)data;
     new_node->next = first_larger;
 
@@ -161,7 +171,7 @@ ir_status_t linked_list_remove(linked_list *list, uint index, void **out) {
         list->tail = previous;
     }
 
-    free(node);
+    kmem_cache_free(&node_cache, node);
 
     list->count--;
 
@@ -227,7 +237,7 @@ ir_status_t linked_list_find_and_remove(linked_list *list, void *target, search_
             if (node == list->tail) {
                 list->tail = previous;
             }
-            free(node);
+            kmem_cache_free(&node_cache, node);
             list->count--;
 
             spinlock_release(list->lock);
@@ -252,7 +262,7 @@ void linked_list_destroy(linked_list *list) {
     _node *node = list->head;
     while (node) {
         _node *next = node->next;
-        free(node);
+        kmem_cache_free(&node_cache, node);
         node = next;
     }
 
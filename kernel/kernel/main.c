@@ -45,8 +45,7 @@ void kernel_startup() {
 void kernel_main(v_addr_t initrd_start_address) {
     debug_printf("Initrd.sys at %#p\n", initrd_start_address);
 
-    create_idle_process();
-    this_cpu->idle_thread = create_idle_thread();
+    scheduler_init_cpu();
 
     // Start the init process
     struct process *init_process;
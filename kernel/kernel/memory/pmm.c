@@ -12,6 +12,8 @@
 #include "types.h"
 #include "align.h"
 #include "kernel/arch/arch.h"
+#include "kernel/spinlock.h"
+#include "kernel/cpu_locals.h"
 #include <stddef.h>
 #include <stdbool.h>
 
@@ -27,8 +29,19 @@ physical_page_info *kernel_pages;
 // The physical memory manager stores information about each region of memory
 // And dedicated space from each region to track its own pages
 // Extra data is stored about each page that allows a linked list
-// to be built from them, and for cases where linear allocations of longer
-// areas are needed, the region's maps can be consulted to find free areas
+// to be built from them.
+//
+// Free pages are kept by a buddy allocator. Free memory is split into blocks
+// of 2^order pages, aligned to their size in physical memory, with a free list
+// for each order. Allocations split larger blocks in half until one is the right
+// size, and frees merge a block with its buddy (the other half of the block
+// they were split from) whenever both are free. The region page arrays are
+// still used directly to find and split the block containing a specific page.
+//
+// Single pages are allocated and freed through a small cache on each cpu, which
+// is refilled from and drained to the free lists in batches. Pages in a cache
+// count as used in the global memory counters, and are added back when the
+// statistics are read.
 
 struct physical_region *regions_array;
 size_t regions_count;
@@ -44,15 +57,15 @@ static char *region_type_strings[] = {
 struct arch_reserved_range *reserved_ranges;
 size_t reserved_ranges_count;
 
-// A linked list containing every free page of memory in the system
-// Serves as a stack for popping physical pages to allocate
-// Pages are pushed and popped to the begining stored here
-static physical_page_info *volatile free_list = NULL;
-static volatile size_t pages_in_free_list = 0; // Used to optimize checks before multi-page allocations
+// Free blocks of each order, linked through the first page of each block
+static physical_page_info *free_lists[PMM_MAX_ORDER + 1];
 
-/// @brief Total amount of free memory in the system
+/// Protects the free lists, page states and memory counters
+static lock_t pmm_lock;
+
+/// @brief Free memory in the free lists, not including cpu page caches
 volatile size_t memory_free = 0;
-/// @brief Total memory used by the kernel and all processes combined
+/// @brief Memory used by the kernel and all processes combined, plus cpu page caches
 volatile size_t memory_used = 0;
 
 /// @brief Memory marked as reserved or unavailable.
@@ -67,9 +80,17 @@ volatile size_t memory_reserved = 0;
 // Internal to this file only
 
 static void pmm_init_region(struct physical_region *region);
-static void pmm_free_list_push(physical_page_info *page); // Return a page to the free page stack
-static physical_page_info *pmm_free_list_pop(); // Grab a free page off the stack
-static void pmm_free_list_remove(physical_page_info *page); // Take a specific page out of free lists
+static void pmm_free_list_push(physical_page_info *block, uint order); // Add a free block to its order's list
+static void pmm_free_list_remove(physical_page_info *block); // Take a specific block out of the free lists
+static struct physical_region *pmm_region_of(physical_page_info *page);
+static physical_page_info *pmm_buddy_allocate(uint order, p_addr_t physical_upper_limit);
+static void pmm_buddy_free(struct physical_region *region, physical_page_info *block, uint order);
+static void pmm_buddy_take_page(struct physical_region *region, physical_page_info *page);
+static void pmm_free_run(struct physical_region *region, physical_page_info *first, size_t count);
+static physical_page_info *pmm_link_run(physical_page_info *first, size_t count);
+static ir_status_t pmm_allocate_contiguous_from_free_lists(size_t count, p_addr_t physical_upper_limit, physical_page_info **page_list_out);
+static void pmm_cache_refill(struct pmm_page_cache *cache);
+static void pmm_cache_drain(struct pmm_page_cache *cache, size_t count);
 
 /// @brief Initialize the phyiscal memory manager
 ///
@@ -155,16 +176,13 @@ static void pmm_init_region(struct physical_region *region) {
             page->address = physical_address;
             page->prev = NULL;
             page->next = NULL;
-            if (i < array_start_index) { // Free pages
-                page->state = PAGE_STATE_FREE;
-                pmm_free_list_push(page);
-            }
-            else { // Pages used to back the page array
-                page->state = PAGE_STATE_USED;
-            }
+            // Pages used to back the page array stay used, the rest are freed below
+            page->state = PAGE_STATE_USED;
+            page->order = PAGE_ORDER_NONE;
 
             physical_address += PAGE_SIZE;
         }
+        pmm_free_run(region, &page_array[0], array_start_index);
 
         memory_free += region->length - page_array_size;
         memory_used += page_array_size;
@@ -206,56 +224,61 @@ static void pmm_init_region(struct physical_region *region) {
     }*/
 }
 
-/// Allocate a single page of memory off the free page stack
+/// Allocate a single page of memory from this cpu's page cache
 ir_status_t pmm_allocate_page(physical_page_info **page_out) {
-    // Pop a page off the free page stack
-    physical_page_info *page = pmm_free_list_pop();
-
-    if (page) { // Page successfully popped
-        // Mark the page as used and hand it to the caller
-        page->state = PAGE_STATE_USED;
-        *page_out = page;
-
-        memory_free -= PAGE_SIZE; // Update memory trackers
-        memory_used += PAGE_SIZE;
-
-        return IR_OK;
+    struct pmm_page_cache *cache = &processor_local_data[this_cpu->core_id].page_cache;
+
+    if (cache->count == 0) {
+        pmm_cache_refill(cache);
+        if (cache->count == 0) {
+            // Out of memory, no free pages left
+            *page_out = NULL;
+            return IR_ERROR_NO_MEMORY;
+        }
     }
 
-    // Out of memory, no pages in the list
-    *page_out = NULL;
-    return IR_ERROR_NO_MEMORY;
+    // Cached pages are already marked as used and counted in the memory trackers
+    physical_page_info *page = cache->pages[cache->count - 1];
+    cache->count--;
+    page->prev = NULL;
+    page->next = NULL;
+    *page_out = page;
+    return IR_OK;
 }
 
 /// Allocate multiple pages (that don't have to be physically contiguous)
 /// Returns a physical_page_info linked-list with `count` pages, that the caller can map however they want
 ir_status_t pmm_allocate_pages(size_t count, physical_page_info **pages_list_out) {
-    // If there aren't enough free pages to allocate
-    if (pages_in_free_list < count) {
-        return IR_ERROR_NO_MEMORY;
-    }
-
     if (count == 0) {
         *pages_list_out = NULL;
         return IR_OK;
     }
 
     // Build a linked list of the pages as they're allocated to give the caller
-    physical_page_info *first_page = pmm_free_list_pop(); // The start of the linked list, which is returned to the caller
-    first_page->state = PAGE_STATE_USED;
-    // Attach more pages to form a linked list
-    physical_page_info *previous_page = first_page;
-    for (uint i = 1; i < count; i++) {
-        physical_page_info *page = pmm_free_list_pop();
-        previous_page->next = page;
-        page->state = PAGE_STATE_USED;
+    physical_page_info *first_page = NULL; // The start of the linked list, which is returned to the caller
+    physical_page_info *previous_page = NULL;
+    for (size_t i = 0; i < count; i++) {
+        physical_page_info *page;
+        if (pmm_allocate_page(&page) != IR_OK) {
+            // Give back what was already allocated
+            while (first_page) {
+                physical_page_info *next = first_page->next;
+                pmm_free_page(first_page);
+                first_page = next;
+            }
+            return IR_ERROR_NO_MEMORY;
+        }
+
+        // Attach the page to the end of the list
+        if (previous_page) {
+            previous_page->next = page;
+        } else {
+            first_page = page;
+        }
         page->prev = previous_page;
         previous_page = page;
     }
 
-    memory_free -= count * PAGE_SIZE;
-    memory_used += count * PAGE_SIZE;
-
     *pages_list_out = first_page;
     return IR_OK;
 }
@@ -270,52 +293,88 @@ ir_status_t pmm_allocate_pages(size_t count, physical_page_info **pages_list_out
 /// @return `IR_OK` on success, or `IR_ERROR_NO_MEMORY` If no contiguous
 ///         regions below `physical_upper_limit` are available
 ir_status_t pmm_allocate_contiguous(size_t count, p_addr_t physical_upper_limit, physical_page_info **page_list_out) {
+    ir_status_t status = pmm_allocate_contiguous_from_free_lists(count, physical_upper_limit, page_list_out);
+    if (status == IR_ERROR_NO_MEMORY) {
+        // Pages held in this cpu's cache could be splitting up the free blocks, so give them back and try again
+        struct pmm_page_cache *cache = &processor_local_data[this_cpu->core_id].page_cache;
+        if (cache->count > 0) {
+            pmm_cache_drain(cache, cache->count);
+            status = pmm_allocate_contiguous_from_free_lists(count, physical_upper_limit, page_list_out);
+        }
+    }
 
-    if (physical_upper_limit == 0) physical_upper_limit = -1;
+    if (status != IR_OK) {
+        debug_printf("Failed to allocate group of %zd pages\n", count);
+    }
+    return status;
+}
 
-    struct physical_region *region = NULL;
-    // Goes backwards to avoid allocating important space in the first 16MB and around the kernel (Where grub will put the init process)
-    // TODO: Figure out a way to make this unnecessary, but continue doing it anyway to safe space for lower limit requests
-
-    for (int r = initialized_regions-1; r >= 0; r--) { // initialized_regions instead of overall because the init
-                                                       // function can call this to get page arrays for reserved regions
-        region = &regions_array[r];
-        size_t pages = region->length / PAGE_SIZE;
-
-        if (region->type != REGION_TYPE_AVAILABLE || region->base > physical_upper_limit) continue;
-
-        size_t start_index = 0;
-        size_t pages_found = 0;
-        for (size_t i = 0; i < pages; i++) {
-            if (region->page_array[i].state == PAGE_STATE_FREE && region->page_array[i].address < physical_upper_limit) {
-                pages_found++;
-                if (pages_found == count) { // A large enough area was found
-                    physical_page_info *previous = NULL;
-                    for (uint p = start_index; p < start_index + count; p++) {
-                        physical_page_info *page = &region->page_array[p];
-                        page->state = PAGE_STATE_USED;
-                        pmm_free_list_remove(page);
-                        if (previous) { previous->next = page; }
-                        page->prev = previous;
-                        previous = page;
-                    }
-                    debug_printf("PMM: Allocating congituous region %#p-%#p\n", region->page_array[i].address, region->page_array[i].address + count * PAGE_SIZE);
+/// @brief Allocate physically contiguous pages from the free lists, without touching cpu page caches
+/// @see `pmm_allocate_contiguous`
+static ir_status_t pmm_allocate_contiguous_from_free_lists(size_t count, p_addr_t physical_upper_limit, physical_page_info **page_list_out) {
 
-                    memory_free -= count * PAGE_SIZE;
-                    memory_used += count * PAGE_SIZE;
-                    *page_list_out = &region->page_array[start_index];
-                    return IR_OK;
+    if (physical_upper_limit == 0) physical_upper_limit = NO_ADDRESS_LIMIT;
+    if (count == 0) {
+        *page_list_out = NULL;
+        return IR_OK;
+    }
+
+    // Round up to the smallest block that fits the request
+    uint order = 0;
+    while ((1ul << order) < count && order <= PMM_MAX_ORDER) order++;
+
+    spinlock_aquire(pmm_lock);
+    if (order <= PMM_MAX_ORDER) {
+        physical_page_info *block = pmm_buddy_allocate(order, physical_upper_limit);
+        if (block) {
+            // Give back the part of the block past the end of the request
+            pmm_free_run(pmm_region_of(block), &block[count], (1ul << order) - count);
+
+            debug_printf("PMM: Allocating congituous region %#p-%#p\n", block->address, block->address + count * PAGE_SIZE);
+
+            memory_free -= count * PAGE_SIZE;
+            memory_used += count * PAGE_SIZE;
+            spinlock_release(pmm_lock);
+            *page_list_out = pmm_link_run(block, count);
+            return IR_OK;
+        }
+    }
+    else {
+        // Requests larger than the largest block search the page arrays for a long enough run of free pages
+        // Goes backwards to avoid allocating important space in the first 16MB and around the kernel (Where grub will put the init process)
+        for (int r = initialized_regions-1; r >= 0; r--) {
+            struct physical_region *region = &regions_array[r];
+            size_t pages = region->length / PAGE_SIZE;
+
+            if (region->type != REGION_TYPE_AVAILABLE || region->base > physical_upper_limit) continue;
+
+            size_t start_index = 0;
+            size_t pages_found = 0;
+            for (size_t i = 0; i < pages; i++) {
+                if (region->page_array[i].state == PAGE_STATE_FREE && region->page_array[i].address < physical_upper_limit) {
+                    pages_found++;
+                    if (pages_found == count) { // A large enough area was found
+                        for (size_t p = start_index; p < start_index + count; p++) {
+                            pmm_buddy_take_page(region, &region->page_array[p]);
+                        }
+                        debug_printf("PMM: Allocating congituous region %#p-%#p\n", region->page_array[start_index].address, region->page_array[start_index].address + count * PAGE_SIZE);
+
+                        memory_free -= count * PAGE_SIZE;
+                        memory_used += count * PAGE_SIZE;
+                        spinlock_release(pmm_lock);
+                        *page_list_out = pmm_link_run(&region->page_array[start_index], count);
+                        return IR_OK;
+                    }
+                }
+                else {
+                    start_index = i+1;
+                    pages_found = 0;
                 }
-            }
-            else {
-                start_index = i+1;
-                pages_found = 0;
             }
         }
     }
 
-    debug_printf("Failed to allocate group of %zd pages\n", count);
-
+    spinlock_release(pmm_lock);
     return IR_ERROR_NO_MEMORY;
 }
 
@@ -341,8 +400,15 @@ ir_status_t pmm_allocate_range(p_addr_t address, size_t length, physical_page_in
 
     debug_printf("PMM: Allocating region %#zx-%#zx\n", address, address + length);
 
+    // Pages in this cpu's cache look used, and could make the range seem busy
+    struct pmm_page_cache *cache = &processor_local_data[this_cpu->core_id].page_cache;
+    if (cache->count > 0) {
+        pmm_cache_drain(cache, cache->count);
+    }
+
     // Find which region could contain this specific range
     // The range must be fully contained within one region
+    spinlock_aquire(pmm_lock);
     struct physical_region *region = NULL;
     for (uint i = 0; i < regions_count; i++) {
         region = &regions_array[i];
@@ -369,6 +435,7 @@ ir_status_t pmm_allocate_range(p_addr_t address, size_t length, physical_page_in
             }
 
             if (!free) { // Something else is using (part) of the memory range
+                spinlock_release(pmm_lock);
                 debug_print("Found region for allocation but area is not free\n");
                 return IR_ERROR_NO_MEMORY;
             }
@@ -378,16 +445,10 @@ ir_status_t pmm_allocate_range(p_addr_t address, size_t length, physical_page_in
             // Though it seems redundant to destroy and rebuild the linked list, it should be done anyway
             // In case the memory had been previously used and freed in the wrong order
             if (region->type == REGION_TYPE_AVAILABLE) {
-                physical_page_info *previous = NULL;
                 for (uint i = start_index; i < start_index + page_count; i++) {
-                    physical_page_info *page = &page_array[i];
-                    page->state = PAGE_STATE_USED;
-                    pmm_free_list_remove(page);
-                    if (previous) { previous->next = page; }
-                    page->prev = previous;
-                    previous = page;
+                    pmm_buddy_take_page(region, &page_array[i]);
                 }
-                previous->next = NULL; // Terminate the list - pmm_free_list_remove doesn't do this
+                pmm_link_run(&page_array[start_index], page_count);
                 memory_free -= page_count * PAGE_SIZE;
                 memory_used += page_count * PAGE_SIZE;
             }
@@ -405,10 +466,13 @@ ir_status_t pmm_allocate_range(p_addr_t address, size_t length, physical_page_in
                 memory_used += page_count * PAGE_SIZE;
             }
 
+            spinlock_release(pmm_lock);
             *page_list_out = &page_array[start_index];
             return IR_OK;
         }
     }
+    // The heap allocates pages itself, so it can't be called with the lock held
+    spinlock_release(pmm_lock);
 
     // If the code reaches here then the requested range is outside of all regions
     // So return out of memory
@@ -430,19 +494,33 @@ ir_status_t pmm_allocate_range(p_addr_t address, size_t length, physical_page_in
         previous = page;
     }
     previous->next = NULL;
+    spinlock_aquire(pmm_lock);
     memory_used += page_count * PAGE_SIZE;
+    spinlock_release(pmm_lock);
     *page_list_out = page_array;
     return IR_OK;
 }
 
 /// Free a page using it's page info struct, so the page can be reused
 void pmm_free_page(physical_page_info *page) {
+    // Regular pages go to this cpu's page cache, and stay counted as used until it is drained
+    if (page->state == PAGE_STATE_USED) {
+        struct pmm_page_cache *cache = &processor_local_data[this_cpu->core_id].page_cache;
+        if (cache->count == PMM_CACHE_SIZE) {
+            pmm_cache_drain(cache, PMM_CACHE_BATCH);
+        }
+        cache->pages[cache->count] = page;
+        cache->count++;
+        return;
+    }
+
+    spinlock_aquire(pmm_lock);
     char state = page->state;
     page->state = PAGE_STATE_FREE;
     memory_used -= PAGE_SIZE;
 
     if (state == PAGE_STATE_USED) { // Regular pages
-        pmm_free_list_push(page);
+        pmm_buddy_free(pmm_region_of(page), page, 0);
         memory_free += PAGE_SIZE;
     }
     else if (state == PAGE_STATE_RESERVED_USED) {
@@ -454,6 +532,7 @@ void pmm_free_page(physical_page_info *page) {
         // don't have a place to go when they aren't in use
         //free(page);
     }
+    spinlock_release(pmm_lock);
 }
 
 /// @brief Get the page that corresponds with a given physical address
@@ -478,73 +557,240 @@ physical_page_info *pmm_page_from_p_addr(p_addr_t address) {
     return NULL;
 }
 
+/// @brief Total the pages kept in every cpu's page cache
+/// @return Size of the cached pages in bytes
+static size_t pmm_cached_memory() {
+    size_t pages = 0;
+    // Caches of cpus that haven't started yet are empty
+    for (int i = 0; i < MAX_CPUS_COUNT; i++) {
+        pages += processor_local_data[i].page_cache.count;
+    }
+    return pages * PAGE_SIZE;
+}
+
+/// @brief Total amount of free memory in the system
 size_t pmm_memory_free() {
-    return memory_free;
+    return memory_free + pmm_cached_memory();
 }
 
+/// @brief Total memory used by the kernel and all processes combined
 size_t pmm_memory_used() {
-    return memory_used;
+    return memory_used - pmm_cached_memory();
 }
 
 size_t pmm_memory_reserved() {
     return memory_reserved;
 }
 
-// Internal helper for adding pages to the free pages linked list
-static void pmm_free_list_push(physical_page_info *page) {
-    physical_page_info *old = free_list;
-    page->prev = NULL;
-    page->next = old;
-    if (old) { // If the stack was completely empty (this can't happen without causing other severe problems)
-               // avoid accessing the null pointer
-        old->prev = page;
-    }
-    // This page is the new front of the list
-    free_list = page;
-    pages_in_free_list++;
+// Internal helper for adding a free block to the front of its order's list
+static void pmm_free_list_push(physical_page_info *block, uint order) {
+    physical_page_info *old = free_lists[order];
+    block->order = order;
+    block->prev = NULL;
+    block->next = old;
+    if (old) {
+        old->prev = block;
+    }
+    // This block is the new front of the list
+    free_lists[order] = block;
 }
 
-// Internal helper that pops the first page off the front of the linked list, to be allocated
-static physical_page_info *pmm_free_list_pop() {
-    physical_page_info *popped_page = free_list;
+// Internal helper to remove a block from its free list, when it is allocated, split or merged
+static void pmm_free_list_remove(physical_page_info *block) {
+    // If the block is the start of the list, the list pointer will have to be updated
+    if (block == free_lists[block->order]) {
+        free_lists[block->order] = block->next;
+    }
 
-    if (popped_page->next == NULL) {
-        debug_printf("FATAL: Free page stack exhausted.\n");
-        panic(NULL, -1, "Out of memory. Free page stack exhausted.\n");
+    // Slice out the block and link the list back together
+    physical_page_info *prev = block->prev;
+    physical_page_info *next = block->next;
+    // Avoid null pointer dereferencing on the borders of the list
+    if (prev) {
+        prev->next = next;
+    }
+    if (next) {
+        next->prev = prev;
     }
+    block->prev = NULL;
+    block->next = NULL;
+    block->order = PAGE_ORDER_NONE;
+}
 
-    // Move the next page to the start of the list
-    free_list = popped_page->next;
+/// @brief Find the available region whose page array holds a page
+static struct physical_region *pmm_region_of(physical_page_info *page) {
+    for (uint i = 0; i < regions_count; i++) {
+        struct physical_region *region = &regions_array[i];
+        if (region->type == REGION_TYPE_AVAILABLE && page >= region->page_array
+                && page < region->page_array + region->length / PAGE_SIZE) {
+            return region;
+        }
+    }
+    return NULL;
+}
 
-    // Disconnect the popped page from the rest of the list
-    // popped_page->prev is already null from previously being the list's start
-    popped_page->next = NULL;
-    free_list->prev = NULL;
+/// @brief Allocate a free block, splitting a larger one if none of the right size are free
+/// @param order log2 of the number of pages in the block
+/// @param physical_upper_limit Highest physical address the block can include
+/// @return The first page of the block, with every page marked as used, or NULL if none are free
+/// @note Call with the pmm lock. Does not update memory counters
+static physical_page_info *pmm_buddy_allocate(uint order, p_addr_t physical_upper_limit) {
+    for (uint o = order; o <= PMM_MAX_ORDER; o++) {
+        physical_page_info *block = free_lists[o];
+        // Free lists aren't sorted by address, so limited allocations have to search them.
+        // Only the start of a larger block is kept, so that part is what has to fit
+        while (block && block->address + (PAGE_SIZE << order) - 1 > physical_upper_limit) {
+            block = block->next;
+        }
+        if (!block) continue;
 
-    pages_in_free_list--;
+        pmm_free_list_remove(block);
+        // Give back the upper half until the block is the requested size
+        while (o > order) {
+            o--;
+            pmm_free_list_push(block + (1ul << o), o);
+        }
 
-    return popped_page;
-    // The caller is responsible for setting the state to used and updating memory counters
+        for (size_t i = 0; i < 1ul << order; i++) {
+            block[i].state = PAGE_STATE_USED;
+        }
+        return block;
+    }
+    return NULL;
 }
 
-// Internal helper to remove a node from the free page linked list
-// Used when allocating contiguous ranges or specific addresses,
-// to prevent the free list from allocating them again
-static void pmm_free_list_remove(physical_page_info *page) {
-    // If the page is the start of the list, the list pointer will have to be updated
-    if (page == free_list) {
-        free_list = page->next;
+/// @brief Return a block to the free lists, merging it with its buddies while they are free
+/// @param region The region containing the block
+/// @param block The first page of the block, with every page of the block already marked free
+/// @param order log2 of the number of pages in the block
+/// @note Call with the pmm lock. Does not update memory counters
+static void pmm_buddy_free(struct physical_region *region, physical_page_info *block, uint order) {
+    size_t base_frame = region->base / PAGE_SIZE;
+    size_t region_pages = region->length / PAGE_SIZE;
+
+    block->order = PAGE_ORDER_NONE;
+    while (order < PMM_MAX_ORDER) {
+        // Blocks are aligned to their size, so the buddy's frame only differs by the order's bit
+        size_t buddy_frame = (block->address / PAGE_SIZE) ^ (1ul << order);
+        size_t buddy_index = buddy_frame - base_frame;
+        // Buddies starting below the region wrap around to a huge index
+        if (buddy_frame < base_frame || buddy_index + (1ul << order) > region_pages) break;
+
+        physical_page_info *buddy = &region->page_array[buddy_index];
+        if (buddy->state != PAGE_STATE_FREE || buddy->order != order) break;
+
+        pmm_free_list_remove(buddy);
+        // The merged block starts at whichever buddy is first
+        if (buddy < block) {
+            block = buddy;
+        }
+        order++;
     }
+    pmm_free_list_push(block, order);
+}
 
-    // Slice out the page and link the list back together
-    physical_page_info *prev = page->prev;
-    physical_page_info *next = page->next;
-    // Avoid null pointer dereferencing on the borders of the list
-    if (prev) {
-        prev->next = next;
+/// @brief Allocate one specific free page, splitting up the free block it is part of
+/// @note Call with the pmm lock. Does not update memory counters
+static void pmm_buddy_take_page(struct physical_region *region, physical_page_info *page) {
+    size_t index = page - region->page_array;
+    size_t frame = page->address / PAGE_SIZE;
+
+    // Look at each aligned block the page could be part of until the free one is found
+    physical_page_info *block = NULL;
+    uint order;
+    for (order = 0; order <= PMM_MAX_ORDER; order++) {
+        size_t offset = frame & ((1ul << order) - 1);
+        if (offset > index) break; // Would start before the region
+        physical_page_info *candidate = page - offset;
+        if (candidate->state == PAGE_STATE_FREE && candidate->order == order) {
+            block = candidate;
+            break;
+        }
     }
-    if (next) {
-        next->prev = prev;
+    if (!block) {
+        debug_printf("FATAL: Free page %#p is not part of a free block\n", page->address);
+        panic(NULL, -1, "Physical memory free lists are corrupted.\n");
+    }
+
+    pmm_free_list_remove(block);
+    // Keep the half with the page in it, until the page is all that is left
+    while (order > 0) {
+        order--;
+        physical_page_info *upper = block + (1ul << order);
+        if (page >= upper) {
+            pmm_free_list_push(block, order);
+            block = upper;
+        } else {
+            pmm_free_list_push(upper, order);
+        }
+    }
+
+    page->state = PAGE_STATE_USED;
+}
+
+/// @brief Free a run of pages from one region, as the largest aligned blocks that fit
+/// @note Call with the pmm lock. Does not update memory counters
+static void pmm_free_run(struct physical_region *region, physical_page_info *first, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        first[i].state = PAGE_STATE_FREE;
+        first[i].order = PAGE_ORDER_NONE;
+    }
+
+    while (count > 0) {
+        size_t frame = first->address / PAGE_SIZE;
+        uint order = 0;
+        while (order < PMM_MAX_ORDER && !(frame & (1ul << order)) && (2ul << order) <= count) {
+            order++;
+        }
+        pmm_buddy_free(region, first, order);
+        first += 1ul << order;
+        count -= 1ul << order;
+    }
+}
+
+/// @brief Link a run of consecutive page infos into a list for the caller
+/// @return The first page of the list
+static physical_page_info *pmm_link_run(physical_page_info *first, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        first[i].prev = i > 0 ? &first[i - 1] : NULL;
+        first[i].next = i + 1 < count ? &first[i + 1] : NULL;
+    }
+    return first;
+}
+
+/// @brief Move a batch of pages from the free lists into an empty cpu page cache
+static void pmm_cache_refill(struct pmm_page_cache *cache) {
+    spinlock_aquire(pmm_lock);
+    size_t count = 0;
+    while (count < PMM_CACHE_BATCH) {
+        physical_page_info *page = pmm_buddy_allocate(0, NO_ADDRESS_LIMIT);
+        if (!page) break;
+        cache->pages[count] = page;
+        count++;
+    }
+    memory_free -= count * PAGE_SIZE;
+    memory_used += count * PAGE_SIZE;
+    spinlock_release(pmm_lock);
+
+    cache->count = count;
+}
+
+/// @brief Return pages from a cpu page cache to the free lists
+/// @param count Number of pages to return, no more than are in the cache
+static void pmm_cache_drain(struct pmm_page_cache *cache, size_t count) {
+    spinlock_aquire(pmm_lock);
+    // The bottom of the stack has the pages freed longest ago
+    for (size_t i = 0; i < count; i++) {
+        physical_page_info *page = cache->pages[i];
+        page->state = PAGE_STATE_FREE;
+        pmm_buddy_free(pmm_region_of(page), page, 0);
+    }
+    memory_free += count * PAGE_SIZE;
+    memory_used -= count * PAGE_SIZE;
+    spinlock_release(pmm_lock);
+
+    for (size_t i = count; i < cache->count; i++) {
+        cache->pages[i - count] = cache->pages[i];
     }
-    pages_in_free_list--;
+    cache->count -= count;
 }
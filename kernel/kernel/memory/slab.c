@@ -0,0 +1,296 @@
+/// @file kernel/memory/slab.c
+/// @brief Object caches for fixed size kernel structures
+///
+/// Each cache splits single pages into slabs of equally sized objects. A slab's
+/// header sits at the start of its page, so the slab an object belongs to is
+/// found by rounding the object's address down. Free objects in a slab are
+/// linked together through a pointer stored in the object, or after it if
+/// the cache has a constructor whose work has to be kept.
+///
+/// In front of the slabs each cpu has a magazine of free objects for every
+/// cache. Magazines are refilled from and drained to the slabs in batches,
+/// which is the only time the cache's lock is taken.
+
+#include "kernel/memory/slab.h"
+#include "kernel/memory/pmm.h"
+#include "kernel/memory/physical_map.h"
+#include "kernel/cpu_locals.h"
+#include "kernel/string.h"
+#include "iridium/errors.h"
+#include "align.h"
+#include "types.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "arch/debug.h"
+
+/// @brief Header at the start of every slab's page
+struct kmem_slab {
+    /// Links in the cache's partial slab list
+    struct kmem_slab *prev;
+    struct kmem_slab *next;
+    /// First free object in the slab
+    void *free;
+    /// Number of objects allocated from the slab, including those in magazines
+    size_t in_use;
+    physical_page_info *page;
+};
+
+/// Offset of the first object from the start of a slab
+#define KMEM_SLAB_OBJECTS_OFFSET ((sizeof(struct kmem_slab) + KMEM_ALIGNMENT - 1) & ~(KMEM_ALIGNMENT - 1))
+
+/// Every cache that has created a slab, linked through `next_cache`.
+/// Caches are never removed, so the list can be walked without the lock once read
+static struct kmem_cache *kmem_caches;
+static lock_t kmem_caches_lock;
+
+/// @brief Find the free list link belonging to an object
+static inline void **kmem_free_link(struct kmem_cache *cache, void *object) {
+    // Constructed objects keep their state while free, so the link goes after them
+    if (cache->constructor) {
+        return (void**)((uintptr_t)object + cache->object_size);
+    }
+    return (void**)object;
+}
+
+/// @brief Find the slab an object was allocated from
+static inline struct kmem_slab *kmem_slab_of(void *object) {
+    return (struct kmem_slab*)ROUND_DOWN_PAGE((uintptr_t)object);
+}
+
+/// @brief Add a slab to the front of the cache's partial list
+static void kmem_partial_push(struct kmem_cache *cache, struct kmem_slab *slab) {
+    slab->prev = NULL;
+    slab->next = cache->partial;
+    if (cache->partial) {
+        cache->partial->prev = slab;
+    }
+    cache->partial = slab;
+}
+
+/// @brief Take a slab out of the cache's partial list
+static void kmem_partial_remove(struct kmem_cache *cache, struct kmem_slab *slab) {
+    if (slab == cache->partial) {
+        cache->partial = slab->next;
+    }
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->prev = NULL;
+    slab->next = NULL;
+}
+
+/// @brief Allocate a page for a new slab and construct its objects
+/// @note Call with a lock on `cache`
+/// @return The slab, or NULL if out of memory
+static struct kmem_slab *kmem_slab_create(struct kmem_cache *cache) {
+    if (cache->slot_size == 0) {
+        size_t slot_size = cache->object_size;
+        if (cache->constructor) {
+            slot_size += KMEM_ALIGNMENT;
+        }
+        cache->slot_size = slot_size;
+        cache->objects_per_slab = (PAGE_SIZE - KMEM_SLAB_OBJECTS_OFFSET) / slot_size;
+        if (cache->objects_per_slab > 0) {
+            spinlock_aquire(kmem_caches_lock);
+            cache->next_cache = kmem_caches;
+            kmem_caches = cache;
+            spinlock_release(kmem_caches_lock);
+        }
+    }
+    if (cache->objects_per_slab == 0) {
+        debug_printf("kmem: Objects in cache %s are too large for a slab\n", cache->name);
+        return NULL;
+    }
+
+    physical_page_info *page;
+    if (pmm_allocate_page(&page) != IR_OK) {
+        return NULL;
+    }
+
+    struct kmem_slab *slab = (struct kmem_slab*)p_addr_to_physical_map(page->address);
+    slab->prev = NULL;
+    slab->next = NULL;
+    slab->in_use = 0;
+    slab->page = page;
+
+    // Link every object in the slab in address order
+    void *object = (void*)((uintptr_t)slab + KMEM_SLAB_OBJECTS_OFFSET);
+    slab->free = object;
+    for (size_t i = 0; i < cache->objects_per_slab; i++) {
+        if (cache->constructor) {
+            cache->constructor(object);
+        }
+        void *next = (void*)((uintptr_t)object + cache->slot_size);
+        *kmem_free_link(cache, object) = i + 1 < cache->objects_per_slab ? next : NULL;
+        object = next;
+    }
+
+    cache->slab_count++;
+    cache->slab_free_objects += cache->objects_per_slab;
+    return slab;
+}
+
+/// @brief Take a free object from the cache's slabs, creating a slab if none have space
+/// @note Call with a lock on `cache`
+/// @return The object, or NULL if out of memory
+static void *kmem_slab_take(struct kmem_cache *cache) {
+    struct kmem_slab *slab = cache->partial;
+    if (!slab) {
+        // Fall back to the empty slab, then to a new one
+        slab = cache->empty;
+        cache->empty = NULL;
+        if (!slab) {
+            slab = kmem_slab_create(cache);
+            if (!slab) return NULL;
+        }
+        kmem_partial_push(cache, slab);
+    }
+
+    void *object = slab->free;
+    slab->free = *kmem_free_link(cache, object);
+    slab->in_use++;
+    cache->slab_free_objects--;
+
+    // Full slabs aren't kept on any list until an object is freed back to them
+    if (!slab->free) {
+        kmem_partial_remove(cache, slab);
+    }
+    return object;
+}
+
+/// @brief Return an object to the slab it came from
+/// @note Call with a lock on `cache`
+static void kmem_slab_give(struct kmem_cache *cache, void *object) {
+    struct kmem_slab *slab = kmem_slab_of(object);
+
+    bool was_full = !slab->free;
+    *kmem_free_link(cache, object) = slab->free;
+    slab->free = object;
+    slab->in_use--;
+    cache->slab_free_objects++;
+
+    if (was_full) {
+        kmem_partial_push(cache, slab);
+    }
+
+    if (slab->in_use == 0) {
+        kmem_partial_remove(cache, slab);
+        // Keep one empty slab around, and give any others back to the pmm
+        if (!cache->empty) {
+            cache->empty = slab;
+        } else {
+            cache->slab_count--;
+            cache->slab_free_objects -= cache->objects_per_slab;
+            pmm_free_page(slab->page);
+        }
+    }
+}
+
+/// @brief Move a batch of objects from the cache's slabs into an empty magazine
+static void kmem_magazine_refill(struct kmem_cache *cache, struct kmem_magazine *magazine) {
+    spinlock_aquire(cache->lock);
+    while (magazine->count < KMEM_MAGAZINE_BATCH) {
+        void *object = kmem_slab_take(cache);
+        if (!object) break;
+        magazine->objects[magazine->count] = object;
+        magazine->count++;
+    }
+    spinlock_release(cache->lock);
+}
+
+/// @brief Return a batch of objects from a full magazine to the cache's slabs
+static void kmem_magazine_drain(struct kmem_cache *cache, struct kmem_magazine *magazine) {
+    spinlock_aquire(cache->lock);
+    // The bottom of the stack has the objects freed longest ago
+    for (size_t i = 0; i < KMEM_MAGAZINE_BATCH; i++) {
+        kmem_slab_give(cache, magazine->objects[i]);
+    }
+    spinlock_release(cache->lock);
+
+    for (size_t i = KMEM_MAGAZINE_BATCH; i < magazine->count; i++) {
+        magazine->objects[i - KMEM_MAGAZINE_BATCH] = magazine->objects[i];
+    }
+    magazine->count -= KMEM_MAGAZINE_BATCH;
+}
+
+/// @brief Allocate an object from a cache
+/// @return The object, holding whatever it did when it was freed, or NULL if out of memory
+void *kmem_cache_alloc(struct kmem_cache *cache) {
+    struct kmem_magazine *magazine = &cache->magazines[this_cpu->core_id];
+
+    if (magazine->count == 0) {
+        kmem_magazine_refill(cache, magazine);
+        if (magazine->count == 0) {
+            return NULL;
+        }
+    }
+
+    magazine->count--;
+    magazine->allocations++;
+    return magazine->objects[magazine->count];
+}
+
+/// @brief Allocate an object from a cache and zero it
+/// @return The object, or NULL if out of memory
+void *kmem_cache_zalloc(struct kmem_cache *cache) {
+    void *object = kmem_cache_alloc(cache);
+    if (object) {
+        memset(object, 0, cache->object_size);
+    }
+    return object;
+}
+
+/// @brief Return an object to the cache it was allocated from
+/// @param object The object, or NULL to do nothing
+void kmem_cache_free(struct kmem_cache *cache, void *object) {
+    if (!object) return;
+
+    struct kmem_magazine *magazine = &cache->magazines[this_cpu->core_id];
+    if (magazine->count == KMEM_MAGAZINE_SIZE) {
+        kmem_magazine_drain(cache, magazine);
+    }
+
+    magazine->objects[magazine->count] = object;
+    magazine->count++;
+    magazine->frees++;
+}
+
+/// @brief Total a cache's statistics across every cpu
+void kmem_cache_get_stats(struct kmem_cache *cache, struct kmem_cache_stats *stats_out) {
+    struct kmem_cache_stats stats = {0};
+
+    spinlock_aquire(cache->lock);
+    stats.slabs = cache->slab_count;
+    stats.objects_free = cache->slab_free_objects;
+    size_t capacity = cache->slab_count * cache->objects_per_slab;
+    spinlock_release(cache->lock);
+
+    // Other cpus' magazines can change while being read, so the totals are approximate
+    for (int i = 0; i < MAX_CPUS_COUNT; i++) {
+        struct kmem_magazine *magazine = &cache->magazines[i];
+        stats.objects_free += magazine->count;
+        stats.allocations += magazine->allocations;
+        stats.frees += magazine->frees;
+    }
+    stats.objects_in_use = capacity > stats.objects_free ? capacity - stats.objects_free : 0;
+
+    *stats_out = stats;
+}
+
+/// @brief Print the statistics of every cache that has been used over the debug output
+void kmem_dump_stats(void) {
+    spinlock_aquire(kmem_caches_lock);
+    struct kmem_cache *cache = kmem_caches;
+    spinlock_release(kmem_caches_lock);
+
+    for (; cache; cache = cache->next_cache) {
+        struct kmem_cache_stats stats;
+        kmem_cache_get_stats(cache, &stats);
+        debug_printf("kmem: %s - %zu slabs, %zu objects in use, %zu free, %zu allocations, %zu frees\n",
+            cache->name, stats.slabs, stats.objects_in_use, stats.objects_free, stats.allocations, stats.frees);
+    }
+}
@@ -34,17 +34,181 @@
 #include "align.h"
 #include <stddef.h>
 
-/// @brief Linked list search/sort function for comparing the bases of `v_addr_region`s
-/// @return A negative value if `data` is smaller, positive if `target` is larger, or 0 if they are equal
-int compare_bases(void *data, void *target) {
-    v_addr_t d_base = ((struct v_addr_region*)data)->base;
-    v_addr_t t_base = ((struct v_addr_region*)target)->base;
-    if (d_base == t_base) return 0;
-    else if (d_base < t_base) return -1;
-    else return 1;
-
-    // With this line, I ran into a problem with the difference flowing into the sign bit and messing up ordering
-    // return ((v_addr_region*)data)->base - ((v_addr_region*)target)->base;
+// Each region's children are kept in an AVL tree ordered by base address.
+// Every node also records the bounds of its subtree and the largest gap between
+// neighbouring regions inside it, so free space can be found without visiting
+// subtrees that can't contain a large enough gap.
+
+static inline int region_tree_height(struct v_addr_region *node) {
+    return node ? node->height : 0;
+}
+
+/// @brief Recalculate a node's height and subtree bounds from its children
+static void region_tree_update(struct v_addr_region *node) {
+    int left_height = region_tree_height(node->left);
+    int right_height = region_tree_height(node->right);
+    node->height = 1 + (left_height > right_height ? left_height : right_height);
+
+    v_addr_t end = node->base + node->length;
+    node->subtree_start = node->left ? node->left->subtree_start : node->base;
+    node->subtree_end = node->right ? node->right->subtree_end : end;
+
+    size_t max_gap = 0;
+    if (node->left) {
+        max_gap = node->left->subtree_max_gap;
+        if (node->base - node->left->subtree_end > max_gap) max_gap = node->base - node->left->subtree_end;
+    }
+    if (node->right) {
+        if (node->right->subtree_max_gap > max_gap) max_gap = node->right->subtree_max_gap;
+        if (node->right->subtree_start - end > max_gap) max_gap = node->right->subtree_start - end;
+    }
+    node->subtree_max_gap = max_gap;
+}
+
+static struct v_addr_region *region_tree_rotate_left(struct v_addr_region *node) {
+    struct v_addr_region *right = node->right;
+    node->right = right->left;
+    right->left = node;
+    region_tree_update(node);
+    region_tree_update(right);
+    return right;
+}
+
+static struct v_addr_region *region_tree_rotate_right(struct v_addr_region *node) {
+    struct v_addr_region *left = node->left;
+    node->left = left->right;
+    left->right = node;
+    region_tree_update(node);
+    region_tree_update(left);
+    return left;
+}
+
+/// @brief Restore the AVL property at a node whose subtrees changed
+/// @return The new root of the subtree
+static struct v_addr_region *region_tree_balance(struct v_addr_region *node) {
+    region_tree_update(node);
+    int balance = region_tree_height(node->left) - region_tree_height(node->right);
+
+    if (balance > 1) {
+        if (region_tree_height(node->left->left) < region_tree_height(node->left->right)) {
+            node->left = region_tree_rotate_left(node->left);
+        }
+        return region_tree_rotate_right(node);
+    }
+    if (balance < -1) {
+        if (region_tree_height(node->right->right) < region_tree_height(node->right->left)) {
+            node->right = region_tree_rotate_right(node->right);
+        }
+        return region_tree_rotate_left(node);
+    }
+    return node;
+}
+
+/// @brief Add a region to a tree of regions it doesn't overlap
+/// @return The new root of the tree
+static struct v_addr_region *region_tree_insert(struct v_addr_region *root, struct v_addr_region *region) {
+    if (!root) {
+        region->left = NULL;
+        region->right = NULL;
+        region_tree_update(region);
+        return region;
+    }
+
+    if (region->base < root->base) {
+        root->left = region_tree_insert(root->left, region);
+    } else {
+        root->right = region_tree_insert(root->right, region);
+    }
+    return region_tree_balance(root);
+}
+
+/// @brief Take the lowest region out of a tree
+/// @param min_out Set to the removed region
+/// @return The new root of the tree
+static struct v_addr_region *region_tree_remove_min(struct v_addr_region *root, struct v_addr_region **min_out) {
+    if (!root->left) {
+        *min_out = root;
+        return root->right;
+    }
+    root->left = region_tree_remove_min(root->left, min_out);
+    return region_tree_balance(root);
+}
+
+/// @brief Take a region out of the tree it's in
+/// @return The new root of the tree
+static struct v_addr_region *region_tree_remove(struct v_addr_region *root, struct v_addr_region *region) {
+    if (!root) return NULL;
+
+    if (region->base < root->base) {
+        root->left = region_tree_remove(root->left, region);
+    } else if (region->base > root->base) {
+        root->right = region_tree_remove(root->right, region);
+    } else {
+        if (!root->left) return root->right;
+        if (!root->right) return root->left;
+
+        // Replace the region with the next one along
+        struct v_addr_region *successor;
+        struct v_addr_region *right = region_tree_remove_min(root->right, &successor);
+        successor->left = root->left;
+        successor->right = right;
+        root = successor;
+    }
+    return region_tree_balance(root);
+}
+
+/// @brief Find the region in a tree containing an address
+/// @return The region, or NULL if none contains `address`
+static struct v_addr_region *region_tree_find(struct v_addr_region *node, v_addr_t address) {
+    while (node) {
+        if (address < node->base) {
+            node = node->left;
+        } else if (address - node->base < node->length) {
+            return node;
+        } else {
+            node = node->right;
+        }
+    }
+    return NULL;
+}
+
+/// @brief Find the region in a tree with the highest base below an address
+/// @return The region, or NULL if every region starts at or above `address`
+static struct v_addr_region *region_tree_find_below(struct v_addr_region *node, v_addr_t address) {
+    struct v_addr_region *found = NULL;
+    while (node) {
+        if (node->base < address) {
+            found = node;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+    return found;
+}
+
+/// @brief Find the lowest gap of at least `length` bytes before or between the regions in a tree
+/// @param previous_end End of the space taken up before the tree's lowest region
+/// @param address_out Set to the start of the gap
+/// @return Whether a gap was found. Space after the tree's highest region isn't checked
+static bool region_tree_find_gap(struct v_addr_region *node, v_addr_t previous_end, size_t length, v_addr_t *address_out) {
+    if (!node) return false;
+
+    if (node->subtree_start - previous_end >= length) {
+        *address_out = previous_end;
+        return true;
+    }
+    if (node->subtree_max_gap < length) return false;
+
+    if (node->left) {
+        if (region_tree_find_gap(node->left, previous_end, length, address_out)) return true;
+        previous_end = node->left->subtree_end;
+    }
+    if (node->base - previous_end >= length) {
+        *address_out = previous_end;
+        return true;
+    }
+    return region_tree_find_gap(node->right, node->base + node->length, length, address_out);
 }
 
 /// @brief Create a region representing an entire address space.
@@ -71,46 +235,39 @@ ir_status_t v_addr_region_create_root(address_space *address_space, v_addr_t bas
     return IR_OK;
 }
 
-/// @brief Create a new v_addr_region from a portion of a parent's address space
+/// @brief Create a region whose base sits at a particular offset from a boundary
 ///
-/// Caller is responsible for checking flags are allowed by parent (TODO?)
-///
-/// @note New regions have 0 references! If a handle is created and removed the
-/// object will be garbage collected
-/// @param parent
-/// @param length Size of the region in bytes. Rounded upwards to nearest page.
-/// @param flags Memory access permissions for this region and child regions
-/// @param out Output parameter set to the newly created region
-/// @param address_out Output parameter set to the region's base address
-/// @return `IR_OK` If the region was successfully created and added to the parent, or an error code.
-ir_status_t v_addr_region_create(struct v_addr_region *parent, size_t length, uint64_t flags,
-        struct v_addr_region **out, v_addr_t *address_out) {
+/// Used to line regions up with the physical memory they map, so the mmu can use large pages.
+/// @param alignment Boundary the offset is measured from, a power of 2 and a multiple of the page size
+/// @param offset Offset from the boundary the region's base has to be at
+/// @see `v_addr_region_create`
+static ir_status_t v_addr_region_create_aligned(struct v_addr_region *parent, size_t length, size_t alignment, size_t offset,
+        uint64_t flags, struct v_addr_region **out, v_addr_t *address_out) {
 
     length = ROUND_UP_PAGE(length);
     if (parent->destroyed) {
         return IR_ERROR_BAD_STATE;
     }
+    // Empty regions would share their base with a neighbour
+    if (length == 0) {
+        return IR_ERROR_INVALID_ARGUMENTS;
+    }
     // Search for a free area large enough
-
-    // TODO: This is horribly inefficient
-    // Needs a whole different data structure to work well
-    v_addr_t previous_end = parent->base;
-    bool found = false;
-    for (uint i = 0; i < parent->object.children.count; i++) {
-        struct v_addr_region *region;
-        linked_list_get(&parent->object.children, i, (void**)&region);
-        // Check the amount of space inbetween regions
-        if (region->base - previous_end >= length) {
-            found = true;
-            break;
+    // Locked until the region is inserted, so other cpus can't claim the same gap
+    spinlock_aquire(parent->object.lock);
+
+    // Any gap with room for the region and the padding in front of it will do
+    size_t padded_length = length + alignment - PAGE_SIZE;
+    v_addr_t previous_end;
+    if (!region_tree_find_gap(parent->children, parent->base, padded_length, &previous_end)) {
+        // Also check if it will fit in after all the existing regions, if theres no space inbetween them
+        previous_end = parent->children ? parent->children->subtree_end : parent->base;
+        if (parent->base + parent->length - previous_end < padded_length) {
+            spinlock_release(parent->object.lock);
+            return IR_ERROR_NO_MEMORY;
         }
-        previous_end = region->base + region->length;
-    }
-
-    // Also check if it will fit in after all the existing regions, if theres no space inbetween them
-    if (!found && parent->base + parent->length - previous_end < length) {
-        return IR_ERROR_NO_MEMORY;
     }
+    previous_end += (offset - previous_end) & (alignment - 1);
 
     //debug_printf("Allocated region at %#p in parent %#p\n", previous_end, parent->base);
 
@@ -133,8 +290,8 @@ ir_status_t v_addr_region_create(struct v_addr_region *parent, size_t length, ui
 
     //debug_printf("V_ADDR_REGION object created at %#p\n", region);
 
-    // Keep the list sorted to simplify searching through it for gaps
-    linked_list_add_sorted(&parent->object.children, compare_bases, region);
+    parent->children = region_tree_insert(parent->children, region);
+    spinlock_release(parent->object.lock);
 
     // This pointer can be used to create a hande to the new region
     if (out) *out = region;
@@ -143,6 +300,23 @@ ir_status_t v_addr_region_create(struct v_addr_region *parent, size_t length, ui
     return IR_OK;
 }
 
+/// @brief Create a new v_addr_region from a portion of a parent's address space
+///
+/// Caller is responsible for checking flags are allowed by parent (TODO?)
+///
+/// @note New regions have 0 references! If a handle is created and removed the
+/// object will be garbage collected
+/// @param parent
+/// @param length Size of the region in bytes. Rounded upwards to nearest page.
+/// @param flags Memory access permissions for this region and child regions
+/// @param out Output parameter set to the newly created region
+/// @param address_out Output parameter set to the region's base address
+/// @return `IR_OK` If the region was successfully created and added to the parent, or an error code.
+ir_status_t v_addr_region_create(struct v_addr_region *parent, size_t length, uint64_t flags,
+        struct v_addr_region **out, v_addr_t *address_out) {
+    return v_addr_region_create_aligned(parent, length, PAGE_SIZE, 0, flags, out, address_out);
+}
+
 ir_status_t v_addr_region_create_specific(struct v_addr_region *parent, v_addr_t address, size_t length,
         uint64_t flags, struct v_addr_region **out, v_addr_t *address_out) {
     if (parent->destroyed)
@@ -155,21 +329,23 @@ ir_status_t v_addr_region_create_specific(struct v_addr_region *parent, v_addr_t
     length = ROUND_UP_PAGE(old_end) - address;
 
     length = ROUND_UP_PAGE(length);
+    // Empty regions would share their base with a neighbour
+    if (length == 0) {
+        return IR_ERROR_INVALID_ARGUMENTS;
+    }
 
     //debug_printf("Allocating %#zx byte region at specific address %#p in parent %#p\n", length, address, parent->base);
 
-    // TODO: Same as above, needs an iterator or different data structure
+    spinlock_aquire(parent->object.lock);
+
+    // Children don't overlap, so only the last one starting before the end can reach into the range
     v_addr_t start = address, end = start + length;
-    for (uint i = 0; i < parent->object.children.count; i++) {
-        struct v_addr_region *region;
-        linked_list_get(&parent->object.children, i, (void**)&region);
-
-        v_addr_t other_start = region->base, other_end = region->base + region->length;
-        // Check the amount of space inbetween regions
-        if (start < other_end && end > other_start ) {
-            debug_printf("Can't map region from %#p to %#p because it overlaps with a region from %#p to %#p\n", start, end, other_start, other_end);
-            return IR_ERROR_NO_MEMORY;
-        }
+    struct v_addr_region *other = region_tree_find_below(parent->children, end);
+    if (other && other->base + other->length > start) {
+        spinlock_release(parent->object.lock);
+        debug_printf("Can't map region from %#p to %#p because it overlaps with a region from %#p to %#p\n",
+            start, end, other->base, other->base + other->length);
+        return IR_ERROR_NO_MEMORY;
     }
 
     // Child region keeps parent alive
@@ -184,14 +360,8 @@ ir_status_t v_addr_region_create_specific(struct v_addr_region *parent, v_addr_t
     region->flags = flags;
     region->length = length;
 
-    // Keep the list sorted to simplify searching through it for gaps
-    linked_list_add_sorted(&parent->object.children, compare_bases, region);
-
-    // Debugging information, display all of the parent's children
-    for (uint i = 0; i < parent->object.children.count; i++) {
-        struct v_addr_region *region;
-        linked_list_get(&parent->object.children, i, (void**)&region);
-    }
+    parent->children = region_tree_insert(parent->children, region);
+    spinlock_release(parent->object.lock);
 
     // This pointer can be used to create a hande to the new region
     if (out) *out = region;
@@ -199,6 +369,29 @@ ir_status_t v_addr_region_create_specific(struct v_addr_region *parent, v_addr_t
     return IR_OK;
 }
 
+/// Most pages `v_addr_region_map_vm_object` passes to the paging functions at once
+#define V_ADDR_REGION_MAP_BATCH 64
+
+/// @brief Flags to map one of a region's pages with
+///
+/// Pages shared copy-on-write are mapped read only, so writing to them faults and gets a private copy.
+/// @note Call with a lock on the region's vm_object
+static uint64_t v_addr_region_page_flags(struct v_addr_region *region, physical_page_info *page) {
+    if (page->references > 1) {
+        return region->flags & ~V_ADDR_REGION_WRITABLE;
+    }
+    return region->flags;
+}
+
+/// @brief Remove a region that was just created and never handed out
+static void v_addr_region_discard(struct v_addr_region *parent, struct v_addr_region *region) {
+    spinlock_aquire(parent->object.lock);
+    parent->children = region_tree_remove(parent->children, region);
+    spinlock_release(parent->object.lock);
+    object_decrement_references((object*)parent);
+    free(region);
+}
+
 /// Map a virtual memory object into a virtual address region in a process.
 /// The caller should obtain the appropriate locks before calling to
 /// maintain reentrancy.
@@ -211,45 +404,91 @@ ir_status_t v_addr_region_map_vm_object(struct v_addr_region *parent, uint64_t f
         return IR_ERROR_BAD_STATE;
     }
 
+    // Device memory keeps the memory type it was created with, no matter how the mapping asks for it
+    if (vm->access_flags & VM_DISABLE_CACHING) flags |= V_ADDR_REGION_DISABLE_CACHE;
+    else if (vm->access_flags & VM_WRITE_COMBINING) flags |= V_ADDR_REGION_WRITE_COMBINE;
+
     struct v_addr_region *region = NULL;
     ir_status_t status;
     if (flags & V_ADDR_REGION_MAP_SPECIFIC) {
         flags &= ~V_ADDR_REGION_MAP_SPECIFIC;
         status = v_addr_region_create_specific(parent, address, vm->size, flags, &region, &address);
+    } else if (vm->physically_contiguous) {
+        // Matching the physical memory's alignment lets it be mapped with large pages,
+        // but the padding that takes isn't worth failing over
+        size_t alignment = arch_mmu_contiguous_alignment(vm->size);
+        p_addr_t physical_base = vm_object_get_page(vm, 0)->address;
+        status = v_addr_region_create_aligned(parent, vm->size, alignment, physical_base & (alignment - 1), flags, &region, &address);
+        if (status == IR_ERROR_NO_MEMORY) {
+            status = v_addr_region_create(parent, vm->size, flags, &region, &address);
+        }
     } else {
         status = v_addr_region_create(parent, vm->size, flags, &region, &address);
     }
     if (status != IR_OK ) return status;
 
+    // The kernel can't take page faults on its own memory, so its mappings are backed up front
+    if (parent->containing_address_space == get_kernel_address_space()) {
+        status = vm_object_commit(vm);
+        if (status != IR_OK) {
+            v_addr_region_discard(parent, region);
+            return status;
+        }
+    }
+
+    // Faults on the region map pages under this lock too
+    spinlock_aquire(vm->object.lock);
     vm->object.references++;
+    vm->mapping_count++;
     parent->object.references++;
     region->vm_object = vm;
 
-    // Create an array of the pages' physical addresses for the paging function
-
-    p_addr_t *physical_addresses = malloc(vm->page_count * sizeof(p_addr_t));
-    physical_page_info *page = vm->page_list;
-    for (uint i = 0; i < vm->page_count; i++) {
-        physical_addresses[i] = page->address;
-        page = page->next;
+    // Only pages that have been touched are mapped, the rest are mapped as they fault.
+    // Runs are split at gaps, and where the flags change at pages shared with clones
+    ir_status_t result = IR_OK;
+    p_addr_t physical_addresses[V_ADDR_REGION_MAP_BATCH];
+    size_t run = 0;
+    size_t run_start = 0;
+    uint64_t run_flags = 0;
+    if (vm->physically_contiguous) {
+        // Every page is present and none are shared, so the whole range goes in at once
+        result = arch_mmu_map_contiguous(parent->containing_address_space, address, vm->page_count,
+            vm_object_get_page(vm, 0)->address, region->flags);
     }
+    for (size_t index = 0; result == IR_OK && !vm->physically_contiguous; index++) {
+        physical_page_info *page = vm_object_next_page(vm, &index);
+        uint64_t page_flags = page ? v_addr_region_page_flags(region, page) : 0;
+        if (run > 0 && (!page || index != run_start + run || page_flags != run_flags || run == V_ADDR_REGION_MAP_BATCH)) {
+            result = arch_mmu_map(parent->containing_address_space, address + run_start * PAGE_SIZE, run, physical_addresses, run_flags);
+            run = 0;
+        }
+        if (!page) break;
 
-    //debug_printf("Mapping v_addr_region with physical address [0] = %#p\n", physical_addresses[0]);
-
-    ir_status_t result = arch_mmu_map(parent->containing_address_space, address, vm->page_count, physical_addresses, flags);
-    free(physical_addresses);
-    if (result == IR_ERROR_NO_MEMORY) {
+        if (run == 0) {
+            run_start = index;
+            run_flags = page_flags;
+        }
+        physical_addresses[run++] = page->address;
+    }
+    if (result == IR_OK) {
+        region->next_mapping = vm->mappings;
+        vm->mappings = region;
+        parent->containing_address_space->committed_pages += vm->page_count;
+    } else {
         debug_printf("Mapping failed, removing mapping @ %#p!\n", address);
 
         // Try to cleanup the failed mappings
-        arch_mmu_unmap(region->containing_address_space, address, vm->page_count);
-        object_decrement_references((object*)vm);
+        arch_mmu_unmap(region->containing_address_space, address, region->length);
+        vm->mapping_count--;
+    }
+    spinlock_release(vm->object.lock);
 
-        // Destroy the region, since the caller cant access memory through it anyway
-        linked_list_find_and_remove(&parent->object.children, region, NULL, NULL);
+    if (result != IR_OK) {
+        object_decrement_references((object*)vm);
         object_decrement_references((object*)parent);
-        free(region);
 
+        // Destroy the region, since the caller cant access memory through it anyway
+        v_addr_region_discard(parent, region);
         return IR_ERROR_NO_MEMORY;
     }
 
@@ -258,6 +497,182 @@ ir_status_t v_addr_region_map_vm_object(struct v_addr_region *parent, uint64_t f
     return IR_OK;
 }
 
+/// @brief Find the region mapping a vm_object that contains a range of addresses
+///
+/// Searches down through `root`'s descendants for the region containing `address`.
+/// @param root The region to search, usually the root of a process's address space
+/// @param address Start of the range
+/// @param length Length of the range in bytes, which must all be inside the one region
+/// @param out Output parameter set to the region. It has an added reference, which
+///            the caller must remove with `object_decrement_references`
+/// @return `IR_OK` on success, or `IR_ERROR_NOT_FOUND` if no single region maps the whole range
+ir_status_t v_addr_region_find_mapping(struct v_addr_region *root, v_addr_t address, size_t length, struct v_addr_region **out) {
+    struct v_addr_region *region = root;
+    spinlock_aquire(region->object.lock);
+
+    while (!region->vm_object) {
+        struct v_addr_region *child = region_tree_find(region->children, address);
+        if (!child || child->destroyed) {
+            spinlock_release(region->object.lock);
+            return IR_ERROR_NOT_FOUND;
+        }
+
+        // Parents are always locked before their children
+        spinlock_aquire(child->object.lock);
+        spinlock_release(region->object.lock);
+        region = child;
+    }
+
+    if (region->destroyed || length > region->length - (address - region->base)) {
+        spinlock_release(region->object.lock);
+        return IR_ERROR_NOT_FOUND;
+    }
+
+    region->object.references++;
+    spinlock_release(region->object.lock);
+    *out = region;
+    return IR_OK;
+}
+
+/// @brief Swap pages into part of a region mapping a vm_object, remapping them in place
+///
+/// Moves memory into and out of an address space without copying it.
+/// @param region A writable region mapping a vm_object that isn't mapped anywhere else
+/// @param address Page aligned start of the range to exchange, inside `region`
+/// @param count Number of pages to exchange
+/// @param pages List of `count` pages to put in the range. Set to the list of pages taken out of it
+/// @return `IR_OK` on success, `IR_ERROR_ACCESS_DENIED` if the region isn't writable,
+///         or an error from `vm_object_exchange_pages`
+ir_status_t v_addr_region_exchange_pages(struct v_addr_region *region, v_addr_t address, size_t count, physical_page_info **pages) {
+    // Swapping pages changes the memory's contents, which a read only mapping must never see
+    if (~region->flags & V_ADDR_REGION_WRITABLE) return IR_ERROR_ACCESS_DENIED;
+
+    vm_object *vm = region->vm_object;
+    size_t first_page = (address - region->base) / PAGE_SIZE;
+
+    // The whole range is remapped at once, so other cpus' stale translations are flushed in one round
+    p_addr_t *physical_addresses = malloc(count * sizeof(p_addr_t));
+
+    // Held until the page tables match the object, so concurrent exchanges can't leave old pages mapped
+    spinlock_aquire(vm->object.lock);
+    ir_status_t status = vm_object_exchange_pages(vm, first_page, count, pages);
+    if (status != IR_OK) {
+        spinlock_release(vm->object.lock);
+        free(physical_addresses);
+        return status;
+    }
+
+    ir_status_t map_status = IR_ERROR_NO_MEMORY;
+    if (physical_addresses) {
+        for (size_t i = 0; i < count; i++) {
+            physical_addresses[i] = vm_object_get_page(vm, first_page + i)->address;
+        }
+        // None of the new pages are shared, so they all get the region's flags
+        map_status = arch_mmu_map(region->containing_address_space, address, count, physical_addresses, region->flags);
+    }
+    if (map_status != IR_OK) {
+        // Mapping stops at the first page table it can't allocate, and later pages could still
+        // map the old memory. With the range unmapped the new pages are mapped as they fault
+        arch_mmu_unmap(region->containing_address_space, address, count * PAGE_SIZE);
+    }
+    spinlock_release(vm->object.lock);
+    free(physical_addresses);
+    return IR_OK;
+}
+
+/// @brief Back a page of memory after an access to it faulted
+///
+/// Finds the region mapping a vm_object at the address, commits the page in the
+/// object if it was never touched, and maps it so the access can be retried.
+/// Writes to pages shared copy-on-write copy the page first.
+/// @param root The root region of the address space the fault happened in
+/// @param address The address that was accessed
+/// @param write Whether the access was a write
+/// @param execute Whether the access was an instruction fetch
+/// @return `IR_OK` if the page was mapped, `IR_ERROR_NOT_FOUND` if no memory is mapped at `address`,
+///         `IR_ERROR_ACCESS_DENIED` if the region doesn't allow the access, or `IR_ERROR_NO_MEMORY`
+ir_status_t v_addr_region_handle_fault(struct v_addr_region *root, v_addr_t address, bool write, bool execute) {
+    struct v_addr_region *region;
+    ir_status_t status = v_addr_region_find_mapping(root, address, 1, &region);
+    if (status != IR_OK) return status;
+
+    uint64_t required = V_ADDR_REGION_READABLE;
+    if (write) required = V_ADDR_REGION_WRITABLE;
+    if (execute) required = V_ADDR_REGION_EXECUTABLE;
+
+    vm_object *vm = region->vm_object;
+    address = ROUND_DOWN_PAGE(address);
+    size_t index = (address - region->base) / PAGE_SIZE;
+    if ((region->flags & required) != required) {
+        status = IR_ERROR_ACCESS_DENIED;
+    } else if (index >= vm->page_count) {
+        // Regions mapped at unaligned addresses can extend a page past their object
+        status = IR_ERROR_NOT_FOUND;
+    } else {
+        spinlock_aquire(vm->object.lock);
+        physical_page_info *page;
+        status = vm_object_commit_page(vm, index, write, &page);
+        // Destroying the region unmaps it with this lock held, so it can't be left mapped
+        if (status == IR_OK && region->destroyed) {
+            status = IR_ERROR_NOT_FOUND;
+        }
+        if (status == IR_OK) {
+            status = arch_mmu_map(region->containing_address_space, address, 1, &page->address, v_addr_region_page_flags(region, page));
+        }
+        spinlock_release(vm->object.lock);
+    }
+
+    object_decrement_references(&region->object);
+    return status;
+}
+
+/// @brief Remap the pages of a region that are shared copy-on-write as read only
+///
+/// Used once a region's vm_object is cloned, since the pages it already mapped were writable.
+/// @note Call with a lock on the region's vm_object
+void v_addr_region_protect_shared(struct v_addr_region *region) {
+    if (region->destroyed || (~region->flags & V_ADDR_REGION_WRITABLE)) return;
+
+    vm_object *vm = region->vm_object;
+    size_t count = region->length / PAGE_SIZE;
+    if (count > vm->page_count) count = vm->page_count;
+
+    physical_page_info *page;
+    for (size_t i = 0; (page = vm_object_next_page(vm, &i)) && i < count; i++) {
+        if (page->references > 1) {
+            // Pages that haven't been mapped yet are left alone
+            arch_mmu_protect(region->containing_address_space, region->base + i * PAGE_SIZE, 1, v_addr_region_page_flags(region, page));
+        }
+    }
+}
+
+/// @brief Remove a run of a vm_object's pages from every region mapping it
+///
+/// Used before the object replaces the pages, so each mapping faults in the new
+/// pages instead of using the old ones. Regions in one address space share a shootdown.
+/// @note Call with a lock on `vm`. The old pages can be freed once this returns
+/// @param first_page Index of the first page to unmap
+/// @param count Number of pages to unmap
+void v_addr_region_unmap_object_pages(vm_object *vm, size_t first_page, size_t count) {
+    struct tlb_gather gather;
+    address_space *gather_space = NULL;
+
+    // Destroyed regions are included, since they stay mapped until they are taken off the list
+    for (struct v_addr_region *region = vm->mappings; region; region = region->next_mapping) {
+        size_t region_pages = region->length / PAGE_SIZE;
+        if (first_page >= region_pages) continue;
+
+        if (region->containing_address_space != gather_space) {
+            if (gather_space) arch_mmu_gather_flush(&gather);
+            gather_space = region->containing_address_space;
+            arch_mmu_gather_init(&gather, gather_space);
+        }
+        size_t pages = count < region_pages - first_page ? count : region_pages - first_page;
+        arch_mmu_unmap_gather(&gather, region->base + first_page * PAGE_SIZE, pages * PAGE_SIZE);
+    }
+    if (gather_space) arch_mmu_gather_flush(&gather);
+}
+
 /// @brief Remove a virtual address region
 ///
 /// Recursively removes all child mappings as well.
@@ -275,10 +690,11 @@ void v_addr_region_destroy(struct v_addr_region *region) {
     debug_printf("Base: %#p, Length: %#zx, Parent: %#p\n", region->base, region->length, region->object.parent);
 
     // Root regions have no parent, and are managed by the associated process directly
-    if (region->object.parent) {
-        if (linked_list_find_and_remove(&region->object.parent->children, region, compare_bases, NULL) != IR_OK) {
-            debug_printf("Failed to remove region from parent!\n");
-        }
+    struct v_addr_region *parent = (struct v_addr_region*)region->object.parent;
+    if (parent) {
+        spinlock_aquire(parent->object.lock);
+        parent->children = region_tree_remove(parent->children, region);
+        spinlock_release(parent->object.lock);
     }
 
     // Prevents further operations on the object
@@ -288,15 +704,39 @@ void v_addr_region_destroy(struct v_addr_region *region) {
     region->object.parent = NULL;
 
     if (region->vm_object) {
-        arch_mmu_unmap(region->containing_address_space, region->base, region->length);
+        struct tlb_gather gather;
+        arch_mmu_gather_init(&gather, region->containing_address_space);
+
+        // Faults map pages with the vm_object locked and check `destroyed` first,
+        // so once this has the lock nothing can be mapped after the unmap
+        spinlock_aquire(region->vm_object->object.lock);
+        arch_mmu_unmap_gather(&gather, region->base, region->length);
+        region->containing_address_space->committed_pages -= region->vm_object->page_count;
+        region->vm_object->mapping_count--;
+        struct v_addr_region **link = &region->vm_object->mappings;
+        while (*link != region) {
+            link = &(*link)->next_mapping;
+        }
+        *link = region->next_mapping;
+        spinlock_release(region->vm_object->object.lock);
+
+        // Other cpus are waited on without the lock held, and have to drop the old mappings
+        // before the pages can be freed with the vm_object
+        arch_mmu_gather_flush(&gather);
         object_decrement_references((object*)region->vm_object);
     }
 
-    // Recursively free regions
-    struct v_addr_region *child;
-    while(linked_list_remove(&region->object.children, 0, (void**)&child) == IR_OK) {
-        if (!child->destroyed)
-            v_addr_region_destroy(child);
+    // Recursively free regions. Destroying a child takes it out of the tree
+    for (;;) {
+        spinlock_aquire(region->object.lock);
+        struct v_addr_region *child = region->children;
+        if (child && child->destroyed) {
+            region->children = region_tree_remove(region->children, child);
+        }
+        spinlock_release(region->object.lock);
+
+        if (!child) break;
+        if (!child->destroyed) v_addr_region_destroy(child);
     }
 }
 
@@ -331,16 +771,12 @@ ir_status_t sys_v_addr_region_create(ir_handle_t parent, size_t length, uint64_t
         return IR_ERROR_INVALID_ARGUMENTS;
     }
     struct process *process = (struct process*)this_cpu->current_thread->object.parent;
-    spinlock_aquire(process->handle_table_lock);
 
-    struct handle *parent_handle;
-    ir_status_t status = linked_list_find(&process->handle_table, (void*)parent, handle_by_id, NULL, (void**)&parent_handle);
-    if (status != IR_OK) {
-        spinlock_release(process->handle_table_lock);
+    struct handle *parent_handle = handle_table_get(&process->handle_table, parent);
+    if (!parent_handle) {
         return IR_ERROR_BAD_HANDLE;
     }
     if (parent_handle->object->type != OBJECT_TYPE_V_ADDR_REGION) {
-        spinlock_release(process->handle_table_lock);
         return IR_ERROR_WRONG_TYPE;
     }
 
@@ -348,18 +784,16 @@ ir_status_t sys_v_addr_region_create(ir_handle_t parent, size_t length, uint64_t
 
     struct v_addr_region *child;
     v_addr_t address;
-    status = v_addr_region_create(parent_region, length, flags, &child, &address);
+    ir_status_t status = v_addr_region_create(parent_region, length, flags, &child, &address);
     if (status != IR_OK) {
         // Child region could not be created
-        spinlock_release(process->handle_table_lock);
         return status;
     }
 
     struct handle *child_handle;
-    handle_create(process, (object*)child, IR_RIGHT_ALL, &child_handle);
-    linked_list_add(&process->handle_table, child_handle);
+    handle_create((object*)child, IR_RIGHT_ALL, &child_handle);
+    handle_table_add(&process->handle_table, child_handle);
 
-    spinlock_release(process->handle_table_lock);
     *region_out = child_handle->handle_id;
     *address_out = address;
     return IR_OK;
@@ -380,17 +814,13 @@ ir_status_t sys_v_addr_region_map(ir_handle_t parent, ir_handle_t vm_object, uin
     }
 
     struct process *process = (struct process*)this_cpu->current_thread->object.parent;
-    spinlock_aquire(process->handle_table_lock);
 
-    struct handle *parent_handle, *vm_object_handle;
-    ir_status_t status = linked_list_find(&process->handle_table, (void*)parent, handle_by_id, NULL, (void**)&parent_handle);
-    ir_status_t status2 = linked_list_find(&process->handle_table, (void*)vm_object, handle_by_id, NULL, (void**)&vm_object_handle);
-    if (status != IR_OK || status2 != IR_OK) {
-        spinlock_release(process->handle_table_lock);
+    struct handle *parent_handle = handle_table_get(&process->handle_table, parent);
+    struct handle *vm_object_handle = handle_table_get(&process->handle_table, vm_object);
+    if (!parent_handle || !vm_object_handle) {
         return IR_ERROR_BAD_HANDLE;
     }
     if (parent_handle->object->type != OBJECT_TYPE_V_ADDR_REGION || vm_object_handle->object->type != OBJECT_TYPE_VM_OBJECT) {
-        spinlock_release(process->handle_table_lock);
         return IR_ERROR_WRONG_TYPE;
     }
     struct v_addr_region *parent_region = (struct v_addr_region*)parent_handle->object;
@@ -398,17 +828,15 @@ ir_status_t sys_v_addr_region_map(ir_handle_t parent, ir_handle_t vm_object, uin
 
     struct v_addr_region *child_region;
     v_addr_t address;
-    status = v_addr_region_map_vm_object(parent_region, flags, vm, &child_region, 0, &address);
+    ir_status_t status = v_addr_region_map_vm_object(parent_region, flags, vm, &child_region, 0, &address);
     if (status != IR_OK) {
-        spinlock_release(process->handle_table_lock);
         return status;
     }
 
     struct handle *child_handle;
-    handle_create(process, (object*)child_region, IR_RIGHT_ALL, &child_handle);
-    linked_list_add(&process->handle_table, (void**)child_handle);
+    handle_create((object*)child_region, IR_RIGHT_ALL, &child_handle);
+    handle_table_add(&process->handle_table, child_handle);
 
-    spinlock_release(process->handle_table_lock);
     *region_out = child_handle->handle_id;
     *address_out = address;
     return IR_OK;
@@ -416,20 +844,15 @@ ir_status_t sys_v_addr_region_map(ir_handle_t parent, ir_handle_t vm_object, uin
 
 ir_status_t sys_v_addr_region_destroy(ir_handle_t region) {
     struct process *process = (struct process*)this_cpu->current_thread->object.parent;
-    spinlock_aquire(process->handle_table_lock);
 
-    struct handle *region_handle;
-    ir_status_t status = linked_list_find(&process->handle_table, (void*)region, handle_by_id, NULL, (void**)&region_handle);
-    if (status != IR_OK) {
-        spinlock_release(process->handle_table_lock);
+    struct handle *region_handle = handle_table_get(&process->handle_table, region);
+    if (!region_handle) {
         return IR_ERROR_BAD_HANDLE;
     }
     if (region_handle->object->type != OBJECT_TYPE_V_ADDR_REGION) {
-        spinlock_release(process->handle_table_lock);
         return IR_ERROR_WRONG_TYPE;
     }
 
-    spinlock_release(process->handle_table_lock);
     // Can't destory address space roots. Only parent process termination can remove them.
     if (!((struct v_addr_region*)region_handle->object)->can_destroy) {
         return IR_ERROR_ACCESS_DENIED;
@@ -2,11 +2,14 @@
 
 #include "kernel/memory/vm_object.h"
 #include "kernel/memory/pmm.h"
+#include "kernel/memory/physical_map.h"
+#include "kernel/memory/v_addr_region.h"
 #include "kernel/handle.h"
 #include "kernel/spinlock.h"
 #include "kernel/process.h"
 #include "kernel/arch/arch.h"
 #include "kernel/heap.h"
+#include "kernel/string.h"
 #include "iridium/types.h"
 #include "iridium/errors.h"
 #include "types.h"
@@ -14,25 +17,147 @@
 #include "arch/defines.h"
 
 #include <arch/debug.h>
+#include <stdatomic.h>
 
-ir_status_t vm_object_create(size_t size, uint64_t flags, vm_object **out) {
-    // Round the size up to a multiple of the architecture's page size
-    size = ROUND_UP_PAGE(size);
+/// @brief Number of entries in the root node of a page tree
+static inline size_t vm_page_tree_root_slots(size_t page_count, uint levels) {
+    if (page_count == 0) return 1;
+    return ((page_count - 1) >> ((levels - 1) * VM_PAGE_TREE_BITS)) + 1;
+}
 
+/// @brief Allocate a vm_object and the root of its page tree, without committing any pages
+/// @return The new object, or NULL if out of memory
+static vm_object *vm_object_allocate(size_t page_count, uint64_t flags) {
     vm_object *vm_obj = calloc(1, sizeof(vm_object));
+    if (!vm_obj) return NULL;
+
+    // Just enough levels to index every page. Objects of up to `VM_PAGE_TREE_SLOTS`
+    // pages are a single node sized to fit, like a flat array
+    uint levels = 1;
+    for (size_t capacity = VM_PAGE_TREE_SLOTS; capacity < page_count; capacity *= VM_PAGE_TREE_SLOTS) {
+        levels++;
+    }
+
+    vm_obj->page_tree = calloc(vm_page_tree_root_slots(page_count, levels), sizeof(void*));
+    if (!vm_obj->page_tree) {
+        free(vm_obj);
+        return NULL;
+    }
 
     vm_obj->object.type = OBJECT_TYPE_VM_OBJECT;
-    vm_obj->size = size;
-    vm_obj->page_count = size / PAGE_SIZE;
+    vm_obj->size = page_count * PAGE_SIZE;
+    vm_obj->page_count = page_count;
+    vm_obj->page_tree_levels = levels;
     vm_obj->access_flags = flags;
+    return vm_obj;
+}
 
-    // Obtain some physical memory pages to back the object
-    ir_status_t status = pmm_allocate_pages(vm_obj->page_count, &vm_obj->page_list);
+/// @brief Find the entry for a page in an object's page tree
+/// @param index Page number, less than `vm->page_count`
+/// @param create Whether to allocate missing nodes on the way to the entry
+/// @return The entry, or NULL if a node is missing and `create` is false or it couldn't be allocated
+static physical_page_info **vm_object_page_slot(vm_object *vm, size_t index, bool create) {
+    void **node = vm->page_tree;
+    for (uint level = vm->page_tree_levels - 1; level > 0; level--) {
+        void **slot = &node[(index >> (level * VM_PAGE_TREE_BITS)) & VM_PAGE_TREE_MASK];
+        if (!*slot) {
+            if (!create) return NULL;
+            *slot = calloc(VM_PAGE_TREE_SLOTS, sizeof(void*));
+            if (!*slot) return NULL;
+        }
+        node = *slot;
+    }
+    return (physical_page_info**)&node[index & VM_PAGE_TREE_MASK];
+}
 
-    if (status != IR_OK) {
-        free(vm_obj);
-        return status;
+/// @brief Look up the page backing part of an object
+/// @note Call with a lock on `vm`
+/// @param index Page number, less than `vm->page_count`
+/// @return The page, or NULL if it hasn't been committed
+physical_page_info *vm_object_get_page(vm_object *vm, size_t index) {
+    physical_page_info **slot = vm_object_page_slot(vm, index, false);
+    return slot ? *slot : NULL;
+}
+
+/// @brief Search part of a page tree for the first page at or after `*index`
+/// @param node_base Index of the first page under `node`
+static physical_page_info *vm_page_tree_next(void **node, uint level, size_t node_base, size_t slots, size_t *index) {
+    size_t span = (size_t)1 << (level * VM_PAGE_TREE_BITS);
+    for (size_t i = (*index - node_base) / span; i < slots; i++) {
+        if (!node[i]) continue;
+
+        size_t base = node_base + i * span;
+        if (*index < base) *index = base;
+        if (level == 0) return node[i];
+
+        physical_page_info *page = vm_page_tree_next(node[i], level - 1, base, VM_PAGE_TREE_SLOTS, index);
+        if (page) return page;
+    }
+    return NULL;
+}
+
+/// @brief Find the first committed page of an object at or after a page number
+///
+/// Skips over parts of the tree with nothing committed, so walking a sparse object is cheap.
+/// @note Call with a lock on `vm`
+/// @param index Page number to start at. Set to the page number of the page found
+/// @return The page, or NULL if no page from `index` onwards is committed
+physical_page_info *vm_object_next_page(vm_object *vm, size_t *index) {
+    if (*index >= vm->page_count) return NULL;
+    return vm_page_tree_next(vm->page_tree, vm->page_tree_levels - 1, 0,
+        vm_page_tree_root_slots(vm->page_count, vm->page_tree_levels), index);
+}
+
+/// @brief Fill in a vm_object's pages from a list of pages, in order
+/// @return `IR_OK` on success, or `IR_ERROR_NO_MEMORY` if the tree couldn't be built,
+///         in which case none of the pages are put in the object
+static ir_status_t vm_object_set_pages(vm_object *vm, physical_page_info *pages) {
+    // Build the whole tree first, so failing doesn't leave some of the pages in it
+    for (size_t i = 0; i < vm->page_count; i += VM_PAGE_TREE_SLOTS) {
+        if (!vm_object_page_slot(vm, i, true)) return IR_ERROR_NO_MEMORY;
+    }
+
+    physical_page_info *page = pages;
+    for (size_t i = 0; i < vm->page_count; i++) {
+        page->references = 1;
+        *vm_object_page_slot(vm, i, false) = page;
+        page = page->next;
     }
+    return IR_OK;
+}
+
+/// @brief Drop an object's reference to one of its pages, freeing it if no other object shares it
+static void vm_object_release_page(physical_page_info *page) {
+    if (atomic_fetch_sub(&page->references, 1) == 1) {
+        pmm_free_page(page);
+    }
+}
+
+/// @brief Free part of a page tree, releasing the pages in it
+static void vm_page_tree_free(void **node, uint level, size_t slots) {
+    for (size_t i = 0; i < slots; i++) {
+        if (!node[i]) continue;
+
+        if (level == 0) {
+            vm_object_release_page(node[i]);
+        } else {
+            vm_page_tree_free(node[i], level - 1, VM_PAGE_TREE_SLOTS);
+        }
+    }
+    free(node);
+}
+
+/// @brief Create a memory object backed by ordinary memory
+///
+/// No memory is allocated up front. Each page is committed the first time it
+/// is touched, which is usually a page fault in a region mapping the object.
+/// @see `vm_object_commit_page`
+ir_status_t vm_object_create(size_t size, uint64_t flags, vm_object **out) {
+    // Round the size up to a multiple of the architecture's page size
+    size = ROUND_UP_PAGE(size);
+
+    vm_object *vm_obj = vm_object_allocate(size / PAGE_SIZE, flags);
+    if (!vm_obj) return IR_ERROR_NO_MEMORY;
 
     *out = vm_obj;
     return IR_OK;
@@ -46,24 +171,33 @@ ir_status_t vm_object_create_physical(p_addr_t physical_address, size_t size, ui
     p_addr_t old_end = old_base + size;
     size = ROUND_UP_PAGE(old_end) - physical_address;
 
-    vm_object *vm_obj = calloc(1, sizeof(vm_object));
+    *out = NULL;
+    vm_object *vm_obj = vm_object_allocate(size / PAGE_SIZE, flags);
+    if (!vm_obj) return IR_ERROR_NO_MEMORY;
 
     // Reserve a specific region of phyiscal memory
-    vm_obj->size = size;
-    vm_obj->page_count = size / PAGE_SIZE;
-    vm_obj->access_flags = flags;
-    vm_obj->object.type = OBJECT_TYPE_VM_OBJECT;
+    physical_page_info *pages;
+    ir_status_t status = pmm_allocate_range(physical_address, size, &pages);
+    if (status != IR_OK) {
+        // If the range could not be reserved discard the object
+        vm_object_cleanup(vm_obj);
+        return status;
+    }
 
-    ir_status_t status = pmm_allocate_range(physical_address, size, &vm_obj->page_list);
-    if (status == IR_OK) {
-        *out = vm_obj;
-        return IR_OK;
+    status = vm_object_set_pages(vm_obj, pages);
+    if (status != IR_OK) {
+        while (pages) {
+            physical_page_info *next = pages->next;
+            pmm_free_page(pages);
+            pages = next;
+        }
+        vm_object_cleanup(vm_obj);
+        return status;
     }
+    vm_obj->physically_contiguous = true;
 
-    // If the range could not be reserved discard the object
-    *out = NULL;
-    free(vm_obj);
-    return status;
+    *out = vm_obj;
+    return IR_OK;
 }
 
 /// @brief Encapsulate a list of pre-allocated physical pages in a virtual memory object
@@ -72,9 +206,6 @@ ir_status_t vm_object_create_physical(p_addr_t physical_address, size_t size, ui
 /// @param vm Output parameter set to the new `vm_object`
 /// @return `IR_OK` on success, or `IR_ERROR_NO_MEMORY`
 ir_status_t vm_object_from_page_list(physical_page_info *pages, uint64_t flags, vm_object **out) {
-    vm_object *vm_obj = calloc(1, sizeof(vm_object));
-    if (!vm_obj) return IR_ERROR_NO_MEMORY;
-
     size_t page_count = 0;
     physical_page_info *page = pages;
     while (page != NULL) {
@@ -82,28 +213,216 @@ ir_status_t vm_object_from_page_list(physical_page_info *pages, uint64_t flags,
         page = page->next;
     }
 
-    // Reserve a specific region of phyiscal memory
-    vm_obj->size = page_count * PAGE_SIZE;
-    vm_obj->page_count = page_count;
-    vm_obj->access_flags = flags;
-    vm_obj->page_list = pages;
-    vm_obj->object.type = OBJECT_TYPE_VM_OBJECT;
+    vm_object *vm_obj = vm_object_allocate(page_count, flags);
+    if (!vm_obj) return IR_ERROR_NO_MEMORY;
+
+    ir_status_t status = vm_object_set_pages(vm_obj, pages);
+    if (status != IR_OK) {
+        vm_object_cleanup(vm_obj);
+        return status;
+    }
 
     *out = vm_obj;
     return IR_OK;
 }
 
+/// @brief Create a copy-on-write clone of a memory object
+///
+/// The clone starts out sharing every page the parent has committed. Shared pages are mapped
+/// read only in both objects, and the first write to one gives the writer its own copy.
+/// Pages that neither object has touched aren't shared, so each commits its own.
+/// @param parent Object to clone, which must be backed by ordinary memory
+/// @param out Output parameter set to the clone
+/// @return `IR_OK` on success, `IR_ERROR_UNSUPPORTED` if `parent` holds device memory, or `IR_ERROR_NO_MEMORY`
+ir_status_t vm_object_create_clone(vm_object *parent, vm_object **out) {
+    // Mappings of contiguous objects can't have individual pages made read only
+    if (parent->physically_contiguous) {
+        return IR_ERROR_UNSUPPORTED;
+    }
+
+    vm_object *clone = vm_object_allocate(parent->page_count, parent->access_flags);
+    if (!clone) return IR_ERROR_NO_MEMORY;
+
+    spinlock_aquire(parent->object.lock);
+    physical_page_info *page;
+    for (size_t i = 0; (page = vm_object_next_page(parent, &i)); i++) {
+        // Device memory and reserved ranges can't be copied on write
+        if (page->state != PAGE_STATE_USED) {
+            spinlock_release(parent->object.lock);
+            vm_object_cleanup(clone);
+            return IR_ERROR_UNSUPPORTED;
+        }
+
+        physical_page_info **slot = vm_object_page_slot(clone, i, true);
+        if (!slot) {
+            spinlock_release(parent->object.lock);
+            vm_object_cleanup(clone);
+            return IR_ERROR_NO_MEMORY;
+        }
+        page->references++;
+        *slot = page;
+    }
+
+    // Writes through the parent's existing mappings have to fault from now on
+    for (struct v_addr_region *region = parent->mappings; region; region = region->next_mapping) {
+        v_addr_region_protect_shared(region);
+    }
+    spinlock_release(parent->object.lock);
+
+    *out = clone;
+    return IR_OK;
+}
+
+/// @brief Back a page of the object with memory, with pages shared with clones replaced if `write` is set
+/// @note Call with a lock on `vm`
+/// @param unmapped Whether the page was already removed from every region mapping `vm`,
+///                 so a page being replaced can be released straight away
+static ir_status_t vm_object_fill_page(vm_object *vm, size_t index, bool write, bool unmapped, physical_page_info **page_out) {
+    physical_page_info **slot = vm_object_page_slot(vm, index, true);
+    if (!slot) return IR_ERROR_NO_MEMORY;
+
+    physical_page_info *page = *slot;
+    if (!page) {
+        ir_status_t status = pmm_allocate_page(&page);
+        if (status != IR_OK) return status;
+
+        // Memory that was never touched reads as zeroes
+        memset((void*)p_addr_to_physical_map(page->address), 0, PAGE_SIZE);
+        page->references = 1;
+        *slot = page;
+    } else if (write && page->references > 1) {
+        physical_page_info *copy;
+        ir_status_t status = pmm_allocate_page(&copy);
+        if (status != IR_OK) return status;
+
+        // Other regions mapping the object would keep reading the shared page,
+        // and still map it once the clones free it
+        if (!unmapped) v_addr_region_unmap_object_pages(vm, index, 1);
+
+        memcpy((void*)p_addr_to_physical_map(copy->address), (void*)p_addr_to_physical_map(page->address), PAGE_SIZE);
+        copy->references = 1;
+        *slot = copy;
+        // Frees the original if the clones sharing it gave it up while it was copied
+        vm_object_release_page(page);
+        page = copy;
+    }
+
+    if (page_out) *page_out = page;
+    return IR_OK;
+}
+
+/// @brief Back a page of the object with memory, allocating a zeroed page if it hasn't been touched yet
+/// @note Call with a lock on `vm`
+/// @param index Page number in the object, which must be less than `vm->page_count`
+/// @param write Whether the page is about to be written, in which case a page shared with
+///              clones is replaced with a private copy, and unmapped from every region mapping `vm`
+/// @param page_out Optional output parameter set to the page backing `index`
+/// @return `IR_OK` on success, or `IR_ERROR_NO_MEMORY`
+ir_status_t vm_object_commit_page(vm_object *vm, size_t index, bool write, physical_page_info **page_out) {
+    return vm_object_fill_page(vm, index, write, false, page_out);
+}
+
+/// @brief Back every page of the object with memory
+///
+/// Used for memory the kernel touches directly, like kernel stacks, where it can't take page faults.
+/// Pages shared with clones are copied, so they can be written.
+/// Pages committed before running out of memory stay committed.
+/// @return `IR_OK` on success, or `IR_ERROR_NO_MEMORY`
+ir_status_t vm_object_commit(vm_object *vm) {
+    spinlock_aquire(vm->object.lock);
+
+    // Shared pages are about to be replaced, so everything from the first one on is unmapped
+    // at once. Nothing can map the old pages again while the lock is held
+    size_t first_shared = 0;
+    physical_page_info *page;
+    while ((page = vm_object_next_page(vm, &first_shared)) && page->references == 1) {
+        first_shared++;
+    }
+    if (page) {
+        v_addr_region_unmap_object_pages(vm, first_shared, vm->page_count - first_shared);
+    }
+
+    for (size_t i = 0; i < vm->page_count; i++) {
+        ir_status_t status = vm_object_fill_page(vm, i, true, true, NULL);
+        if (status != IR_OK) {
+            spinlock_release(vm->object.lock);
+            return status;
+        }
+    }
+    spinlock_release(vm->object.lock);
+    return IR_OK;
+}
+
+/// @brief Swap a run of the object's pages for other pages, without copying their contents
+///
+/// Used to move memory between address spaces. The caller is responsible for
+/// updating the region mapping the object afterwards.
+/// Pages in the run that were never touched are committed first, so the pages
+/// taken out always hold what the range did.
+/// @note Call with a lock on `vm`
+/// @param first_page Index of the first page to exchange
+/// @param count Number of pages to exchange
+/// @param pages List of `count` pages to put in the object. Set to the list of pages taken out of it
+/// @return `IR_OK` on success, `IR_ERROR_INVALID_ARGUMENTS` if the range is outside the object,
+///         `IR_ERROR_UNSUPPORTED` if the object is mapped more than once, shares the pages with a clone,
+///         or isn't backed by ordinary memory, or `IR_ERROR_NO_MEMORY` if untouched pages couldn't be committed
+ir_status_t vm_object_exchange_pages(vm_object *vm, size_t first_page, size_t count, physical_page_info **pages) {
+    if (count == 0 || first_page >= vm->page_count || count > vm->page_count - first_page) {
+        return IR_ERROR_INVALID_ARGUMENTS;
+    }
+
+    // Other mappings would keep using the old pages, and contiguous objects have to stay that way
+    if (vm->mapping_count != 1 || vm->physically_contiguous) {
+        return IR_ERROR_UNSUPPORTED;
+    }
+
+    for (size_t i = first_page; i < first_page + count; i++) {
+        physical_page_info *page = vm_object_get_page(vm, i);
+        // Device memory and reserved ranges can't be handed to anything else
+        if (page && page->state != PAGE_STATE_USED) {
+            return IR_ERROR_UNSUPPORTED;
+        }
+        // The other objects would lose their copy of the page
+        if (page && page->references > 1) {
+            return IR_ERROR_UNSUPPORTED;
+        }
+    }
+    for (size_t i = first_page; i < first_page + count; i++) {
+        ir_status_t status = vm_object_commit_page(vm, i, false, NULL);
+        if (status != IR_OK) return status;
+    }
+
+    // Put the new pages in place, and link the old ones into a list for the caller
+    physical_page_info *new_page = *pages;
+    physical_page_info *taken = NULL;
+    physical_page_info *taken_last = NULL;
+    for (size_t i = first_page; i < first_page + count; i++) {
+        // Every page in the run was just committed, so its entry exists
+        physical_page_info **slot = vm_object_page_slot(vm, i, false);
+        physical_page_info *old_page = *slot;
+        new_page->references = 1;
+        *slot = new_page;
+        new_page = new_page->next;
+
+        old_page->prev = taken_last;
+        old_page->next = NULL;
+        if (taken_last) {
+            taken_last->next = old_page;
+        } else {
+            taken = old_page;
+        }
+        taken_last = old_page;
+    }
+
+    *pages = taken;
+    return IR_OK;
+}
+
 /// @brief Called when a `vm_object` is no longer referred to anywhere and will be removed
 /// @param vm The virtual memory object being freed
 /// @see `object_decrement_references`
 void vm_object_cleanup(vm_object *vm) {
-    physical_page_info *page = vm->page_list;
-    while (page->next != NULL) {
-        physical_page_info *next = page->next;
-        pmm_free_page(page);
-        page = next;
-    }
-
+    vm_page_tree_free(vm->page_tree, vm->page_tree_levels - 1, vm_page_tree_root_slots(vm->page_count, vm->page_tree_levels));
     free(vm);
 }
 
@@ -120,9 +439,6 @@ ir_status_t sys_vm_object_create(size_t size, uint64_t flags, ir_handle_t *handl
     }
 
     struct process *process = (struct process*)this_cpu->current_thread->object.parent;
-    // This does not have to obtain the handle table lock because it does not access
-    // any of the process's objects or remove handles, which means it will not
-    // interfere with other system calls
 
     vm_object *vm_object;
     ir_status_t status = vm_object_create(size, flags, &vm_object);
@@ -134,13 +450,16 @@ ir_status_t sys_vm_object_create(size_t size, uint64_t flags, ir_handle_t *handl
         rights &= ~IR_RIGHT_EXECUTE;
     }
 
-    status = handle_create(process, (object*)vm_object, rights, &object_handle);
+    status = handle_create((object*)vm_object, rights, &object_handle);
     if (status != IR_OK) {
         return status;
     }
 
-    status = linked_list_add(&process->handle_table, object_handle);
-    if (status != IR_OK) { return status; }
+    status = handle_table_add(&process->handle_table, object_handle);
+    if (status != IR_OK) {
+        handle_release(object_handle);
+        return status;
+    }
 
     *handle_out = object_handle->handle_id;
     return IR_OK;
@@ -160,9 +479,6 @@ ir_status_t sys_vm_object_create_physical(p_addr_t address, size_t size, ir_hand
     }
 
     struct process *process = (struct process*)this_cpu->current_thread->object.parent;
-    // This does not have to obtain the handle table lock because it does not access
-    // any of the process's objects or remove handles, which means it will not
-    // interfere with other system calls
 
     vm_object *vm_object;
     ir_status_t status = vm_object_create_physical(address, size, VM_MMIO_FLAGS, &vm_object);
@@ -172,14 +488,69 @@ ir_status_t sys_vm_object_create_physical(p_addr_t address, size_t size, ir_hand
     // TODO: Is there a use case for transfering or sharing physical memory regions?
     ir_rights_t rights = IR_RIGHT_MAP | IR_RIGHT_READ | IR_RIGHT_WRITE;
 
-    status = handle_create(process, (object*)vm_object, rights, &object_handle);
+    status = handle_create((object*)vm_object, rights, &object_handle);
     if (status != IR_OK) {
         return status;
     }
 
-    status = linked_list_add(&process->handle_table, object_handle);
-    if (status != IR_OK) { return status; }
+    status = handle_table_add(&process->handle_table, object_handle);
+    if (status != IR_OK) {
+        handle_release(object_handle);
+        return status;
+    }
 
     *handle_out = object_handle->handle_id;
     return IR_OK;
 }
+
+/// @brief SYSCALL_VM_OBJECT_CREATE_CLONE
+/// Creates a new vm_object with the same contents as an existing one. The two share memory
+/// until one of them writes to it, and then the page written is copied.
+/// @param vm_object A handle to the object to clone, with `IR_RIGHT_READ`
+/// @param clone_out Output parameter containing a handle for the clone
+/// @return `IR_OK` on success, `IR_ERROR_UNSUPPORTED` if `vm_object` represents device memory,
+///         or `IR_ERROR_NO_MEMORY` under out-of-memory conditions
+ir_status_t sys_vm_object_create_clone(ir_handle_t vm_object, ir_handle_t *clone_out) {
+    if (!arch_validate_user_pointer(clone_out)) {
+        return IR_ERROR_INVALID_ARGUMENTS;
+    }
+
+    struct process *process = (struct process*)this_cpu->current_thread->object.parent;
+
+    struct handle *parent_handle = handle_table_get(&process->handle_table, vm_object);
+    if (!parent_handle) {
+        return IR_ERROR_BAD_HANDLE;
+    }
+    if (parent_handle->object->type != OBJECT_TYPE_VM_OBJECT) {
+        return IR_ERROR_WRONG_TYPE;
+    }
+    if (~parent_handle->rights & IR_RIGHT_READ) {
+        return IR_ERROR_ACCESS_DENIED;
+    }
+
+    struct vm_object *clone;
+    ir_status_t status = vm_object_create_clone((struct vm_object*)parent_handle->object, &clone);
+    if (status != IR_OK) return status;
+
+    // The clone's contents can only be run if the original's could
+    ir_rights_t rights = IR_RIGHT_ALL;
+    if (~parent_handle->rights & IR_RIGHT_EXECUTE) {
+        rights &= ~IR_RIGHT_EXECUTE;
+    }
+
+    struct handle *clone_handle;
+    status = handle_create((object*)clone, rights, &clone_handle);
+    if (status != IR_OK) {
+        vm_object_cleanup(clone);
+        return status;
+    }
+
+    status = handle_table_add(&process->handle_table, clone_handle);
+    if (status != IR_OK) {
+        handle_release(clone_handle);
+        return status;
+    }
+
+    *clone_out = clone_handle->handle_id;
+    return IR_OK;
+}
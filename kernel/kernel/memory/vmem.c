@@ -1,5 +1,6 @@
 
 #include "kernel/arch/mmu.h"
+#include "kernel/cpu_locals.h"
 #include "kernel/memory/init.h"
 #include "kernel/memory/physical_map.h"
 #include "kernel/memory/vmem.h"
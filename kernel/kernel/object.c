@@ -11,6 +11,7 @@
 #include "kernel/main.h"
 #include "kernel/memory/v_addr_region.h"
 #include "kernel/memory/vm_object.h"
+#include "kernel/port.h"
 #include "kernel/process.h"
 #include "kernel/scheduler.h"
 #include "kernel/time.h"
@@ -45,6 +46,9 @@ struct obj_functions functions[] = {
     },
     [OBJECT_TYPE_IOPORT] = {
         .cleanup = (object_cleanup)(uintptr_t)ioport_cleanup
+    },
+    [OBJECT_TYPE_PORT] = {
+        .cleanup = (object_cleanup)(uintptr_t)port_cleanup
     }
 };
 
@@ -66,6 +70,8 @@ void object_decrement_references(object* obj) {
 
     if (obj->references == 0) {
         debug_printf("Releasing object of type %d\n", obj->type);
+        // Port bindings don't keep objects alive, so they are detached before the object is freed
+        port_unbind_object(obj);
         spinlock_aquire(obj->lock);
         //debug_printf("Releasing unreferenced object of type %d @ %#p\n", obj->type, obj);
         // The object is no longer being used anywhere
@@ -88,28 +94,115 @@ void object_decrement_references(object* obj) {
     }
 }
 
+/// @brief Attach a listener to an object
+/// @note Call with a lock on `obj`
+void object_add_listener(object *obj, struct signal_listener *listener) {
+    listener->prev = NULL;
+    listener->next = obj->signal_listeners;
+    if (listener->next) {
+        listener->next->prev = listener;
+    }
+    obj->signal_listeners = listener;
+    listener->attached = true;
+}
+
+/// @brief Detach a listener from an object, if it is attached
+/// @note Call with a lock on `obj`
+void object_remove_listener(object *obj, struct signal_listener *listener) {
+    if (!listener->attached) return;
+
+    if (listener->prev) {
+        listener->prev->next = listener->next;
+    } else {
+        obj->signal_listeners = listener->next;
+    }
+    if (listener->next) {
+        listener->next->prev = listener->prev;
+    }
+    listener->prev = NULL;
+    listener->next = NULL;
+    listener->attached = false;
+}
+
 /// @brief Update an object's signals and trigger connected listeners if applicable
 /// This should be used instead of directly setting the value of object->signals
 /// @note Call with a lock on `obj`
 void object_set_signals(object *obj, ir_signal_t signals) {
+    ir_signal_t raised = signals & ~obj->signals;
     obj->signals = signals;
 
-    // TODO: Linked list iterator
-    //
-    uint i = 0;
-    while (i < obj->signal_listeners.count) {
-        struct signal_listener *listener;
-        ir_status_t status = linked_list_get(&obj->signal_listeners, i, (void**)&listener);
-        if (status != IR_OK) { debug_printf("Failed to get item %d from listeners\n", i); while (1); }
-        if (listener->target_signals & signals) {
-            linked_list_remove(&obj->signal_listeners, i, NULL);
+    struct signal_listener *next;
+    for (struct signal_listener *listener = obj->signal_listeners; listener; listener = next) {
+        next = listener->next;
+        if (listener->port) {
+            // Port bindings stay attached, and only report signals as they are raised
+            if (listener->target_signals & raised) {
+                port_queue_packet(listener, raised, signals);
+            }
+        } else if (listener->target_signals & signals) {
+            object_remove_listener(obj, listener);
             listener->observed_signals = signals;
             scheduler_unblock_listener(listener);
-            i--;
         }
-        i++;
     }
+}
 
+/// @brief Timer callback for waits that reach their deadline
+static void object_wait_timed_out(struct timer *timer) {
+    scheduler_abort_listener(timer->data);
+}
+
+/// @brief Block the current thread until an object asserts one of the target signals
+/// @param obj Object whose signals will be listened to, which the caller keeps alive
+/// @param target_signals Bitmap of signals to wait for
+/// @param deadline Time since boot in microseconds to stop waiting at, or `SIZE_MAX` to never time out
+/// @param observed_signals Set to the object's signals when one was asserted
+/// @return `IR_OK` when a target signal is asserted, or `IR_ERROR_TIMED_OUT` if the deadline is reached first
+ir_status_t object_wait(object *obj, ir_signal_t target_signals, size_t deadline, ir_signal_t *observed_signals) {
+    spinlock_aquire(obj->lock);
+
+    // If one of the watched signals is already asserted
+    if (obj->signals & target_signals) {
+        *observed_signals = obj->signals;
+        spinlock_release(obj->lock);
+        return IR_OK;
+    }
+    if (deadline <= time_microseconds()) {
+        *observed_signals = obj->signals;
+        spinlock_release(obj->lock);
+        return IR_ERROR_TIMED_OUT;
+    }
+
+    // The thread stays inside this function until the listener is detached, so it can live on the stack
+    struct signal_listener listener = {0};
+    listener.thread = this_cpu->current_thread;
+    listener.target = obj;
+    listener.target_signals = target_signals;
+
+    if (deadline != SIZE_MAX) {
+        // Timers only fire when this cpu switches threads, which can't happen before the wait blocks
+        ir_status_t status = timer_set(&listener.timeout, deadline, object_wait_timed_out, &listener);
+        if (status != IR_OK) {
+            spinlock_release(obj->lock);
+            return status;
+        }
+    }
+
+    object_add_listener(obj, &listener);
+    spinlock_release(obj->lock);
+
+    // Block the task until one of the signals are asserted
+    scheduler_block_listener_and_switch(&listener);
+
+    // This is not reached until either the signal is raised or the deadline is reached.
+    this_cpu->current_thread->blocking_listener = NULL;
+    timer_cancel(&listener.timeout);
+
+    *observed_signals = listener.observed_signals;
+    if (listener.observed_signals & target_signals) {
+        return IR_OK;
+    }
+    return IR_ERROR_TIMED_OUT;
 }
 
 /// @brief Blocking syscall that waits until an object asserts a signal
@@ -127,74 +220,20 @@ ir_status_t sys_object_wait(ir_handle_t object_handle, ir_signal_t target_signal
     }
 
     struct process *process = (struct process*)this_cpu->current_thread->object.parent;
-    spinlock_aquire(process->handle_table_lock);
-
-    struct handle *handle;
-    ir_status_t status = linked_list_find(&process->handle_table, (void*)object_handle, handle_by_id, NULL, (void**)&handle);
-    if (status != IR_OK) {
-        spinlock_release(process->handle_table_lock);
+    struct handle *handle = handle_table_get(&process->handle_table, object_handle);
+    if (!handle) {
         return IR_ERROR_BAD_HANDLE;
     }
     struct object *object = handle->object;
 
-    spinlock_aquire(object->lock);
-    spinlock_release(process->handle_table_lock);
+    // Keep the object alive, even in the even of another
+    // thread freeing the handle used to make the listener
+    object->references++;
 
-    // If one of the watched signals is already asserted
-    if (object->signals & target_signals) {
-        *observed_signals = target_signals;
-        spinlock_release(object->lock);
-        return IR_OK;
-    }
-
-    if (timeout_microseconds > 0) {
-        struct signal_listener* listener = malloc(sizeof(struct signal_listener));
-        if (!listener) {
-            spinlock_release(object->lock);
-            return IR_ERROR_NO_MEMORY;
-        }
-
-        listener->thread = this_cpu->current_thread;
-        listener->target = object;
-        listener->target_signals = target_signals;
-        listener->deadline = microseconds_since_boot + timeout_microseconds;
-
-        // TODO: Find better way to prevent overflows
-        // -1 means never expire
-        if (timeout_microseconds == -1ul) {
-            listener->deadline = -1;
-        }
+    ir_signal_t signals;
+    ir_status_t status = object_wait(object, target_signals, time_deadline_after(timeout_microseconds), &signals);
+    *observed_signals = signals;
 
-        // Keep the object alive, even in the even of another
-        // thread freeing the handle used to make the listener
-        object->references++;
-        linked_list_add(&object->signal_listeners, listener);
-        spinlock_release(object->lock);
-
-        // Block the task until one of the signals are asserted
-        scheduler_block_listener_and_switch(listener);
-
-        // This is not reached until either the signal is raised or the deadline is reached.
-        ir_signal_t signals = listener->observed_signals;
-        *observed_signals = signals;
-
-        free(listener);
-
-        object_decrement_references(object);
-
-        // If any of the target signals were raised
-        if (signals & target_signals) {
-            return IR_OK;
-        }
-    }
-    else {
-        *observed_signals = object->signals;
-
-        // If any of the target signals were raised
-        if (object->signals & target_signals) {
-            return IR_OK;
-        }
-    }
-
-    return IR_ERROR_TIMED_OUT;
+    object_decrement_references(object);
+    return status;
 }
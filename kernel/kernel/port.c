@@ -0,0 +1,397 @@
+/// @file kernel/port.c
+/// @brief Kernel object for waiting on the signals of many objects at once
+///
+/// Lock order is a port's `bindings_lock`, then the bound object's lock, then the
+/// port's own lock. Signals are raised with the bound object's lock held, so packets
+/// are queued with the port's lock taken inside it.
+///
+/// Bindings don't keep their objects alive. Whichever of the port and the object is
+/// released first detaches them, and an object isn't freed while any are attached.
+
+#include "kernel/port.h"
+#include "kernel/arch/arch.h"
+#include "kernel/handle.h"
+#include "kernel/process.h"
+#include "kernel/time.h"
+#include "iridium/errors.h"
+#include "iridium/types.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct kmem_cache port_cache = KMEM_CACHE_INITIALIZER("port", sizeof(struct port));
+static struct kmem_cache port_binding_cache = KMEM_CACHE_INITIALIZER("port_binding", sizeof(struct port_binding));
+
+/// @brief Create a port with no bindings
+/// @return `IR_OK` on success or `IR_ERROR_NO_MEMORY`
+ir_status_t port_create(struct port **out) {
+    struct port *port = kmem_cache_zalloc(&port_cache);
+    if (!port) return IR_ERROR_NO_MEMORY;
+
+    port->object.type = OBJECT_TYPE_PORT;
+    *out = port;
+    return IR_OK;
+}
+
+/// @brief Port garbage collection
+/// Detaches every binding from its object
+/// @note Called with a lock on `port`
+void port_cleanup(struct port *port) {
+    // Bindings can still be found through their objects until they are detached
+    port->closed = true;
+    spinlock_release(port->object.lock);
+
+    // Objects being released detach their own bindings, so the list is still walked with its lock
+    spinlock_aquire(port->bindings_lock);
+    struct port_binding *binding = port->bindings;
+    while (binding) {
+        struct port_binding *next = binding->next;
+        // Objects aren't freed until they have taken their bindings out of the list,
+        // which they can't do while the lock is held here
+        object *target = binding->listener.target;
+
+        spinlock_aquire(target->lock);
+        object_remove_listener(target, &binding->listener);
+        spinlock_release(target->lock);
+
+        kmem_cache_free(&port_binding_cache, binding);
+        binding = next;
+    }
+    port->bindings = NULL;
+    spinlock_release(port->bindings_lock);
+
+    kmem_cache_free(&port_cache, port);
+}
+
+/// @brief Queue a packet for a port binding whose watched signals were raised
+/// @note Called with a lock on the binding's target
+void port_queue_packet(struct signal_listener *listener, ir_signal_t trigger, ir_signal_t signals) {
+    struct port_binding *binding = (struct port_binding*)listener;
+    struct port *port = listener->port;
+
+    spinlock_aquire(port->object.lock);
+    if (port->closed) {
+        spinlock_release(port->object.lock);
+        return;
+    }
+
+    // A binding that already has a packet waiting adds to it rather than queueing another
+    binding->trigger |= trigger;
+    binding->signals = signals;
+    if (!binding->queued) {
+        binding->queued = true;
+        binding->queue_next = NULL;
+        if (port->queue_tail) {
+            port->queue_tail->queue_next = binding;
+        } else {
+            port->queue_head = binding;
+        }
+        port->queue_tail = binding;
+
+        if (~port->object.signals & PORT_SIGNAL_PACKET_WAITING) {
+            object_set_signals(&port->object, port->object.signals | PORT_SIGNAL_PACKET_WAITING);
+        }
+    }
+    spinlock_release(port->object.lock);
+}
+
+/// @brief Take a binding's packet out of its port's queue, if it has one queued
+/// @note Call with a lock on `port`
+static void port_dequeue_binding(struct port *port, struct port_binding *binding) {
+    if (!binding->queued) return;
+
+    struct port_binding *previous = NULL;
+    struct port_binding *queued = port->queue_head;
+    while (queued != binding) {
+        previous = queued;
+        queued = queued->queue_next;
+    }
+
+    if (previous) {
+        previous->queue_next = binding->queue_next;
+    } else {
+        port->queue_head = binding->queue_next;
+    }
+    if (port->queue_tail == binding) {
+        port->queue_tail = previous;
+    }
+    binding->queue_next = NULL;
+    binding->queued = false;
+    binding->trigger = 0;
+
+    if (!port->queue_head) {
+        object_set_signals(&port->object, port->object.signals & ~PORT_SIGNAL_PACKET_WAITING);
+    }
+}
+
+/// @brief Add a reference to a port, unless it is already being released
+/// @return Whether the reference was added
+static bool port_reference_if_alive(struct port *port) {
+    uint references = atomic_load(&port->object.references);
+    while (references != 0) {
+        if (atomic_compare_exchange_weak(&port->object.references, &references, references + 1)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// @brief Detach every port binding from an object that is being released
+/// @note Call without a lock on `obj`, once nothing else has a reference to it
+void port_unbind_object(object *obj) {
+    for (;;) {
+        spinlock_aquire(obj->lock);
+        struct signal_listener *listener = obj->signal_listeners;
+        while (listener && !listener->port) {
+            listener = listener->next;
+        }
+        if (!listener) {
+            spinlock_release(obj->lock);
+            return;
+        }
+
+        // The binding can be freed once the object is unlocked, so only the port is held on to
+        struct port *port = listener->port;
+        bool referenced = port_reference_if_alive(port);
+        spinlock_release(obj->lock);
+        if (!referenced) {
+            // The port is being released too, and detaches its bindings itself
+            arch_cpu_relax();
+            continue;
+        }
+
+        spinlock_aquire(port->bindings_lock);
+        struct port_binding **link = &port->bindings;
+        while (*link) {
+            struct port_binding *binding = *link;
+            if (binding->listener.target != obj) {
+                link = &binding->next;
+                continue;
+            }
+            *link = binding->next;
+
+            spinlock_aquire(obj->lock);
+            object_remove_listener(obj, &binding->listener);
+            spinlock_release(obj->lock);
+
+            spinlock_aquire(port->object.lock);
+            port_dequeue_binding(port, binding);
+            spinlock_release(port->object.lock);
+
+            kmem_cache_free(&port_binding_cache, binding);
+        }
+        spinlock_release(port->bindings_lock);
+
+        object_decrement_references(&port->object);
+    }
+}
+
+/// @brief Look up a port from one of the current process's handles
+/// @param rights Rights the handle needs
+static ir_status_t port_from_handle(ir_handle_t port_handle, ir_rights_t rights, struct port **out) {
+    struct process *process = (struct process*)this_cpu->current_thread->object.parent;
+    struct handle *handle = handle_table_get(&process->handle_table, port_handle);
+    if (!handle) {
+        return IR_ERROR_BAD_HANDLE;
+    }
+    if (handle->object->type != OBJECT_TYPE_PORT) {
+        return IR_ERROR_WRONG_TYPE;
+    }
+    if ((handle->rights & rights) != rights) {
+        return IR_ERROR_ACCESS_DENIED;
+    }
+
+    *out = (struct port*)handle->object;
+    return IR_OK;
+}
+
+/// @brief SYSCALL_PORT_CREATE
+ir_status_t sys_port_create(ir_handle_t *port_out) {
+    if (!arch_validate_user_pointer(port_out)) {
+        return IR_ERROR_INVALID_ARGUMENTS;
+    }
+
+    struct port *port;
+    ir_status_t status = port_create(&port);
+    if (status != IR_OK) return status;
+
+    struct process *process = (struct process*)this_cpu->current_thread->object.parent;
+    struct handle *handle;
+    status = handle_create(&port->object, IR_RIGHT_ALL, &handle);
+    if (status != IR_OK) {
+        kmem_cache_free(&port_cache, port);
+        return status;
+    }
+
+    status = handle_table_add(&process->handle_table, handle);
+    if (status != IR_OK) {
+        handle_release(handle);
+        return status;
+    }
+
+    *port_out = handle->handle_id;
+    return IR_OK;
+}
+
+/// @brief SYSCALL_PORT_BIND
+/// Queue a packet in a port each time one of an object's signals is raised
+/// @param port A handle to the port, with `IR_RIGHT_WRITE`
+/// @param object A handle to the object being watched, which can't be a port
+/// @param signals Bitmap of the signals that queue packets
+/// @param key Value identifying the binding in its packets. Each object can only be bound once with a key
+/// @return `IR_OK` on success, or `IR_ERROR_ALREADY_EXISTS` if the object is already bound with the key
+ir_status_t sys_port_bind(ir_handle_t port, ir_handle_t object, ir_signal_t signals, unsigned long key) {
+    if (signals == 0) {
+        return IR_ERROR_INVALID_ARGUMENTS;
+    }
+
+    struct port *port_object;
+    ir_status_t status = port_from_handle(port, IR_RIGHT_WRITE, &port_object);
+    if (status != IR_OK) return status;
+
+    struct process *process = (struct process*)this_cpu->current_thread->object.parent;
+    struct handle *object_handle = handle_table_get(&process->handle_table, object);
+    if (!object_handle) {
+        return IR_ERROR_BAD_HANDLE;
+    }
+    struct object *target = object_handle->object;
+    // Ports queueing packets in each other could take their locks in either order
+    if (target->type == OBJECT_TYPE_PORT) {
+        return IR_ERROR_WRONG_TYPE;
+    }
+
+    struct port_binding *binding = kmem_cache_zalloc(&port_binding_cache);
+    if (!binding) return IR_ERROR_NO_MEMORY;
+    binding->listener.target = target;
+    binding->listener.port = port_object;
+    binding->listener.target_signals = signals;
+    binding->key = key;
+
+    spinlock_aquire(port_object->bindings_lock);
+    for (struct port_binding *existing = port_object->bindings; existing; existing = existing->next) {
+        if (existing->listener.target == target && existing->key == key) {
+            spinlock_release(port_object->bindings_lock);
+            kmem_cache_free(&port_binding_cache, binding);
+            return IR_ERROR_ALREADY_EXISTS;
+        }
+    }
+    binding->next = port_object->bindings;
+    port_object->bindings = binding;
+
+    spinlock_aquire(target->lock);
+    object_add_listener(target, &binding->listener);
+    // Signals that are already raised are reported straight away
+    if (target->signals & signals) {
+        port_queue_packet(&binding->listener, target->signals & signals, target->signals);
+    }
+    spinlock_release(target->lock);
+
+    spinlock_release(port_object->bindings_lock);
+    return IR_OK;
+}
+
+/// @brief SYSCALL_PORT_UNBIND
+/// Stop an object queueing packets in a port, and discard any packet it has queued
+/// @return `IR_OK` on success, or `IR_ERROR_NOT_FOUND` if the object isn't bound with the key
+ir_status_t sys_port_unbind(ir_handle_t port, ir_handle_t object, unsigned long key) {
+    struct port *port_object;
+    ir_status_t status = port_from_handle(port, IR_RIGHT_WRITE, &port_object);
+    if (status != IR_OK) return status;
+
+    struct process *process = (struct process*)this_cpu->current_thread->object.parent;
+    struct handle *object_handle = handle_table_get(&process->handle_table, object);
+    if (!object_handle) {
+        return IR_ERROR_BAD_HANDLE;
+    }
+    struct object *target = object_handle->object;
+
+    spinlock_aquire(port_object->bindings_lock);
+    struct port_binding **link = &port_object->bindings;
+    while (*link && ((*link)->listener.target != target || (*link)->key != key)) {
+        link = &(*link)->next;
+    }
+    struct port_binding *binding = *link;
+    if (!binding) {
+        spinlock_release(port_object->bindings_lock);
+        return IR_ERROR_NOT_FOUND;
+    }
+    *link = binding->next;
+
+    // Once detached the object can't queue the packet again, so it is safe to discard
+    spinlock_aquire(target->lock);
+    object_remove_listener(target, &binding->listener);
+    spinlock_release(target->lock);
+
+    spinlock_aquire(port_object->object.lock);
+    port_dequeue_binding(port_object, binding);
+    spinlock_release(port_object->object.lock);
+
+    spinlock_release(port_object->bindings_lock);
+
+    kmem_cache_free(&port_binding_cache, binding);
+    return IR_OK;
+}
+
+/// @brief Move up to `max_packets` packets out of a port's queue
+/// @return Number of packets taken
+static size_t port_take_packets(struct port *port, ir_port_packet_t *packets, size_t max_packets) {
+    spinlock_aquire(port->object.lock);
+
+    size_t count = 0;
+    while (count < max_packets && port->queue_head) {
+        struct port_binding *binding = port->queue_head;
+        packets[count].key = binding->key;
+        packets[count].trigger = binding->trigger;
+        packets[count].signals = binding->signals;
+        count++;
+
+        port_dequeue_binding(port, binding);
+    }
+
+    spinlock_release(port->object.lock);
+    return count;
+}
+
+/// @brief SYSCALL_PORT_WAIT
+/// Read queued packets from a port, waiting for one to be queued if there are none
+/// @param port A handle to the port, with `IR_RIGHT_READ`
+/// @param packets Buffer the packets are written to
+/// @param max_packets Size of `packets`, in packets
+/// @param timeout_microseconds How long to wait for packets. 0 returns immediately, and -1 never times out
+/// @param count_out Set to the number of packets read
+/// @return `IR_OK` on success, or `IR_ERROR_TIMED_OUT` if no packets were queued in time
+ir_status_t sys_port_wait(ir_handle_t port, ir_port_packet_t *packets, size_t max_packets, size_t timeout_microseconds, size_t *count_out) {
+    if (!arch_validate_user_pointer(packets) || !arch_validate_user_pointer(count_out) || max_packets == 0) {
+        return IR_ERROR_INVALID_ARGUMENTS;
+    }
+    if (max_packets > PORT_MAX_WAIT_PACKETS) {
+        max_packets = PORT_MAX_WAIT_PACKETS;
+    }
+
+    struct port *port_object;
+    ir_status_t status = port_from_handle(port, IR_RIGHT_READ, &port_object);
+    if (status != IR_OK) return status;
+
+    // Keep the port alive while waiting, even if another thread closes the handle
+    port_object->object.references++;
+
+    size_t deadline = time_deadline_after(timeout_microseconds);
+    ir_port_packet_t batch[PORT_MAX_WAIT_PACKETS];
+    size_t count;
+    // Other threads waiting on the port can take the packets first, so wait again if none are left
+    while ((count = port_take_packets(port_object, batch, max_packets)) == 0) {
+        ir_signal_t signals;
+        status = object_wait(&port_object->object, PORT_SIGNAL_PACKET_WAITING, deadline, &signals);
+        if (status != IR_OK) break;
+    }
+
+    object_decrement_references(&port_object->object);
+
+    if (count == 0) return status;
+
+    for (size_t i = 0; i < count; i++) {
+        packets[i] = batch[i];
+    }
+    *count_out = count;
+    return IR_OK;
+}
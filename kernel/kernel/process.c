@@ -7,6 +7,7 @@
 #include "kernel/handle.h"
 #include "kernel/scheduler.h"
 #include "kernel/memory/v_addr_region.h"
+#include "kernel/memory/slab.h"
 #include "kernel/arch/arch.h"
 #include "kernel/arch/mmu.h"
 #include "kernel/string.h"
@@ -28,6 +29,8 @@ int next_thread_id = 1;
 /// Parent of each CPU's idle thread
 struct process* idle_process;
 
+static struct kmem_cache thread_cache = KMEM_CACHE_INITIALIZER("thread", sizeof(struct thread));
+
 /// @brief This function is run when scheduling the idle task
 void idle_task() {
     while (1) {
@@ -45,7 +48,7 @@ void create_idle_process() {
 /// @brief Create an idle thread to run when nothing else is scheduled
 struct thread* create_idle_thread() {
     // Since this is only called during startup we don't need to do error checking
-    struct thread* idle_thread = calloc(1, sizeof(struct thread));
+    struct thread* idle_thread = kmem_cache_zalloc(&thread_cache);
 
     linked_list_add(&idle_process->object.children, idle_thread);
     idle_thread->object.parent = (object*)idle_process;
@@ -101,8 +104,7 @@ ir_status_t process_create(struct process **process_out, struct v_addr_region **
     status = v_addr_region_create_root(&process->address_space, 0, USER_MEMORY_LENGTH, &process->root_v_addr_region);
     if (status != IR_OK) {
         free(process);
-        free(channel);
-        free(channel_peer);
+        channel_destroy_unused(channel, channel_peer);
         return status;
     }
 
@@ -111,12 +113,12 @@ ir_status_t process_create(struct process **process_out, struct v_addr_region **
     struct handle *process_handle;
     struct handle *v_addr_region_handle;
     struct handle *channel_handle;
-    handle_create(process, (object*)process, IR_RIGHT_ALL, &process_handle);
-    handle_create(process, (object*)process->root_v_addr_region, IR_RIGHT_ALL, &v_addr_region_handle);
-    handle_create(process, (object*)channel_peer, IR_RIGHT_ALL, &channel_handle);
-    linked_list_add(&process->handle_table, process_handle);
-    linked_list_add(&process->handle_table, v_addr_region_handle);
-    linked_list_add(&process->handle_table, channel_handle);
+    handle_create((object*)process, IR_RIGHT_ALL, &process_handle);
+    handle_create((object*)process->root_v_addr_region, IR_RIGHT_ALL, &v_addr_region_handle);
+    handle_create((object*)channel_peer, IR_RIGHT_ALL, &channel_handle);
+    handle_table_add(&process->handle_table, process_handle);
+    handle_table_add(&process->handle_table, v_addr_region_handle);
+    handle_table_add(&process->handle_table, channel_handle);
 
     *process_out = process;
     *virtual_address_space_out = process->root_v_addr_region;
@@ -130,14 +132,14 @@ ir_status_t process_create(struct process **process_out, struct v_addr_region **
 /// @return `IR_OK` on success, or an error code
 ir_status_t thread_create(struct process* parent_process, struct thread **out) {
 
-    struct thread *thread = calloc(1, sizeof(struct thread));
+    struct thread *thread = kmem_cache_zalloc(&thread_cache);
     if (!thread) { return IR_ERROR_NO_MEMORY; }
 
     spinlock_aquire(parent_process->object.lock);
 
     if (linked_list_add(&parent_process->object.children, thread) != IR_OK) {
         spinlock_release(parent_process->object.lock);
-        free(thread);
+        kmem_cache_free(&thread_cache, thread);
         return IR_ERROR_NO_MEMORY;
     }
 
@@ -146,6 +148,8 @@ ir_status_t thread_create(struct process* parent_process, struct thread **out) {
     arch_initialize_thread_context(&thread->context);
     thread->thread_id = next_thread_id;
     next_thread_id++;
+    // Start out on the creating cpu, the load balancer moves it if needed
+    thread->cpu = this_cpu->core_id;
     vm_object *kernel_stack_vm;
     v_addr_t stack_base;
     if (vm_object_create(PER_THREAD_KERNEL_STACK_SIZE, VM_READABLE | VM_WRITABLE, &kernel_stack_vm) == IR_OK) {
@@ -166,7 +170,7 @@ ir_status_t thread_create(struct process* parent_process, struct thread **out) {
 
     linked_list_find_and_remove(&parent_process->object.children, thread, NULL, NULL);
     spinlock_release(parent_process->object.lock);
-    free(thread);
+    kmem_cache_free(&thread_cache, thread);
 
     return IR_ERROR_NO_MEMORY;
 }
@@ -211,13 +215,13 @@ ir_status_t sys_process_create(ir_handle_t *process, ir_handle_t *v_addr_region,
     struct handle *process_handle;
     struct handle *v_addr_region_handle;
     struct handle *channel_handle;
-    handle_create(current_process, (object*)process, IR_RIGHT_ALL, &process_handle);
-    handle_create(current_process, (object*)root_region, IR_RIGHT_ALL, &v_addr_region_handle);
-    handle_create(current_process, (object*)startup_channel, IR_RIGHT_ALL, &channel_handle);
+    handle_create((object*)new_process, IR_RIGHT_ALL, &process_handle);
+    handle_create((object*)root_region, IR_RIGHT_ALL, &v_addr_region_handle);
+    handle_create((object*)startup_channel, IR_RIGHT_ALL, &channel_handle);
 
-    linked_list_add(&current_process->handle_table, process_handle);
-    linked_list_add(&current_process->handle_table, v_addr_region_handle);
-    linked_list_add(&current_process->handle_table, channel_handle);
+    handle_table_add(&current_process->handle_table, process_handle);
+    handle_table_add(&current_process->handle_table, v_addr_region_handle);
+    handle_table_add(&current_process->handle_table, channel_handle);
 
     *process = process_handle->handle_id;
     *v_addr_region = v_addr_region_handle->handle_id;
@@ -229,12 +233,9 @@ ir_status_t sys_process_create(ir_handle_t *process, ir_handle_t *v_addr_region,
 ir_status_t sys_thread_create(ir_handle_t parent_process, ir_handle_t *out) {
     // TODO: Checks
     struct process *process = (struct process*)this_cpu->current_thread->object.parent;
-    spinlock_aquire(process->handle_table_lock);
 
-    struct handle *process_handle;
-    ir_status_t status = linked_list_find(&process->handle_table, (void*)parent_process, handle_by_id, NULL, (void**)&process_handle);
-    if (status != IR_OK) {
-        spinlock_release(process->handle_table_lock);
+    struct handle *process_handle = handle_table_get(&process->handle_table, parent_process);
+    if (!process_handle) {
         return IR_ERROR_BAD_HANDLE;
     }
 
@@ -244,10 +245,8 @@ ir_status_t sys_thread_create(ir_handle_t parent_process, ir_handle_t *out) {
     debug_printf("Created thread %d\n", thread->thread_id);
 
     struct handle *handle;
-    handle_create(process, (object*)thread, IR_RIGHT_ALL, &handle);
-    linked_list_add(&process->handle_table, handle);
-
-    spinlock_release(process->handle_table_lock);
+    handle_create((object*)thread, IR_RIGHT_ALL, &handle);
+    handle_table_add(&process->handle_table, handle);
 
     *out = handle->handle_id;
     return IR_OK;
@@ -267,18 +266,13 @@ ir_status_t sys_thread_start(ir_handle_t thread, uintptr_t entry, uintptr_t stac
     debug_printf("Thread stack at %#p\n", stack_top);
 
     struct process *process = (struct process*)this_cpu->current_thread->object.parent;
-    spinlock_aquire(process->handle_table_lock);
 
-    struct handle *handle;
-    ir_status_t status = linked_list_find(&process->handle_table, (void*)thread, handle_by_id, NULL, (void**)&handle);
-    if (status != IR_OK) {
-        spinlock_release(process->handle_table_lock);
+    struct handle *handle = handle_table_get(&process->handle_table, thread);
+    if (!handle) {
         return IR_ERROR_BAD_HANDLE;
     }
 
     thread_start((struct thread*)handle->object, entry, stack_top, arg0);
-
-    spinlock_release(process->handle_table_lock);
     return IR_OK;
 }
 
@@ -326,9 +320,11 @@ void process_kill_locked(struct process *process, long exit_code) {
         thread->exit_code = -1ul;
         // Wake up blocking threads to avoid waiting to cleanup the process
         if (thread->blocking_listener) {
-            scheduler_unblock_listener(thread->blocking_listener);
+            scheduler_abort_listener(thread->blocking_listener);
+        }
+        if (timer_cancel(&thread->sleep_timer)) {
+            schedule_thread(thread);
         }
-        thread->sleeping_until = 0;
     }
 
     // Alert any processes with handles that we have exited
@@ -343,13 +339,7 @@ void process_kill_locked(struct process *process, long exit_code) {
 void process_finish_termination(struct process *process) {
 
     // Release any references this process has to other resources
-    struct handle *handle;
-    while (IR_OK == linked_list_remove(&process->handle_table, 0, (void**)&handle)) {
-        object_decrement_references(handle->object);
-        free(handle);
-    }
-
-    linked_list_destroy(&process->free_handle_ids);
+    handle_table_destroy(&process->handle_table);
 
     // Unmap all of the memory backing this process, even if others have handles to the regions
     v_addr_region_destroy(process->root_v_addr_region);
@@ -372,6 +362,8 @@ void thread_finish_termination(struct thread *thread) {
     // If this was the last thread the process as a whole has terminated
     if (process->children.count == 1) {
         debug_printf("Last thread exiting, cleaning process\n");
+        address_space *memory = &((struct process*)process)->address_space;
+        debug_printf("Process had %zu of %zu committed pages resident\n", memory->resident_pages, (size_t)memory->committed_pages);
         if (((struct process*)process)->state == ACTIVE) {
             process_kill_locked((struct process*)process, thread->exit_code);
         }
@@ -403,7 +395,8 @@ void process_cleanup(struct process *process) {
 /// @brief Thread garbage collection handler
 void thread_cleanup(struct thread *thread) {
     debug_printf("Freed an exited thread\n");
-    free(thread);
+    arch_free_extended_state(thread);
+    kmem_cache_free(&thread_cache, thread);
 }
 
 ir_status_t sys_process_exit(long exit_code) {
@@ -0,0 +1,76 @@
+/// @file kernel/rcu.c
+/// @brief Deferred freeing of data that is read without locks
+///
+/// A global generation number is advanced every time a callback is queued,
+/// and callbacks remember the new value. Each cpu records the generation it
+/// saw each time it passes through the scheduler. A callback is ready once
+/// every running cpu has recorded its generation or a later one, since any
+/// reference a cpu took before the data was unpublished ended at that point.
+
+#include "kernel/rcu.h"
+#include "kernel/cpu_locals.h"
+#include <stdatomic.h>
+#include <stdint.h>
+
+/// Generation that new callbacks wait for every cpu to pass
+static _Atomic size_t rcu_generation = 1;
+
+/// @brief Find the latest generation every running cpu has passed
+static size_t rcu_completed_generation() {
+    size_t completed = SIZE_MAX;
+    for (int i = 0; i < MAX_CPUS_COUNT; i++) {
+        // Cpus that haven't started scheduling threads can't be holding references
+        if (!processor_local_data[i].current_thread) continue;
+        size_t generation = processor_local_data[i].rcu.generation;
+        if (generation < completed) completed = generation;
+    }
+    return completed;
+}
+
+/// @brief Run a callback once no cpu can still be using data unpublished before this call
+/// @param head Embedded in the data to free, and valid until the callback runs
+/// @param callback Runs on this cpu from the scheduler, with interrupts disabled
+void rcu_call(struct rcu_head *head, rcu_callback callback) {
+    head->callback = callback;
+    head->next = NULL;
+    // Orders the caller unpublishing the data before the new generation
+    head->generation = atomic_fetch_add(&rcu_generation, 1) + 1;
+
+    struct rcu_cpu_data *rcu = &processor_local_data[this_cpu->core_id].rcu;
+    if (rcu->tail) {
+        rcu->tail->next = head;
+    } else {
+        rcu->head = head;
+    }
+    rcu->tail = head;
+}
+
+/// @brief Record that this cpu holds no rcu protected references, and run any callbacks that are ready
+/// @note Called by the scheduler, which is where readers' references end
+void rcu_quiescent_state() {
+    struct rcu_cpu_data *rcu = &processor_local_data[this_cpu->core_id].rcu;
+    // A full barrier, so reads made after this point can't see data from before it was unpublished
+    atomic_store((_Atomic size_t*)&rcu->generation, atomic_load(&rcu_generation));
+
+    if (!rcu->head) return;
+
+    // Callbacks were queued in generation order, so stop at the first one that isn't ready
+    size_t completed = rcu_completed_generation();
+    while (rcu->head && rcu->head->generation <= completed) {
+        struct rcu_head *head = rcu->head;
+        rcu->head = head->next;
+        if (!rcu->head) rcu->tail = NULL;
+        // Callbacks are free to queue more callbacks
+        head->callback(head);
+    }
+}
+
+/// @brief Record that this cpu is going idle, so other cpus don't have to wait for it
+void rcu_enter_idle() {
+    processor_local_data[this_cpu->core_id].rcu.generation = SIZE_MAX;
+}
+
+/// @brief Whether this cpu has callbacks waiting for a grace period
+bool rcu_pending() {
+    return processor_local_data[this_cpu->core_id].rcu.head != NULL;
+}
@@ -1,5 +1,11 @@
 /// @file kernel/scheduler.c
 /// @brief Rudimentary round-robin scheduler
+///
+/// The scheduler is tickless. Each time a cpu picks a thread it programs a
+/// one-shot timer for the earlier of the thread's timeslice ending and the
+/// cpu's next kernel timer, such as a sleeping thread waking or a wait
+/// timing out. Idle cpus have no timeslice, and are woken with
+/// `arch_cpu_wake` when they are given a thread.
 
 #include "kernel/scheduler.h"
 #include "kernel/process.h"
@@ -9,24 +15,24 @@
 #include "kernel/arch/mmu.h"
 #include "kernel/string.h"
 #include "kernel/time.h"
+#include "kernel/timer.h"
+#include "kernel/rcu.h"
 #include "kernel/main.h"
 #include "arch/registers.h"
 #include "iridium/errors.h"
 #include "iridium/types.h"
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdnoreturn.h>
 
 #include "arch/debug.h"
 
-/// @brief Contains all threads waiting to run
-/// Running threads are removed and at the end of their timeslice appended to the end
-linked_list run_queue;
+/// How often each cpu evens out its run queue with the busiest cpu
+#define BALANCE_INTERVAL_MICROSECONDS 100000 // 100 ms
 
-/// Every thread waiting on an object for signal changes.
-/// Contains signal listeners rather than the thread itself.
-linked_list waiting_for_signals;
-
-/// Threads waiting for time to pass
-linked_list sleeping_threads;
+/// How long a thread runs before other threads on its cpu get a turn
+#define TIMESLICE_MICROSECONDS 10000 // 10 ms
 
 /// SYSCALL_YIELD
 ir_status_t sys_yield() {
@@ -51,66 +57,210 @@ ir_status_t sys_yield() {
     return IR_OK;
 }
 
+/// @brief Add a thread to the end of a run queue
+static void run_queue_push(struct run_queue *queue, struct thread *thread) {
+    spinlock_aquire(queue->lock);
+    thread->run_queue_next = NULL;
+    if (queue->tail) {
+        queue->tail->run_queue_next = thread;
+    } else {
+        queue->head = thread;
+    }
+    queue->tail = thread;
+    queue->count++;
+    spinlock_release(queue->lock);
+}
+
+/// @brief Take the thread at the front of a run queue
+/// @return The thread, or NULL if the queue is empty
+static struct thread *run_queue_pop(struct run_queue *queue) {
+    // Avoid taking the lock of queues with nothing in them
+    if (queue->count == 0) return NULL;
+
+    spinlock_aquire(queue->lock);
+    struct thread *thread = queue->head;
+    if (thread) {
+        queue->head = thread->run_queue_next;
+        if (!queue->head) queue->tail = NULL;
+        queue->count--;
+        thread->run_queue_next = NULL;
+    }
+    spinlock_release(queue->lock);
+    return thread;
+}
+
+/// @brief Find the cpu with the most threads waiting to run
+static struct per_cpu_data *busiest_cpu() {
+    struct per_cpu_data *busiest = NULL;
+    size_t busiest_count = 0;
+    for (int i = 0; i < cpu_count; i++) {
+        size_t count = processor_local_data[i].run_queue.count;
+        if (count > busiest_count) {
+            busiest = &processor_local_data[i];
+            busiest_count = count;
+        }
+    }
+    return busiest;
+}
+
+/// @brief Move threads from the busiest cpu until both run queues are about the same length
+static void scheduler_balance() {
+    struct per_cpu_data *cpu = &processor_local_data[this_cpu->core_id];
+    struct per_cpu_data *busiest = busiest_cpu();
+    if (!busiest || busiest == cpu) return;
+
+    // Counts are read without locks, so this is only an estimate
+    size_t local_count = cpu->run_queue.count;
+    size_t busiest_count = busiest->run_queue.count;
+    if (busiest_count <= local_count + 1) return;
+
+    for (size_t moving = (busiest_count - local_count) / 2; moving > 0; moving--) {
+        struct thread *thread = run_queue_pop(&busiest->run_queue);
+        if (!thread) break;
+        run_queue_push(&cpu->run_queue, thread);
+    }
+}
+
+/// @brief Pick the next thread for this cpu to run
+/// Takes a thread waiting on another cpu when there is nothing to run locally
+/// @return The thread, or NULL if there is nothing to run anywhere
+static struct thread *scheduler_next_thread() {
+    struct thread *next = run_queue_pop(&processor_local_data[this_cpu->core_id].run_queue);
+    if (next) return next;
+
+    struct per_cpu_data *busiest = busiest_cpu();
+    if (busiest) return run_queue_pop(&busiest->run_queue);
+    return NULL;
+}
+
+/// @brief Program this cpu's timer for the next time the scheduler needs to run
+/// @param next The thread this cpu is about to run
+static void scheduler_set_timer(struct thread *next) {
+    // Idle cpus don't need to be interrupted until there is something to do,
+    // unless they have rcu callbacks that only run when the scheduler does
+    if (next == this_cpu->idle_thread && !rcu_pending()) {
+        // Pairs with the fence in `schedule_thread`: either it sees this cpu is idle and wakes it,
+        // or this sees the thread it queued, and the scheduler runs again straight away
+        atomic_thread_fence(memory_order_seq_cst);
+        if (processor_local_data[this_cpu->core_id].run_queue.count != 0) {
+            timer_program_cpu(time_microseconds());
+        } else {
+            timer_program_cpu(SIZE_MAX);
+        }
+    } else {
+        timer_program_cpu(time_microseconds() + TIMESLICE_MICROSECONDS);
+    }
+}
+
+/// @brief Whether a cpu is running its idle thread
+static bool cpu_is_idle(int cpu) {
+    struct per_cpu_data *data = &processor_local_data[cpu];
+    // Cpus that never started have no idle thread
+    return data->idle_thread && data->current_thread == data->idle_thread;
+}
+
+/// @brief Wait until no other cpu is using a thread's kernel stack
+static void scheduler_wait_off_cpu(struct thread *thread) {
+    while (thread->on_cpu) {
+        arch_cpu_relax();
+    }
+}
+
+/// @brief Switch this cpu from one thread to another
+/// @param previous The thread currently running on this cpu
+/// @param next The thread to run next
+/// @param reschedule Whether `previous` goes back into the run queue
+static noreturn void scheduler_enter_thread(struct thread *previous, struct thread *next, bool reschedule) {
+    // A thread woken while this cpu was switching away from it is still ours to run
+    bool volatile *release = NULL;
+    if (next != previous) {
+        scheduler_wait_off_cpu(next);
+        if (previous) release = &previous->on_cpu;
+    }
+
+    next->on_cpu = true;
+    next->cpu = this_cpu->core_id;
+    this_cpu->current_thread = next;
+
+    // The previous thread stays unavailable to other cpus until arch_enter_context is off its stack
+    if (reschedule && previous && previous != next && previous != this_cpu->idle_thread) {
+        run_queue_push(&processor_local_data[this_cpu->core_id].run_queue, previous);
+    }
+
+    if (next == this_cpu->idle_thread) {
+        rcu_enter_idle();
+        arch_mmu_enter_kernel_address_space();
+    } else {
+        struct process *process = (struct process*)next->object.parent;
+        arch_mmu_set_address_space(&process->address_space);
+    }
+    arch_set_interrupt_stack(next->kernel_stack_top);
+    arch_switch_extended_state(next);
+    scheduler_set_timer(next);
+    arch_enter_context(&next->context, release);
+}
+
+/// @brief Prepare the current cpu for scheduling threads
+void scheduler_init_cpu() {
+    this_cpu->idle_thread = create_idle_thread();
+    // The idle thread never leaves kernel mode, so its kernel stack is free to switch threads on
+    this_cpu->switch_stack_top = this_cpu->idle_thread->kernel_stack_top;
+    this_cpu->next_balance = time_microseconds() + BALANCE_INTERVAL_MICROSECONDS;
+}
+
 /// NOTE: Does not save context. Caller must ensure that the thread has appropriate context to reenter
 void switch_task(bool reschedule) {
     arch_enter_critical();
 
-    // Before switching tasks, see if there are any threads listening for signals whose deadlines have passed
-    struct signal_listener *listener;
-    while (linked_list_get(&waiting_for_signals, 0, (void**)&listener) == IR_OK && listener->deadline < microseconds_since_boot) {
-        // TODO: Lock for multiprocessing environment
-        linked_list_remove(&waiting_for_signals, 0, NULL);
-        scheduler_unblock_listener(listener);
-    }
+    size_t now = time_microseconds();
 
-    // And wake up sleeping threads who have waited long enough
-    struct thread *thread;
-    while (linked_list_get(&sleeping_threads, 0, (void*)&thread) == IR_OK && thread->sleeping_until < microseconds_since_boot) {
-        // TODO: Lock for multiprocessing environment
-        linked_list_remove(&sleeping_threads, 0, NULL);
-        schedule_thread(thread);
+    // Nothing running on this cpu holds lockless references past this point
+    rcu_quiescent_state();
+
+    // Before switching tasks, wake up sleeping threads and time out waits whose deadlines have passed
+    timer_run_expired(now);
+
+    if (now >= this_cpu->next_balance) {
+        this_cpu->next_balance = now + BALANCE_INTERVAL_MICROSECONDS;
+        scheduler_balance();
     }
 
-    thread = this_cpu->current_thread;
+    struct thread *thread = this_cpu->current_thread;
     struct thread *next;
-    bool try_again = true;
-    // If the previous thread was terminating try scheduling the next one
-    while (try_again) {
-        try_again = false;
-        ir_status_t status = linked_list_remove(&run_queue, 0, (void**)&next);
-
-        // Retrieve and run the next thread
-        if (status == IR_OK) {
-            // Terminating threads are allowed to finish syscalls, but will end as soon as they are done.
-            // This is done to avoid leaving the kernel in an undefined state
-            if (next->state == ACTIVE || next->in_syscall) {
-                struct process *process = (struct process*)next->object.parent;
-                this_cpu->current_thread = next;
-                if (reschedule && thread != this_cpu->idle_thread) {
-                    linked_list_add(&run_queue, thread);
-                }
-
-                arch_mmu_set_address_space(&process->address_space);
-                arch_set_interrupt_stack(next->kernel_stack_top);
-                arch_enter_context(&next->context);
-            } else {
-                thread_finish_termination(next);
-                try_again = true;
-            }
+
+    // A thread handed this cpu skips the run queue, since the previous thread is waiting on it
+    next = this_cpu->handoff_thread;
+    this_cpu->handoff_thread = NULL;
+    if (next && next != thread && (next->state == ACTIVE || next->in_syscall)) {
+        scheduler_enter_thread(thread, next, reschedule);
+    } else if (next && next != thread) {
+        run_queue_push(&processor_local_data[this_cpu->core_id].run_queue, next);
+    }
+
+    while ((next = scheduler_next_thread()) != NULL) {
+        // Terminating threads are allowed to finish syscalls, but will end as soon as they are done.
+        // This is done to avoid leaving the kernel in an undefined state
+        if (next->state == ACTIVE || next->in_syscall) {
+            scheduler_enter_thread(thread, next, reschedule);
         }
-        else if (thread != this_cpu->idle_thread) {
-            debug_print("No other threads, entering idle\n");
-            if (reschedule) {
-                linked_list_add(&run_queue, thread);
-            }
-            this_cpu->current_thread = this_cpu->idle_thread;
-            arch_set_interrupt_stack(this_cpu->idle_thread->kernel_stack_top);
-            arch_mmu_enter_kernel_address_space();
 
-            arch_enter_context(&this_cpu->idle_thread->context);
+        if (next == thread) {
+            // Its stack is still in use, so requeue it to be cleaned up once we've switched away
+            reschedule = true;
+            continue;
         }
+        scheduler_wait_off_cpu(next);
+        thread_finish_termination(next);
     }
+
     // No other threads to run, continue what we were already doing
+    if (thread == this_cpu->idle_thread || (reschedule && thread && (thread->state == ACTIVE || thread->in_syscall))) {
+        scheduler_set_timer(thread);
+        return;
+    }
+
+    debug_print("No other threads, entering idle\n");
+    scheduler_enter_thread(thread, this_cpu->idle_thread, reschedule);
 }
 
 void schedule_thread(struct thread *thread) {
@@ -123,7 +273,41 @@ void schedule_thread(struct thread *thread) {
         panic(NULL, -1, "Scheduled a terminated thread\n");
     }
 
-    linked_list_add(&run_queue, thread);
+    // The thread doing the waking is about to block, so the woken thread can have its cpu
+    if (this_cpu->direct_handoff && !this_cpu->handoff_thread && thread != this_cpu->current_thread) {
+        this_cpu->handoff_thread = thread;
+        return;
+    }
+
+    // Return to the cpu it last ran on, whose caches are most likely to still hold its memory,
+    // unless that cpu is busy and another one has nothing to do
+    int cpu = thread->cpu;
+    if (!cpu_is_idle(cpu)) {
+        for (int i = 0; i < cpu_count; i++) {
+            if (cpu_is_idle(i)) {
+                cpu = i;
+                break;
+            }
+        }
+    }
+    run_queue_push(&processor_local_data[cpu].run_queue, thread);
+
+    // Idle cpus have no timer running, so they need to be told there is work.
+    // The cpu could be going idle right now, so the push has to be visible before it is checked
+    atomic_thread_fence(memory_order_seq_cst);
+    if (cpu_is_idle(cpu)) {
+        arch_cpu_wake(cpu);
+    }
+}
+
+/// @brief Hand this cpu to the first thread woken until the handoff is disabled
+///
+/// Used by threads that wake another thread and then immediately block waiting on it,
+/// such as a client calling a server. The woken thread runs as soon as the current
+/// thread switches away, instead of going through a run queue or an idle cpu.
+/// @param enabled Whether wakeups are handed off
+void scheduler_set_direct_handoff(bool enabled) {
+    this_cpu->direct_handoff = enabled;
 }
 
 /// @brief Block a thread until a signal is set
@@ -132,7 +316,6 @@ void schedule_thread(struct thread *thread) {
 /// the compiler should know the registers gets clobbered.
 ir_status_t scheduler_block_listener_and_switch(struct signal_listener *listener) {
     // This thread won't be on the run queue since it is currently running
-    linked_list_add(&waiting_for_signals, listener);
     this_cpu->current_thread->blocking_listener = listener;
 
     arch_save_context(&this_cpu->current_thread->context);
@@ -144,29 +327,64 @@ ir_status_t scheduler_block_listener_and_switch(struct signal_listener *listener
     return IR_OK;
 }
 
-/// @brief Unblock a thread that is listening to object signals
-/// @param listener The thread's signal listener
+/// @brief Claim the right to wake a listener's thread
+///
+/// The signal, the timeout and process termination can race to wake the thread,
+/// and only the first one may schedule it.
+/// @return Whether the caller is the first
+static bool scheduler_claim_listener(struct signal_listener *listener) {
+    return !atomic_exchange(&listener->woken, true);
+}
+
+/// @brief Schedule a listener's thread once the listener has been claimed
+static void scheduler_wake_listener(struct signal_listener *listener) {
+    // Waits for the timeout's callback to finish if it is already running elsewhere
+    timer_cancel(&listener->timeout);
+
+    listener->thread->blocking_listener = NULL;
+    schedule_thread(listener->thread);
+    // Listener is freed by the unblocked process when it begins running again
+}
+
+/// @brief Unblock a thread whose listener's signals were raised
+/// @param listener The thread's signal listener, already removed from its target's listeners
+/// @note Called with a lock on the listener's target
 void scheduler_unblock_listener(struct signal_listener *listener) {
+    if (!scheduler_claim_listener(listener)) return;
 
     debug_print("Listener unblocked\n");
+    scheduler_wake_listener(listener);
+}
 
-    linked_list_find_and_remove(&waiting_for_signals, listener, NULL, NULL);
+/// @brief Unblock a thread waiting on signals without them being raised,
+/// such as when the wait times out or the process is killed
+/// @param listener The thread's signal listener
+void scheduler_abort_listener(struct signal_listener *listener) {
+    if (!scheduler_claim_listener(listener)) return;
 
     spinlock_aquire(listener->target->lock);
-    linked_list_find_and_remove(&listener->target->signal_listeners, listener, NULL, NULL);
+    object_remove_listener(listener->target, listener);
     spinlock_release(listener->target->lock);
 
-    listener->thread->blocking_listener = NULL;
-    linked_list_add(&run_queue, listener->thread);
-    // Listener is freed by the unblocked process when it begins running again
+    scheduler_wake_listener(listener);
+}
+
+/// @brief Timer callback that ends a thread's sleep
+static void scheduler_sleep_finished(struct timer *timer) {
+    schedule_thread(timer->data);
 }
 
 /// @brief Put a thread to sleep and take it out of the run queue for a specific amount of time
 /// @param thread A thread that is not currently in a run queue
 /// @param microseconds How long the thread should sleep.
 void scheduler_sleep_microseconds(struct thread *thread, size_t microseconds) {
-    thread->sleeping_until = microseconds_since_boot + microseconds;
-    linked_list_add_sorted(&sleeping_threads, NULL, thread);
+    size_t deadline = time_microseconds() + microseconds;
+    if (deadline < microseconds) deadline = SIZE_MAX; // Overflowed
+
+    // Nothing would wake the thread up without a timer, so return right away instead
+    if (timer_set(&thread->sleep_timer, deadline, scheduler_sleep_finished, thread) != IR_OK) {
+        return;
+    }
 
     switch_task(false);
 }
@@ -1,5 +1,6 @@
 
 #include <kernel/string.h>
+#include "arch/defines.h"
 #include "arch/debug.h"
 
 #include <stdarg.h>
@@ -49,24 +50,113 @@ int strncmp(const char *str1, const char *str2, size_t n) {
     return *s1 - *s2;
 }
 
+/// Copies at least this long use `rep movsb`/`rep stosb` on cpus where only long ones are fast
+#define STRING_REP_THRESHOLD 64
+
+bool string_fast_rep = false;
+bool string_fast_short_rep = false;
+
+/// A word at any alignment, which can alias anything
+typedef uint64_t __attribute__((may_alias, aligned(1))) unaligned_word;
+
+/// @brief Whether a copy or fill of `size` bytes should use the cpu's string instructions
+static inline bool string_use_rep(size_t size) {
+#ifdef __x86_64__
+    return string_fast_short_rep || (string_fast_rep && size >= STRING_REP_THRESHOLD);
+#else
+    (void)size;
+    return false;
+#endif
+}
+
+/// @brief Copy from the lowest address up, a word at a time once the destination is aligned
+static void copy_forward(unsigned char *destination, const unsigned char *source, size_t size) {
+    if (size >= sizeof(uint64_t)) {
+        while ((uintptr_t)destination % sizeof(uint64_t)) {
+            *destination++ = *source++;
+            size--;
+        }
+        for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t)) {
+            *(uint64_t*)destination = *(const unaligned_word*)source;
+            destination += sizeof(uint64_t);
+            source += sizeof(uint64_t);
+        }
+    }
+    while (size--) {
+        *destination++ = *source++;
+    }
+}
+
+/// @brief Copy from the highest address down, for a destination overlapping the end of the source
+static void copy_backward(unsigned char *destination, const unsigned char *source, size_t size) {
+    destination += size;
+    source += size;
+    if (size >= sizeof(uint64_t)) {
+        while ((uintptr_t)destination % sizeof(uint64_t)) {
+            *--destination = *--source;
+            size--;
+        }
+        for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t)) {
+            destination -= sizeof(uint64_t);
+            source -= sizeof(uint64_t);
+            *(uint64_t*)destination = *(const unaligned_word*)source;
+        }
+    }
+    while (size--) {
+        *--destination = *--source;
+    }
+}
+
 // Copy a section of memory from one location to another
 void *memcpy(void* dest, const void* src, size_t size) {
-    // TODO: This needs some serious optimization
+#ifdef __x86_64__
+    if (string_use_rep(size)) {
+        void *destination = dest;
+        asm volatile ("rep movsb" : "+D" (destination), "+S" (src), "+c" (size) :: "memory");
+        return dest;
+    }
+#endif
 
-    char* destination = (char*)dest;
-    char* source = (char*)src;
+    copy_forward(dest, src, size);
+    return dest;
+}
 
-    for (size_t n = 0; n < size; n++) {
-        destination[n] = source[n];
+// Copy a section of memory to a location that may overlap it
+void *memmove(void *dest, const void *src, size_t size) {
+    // Copying forwards only goes wrong if the destination starts inside the source
+    if ((uintptr_t)dest - (uintptr_t)src >= size) {
+        return memcpy(dest, src, size);
     }
 
+    // Backwards string instructions don't get the fast microcode, so words are as good
+    copy_backward(dest, src, size);
     return dest;
 }
 
 // Fill an area of memory with a specific value
 void *memset(void *ptr, int value, size_t n) {
     unsigned char c = (unsigned char)value;
-    char *str = ptr;
+
+#ifdef __x86_64__
+    if (string_use_rep(n)) {
+        void *destination = ptr;
+        asm volatile ("rep stosb" : "+D" (destination), "+c" (n) : "a" (c) : "memory");
+        return ptr;
+    }
+#endif
+
+    unsigned char *str = ptr;
+    if (n >= sizeof(uint64_t)) {
+        while ((uintptr_t)str % sizeof(uint64_t)) {
+            *str++ = c;
+            n--;
+        }
+        uint64_t pattern = c * 0x0101010101010101ul;
+        for (; n >= sizeof(uint64_t); n -= sizeof(uint64_t)) {
+            *(uint64_t*)str = pattern;
+            str += sizeof(uint64_t);
+        }
+    }
     while (n > 0) {
         *str = c;
         str++;
@@ -76,6 +166,25 @@ void *memset(void *ptr, int value, size_t n) {
     return ptr;
 }
 
+// Zero a page with stores that go around the cache
+void zero_page_nontemporal(void *page) {
+#ifdef __x86_64__
+    uint64_t *word = page;
+    uint64_t *end = word + PAGE_SIZE / sizeof(uint64_t);
+    for (; word < end; word += 4) {
+        asm volatile ("movnti %1, (%0)\n"
+                      "movnti %1, 8(%0)\n"
+                      "movnti %1, 16(%0)\n"
+                      "movnti %1, 24(%0)"
+                      :: "r" (word), "r" (0ul) : "memory");
+    }
+    // Non-temporal stores aren't ordered with later ones until fenced
+    asm volatile ("sfence" ::: "memory");
+#else
+    memset(page, 0, PAGE_SIZE);
+#endif
+}
+
 int memcmp(const void *str1, const void *str2, size_t n) {
     const unsigned char *string1 = (const unsigned char *)str1;
     const unsigned char *string2 = (const unsigned char *)str2;
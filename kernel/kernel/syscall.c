@@ -6,12 +6,14 @@
 #include "iridium/syscalls.h"
 #include "kernel/channel.h"
 #include "kernel/devices/framebuffer.h"
+#include "kernel/futex.h"
 #include "kernel/handle.h"
 #include "kernel/heap.h"
 #include "kernel/interrupt.h"
 #include "kernel/ioport.h"
 #include "kernel/memory/v_addr_region.h"
 #include "kernel/memory/vm_object.h"
+#include "kernel/port.h"
 #include "kernel/process.h"
 #include "kernel/scheduler.h"
 #include "kernel/time.h"
@@ -57,6 +59,16 @@ const syscall syscall_table[] = {
     [SYSCALL_CHANNEL_CREATE] = (syscall)(uintptr_t)sys_channel_create,
     [SYSCALL_CHANNEL_READ] = (syscall)(uintptr_t)sys_channel_read,
     [SYSCALL_CHANNEL_WRITE] = (syscall)(uintptr_t)sys_channel_write,
+    [SYSCALL_CHANNEL_SET_QUEUE_DEPTH] = (syscall)(uintptr_t)sys_channel_set_queue_depth,
+    [SYSCALL_CHANNEL_WRITE_MOVE] = (syscall)(uintptr_t)sys_channel_write_move,
+    [SYSCALL_CHANNEL_CALL] = (syscall)(uintptr_t)sys_channel_call,
+    [SYSCALL_PORT_CREATE] = (syscall)(uintptr_t)sys_port_create,
+    [SYSCALL_PORT_BIND] = (syscall)(uintptr_t)sys_port_bind,
+    [SYSCALL_PORT_UNBIND] = (syscall)(uintptr_t)sys_port_unbind,
+    [SYSCALL_PORT_WAIT] = (syscall)(uintptr_t)sys_port_wait,
+    [SYSCALL_FUTEX_WAIT] = (syscall)(uintptr_t)sys_futex_wait,
+    [SYSCALL_FUTEX_WAKE] = (syscall)(uintptr_t)sys_futex_wake,
+    [SYSCALL_VM_OBJECT_CREATE_CLONE] = (syscall)(uintptr_t)sys_vm_object_create_clone,
 };
 
 uint syscall_count = sizeof(syscall_table) / sizeof(syscall);
@@ -65,7 +77,7 @@ uint syscall_count = sizeof(syscall_table) / sizeof(syscall);
 /// @param syscall_num The id of the system call the kernel is requested to perform
 /// @return The value returned by the performed system call
 int64_t syscall_handler(unsigned int syscall_num, long arg0, long arg1, long arg2, long arg3, long arg4) {
-    if (syscall_num > syscall_count || syscall_table[syscall_num] == NULL) {
+    if (syscall_num >= syscall_count || syscall_table[syscall_num] == NULL) {
         return IR_ERROR_INVALID_ARGUMENTS;
     }
     // Avoid leaving the kernel in a bad state by delaying potential termination until the syscall is complete
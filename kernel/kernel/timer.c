@@ -0,0 +1,174 @@
+/// @file kernel/timer.c
+/// @brief Per-cpu min-heaps of timers waiting for their deadlines
+
+#include "kernel/timer.h"
+#include "kernel/cpu_locals.h"
+#include "kernel/arch/arch.h"
+#include "kernel/heap.h"
+#include "iridium/errors.h"
+#include <stdint.h>
+
+/// Number of timers a heap has space for when the first one is armed
+#define TIMER_HEAP_INITIAL_CAPACITY 16
+
+#define TIMER_HEAP_PARENT(index) (((index) - 1) / 2)
+#define TIMER_HEAP_LEFT(index) ((index) * 2 + 1)
+
+/// @brief Put a timer at a position in the heap's array
+static inline void timer_heap_place(struct timer_heap *heap, size_t index, struct timer *timer) {
+    heap->timers[index] = timer;
+    timer->heap_index = index;
+}
+
+/// @brief Move a timer towards the root until its parent's deadline is no later
+static void timer_heap_sift_up(struct timer_heap *heap, size_t index) {
+    struct timer *timer = heap->timers[index];
+    while (index > 0) {
+        size_t parent = TIMER_HEAP_PARENT(index);
+        if (heap->timers[parent]->deadline <= timer->deadline) break;
+        timer_heap_place(heap, index, heap->timers[parent]);
+        index = parent;
+    }
+    timer_heap_place(heap, index, timer);
+}
+
+/// @brief Move a timer away from the root until neither child's deadline is earlier
+static void timer_heap_sift_down(struct timer_heap *heap, size_t index) {
+    struct timer *timer = heap->timers[index];
+    for (;;) {
+        size_t child = TIMER_HEAP_LEFT(index);
+        if (child >= heap->count) break;
+        // Follow the earlier of the two children
+        if (child + 1 < heap->count && heap->timers[child + 1]->deadline < heap->timers[child]->deadline) {
+            child++;
+        }
+        if (timer->deadline <= heap->timers[child]->deadline) break;
+        timer_heap_place(heap, index, heap->timers[child]);
+        index = child;
+    }
+    timer_heap_place(heap, index, timer);
+}
+
+/// @brief Take a timer out of the heap it is armed in
+/// @note Call with a lock on `heap`
+static void timer_heap_remove(struct timer_heap *heap, struct timer *timer) {
+    size_t index = timer->heap_index;
+    heap->count--;
+    // Fill the gap with the last timer and restore the ordering around it
+    if (index != heap->count) {
+        timer_heap_place(heap, index, heap->timers[heap->count]);
+        if (index > 0 && heap->timers[index]->deadline < heap->timers[TIMER_HEAP_PARENT(index)]->deadline) {
+            timer_heap_sift_up(heap, index);
+        } else {
+            timer_heap_sift_down(heap, index);
+        }
+    }
+    timer->heap = NULL;
+}
+
+/// @brief Arm a timer on the current cpu, replacing any deadline it was armed with
+/// @param timer The timer, which must stay valid until it fires or is cancelled
+/// @param deadline Time since boot in microseconds to run the callback at
+/// @param callback Function to run once the deadline passes
+/// @param data Value for the callback to find in `timer->data`
+/// @return `IR_OK`, or `IR_ERROR_NO_MEMORY` if the heap could not grow
+ir_status_t timer_set(struct timer *timer, size_t deadline, timer_callback callback, void *data) {
+    timer_cancel(timer);
+
+    timer->deadline = deadline;
+    timer->callback = callback;
+    timer->data = data;
+
+    struct timer_heap *heap = &processor_local_data[this_cpu->core_id].timers;
+    spinlock_aquire(heap->lock);
+
+    if (heap->count == heap->capacity) {
+        size_t capacity = heap->capacity ? heap->capacity * 2 : TIMER_HEAP_INITIAL_CAPACITY;
+        struct timer **timers = realloc(heap->timers, capacity * sizeof(struct timer*));
+        if (!timers) {
+            spinlock_release(heap->lock);
+            return IR_ERROR_NO_MEMORY;
+        }
+        heap->timers = timers;
+        heap->capacity = capacity;
+    }
+
+    timer->heap = heap;
+    timer_heap_place(heap, heap->count, timer);
+    heap->count++;
+    timer_heap_sift_up(heap, timer->heap_index);
+
+    spinlock_release(heap->lock);
+
+    // The hardware timer might be set for later than this, such as the end of a timeslice
+    if (deadline < heap->programmed_deadline) {
+        timer_program_cpu(deadline);
+    }
+
+    return IR_OK;
+}
+
+/// @brief Disarm a timer
+///
+/// If the callback is already running on another cpu this waits for it to finish,
+/// so the timer can be freed once this returns.
+/// @return `true` if the timer was disarmed before its callback ran
+bool timer_cancel(struct timer *timer) {
+    struct timer_heap *heap;
+    while ((heap = timer->heap) != NULL) {
+        spinlock_aquire(heap->lock);
+        // The timer could have fired or moved while waiting for the lock
+        if (timer->heap == heap) {
+            timer_heap_remove(heap, timer);
+            spinlock_release(heap->lock);
+            return true;
+        }
+        spinlock_release(heap->lock);
+    }
+
+    // Callbacks cancelling their own timer are on this cpu, and can't wait for themselves
+    for (int i = 0; i < cpu_count; i++) {
+        if (i == this_cpu->core_id) continue;
+        while (processor_local_data[i].timers.running == timer) {
+            arch_cpu_relax();
+        }
+    }
+    return false;
+}
+
+/// @brief Run the callbacks of every timer on this cpu whose deadline has passed
+/// @param now The current time since boot in microseconds
+void timer_run_expired(size_t now) {
+    struct timer_heap *heap = &processor_local_data[this_cpu->core_id].timers;
+
+    for (;;) {
+        spinlock_aquire(heap->lock);
+        if (heap->count == 0 || heap->timers[0]->deadline > now) {
+            spinlock_release(heap->lock);
+            return;
+        }
+        struct timer *timer = heap->timers[0];
+        timer_heap_remove(heap, timer);
+        heap->running = timer;
+        spinlock_release(heap->lock);
+
+        // Callbacks are free to arm timers, including the one that fired
+        timer->callback(timer);
+        heap->running = NULL;
+    }
+}
+
+/// @brief Program this cpu's hardware timer for the earlier of a deadline and its next kernel timer
+/// @param deadline Time since boot in microseconds, or `SIZE_MAX` for none
+void timer_program_cpu(size_t deadline) {
+    struct timer_heap *heap = &processor_local_data[this_cpu->core_id].timers;
+
+    spinlock_aquire(heap->lock);
+    if (heap->count > 0 && heap->timers[0]->deadline < deadline) {
+        deadline = heap->timers[0]->deadline;
+    }
+    spinlock_release(heap->lock);
+
+    heap->programmed_deadline = deadline;
+    arch_timer_set_deadline(deadline == SIZE_MAX ? UINT64_MAX : deadline);
+}
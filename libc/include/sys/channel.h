@@ -24,6 +24,15 @@ ir_status_t ir_channel_read(ir_handle_t channel, char *buffer, size_t buffer_len
 
 ir_status_t ir_channel_write(ir_handle_t channel, char *message, size_t message_length, ir_handle_t **handles, size_t handles_count);
 
+// Like ir_channel_write, but large page aligned messages have their pages moved to the reader,
+// and the caller's buffer reads as zeroes afterwards
+ir_status_t ir_channel_write_move(ir_handle_t channel, char *message, size_t message_length, ir_handle_t **handles, size_t handles_count);
+
+ir_status_t ir_channel_set_queue_depth(ir_handle_t channel, size_t queue_depth);
+
+// Writes a request and waits for the reply with the same transaction id
+ir_status_t ir_channel_call(ir_handle_t channel, ir_channel_call_args_t *args, size_t timeout_microseconds, size_t *handles_count, size_t *message_length);
+
 #ifdef __cplusplus
 }
 #endif
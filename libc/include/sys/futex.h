@@ -0,0 +1,25 @@
+
+#ifndef _LIBC_FUTEX_H_
+#define _LIBC_FUTEX_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define __need_size_t
+#include <stddef.h>
+#include <stdint.h>
+#include <iridium/types.h>
+
+// Wrappers for raw futex system calls
+
+// Blocks while *address == expected, until woken or timed out
+ir_status_t ir_futex_wait(volatile uint32_t *address, uint32_t expected, size_t timeout_microseconds);
+
+ir_status_t ir_futex_wake(volatile uint32_t *address, size_t count, size_t *woken_out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LIBC_FUTEX_H_
@@ -0,0 +1,27 @@
+
+#ifndef _LIBC_PORT_H_
+#define _LIBC_PORT_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define __need_size_t
+#include <stddef.h>
+#include <iridium/types.h>
+
+// Wrappers for raw port system calls
+
+ir_status_t ir_port_create(ir_handle_t *port_out);
+
+ir_status_t ir_port_bind(ir_handle_t port, ir_handle_t object, ir_signal_t signals, unsigned long key);
+
+ir_status_t ir_port_unbind(ir_handle_t port, ir_handle_t object, unsigned long key);
+
+ir_status_t ir_port_wait(ir_handle_t port, ir_port_packet_t *packets, size_t max_packets, size_t timeout_microseconds, size_t *count_out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LIBC_PORT_H_
@@ -0,0 +1,60 @@
+
+#ifndef _LIBC_SYNC_H_
+#define _LIBC_SYNC_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+// Locks built on futexes. They stay in userspace unless contended, and
+// contended waiters sleep in the kernel instead of spinning.
+// All of them are ready to use when zeroed.
+
+typedef struct {
+    // 0 when unlocked, 1 when locked, and 2 when locked with threads waiting
+    volatile uint32_t state;
+} ir_mutex_t;
+
+#define IR_MUTEX_INIT { 0 }
+
+void ir_mutex_lock(ir_mutex_t *mutex);
+// Returns 1 if the mutex was taken, or 0 if it is already locked
+int ir_mutex_try_lock(ir_mutex_t *mutex);
+void ir_mutex_unlock(ir_mutex_t *mutex);
+
+typedef struct {
+    // Incremented by every signal, so waiters can tell whether they missed one
+    volatile uint32_t sequence;
+} ir_condvar_t;
+
+#define IR_CONDVAR_INIT { 0 }
+
+// Unlocks the mutex while waiting, and locks it again before returning.
+// Like any condition variable, wakeups can be spurious
+void ir_condvar_wait(ir_condvar_t *condvar, ir_mutex_t *mutex);
+void ir_condvar_signal(ir_condvar_t *condvar);
+void ir_condvar_broadcast(ir_condvar_t *condvar);
+
+typedef struct {
+    // Number of readers holding the lock, or IR_RWLOCK_WRITER
+    volatile uint32_t state;
+    // Threads sleeping on state, so unlocking only enters the kernel when needed
+    volatile uint32_t waiters;
+} ir_rwlock_t;
+
+#define IR_RWLOCK_INIT { 0, 0 }
+#define IR_RWLOCK_WRITER 0xffffffffu
+
+// Readers share the lock. New readers aren't held back by waiting writers
+void ir_rwlock_read_lock(ir_rwlock_t *rwlock);
+void ir_rwlock_read_unlock(ir_rwlock_t *rwlock);
+void ir_rwlock_write_lock(ir_rwlock_t *rwlock);
+void ir_rwlock_write_unlock(ir_rwlock_t *rwlock);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LIBC_SYNC_H_
@@ -13,8 +13,10 @@ extern "C" {
 // Wrappers for raw vm object system calls
 
 ir_status_t ir_vm_object_create(size_t size, unsigned long flags, ir_handle_t *handle_out);
+/// Create a vm object sharing another's memory, which is copied a page at a time as either is written
+ir_status_t ir_vm_object_create_clone(ir_handle_t vm_object, ir_handle_t *clone_out);
 
-// More calls will be added in the future, such as duplicating and potentially resizing
+// More calls will be added in the future, such as potentially resizing
 
 #ifdef __cplusplus
 }
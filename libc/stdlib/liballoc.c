@@ -2,9 +2,9 @@
  * Durand's Amazing Super Duper Memory functions.
  * */
 
-#include <stdatomic.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <sys/sync.h>
 #include <sys/v_addr_region.h>
 #include <sys/vm_object.h>
 #include <iridium/types.h>
@@ -122,20 +122,12 @@ static struct memory_block *memory_blocks = initial_block_array;
 
 static int expanding_block_array = 0;
 
-atomic_flag global_lock = ATOMIC_FLAG_INIT;
+// Contended allocations sleep until the holder unlocks, instead of spinning through their timeslice
+static ir_mutex_t global_lock = IR_MUTEX_INIT;
 
-typedef struct lock_t {
-    const char *function;
-} lock_t;
+#define liballoc_lock() ir_mutex_lock(&global_lock)
 
-#define liballoc_lock() \
-    do { \
-    while (atomic_flag_test_and_set_explicit(&global_lock, memory_order_acquire)); \
-    } while (0)
-
-#define liballoc_unlock() do { \
-    atomic_flag_clear_explicit(&global_lock, memory_order_release); \
-    } while (0)
+#define liballoc_unlock() ir_mutex_unlock(&global_lock)
 
 void *liballoc_alloc(size_t pages) {
 
@@ -1,14 +1,32 @@
 #include <string.h>
+#include "string_impl.h"
 
 void *memchr(const void *str, int c, size_t n) {
-    unsigned char *string = (unsigned char*)str;
-    while (n > 0) {
-        if (*string == (unsigned char)c) {
-            return string;
+    return _string_functions.memchr(str, c, n);
+}
+
+STRING_GENERAL_REGS void *_memchr_swar(const void *str, int c, size_t n) {
+    if (n == 0) {
+        return NULL;
+    }
+
+    // Start from the aligned word holding the first byte
+    size_t offset = (uintptr_t)str % WORD_SIZE;
+    const aligned_word *word = (const aligned_word*)((const unsigned char*)str - offset);
+    // Bytes left to search, counted from the start of `word`
+    size_t remaining = n > SIZE_MAX - offset ? SIZE_MAX : n + offset;
+
+    word_t pattern = word_repeat((unsigned char)c);
+    word_t found = word_has_zero(word_skip_bytes(*word ^ pattern, offset));
+    while (!found) {
+        if (remaining <= WORD_SIZE) {
+            return NULL;
         }
-        string++;
-        n--;
+        remaining -= WORD_SIZE;
+        word++;
+        found = word_has_zero(*word ^ pattern);
     }
 
-    return NULL;
+    size_t index = word_first_byte(found);
+    return index < remaining ? (unsigned char*)word + index : NULL;
 }
@@ -1,13 +1,32 @@
 #include <string.h>
+#include "string_impl.h"
 
 int memcmp(const void *str1, const void *str2, size_t n) {
+    return _string_functions.memcmp(str1, str2, n);
+}
+
+STRING_GENERAL_REGS int _memcmp_swar(const void *str1, const void *str2, size_t n) {
     const unsigned char *string1 = (const unsigned char *)str1;
     const unsigned char *string2 = (const unsigned char *)str2;
 
-    while (*string1 == *string2 && n) {
+    // Both areas are read in full, so words never reach past either of them
+    for (; n >= WORD_SIZE; n -= WORD_SIZE) {
+        word_t difference = *(const unaligned_word*)string1 ^ *(const unaligned_word*)string2;
+        if (difference) {
+            size_t index = word_first_byte(difference);
+            return string1[index] - string2[index];
+        }
+        string1 += WORD_SIZE;
+        string2 += WORD_SIZE;
+    }
+
+    while (n) {
+        if (*string1 != *string2) {
+            return *string1 - *string2;
+        }
         string1++;
         string2++;
         n--;
     }
-    return *string1 - *string2;
+    return 0;
 }
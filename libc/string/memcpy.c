@@ -1,11 +1,28 @@
 #include <string.h>
+#include "string_impl.h"
 
 void *memcpy(void* dest, const void* src, size_t size) {
-    char* destination = (char*)dest;
-    char* source = (char*)src;
+    return _string_functions.memcpy(dest, src, size);
+}
+
+STRING_GENERAL_REGS void *_memcpy_swar(void* dest, const void* src, size_t size) {
+    unsigned char *destination = (unsigned char*)dest;
+    const unsigned char *source = (const unsigned char*)src;
 
-    for (size_t n = 0; n < size; n++) {
-        destination[n] = source[n];
+    // Copy a word at a time once the destination is aligned
+    if (size >= WORD_SIZE) {
+        while ((uintptr_t)destination % WORD_SIZE) {
+            *destination++ = *source++;
+            size--;
+        }
+        for (; size >= WORD_SIZE; size -= WORD_SIZE) {
+            *(aligned_word*)destination = *(const unaligned_word*)source;
+            destination += WORD_SIZE;
+            source += WORD_SIZE;
+        }
+    }
+    while (size--) {
+        *destination++ = *source++;
     }
 
     return dest;
@@ -1,7 +1,25 @@
 #include <string.h>
+#include "string_impl.h"
 
 void *memset(void *str, int c, size_t n) {
+    return _string_functions.memset(str, c, n);
+}
+
+STRING_GENERAL_REGS void *_memset_swar(void *str, int c, size_t n) {
     unsigned char *string = (unsigned char*)str;
+
+    // Fill a word at a time once the destination is aligned
+    if (n >= WORD_SIZE) {
+        while ((uintptr_t)string % WORD_SIZE) {
+            *string++ = (unsigned char)c;
+            n--;
+        }
+        word_t pattern = word_repeat((unsigned char)c);
+        for (; n >= WORD_SIZE; n -= WORD_SIZE) {
+            *(aligned_word*)string = pattern;
+            string += WORD_SIZE;
+        }
+    }
     while (n > 0) {
         *string = (unsigned char)c;
         string++;
@@ -1,14 +1,25 @@
 #include <string.h>
+#include "string_impl.h"
 
 char *strchr(const char *str, int c) {
-    unsigned char *string = (unsigned char*)str;
-    while (*string != '\0') {
-        if (*string == (unsigned char)c) {
-            return (char *)string;
-        }
-        string++;
+    return _string_functions.strchr(str, c);
+}
+
+STRING_GENERAL_REGS char *_strchr_swar(const char *str, int c) {
+    // Start from the aligned word holding the first byte
+    size_t offset = (uintptr_t)str % WORD_SIZE;
+    const aligned_word *word = (const aligned_word*)(str - offset);
+
+    // Stop at the first byte matching either the character or the null terminator
+    word_t pattern = word_repeat((unsigned char)c);
+    word_t found = word_has_zero(word_skip_bytes(*word, offset)) |
+                   word_has_zero(word_skip_bytes(*word ^ pattern, offset));
+    while (!found) {
+        word++;
+        found = word_has_zero(*word) | word_has_zero(*word ^ pattern);
     }
 
     // The null terminator is considered part of the string in the context of this function
-    return (unsigned char)c == '\0' ? (char *)string : NULL;
+    const char *match = (const char*)word + word_first_byte(found);
+    return *match == (char)c ? (char *)match : NULL;
 }
@@ -1,13 +1,27 @@
 #include <string.h>
+#include "string_impl.h"
 
-int strcmp(const char *str1, const char *str2) {
+STRING_GENERAL_REGS int strcmp(const char *str1, const char *str2) {
     const unsigned char *string1 = (const unsigned char *)str1;
     const unsigned char *string2 = (const unsigned char *)str2;
 
-    while (*string1 == *string2 && *string1 != '\0') {
+    while (1) {
+        // Skip whole words while the first string is aligned and neither string ends in them.
+        // The second string's word can be unaligned, so it isn't read if it could cross a page
+        if ((uintptr_t)string1 % WORD_SIZE == 0 && word_read_stays_in_page(string2)) {
+            word_t word1 = *(const aligned_word*)string1;
+            if (word1 == *(const unaligned_word*)string2 && !word_has_zero(word1)) {
+                string1 += WORD_SIZE;
+                string2 += WORD_SIZE;
+                continue;
+            }
+        }
+
+        // Otherwise go a byte at a time, which finds any difference before reaching the next word
+        if (*string1 != *string2 || *string1 == '\0') {
+            return *string1 - *string2;
+        }
         string1++;
         string2++;
     }
-
-    return *string1 - *string2;
 }
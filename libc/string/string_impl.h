@@ -0,0 +1,114 @@
+
+#ifndef _LIBC_STRING_IMPL_H_
+#define _LIBC_STRING_IMPL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Helpers for scanning memory a word at a time using only general purpose registers ("SWAR").
+// Scans read whole aligned words, which never cross into a page the string doesn't touch,
+// so they are safe to run up to the last byte of a mapping.
+
+typedef unsigned long word_t;
+
+#ifdef __x86_64__
+/// Keeps the compiler from turning word at a time code into vector code.
+/// Helpers need it too, or they can't be inlined into functions using it
+#define STRING_GENERAL_REGS __attribute__((target("general-regs-only")))
+#else
+#define STRING_GENERAL_REGS
+#endif
+
+/// A word at any alignment, which can alias anything
+typedef word_t __attribute__((may_alias, aligned(1))) unaligned_word;
+/// An aligned word, which can alias anything
+typedef word_t __attribute__((may_alias)) aligned_word;
+
+#define WORD_SIZE sizeof(word_t)
+/// 0x0101...01
+#define WORD_ONES ((word_t)-1 / 0xff)
+/// 0x8080...80
+#define WORD_HIGHS (WORD_ONES * 0x80)
+
+/// The smallest page size, used to tell whether an unaligned word read could fault
+#define STRING_PAGE_SIZE 4096
+
+/// @brief Mark the zero bytes of a word
+/// @return The high bit set in the first (lowest addressed) zero byte, or 0 if there are none.
+///         Bytes after the first zero byte can be falsely marked.
+static inline STRING_GENERAL_REGS word_t word_has_zero(word_t x) {
+    return (x - WORD_ONES) & ~x & WORD_HIGHS;
+}
+
+/// @brief Word with every byte set to `c`
+static inline STRING_GENERAL_REGS word_t word_repeat(unsigned char c) {
+    return c * WORD_ONES;
+}
+
+/// @brief Index of the byte holding the lowest set bit of a non-zero word
+static inline STRING_GENERAL_REGS size_t word_first_byte(word_t x) {
+    return __builtin_ctzl(x) / 8;
+}
+
+/// @brief Set the bytes of a word loaded from before a string's start, so they never match
+/// @param offset How many bytes of the word come before the string, less than `WORD_SIZE`
+static inline STRING_GENERAL_REGS word_t word_skip_bytes(word_t x, size_t offset) {
+    return x | (((word_t)1 << (offset * 8)) - 1);
+}
+
+/// @brief Whether reading a word from `address` can't reach into the next page
+static inline STRING_GENERAL_REGS int word_read_stays_in_page(const void *address) {
+    return ((uintptr_t)address & (STRING_PAGE_SIZE - 1)) <= STRING_PAGE_SIZE - WORD_SIZE;
+}
+
+// Word at a time versions of the functions in `_string_functions`, which work on any cpu
+void *_memchr_swar(const void *str, int c, size_t n);
+int _memcmp_swar(const void *str1, const void *str2, size_t n);
+void *_memcpy_swar(void *dest, const void *src, size_t n);
+void *_memset_swar(void *str, int c, size_t n);
+char *_strchr_swar(const char *str, int c);
+size_t _strlen_swar(const char *str);
+
+/// Implementations of the string functions with faster versions on some cpus,
+/// chosen by `_string_init` before `main` runs
+struct string_functions {
+    void *(*memchr)(const void *str, int c, size_t n);
+    int (*memcmp)(const void *str1, const void *str2, size_t n);
+    void *(*memcpy)(void *dest, const void *src, size_t n);
+    void *(*memset)(void *str, int c, size_t n);
+    char *(*strchr)(const char *str, int c);
+    size_t (*strlen)(const char *str);
+};
+
+extern struct string_functions _string_functions;
+
+#ifdef __x86_64__
+// Versions using 16 byte SSE2 vectors, which every x86_64 cpu has
+void *_memchr_sse2(const void *str, int c, size_t n);
+int _memcmp_sse2(const void *str1, const void *str2, size_t n);
+void *_memcpy_sse2(void *dest, const void *src, size_t n);
+void *_memset_sse2(void *str, int c, size_t n);
+char *_strchr_sse2(const char *str, int c);
+size_t _strlen_sse2(const char *str);
+
+// Versions using 32 byte AVX2 vectors
+void *_memchr_avx2(const void *str, int c, size_t n);
+int _memcmp_avx2(const void *str1, const void *str2, size_t n);
+void *_memcpy_avx2(void *dest, const void *src, size_t n);
+void *_memset_avx2(void *str, int c, size_t n);
+char *_strchr_avx2(const char *str, int c);
+size_t _strlen_avx2(const char *str);
+#endif
+
+// Pick the fastest string functions this cpu supports
+void _string_init(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LIBC_STRING_IMPL_H_
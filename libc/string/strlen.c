@@ -1,10 +1,20 @@
 #include <string.h>
+#include "string_impl.h"
 
 size_t strlen(const char *str) {
-    int length = 0;
-    while (*str != '\0') {
-        length++;
-        str++;
+    return _string_functions.strlen(str);
+}
+
+STRING_GENERAL_REGS size_t _strlen_swar(const char *str) {
+    // Start from the aligned word holding the first byte
+    size_t offset = (uintptr_t)str % WORD_SIZE;
+    const aligned_word *word = (const aligned_word*)(str - offset);
+
+    word_t found = word_has_zero(word_skip_bytes(*word, offset));
+    while (!found) {
+        word++;
+        found = word_has_zero(*word);
     }
-    return length;
+
+    return (const char*)word + word_first_byte(found) - str;
 }
@@ -1,14 +1,31 @@
 #include <string.h>
+#include "string_impl.h"
 
-int strncmp(const char *str1, const char *str2, size_t n) {
+STRING_GENERAL_REGS int strncmp(const char *str1, const char *str2, size_t n) {
     const unsigned char *s1 = (const unsigned char *)str1;
     const unsigned char *s2 = (const unsigned char *)str2;
 
-    while (n && (*s1 == *s2) && *s1 != '\0') {
+    while (n) {
+        // Skip whole words while the first string is aligned and neither string ends in them.
+        // The second string's word can be unaligned, so it isn't read if it could cross a page
+        if (n >= WORD_SIZE && (uintptr_t)s1 % WORD_SIZE == 0 && word_read_stays_in_page(s2)) {
+            word_t word1 = *(const aligned_word*)s1;
+            if (word1 == *(const unaligned_word*)s2 && !word_has_zero(word1)) {
+                s1 += WORD_SIZE;
+                s2 += WORD_SIZE;
+                n -= WORD_SIZE;
+                continue;
+            }
+        }
+
+        // Otherwise go a byte at a time, which finds any difference before reaching the next word
+        if (*s1 != *s2 || *s1 == '\0') {
+            return *s1 - *s2;
+        }
         s1++;
         s2++;
         n--;
     }
 
-    return *s1 - *s2;
+    return 0;
 }
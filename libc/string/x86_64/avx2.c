@@ -0,0 +1,18 @@
+#include <string.h>
+#include "../string_impl.h"
+
+// Only called once `_string_init` has checked the cpu and kernel support AVX2
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+#define SIMD_NAME(name) _##name##_avx2
+#define VECTOR_SIZE 32
+typedef __m256i vector_t;
+#define vector_load(p) _mm256_load_si256((const __m256i*)(p))
+#define vector_loadu(p) _mm256_loadu_si256((const __m256i*)(p))
+#define vector_store(p, v) _mm256_store_si256((__m256i*)(p), v)
+#define vector_storeu(p, v) _mm256_storeu_si256((__m256i*)(p), v)
+#define vector_repeat(c) _mm256_set1_epi8((char)(c))
+#define vector_equal_mask(a, b) ((unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)))
+
+#include "simd.h"
@@ -0,0 +1,145 @@
+
+// Vector versions of the string functions, included once per instruction set by a file defining:
+//   SIMD_NAME(name)            The name of that instruction set's version of a function
+//   VECTOR_SIZE                Bytes in a vector, at most 32
+//   vector_t                   The vector type
+//   vector_load(p)             Load from an address aligned to `VECTOR_SIZE`
+//   vector_loadu(p)            Load from any address
+//   vector_store(p, v)         Store to an address aligned to `VECTOR_SIZE`
+//   vector_storeu(p, v)        Store to any address
+//   vector_repeat(c)           A vector with every byte set to `c`
+//   vector_equal_mask(a, b)    An unsigned int with bit `i` set if byte `i` of both vectors is equal
+//
+// Scans load aligned vectors, which never cross into a page the string doesn't touch,
+// and other functions only load vectors inside the areas they were given.
+// Anything shorter than a vector is left to the word at a time versions.
+
+/// Bit set for each byte in a vector
+#define VECTOR_MASK_ALL ((unsigned int)((1ul << VECTOR_SIZE) - 1))
+
+void *SIMD_NAME(memchr)(const void *str, int c, size_t n) {
+    if (n == 0) {
+        return NULL;
+    }
+
+    // Start from the aligned vector holding the first byte
+    size_t offset = (uintptr_t)str % VECTOR_SIZE;
+    const unsigned char *block = (const unsigned char*)str - offset;
+    // Bytes left to search, counted from the start of `block`
+    size_t remaining = n > SIZE_MAX - offset ? SIZE_MAX : n + offset;
+
+    vector_t pattern = vector_repeat(c);
+    unsigned int found = vector_equal_mask(vector_load(block), pattern) & (VECTOR_MASK_ALL << offset);
+    while (!found) {
+        if (remaining <= VECTOR_SIZE) {
+            return NULL;
+        }
+        remaining -= VECTOR_SIZE;
+        block += VECTOR_SIZE;
+        found = vector_equal_mask(vector_load(block), pattern);
+    }
+
+    size_t index = __builtin_ctz(found);
+    return index < remaining ? (void*)(block + index) : NULL;
+}
+
+int SIMD_NAME(memcmp)(const void *str1, const void *str2, size_t n) {
+    if (n < VECTOR_SIZE) {
+        return _memcmp_swar(str1, str2, n);
+    }
+
+    const unsigned char *string1 = (const unsigned char *)str1;
+    const unsigned char *string2 = (const unsigned char *)str2;
+
+    // The last vector overlaps the one before it rather than reading past the end
+    size_t last = n - VECTOR_SIZE;
+    for (size_t i = 0; ; i += VECTOR_SIZE) {
+        if (i > last) {
+            i = last;
+        }
+        unsigned int difference = vector_equal_mask(vector_loadu(string1 + i), vector_loadu(string2 + i)) ^ VECTOR_MASK_ALL;
+        if (difference) {
+            size_t index = i + __builtin_ctz(difference);
+            return string1[index] - string2[index];
+        }
+        if (i == last) {
+            return 0;
+        }
+    }
+}
+
+void *SIMD_NAME(memcpy)(void *dest, const void *src, size_t size) {
+    if (size < VECTOR_SIZE) {
+        return _memcpy_swar(dest, src, size);
+    }
+
+    unsigned char *destination = (unsigned char*)dest;
+    const unsigned char *source = (const unsigned char*)src;
+
+    // Unaligned first and last vectors cover the ends, and aligned stores fill in between
+    vector_t first = vector_loadu(source);
+    vector_t last = vector_loadu(source + size - VECTOR_SIZE);
+    for (size_t i = VECTOR_SIZE - (uintptr_t)destination % VECTOR_SIZE; i + VECTOR_SIZE <= size; i += VECTOR_SIZE) {
+        vector_store(destination + i, vector_loadu(source + i));
+    }
+    vector_storeu(destination, first);
+    vector_storeu(destination + size - VECTOR_SIZE, last);
+
+    return dest;
+}
+
+void *SIMD_NAME(memset)(void *str, int c, size_t n) {
+    if (n < VECTOR_SIZE) {
+        return _memset_swar(str, c, n);
+    }
+
+    unsigned char *string = (unsigned char*)str;
+
+    // Unaligned first and last vectors cover the ends, and aligned stores fill in between
+    vector_t pattern = vector_repeat(c);
+    vector_storeu(string, pattern);
+    for (size_t i = VECTOR_SIZE - (uintptr_t)string % VECTOR_SIZE; i + VECTOR_SIZE <= n; i += VECTOR_SIZE) {
+        vector_store(string + i, pattern);
+    }
+    vector_storeu(string + n - VECTOR_SIZE, pattern);
+
+    return str;
+}
+
+char *SIMD_NAME(strchr)(const char *str, int c) {
+    // Start from the aligned vector holding the first byte
+    size_t offset = (uintptr_t)str % VECTOR_SIZE;
+    const char *block = str - offset;
+
+    // Stop at the first byte matching either the character or the null terminator
+    vector_t zero = vector_repeat(0);
+    vector_t pattern = vector_repeat(c);
+    vector_t vector = vector_load(block);
+    unsigned int found = (vector_equal_mask(vector, zero) | vector_equal_mask(vector, pattern)) & (VECTOR_MASK_ALL << offset);
+    while (!found) {
+        block += VECTOR_SIZE;
+        vector = vector_load(block);
+        found = vector_equal_mask(vector, zero) | vector_equal_mask(vector, pattern);
+    }
+
+    // The null terminator is considered part of the string in the context of this function
+    const char *match = block + __builtin_ctz(found);
+    return *match == (char)c ? (char *)match : NULL;
+}
+
+size_t SIMD_NAME(strlen)(const char *str) {
+    // Start from the aligned vector holding the first byte
+    size_t offset = (uintptr_t)str % VECTOR_SIZE;
+    const char *block = str - offset;
+
+    vector_t zero = vector_repeat(0);
+    unsigned int found = vector_equal_mask(vector_load(block), zero) & (VECTOR_MASK_ALL << offset);
+    while (!found) {
+        block += VECTOR_SIZE;
+        found = vector_equal_mask(vector_load(block), zero);
+    }
+
+    return block + __builtin_ctz(found) - str;
+}
+
+#undef VECTOR_MASK_ALL
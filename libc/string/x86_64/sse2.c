@@ -0,0 +1,16 @@
+#include <string.h>
+#include "../string_impl.h"
+
+#include <emmintrin.h>
+
+#define SIMD_NAME(name) _##name##_sse2
+#define VECTOR_SIZE 16
+typedef __m128i vector_t;
+#define vector_load(p) _mm_load_si128((const __m128i*)(p))
+#define vector_loadu(p) _mm_loadu_si128((const __m128i*)(p))
+#define vector_store(p, v) _mm_store_si128((__m128i*)(p), v)
+#define vector_storeu(p, v) _mm_storeu_si128((__m128i*)(p), v)
+#define vector_repeat(c) _mm_set1_epi8((char)(c))
+#define vector_equal_mask(a, b) ((unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)))
+
+#include "simd.h"
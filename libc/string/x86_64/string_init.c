@@ -0,0 +1,71 @@
+#include <string.h>
+#include "../string_impl.h"
+
+#include <cpuid.h>
+
+#define CPUID_FEATURE_LEAF 1
+#define CPUID_ECX_OSXSAVE (1 << 27)
+#define CPUID_ECX_AVX (1 << 28)
+#define CPUID_EXTENDED_FEATURE_LEAF 7
+#define CPUID_EBX_AVX2 (1 << 5)
+
+/// SSE and AVX state enabled in XCR0, meaning the kernel saves the AVX registers
+#define XCR0_SSE_AVX 0x6
+
+/// Word at a time until `_string_init` runs, so anything called before it is still safe
+struct string_functions _string_functions = {
+    .memchr = _memchr_swar,
+    .memcmp = _memcmp_swar,
+    .memcpy = _memcpy_swar,
+    .memset = _memset_swar,
+    .strchr = _strchr_swar,
+    .strlen = _strlen_swar,
+};
+
+/// @brief Whether both the cpu and the kernel support AVX2
+static int avx2_supported(void) {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(CPUID_FEATURE_LEAF, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+    if (!(ecx & CPUID_ECX_OSXSAVE) || !(ecx & CPUID_ECX_AVX)) {
+        return 0;
+    }
+
+    unsigned int xcr0_low, xcr0_high;
+    asm ("xgetbv" : "=a" (xcr0_low), "=d" (xcr0_high) : "c" (0));
+    if ((xcr0_low & XCR0_SSE_AVX) != XCR0_SSE_AVX) {
+        return 0;
+    }
+
+    if (__get_cpuid_max(0, NULL) < CPUID_EXTENDED_FEATURE_LEAF) {
+        return 0;
+    }
+    __cpuid_count(CPUID_EXTENDED_FEATURE_LEAF, 0, eax, ebx, ecx, edx);
+    return ebx & CPUID_EBX_AVX2;
+}
+
+/// @brief Pick the fastest string functions this cpu supports.
+/// Called once at startup, before `main` or any other threads run
+void _string_init(void) {
+    if (avx2_supported()) {
+        _string_functions = (struct string_functions){
+            .memchr = _memchr_avx2,
+            .memcmp = _memcmp_avx2,
+            .memcpy = _memcpy_avx2,
+            .memset = _memset_avx2,
+            .strchr = _strchr_avx2,
+            .strlen = _strlen_avx2,
+        };
+    } else {
+        // Every x86_64 cpu has SSE2
+        _string_functions = (struct string_functions){
+            .memchr = _memchr_sse2,
+            .memcmp = _memcmp_sse2,
+            .memcpy = _memcpy_sse2,
+            .memset = _memset_sse2,
+            .strchr = _strchr_sse2,
+            .strlen = _strlen_sse2,
+        };
+    }
+}
@@ -1,27 +1,69 @@
 #include <ctype.h>
 #include <strings.h>
+#include "../string/string_impl.h"
 
-int strcasecmp(const char *s1, const char *s2) {
+/// @brief Lowercase the ASCII letters in a word, like `tolower` on each byte
+static inline STRING_GENERAL_REGS word_t word_to_lower(word_t x) {
+    // Adding to the low 7 bits of each byte can't carry into the next one, and sets
+    // the high bit in bytes from 'A' up, then in bytes past 'Z'
+    word_t low = x & ~WORD_HIGHS;
+    word_t from_a = low + word_repeat(0x80 - 'A');
+    word_t past_z = low + word_repeat(0x80 - 'Z' - 1);
+    word_t upper = from_a & ~past_z & ~x & WORD_HIGHS;
+    // 0x80 >> 2 is the bit separating upper and lowercase letters
+    return x | upper >> 2;
+}
+
+/// @brief Whether the next word of both strings is the same ignoring case, without either ending.
+/// The first string must be aligned
+static inline STRING_GENERAL_REGS int words_equal_ignoring_case(const unsigned char *string1, const unsigned char *string2) {
+    // The second string's word can be unaligned, so it isn't read if it could cross a page
+    if (!word_read_stays_in_page(string2)) {
+        return 0;
+    }
+    word_t word1 = *(const aligned_word*)string1;
+    return word_to_lower(word1) == word_to_lower(*(const unaligned_word*)string2) && !word_has_zero(word1);
+}
+
+STRING_GENERAL_REGS int strcasecmp(const char *s1, const char *s2) {
     const unsigned char *string1 = (const unsigned char *)s1;
     const unsigned char *string2 = (const unsigned char *)s2;
 
-    while (tolower(*string1) == tolower(*string2) && *string1 != '\0') {
+    while (1) {
+        if ((uintptr_t)string1 % WORD_SIZE == 0 && words_equal_ignoring_case(string1, string2)) {
+            string1 += WORD_SIZE;
+            string2 += WORD_SIZE;
+            continue;
+        }
+
+        // A byte at a time finds any difference before reaching the next word
+        if (tolower(*string1) != tolower(*string2) || *string1 == '\0') {
+            return tolower(*string1) - tolower(*string2);
+        }
         string1++;
         string2++;
     }
-
-    return tolower(*string1) - tolower(*string2);
 }
 
-int strncasecmp(const char *s1, const char *s2, size_t n) {
+STRING_GENERAL_REGS int strncasecmp(const char *s1, const char *s2, size_t n) {
     const unsigned char *string1 = (const unsigned char *)s1;
     const unsigned char *string2 = (const unsigned char *)s2;
 
-    while (n && (tolower(*string1) == tolower(*string2)) && *string1 != '\0') {
+    while (n) {
+        if (n >= WORD_SIZE && (uintptr_t)string1 % WORD_SIZE == 0 && words_equal_ignoring_case(string1, string2)) {
+            string1 += WORD_SIZE;
+            string2 += WORD_SIZE;
+            n -= WORD_SIZE;
+            continue;
+        }
+
+        if (tolower(*string1) != tolower(*string2) || *string1 == '\0') {
+            return tolower(*string1) - tolower(*string2);
+        }
         string1++;
         string2++;
         n--;
     }
 
-    return tolower(*string1) - tolower(*string2);
+    return 0;
 }
@@ -21,3 +21,15 @@ ir_status_t ir_channel_read(ir_handle_t channel, char *buffer, size_t buffer_len
 ir_status_t ir_channel_write(ir_handle_t channel, char *message, size_t message_length, ir_handle_t **handles, size_t handles_count) {
     return _syscall_5(SYSCALL_CHANNEL_WRITE, channel, (long)message, message_length, (long)handles, (long)handles_count);
 }
+
+ir_status_t ir_channel_write_move(ir_handle_t channel, char *message, size_t message_length, ir_handle_t **handles, size_t handles_count) {
+    return _syscall_5(SYSCALL_CHANNEL_WRITE_MOVE, channel, (long)message, message_length, (long)handles, (long)handles_count);
+}
+
+ir_status_t ir_channel_set_queue_depth(ir_handle_t channel, size_t queue_depth) {
+    return _syscall_2(SYSCALL_CHANNEL_SET_QUEUE_DEPTH, channel, queue_depth);
+}
+
+ir_status_t ir_channel_call(ir_handle_t channel, ir_channel_call_args_t *args, size_t timeout_microseconds, size_t *handles_count, size_t *message_length) {
+    return _syscall_5(SYSCALL_CHANNEL_CALL, channel, (long)args, timeout_microseconds, (long)handles_count, (long)message_length);
+}
@@ -0,0 +1,12 @@
+#include <sys/futex.h>
+#include <sys/x86_64/syscall.h>
+#include <iridium/syscalls.h>
+#include <iridium/types.h>
+
+ir_status_t ir_futex_wait(volatile uint32_t *address, uint32_t expected, size_t timeout_microseconds) {
+    return _syscall_3(SYSCALL_FUTEX_WAIT, (long)address, expected, timeout_microseconds);
+}
+
+ir_status_t ir_futex_wake(volatile uint32_t *address, size_t count, size_t *woken_out) {
+    return _syscall_3(SYSCALL_FUTEX_WAKE, (long)address, count, (long)woken_out);
+}
@@ -0,0 +1,20 @@
+#include <sys/port.h>
+#include <sys/x86_64/syscall.h>
+#include <iridium/syscalls.h>
+#include <iridium/types.h>
+
+ir_status_t ir_port_create(ir_handle_t *port_out) {
+    return _syscall_1(SYSCALL_PORT_CREATE, (long)port_out);
+}
+
+ir_status_t ir_port_bind(ir_handle_t port, ir_handle_t object, ir_signal_t signals, unsigned long key) {
+    return _syscall_4(SYSCALL_PORT_BIND, port, object, signals, key);
+}
+
+ir_status_t ir_port_unbind(ir_handle_t port, ir_handle_t object, unsigned long key) {
+    return _syscall_3(SYSCALL_PORT_UNBIND, port, object, key);
+}
+
+ir_status_t ir_port_wait(ir_handle_t port, ir_port_packet_t *packets, size_t max_packets, size_t timeout_microseconds, size_t *count_out) {
+    return _syscall_5(SYSCALL_PORT_WAIT, port, (long)packets, max_packets, timeout_microseconds, (long)count_out);
+}
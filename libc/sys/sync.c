@@ -0,0 +1,109 @@
+#include <sys/sync.h>
+#include <sys/futex.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Times a contended lock is retried before sleeping, in case the holder is about to release it
+#define SPIN_COUNT 100
+
+#define NEVER_TIME_OUT ((size_t)-1)
+
+void ir_mutex_lock(ir_mutex_t *mutex) {
+    uint32_t state = 0;
+    if (__atomic_compare_exchange_n(&mutex->state, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    for (int i = 0; i < SPIN_COUNT && state == 1; i++) {
+        __builtin_ia32_pause();
+        state = 0;
+        if (__atomic_compare_exchange_n(&mutex->state, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return;
+        }
+    }
+
+    // Mark the mutex as having waiters, so the holder knows to wake one when it unlocks.
+    // Whoever takes it this way can't tell if others are still waiting, so it keeps the mark
+    while (__atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE) != 0) {
+        ir_futex_wait(&mutex->state, 2, NEVER_TIME_OUT);
+    }
+}
+
+int ir_mutex_try_lock(ir_mutex_t *mutex) {
+    uint32_t state = 0;
+    return __atomic_compare_exchange_n(&mutex->state, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void ir_mutex_unlock(ir_mutex_t *mutex) {
+    if (__atomic_exchange_n(&mutex->state, 0, __ATOMIC_RELEASE) == 2) {
+        ir_futex_wake(&mutex->state, 1, NULL);
+    }
+}
+
+void ir_condvar_wait(ir_condvar_t *condvar, ir_mutex_t *mutex) {
+    uint32_t sequence = __atomic_load_n(&condvar->sequence, __ATOMIC_RELAXED);
+    ir_mutex_unlock(mutex);
+
+    // Returns straight away if signalled since unlocking
+    ir_futex_wait(&condvar->sequence, sequence, NEVER_TIME_OUT);
+
+    // Other threads may have been woken with this one, so relock as if contended
+    while (__atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE) != 0) {
+        ir_futex_wait(&mutex->state, 2, NEVER_TIME_OUT);
+    }
+}
+
+void ir_condvar_signal(ir_condvar_t *condvar) {
+    __atomic_fetch_add(&condvar->sequence, 1, __ATOMIC_RELEASE);
+    ir_futex_wake(&condvar->sequence, 1, NULL);
+}
+
+void ir_condvar_broadcast(ir_condvar_t *condvar) {
+    __atomic_fetch_add(&condvar->sequence, 1, __ATOMIC_RELEASE);
+    ir_futex_wake(&condvar->sequence, SIZE_MAX, NULL);
+}
+
+void ir_rwlock_read_lock(ir_rwlock_t *rwlock) {
+    for (;;) {
+        uint32_t state = __atomic_load_n(&rwlock->state, __ATOMIC_RELAXED);
+        if (state != IR_RWLOCK_WRITER) {
+            if (__atomic_compare_exchange_n(&rwlock->state, &state, state + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                return;
+            }
+            continue;
+        }
+
+        __atomic_fetch_add(&rwlock->waiters, 1, __ATOMIC_SEQ_CST);
+        ir_futex_wait(&rwlock->state, IR_RWLOCK_WRITER, NEVER_TIME_OUT);
+        __atomic_fetch_sub(&rwlock->waiters, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void ir_rwlock_read_unlock(ir_rwlock_t *rwlock) {
+    // Only writers wait for readers, and they only need waking by the last one out
+    if (__atomic_fetch_sub(&rwlock->state, 1, __ATOMIC_SEQ_CST) == 1
+            && __atomic_load_n(&rwlock->waiters, __ATOMIC_SEQ_CST) != 0) {
+        ir_futex_wake(&rwlock->state, SIZE_MAX, NULL);
+    }
+}
+
+void ir_rwlock_write_lock(ir_rwlock_t *rwlock) {
+    for (;;) {
+        uint32_t state = 0;
+        if (__atomic_compare_exchange_n(&rwlock->state, &state, IR_RWLOCK_WRITER, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return;
+        }
+
+        // The wait returns straight away if the state changed after it was read
+        __atomic_fetch_add(&rwlock->waiters, 1, __ATOMIC_SEQ_CST);
+        ir_futex_wait(&rwlock->state, state, NEVER_TIME_OUT);
+        __atomic_fetch_sub(&rwlock->waiters, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void ir_rwlock_write_unlock(ir_rwlock_t *rwlock) {
+    __atomic_store_n(&rwlock->state, 0, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&rwlock->waiters, __ATOMIC_SEQ_CST) != 0) {
+        ir_futex_wake(&rwlock->state, SIZE_MAX, NULL);
+    }
+}
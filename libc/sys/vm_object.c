@@ -6,3 +6,7 @@
 ir_status_t ir_vm_object_create(size_t size, unsigned long flags, ir_handle_t *handle_out) {
     return _syscall_3(SYSCALL_VM_OBJECT_CREATE, size , flags, (long)handle_out);
 }
+
+ir_status_t ir_vm_object_create_clone(ir_handle_t vm_object, ir_handle_t *clone_out) {
+    return _syscall_2(SYSCALL_VM_OBJECT_CREATE_CLONE, vm_object, (long)clone_out);
+}
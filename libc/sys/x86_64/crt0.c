@@ -4,9 +4,13 @@
 #include <sys/x86_64/syscall.h>
 #include <iridium/syscalls.h>
 #include <iridium/errors.h>
+#include "../../string/string_impl.h"
 
 void _start(void) {
 
+    // Argument parsing already uses the string functions
+    _string_init();
+
     char **argv = malloc(sizeof(void*));
     argv[0] = NULL;
     int argc = 0;
@@ -49,4 +49,8 @@
 /// @brief A blocking operation was stopped before completing or timing out
 #define IR_ERROR_CANCLED (-14)
 
+/// @brief The operation can't be performed yet, such as writing to a full channel.
+/// Wait for the object's signals to change and try again
+#define IR_ERROR_SHOULD_WAIT (-15)
+
 #endif // PUBLIC_IRIDIUM_ERRORS_H_
@@ -44,5 +44,18 @@
 #define SYSCALL_CHANNEL_CREATE 29
 #define SYSCALL_CHANNEL_READ 30
 #define SYSCALL_CHANNEL_WRITE 31
+#define SYSCALL_CHANNEL_SET_QUEUE_DEPTH 32 // Change how many messages a channel can queue
+#define SYSCALL_CHANNEL_WRITE_MOVE 33 // Write a message, moving its whole pages out of the caller instead of copying them
+#define SYSCALL_CHANNEL_CALL 34 // Write a request and wait for its reply
+
+#define SYSCALL_PORT_CREATE 35
+#define SYSCALL_PORT_BIND 36 // Queue packets in a port when an object's signals are raised
+#define SYSCALL_PORT_UNBIND 37
+#define SYSCALL_PORT_WAIT 38 // Read a batch of packets, blocking until there are some
+
+#define SYSCALL_FUTEX_WAIT 39 // Block while a 32 bit value in memory holds an expected value
+#define SYSCALL_FUTEX_WAKE 40
+
+#define SYSCALL_VM_OBJECT_CREATE_CLONE 41 // Create a copy-on-write copy of a vm object
 
 #endif // ! PUBLIC_IRIDIUM_SYSCALLS_H_
@@ -4,6 +4,8 @@
 #ifndef PUBLIC_IRIDIUM_TYPES_H_
 #define PUBLIC_IRIDIUM_TYPES_H_
 
+#include <stddef.h>
+
 // This null handle ID is never valid
 #define IR_HANDLE_INVALID 0
 #define THIS_PROCESS_HANDLE 1
@@ -33,20 +35,25 @@
 #define OBJECT_TYPE_CHANNEL 6
 #define OBJECT_TYPE_INTERRUPT 7
 #define OBJECT_TYPE_IOPORT 8
+#define OBJECT_TYPE_PORT 9
 
 #define V_ADDR_REGION_READABLE 0x1 // Can only be false if the target supports execute only pages
 #define V_ADDR_REGION_WRITABLE 0x2
 #define V_ADDR_REGION_EXECUTABLE 0x4
 #define V_ADDR_REGION_MAP_SPECIFIC 0x8
-#define V_ADDR_REGION_DISABLE_CACHE 0x10 /// Disable caching and use write-through
+#define V_ADDR_REGION_DISABLE_CACHE 0x10 /// Uncacheable, strongly ordered memory for mmio registers
+#define V_ADDR_REGION_WRITE_COMBINE 0x20 /// Uncached, but writes may be buffered and combined. Meant for framebuffers
 
 #define VM_READABLE 0x1
 #define VM_WRITABLE 0x2
 #define VM_EXECUTABLE 0x4
 #define VM_DISABLE_CACHING 0x8
+#define VM_WRITE_COMBINING 0x10
 
 /// Disable caching and executation for mmio ranges
 #define VM_MMIO_FLAGS (VM_DISABLE_CACHING | VM_WRITABLE | VM_READABLE)
+/// Write-combining for memory like framebuffers that is written in bulk but never read back
+#define VM_FRAMEBUFFER_FLAGS (VM_WRITE_COMBINING | VM_WRITABLE | VM_READABLE)
 
 // IO Port data sizes
 #define SIZE_BYTE 0
@@ -71,6 +78,9 @@
 /// The other end of the channel is gone, and can no longer send or recieve messages
 #define CHANNEL_SIGNAL_PEER_DISCONNECTED 0x10
 
+/// There are packets queued in the port
+#define PORT_SIGNAL_PACKET_WAITING 0x1
+
 /// @brief Return status of all system calls and many internal functions.
 /// A value of 0 (`IR_OK`) represents success, and error codes are negative values.
 /// @see `public/iridium/errors.h` for error code definitions
@@ -82,6 +92,24 @@ typedef unsigned long ir_handle_t;
 /// Bit field of an object's currently active signals
 typedef unsigned long ir_signal_t;
 
+/// @brief Transaction id at the start of messages sent with `SYSCALL_CHANNEL_CALL`
+/// The kernel picks the id, and replies starting with the same id go straight to the caller.
+/// Ids chosen by the kernel always have the top bit set, so they never match ids chosen by userspace
+typedef unsigned int ir_txid_t;
+
+/// @brief Arguments to `SYSCALL_CHANNEL_CALL`, which don't fit in registers
+typedef struct {
+    /// Request to write, starting with space for an `ir_txid_t`
+    const char *write_data;
+    size_t write_length;
+    /// Handles to transfer with the request
+    ir_handle_t *write_handles;
+    size_t write_handles_count;
+    /// Receives the reply's handle ids followed by its bytes, like `SYSCALL_CHANNEL_READ`
+    char *read_buffer;
+    size_t read_buffer_length;
+} ir_channel_call_args_t;
+
 /// Data recieved when a signal is sent to an object
 typedef struct {
     ir_status_t status;
@@ -92,4 +120,14 @@ typedef struct {
 
 } ir_signal_packet_t;
 
+/// @brief Packet read from a port, reporting signals raised on an object bound to it
+typedef struct {
+    /// Key given when the object was bound
+    unsigned long key;
+    /// Every watched signal raised since the last packet for the binding was read
+    ir_signal_t trigger;
+    /// The state of all of the object's signals when the packet was last updated
+    ir_signal_t signals;
+} ir_port_packet_t;
+
 #endif // PUBLIC_IRIDIUM_TYPES_H_